@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Send a command to the control socket of a process running with torsocks
+ * and copy its answer on stdout.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s SOCKET COMMAND\n"
+			"Send COMMAND to a torsocks control socket.\n\n"
+			"Commands:\n"
+			"  stats  metrics in the Prometheus text format\n"
+			"  dump   flight recorder dump, see torsocks-flight(1)\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+	ssize_t ret;
+	char buf[4096];
+	struct sockaddr_un addr;
+
+	if (argc != 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, argv[1]);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror(argv[1]);
+		goto error;
+	}
+
+	snprintf(buf, sizeof(buf), "%s\n", argv[2]);
+	if (write(fd, buf, strlen(buf)) != (ssize_t) strlen(buf)) {
+		perror("write");
+		goto error;
+	}
+
+	for (;;) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			goto error;
+		}
+		if (ret == 0) {
+			break;
+		}
+		if (fwrite(buf, 1, ret, stdout) != (size_t) ret) {
+			perror("write");
+			goto error;
+		}
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+
+error:
+	close(fd);
+	return EXIT_FAILURE;
+}
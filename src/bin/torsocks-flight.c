@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decode a dump of the torsocks flight recorder into the timings of every
+ * connection and resolution. The dump is read from a file, stdin or directly
+ * from the control socket of a running process.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/flight.h>
+
+/* Steps of a connection or resolution still in progress. */
+struct operation {
+	struct flight_event start;
+	struct flight_event steps[8];
+	unsigned int nb_steps;
+	int used;
+};
+
+static int raw;
+
+static const char *phase_names[] = {
+	[FLIGHT_CONNECT_START] = "connect",
+	[FLIGHT_TOR_CONNECTED] = "tor_connected",
+	[FLIGHT_METHOD] = "method",
+	[FLIGHT_AUTH] = "auth",
+	[FLIGHT_REQUEST] = "request",
+	[FLIGHT_REPLY] = "reply",
+	[FLIGHT_CONNECT_END] = "end",
+	[FLIGHT_RESOLVE_START] = "resolve",
+	[FLIGHT_RESOLVE_END] = "end",
+	[FLIGHT_CLOSE] = "close",
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-r] [-s SOCKET] [FILE]\n"
+			"Decode a torsocks flight recorder dump, stdin if no FILE.\n\n"
+			"  -r         print every event instead of the timings\n"
+			"  -s SOCKET  ask the dump to the control socket of a process\n",
+			name);
+}
+
+static const char *phase_name(unsigned int phase)
+{
+	if (phase < sizeof(phase_names) / sizeof(phase_names[0]) &&
+			phase_names[phase]) {
+		return phase_names[phase];
+	}
+	return "unknown";
+}
+
+/*
+ * Name of the backend of an event, NULL for a socket.
+ */
+static const char *backend_name(unsigned int backend)
+{
+	switch (backend) {
+	case FLIGHT_BACKEND_URING:
+		return "uring";
+	case FLIGHT_BACKEND_DNS:
+		return "dns";
+	case FLIGHT_BACKEND_CONTROL:
+		return "control";
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Format the wall clock time of an event in the given buffer.
+ */
+static void event_time(const struct flight_dump_header *hdr,
+		const struct flight_event *ev, char *buf, size_t len)
+{
+	int64_t ns;
+	time_t sec;
+	struct tm tm;
+
+	/* Go back from the dump time by the age of the event. */
+	ns = hdr->realtime_sec * 1000000000LL + hdr->realtime_nsec -
+		(int64_t) (hdr->monotonic - ev->ts);
+	sec = ns / 1000000000LL;
+	localtime_r(&sec, &tm);
+	strftime(buf, len, "%b %d %H:%M:%S", &tm);
+	snprintf(buf + strlen(buf), len - strlen(buf), ".%06" PRId64,
+			(int64_t) (ns % 1000000000LL) / 1000);
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct flight_event *ea = a, *eb = b;
+
+	if (ea->ts != eb->ts) {
+		return ea->ts < eb->ts ? -1 : 1;
+	}
+	return 0;
+}
+
+static void print_raw(const struct flight_dump_header *hdr,
+		const struct flight_event *ev)
+{
+	char time_buf[32];
+
+	event_time(hdr, ev, time_buf, sizeof(time_buf));
+	printf("%s slot=%" PRIu32 " fd=%" PRId32 " %s", time_buf, ev->tid,
+			ev->fd, phase_name(ev->phase));
+	if (backend_name(ev->backend)) {
+		printf(" %s", backend_name(ev->backend));
+	}
+	if (ev->phase == FLIGHT_REPLY) {
+		printf(" rep=0x%02x", ev->reply);
+	}
+	if (ev->err) {
+		printf(" err=%s", strerror(ev->err));
+	}
+	printf("\n");
+}
+
+/*
+ * Print a finished or still running operation with the delay of every step
+ * since its start.
+ */
+static void print_operation(const struct flight_dump_header *hdr,
+		const struct operation *op)
+{
+	unsigned int i;
+	char time_buf[32];
+	const struct flight_event *ev, *last = NULL;
+
+	event_time(hdr, &op->start, time_buf, sizeof(time_buf));
+	printf("%s %s fd=%" PRId32 " slot=%" PRIu32, time_buf,
+			phase_name(op->start.phase), op->start.fd, op->start.tid);
+
+	for (i = 0; i < op->nb_steps; i++) {
+		ev = &op->steps[i];
+		printf(" %s", phase_name(ev->phase));
+		if (ev->phase == FLIGHT_REPLY) {
+			printf("(0x%02x)", ev->reply);
+		}
+		printf("=+%" PRIu64 "us", (ev->ts - op->start.ts) / 1000);
+		last = ev;
+	}
+
+	if (!last || (last->phase != FLIGHT_CONNECT_END &&
+				last->phase != FLIGHT_RESOLVE_END)) {
+		printf(" in progress\n");
+		return;
+	}
+	if (backend_name(last->backend)) {
+		printf(" %s", backend_name(last->backend));
+	}
+	printf(" %s\n", last->err ? strerror(last->err) : "ok");
+}
+
+static struct operation *find_operation(struct operation *ops,
+		size_t nb_ops, const struct flight_event *ev)
+{
+	size_t i;
+
+	for (i = 0; i < nb_ops; i++) {
+		if (ops[i].used && ops[i].start.tid == ev->tid &&
+				ops[i].start.fd == ev->fd) {
+			return &ops[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Group the events by thread and fd from the start of an operation to its end.
+ */
+static void print_timings(const struct flight_dump_header *hdr,
+		const struct flight_event *events, size_t nb_events)
+{
+	size_t i, nb_ops = 0;
+	struct operation *ops, *op;
+	const struct flight_event *ev;
+
+	/* There can't be more operations in progress than events. */
+	ops = calloc(nb_events + 1, sizeof(*ops));
+	if (!ops) {
+		perror("calloc");
+		return;
+	}
+
+	for (i = 0; i < nb_events; i++) {
+		ev = &events[i];
+		op = find_operation(ops, nb_ops, ev);
+
+		switch (ev->phase) {
+		case FLIGHT_CONNECT_START:
+		case FLIGHT_RESOLVE_START:
+			if (op) {
+				/* The end was overwritten in the ring. */
+				print_operation(hdr, op);
+				op->used = 0;
+			}
+			op = &ops[nb_ops++];
+			op->start = *ev;
+			op->nb_steps = 0;
+			op->used = 1;
+			break;
+		case FLIGHT_CLOSE:
+			print_raw(hdr, ev);
+			break;
+		default:
+			if (!op) {
+				/* The start was overwritten in the ring. */
+				break;
+			}
+			if (op->nb_steps < sizeof(op->steps) / sizeof(op->steps[0])) {
+				op->steps[op->nb_steps++] = *ev;
+			}
+			if (ev->phase == FLIGHT_CONNECT_END ||
+					ev->phase == FLIGHT_RESOLVE_END) {
+				print_operation(hdr, op);
+				op->used = 0;
+			}
+			break;
+		}
+	}
+
+	for (i = 0; i < nb_ops; i++) {
+		if (ops[i].used) {
+			print_operation(hdr, &ops[i]);
+		}
+	}
+
+	free(ops);
+}
+
+/*
+ * Decode a complete dump.
+ *
+ * Return 0 on success else -1.
+ */
+static int decode(FILE *fp, const char *name)
+{
+	int ret = 0;
+	size_t i, nb_events = 0, size = 0;
+	struct flight_dump_header hdr;
+	struct flight_event ev, *events = NULL, *tmp;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+			hdr.magic != FLIGHT_DUMP_MAGIC) {
+		fprintf(stderr, "%s: not a flight recorder dump\n", name);
+		return -1;
+	}
+	if (hdr.version != FLIGHT_DUMP_VERSION ||
+			hdr.event_size != sizeof(struct flight_event)) {
+		fprintf(stderr, "%s: unsupported dump version %u\n", name,
+				hdr.version);
+		return -1;
+	}
+
+	while (fread(&ev, sizeof(ev), 1, fp) == 1) {
+		if (nb_events == size) {
+			size = size ? size * 2 : 1024;
+			tmp = realloc(events, size * sizeof(*events));
+			if (!tmp) {
+				perror("realloc");
+				ret = -1;
+				goto end;
+			}
+			events = tmp;
+		}
+		events[nb_events++] = ev;
+	}
+
+	/* Every thread is dumped one after the other. Merge them. */
+	qsort(events, nb_events, sizeof(*events), compare_events);
+
+	printf("pid %" PRIu32 ": %zu events\n", hdr.pid, nb_events);
+	if (raw) {
+		for (i = 0; i < nb_events; i++) {
+			print_raw(&hdr, &events[i]);
+		}
+	} else {
+		print_timings(&hdr, events, nb_events);
+	}
+
+end:
+	free(events);
+	return ret;
+}
+
+/*
+ * Connect to the control socket of a process and ask for a dump.
+ *
+ * Return a stream of the dump or NULL on error.
+ */
+static FILE *open_control(const char *path)
+{
+	int fd;
+	struct sockaddr_un addr;
+	static const char cmd[] = "dump\n";
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return NULL;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+
+	return fdopen(fd, "rb");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret;
+	const char *name = "stdin", *socket_path = NULL;
+	FILE *fp = stdin;
+
+	while ((opt = getopt(argc, argv, "rs:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			raw = 1;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (socket_path) {
+		name = socket_path;
+		fp = open_control(socket_path);
+	} else if (optind < argc) {
+		name = argv[optind];
+		fp = fopen(name, "rb");
+		if (!fp) {
+			perror(name);
+		}
+	}
+	if (!fp) {
+		return EXIT_FAILURE;
+	}
+
+	ret = decode(fp, name);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
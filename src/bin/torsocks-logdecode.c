@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decode a torsocks log file written with TORSOCKS_LOG_FORMAT=binary into
+ * the text format of the normal logger.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/log-ring.h>
+
+/* No sane record is bigger than this. */
+#define MAX_RECORD_LEN	(64 * 1024)
+
+static int show_ids;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-i] [FILE]...\n"
+			"Decode torsocks binary log files, stdin if no FILE.\n\n"
+			"  -i  prefix every message with its pid and thread number\n",
+			name);
+}
+
+/*
+ * Decode every record of a stream.
+ *
+ * Return 0 on success else -1 if the stream is corrupted.
+ */
+static int decode(FILE *fp, const char *name)
+{
+	int ret = 0;
+	char time_buf[32];
+	char *msg = NULL;
+	long offset = 0;
+	struct log_record rec;
+
+	msg = malloc(MAX_RECORD_LEN);
+	if (!msg) {
+		perror("malloc");
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.magic != LOG_RECORD_MAGIC || rec.len > MAX_RECORD_LEN) {
+			fprintf(stderr, "%s: invalid record at offset %ld\n", name, offset);
+			ret = -1;
+			break;
+		}
+		if (fread(msg, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "%s: truncated record at offset %ld\n", name,
+					offset);
+			ret = -1;
+			break;
+		}
+		offset += sizeof(rec) + rec.len;
+
+		(void) log_record_time(&rec, time_buf, sizeof(time_buf));
+		if (show_ids) {
+			printf("%s%" PRIu32 ":%" PRIu32 " %.*s", time_buf, rec.pid,
+					rec.tid, (int) rec.len, msg);
+		} else {
+			printf("%s%.*s", time_buf, (int) rec.len, msg);
+		}
+	}
+
+	free(msg);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, ret = EXIT_SUCCESS;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "ih")) != -1) {
+		switch (opt) {
+		case 'i':
+			show_ids = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc) {
+		return decode(stdin, "stdin") ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	for (i = optind; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if (!fp) {
+			perror(argv[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if (decode(fp, argv[i])) {
+			ret = EXIT_FAILURE;
+		}
+		fclose(fp);
+	}
+
+	return ret;
+}
@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "addrinfo.h"
+#include "compat.h"
+#include "defaults.h"
+#include "macros.h"
+
+/* Service names cached with their port. Longer names are not cached. */
+#define SERVICE_CACHE_SIZE	32
+#define SERVICE_NAME_MAX	32
+
+/* Results cached. Longer names or services are not cached. */
+#define ADDRINFO_CACHE_SIZE	64
+
+/*
+ * An entry of a result, allocated with its address right after it like the
+ * libc does.
+ */
+struct addrinfo_entry {
+	struct addrinfo ai;
+	union {
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} addr;
+};
+
+/* Socket types a result is expanded to when the hints give none. */
+static const struct {
+	int socktype;
+	int protocol;
+	/* Protocol of the services database, NULL if a service is invalid. */
+	const char *proto;
+} addrinfo_socktypes[] = {
+	{ SOCK_STREAM, IPPROTO_TCP, "tcp" },
+	{ SOCK_DGRAM, IPPROTO_UDP, "udp" },
+	{ SOCK_RAW, 0, NULL },
+};
+
+/*
+ * Ports of the service names already looked up, -1 if unknown. Replaced in
+ * round robin.
+ */
+static struct {
+	tsocks_mutex_t lock;
+	unsigned int next;
+	struct {
+		char name[SERVICE_NAME_MAX];
+		const char *proto;
+		int port;
+	} entries[SERVICE_CACHE_SIZE];
+} services = {
+	.lock = TSOCKS_MUTEX_INIT,
+};
+
+/*
+ * Results of the names resolved by Tor, keyed by the getaddrinfo(3) arguments
+ * and kept ttl seconds.
+ */
+static struct {
+	tsocks_mutex_t lock;
+	unsigned int ttl;
+	struct {
+		uint32_t hash;
+		int family;
+		int socktype;
+		int protocol;
+		int flags;
+		uint64_t expire;
+		struct addrinfo *ai;
+		char service[SERVICE_NAME_MAX];
+		char node[DEFAULT_DOMAIN_NAME_SIZE + 1];
+	} entries[ADDRINFO_CACHE_SIZE];
+} cache = {
+	.lock = TSOCKS_MUTEX_INIT,
+};
+
+static TSOCKS_INIT_ONCE(cache_atfork_once);
+
+static uint64_t now_sec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Look up a service name in the services database for the given protocol
+ * through the cache.
+ *
+ * Return the port in host byte order or -1 if unknown.
+ */
+static int service_lookup(const char *name, const char *proto)
+{
+	int port = -1;
+	unsigned int i;
+	char buf[1024];
+	struct servent se, *result = NULL;
+
+	if (strlen(name) >= SERVICE_NAME_MAX) {
+		goto lookup;
+	}
+
+	tsocks_mutex_lock(&services.lock);
+	for (i = 0; i < SERVICE_CACHE_SIZE; i++) {
+		if (services.entries[i].proto == proto &&
+				strcmp(services.entries[i].name, name) == 0) {
+			port = services.entries[i].port;
+			tsocks_mutex_unlock(&services.lock);
+			goto end;
+		}
+	}
+	tsocks_mutex_unlock(&services.lock);
+
+lookup:
+	if (getservbyname_r(name, proto, &se, buf, sizeof(buf), &result) == 0 &&
+			result) {
+		port = ntohs(result->s_port);
+	}
+
+	if (strlen(name) < SERVICE_NAME_MAX) {
+		tsocks_mutex_lock(&services.lock);
+		i = services.next++ % SERVICE_CACHE_SIZE;
+		strcpy(services.entries[i].name, name);
+		services.entries[i].proto = proto;
+		services.entries[i].port = port;
+		tsocks_mutex_unlock(&services.lock);
+	}
+
+end:
+	return port;
+}
+
+/*
+ * Parse a numeric service.
+ *
+ * Return the port or -1 if the service is not a number.
+ */
+static int service_number(const char *service)
+{
+	char *end;
+	unsigned long port;
+
+	if (*service < '0' || *service > '9') {
+		return -1;
+	}
+	port = strtoul(service, &end, 10);
+	if (*end != '\0' || port > 65535) {
+		return -1;
+	}
+	return port;
+}
+
+/*
+ * Build the result of getaddrinfo(3) for the given addresses, in that order,
+ * each expanded to every socket type allowed by the hints and the service.
+ * The canonical name is set on the first entry if AI_CANONNAME is given.
+ *
+ * Return 0 on success or else an EAI_* value.
+ */
+ATTR_HIDDEN
+int addrinfo_build_list(const char *canonname,
+		const struct addrinfo_addr *addrs, unsigned int nb_addrs,
+		const char *service, const struct addrinfo *hints,
+		struct addrinfo **res)
+{
+	int port = 0, ports[ARRAY_SIZE(addrinfo_socktypes)];
+	unsigned int i, j, nb = 0;
+	struct addrinfo_entry *entry;
+	struct addrinfo **tail;
+
+	assert(addrs);
+	assert(nb_addrs > 0);
+	assert(hints);
+	assert(res);
+
+	switch (hints->ai_socktype) {
+	case 0:
+	case SOCK_STREAM:
+	case SOCK_DGRAM:
+	case SOCK_RAW:
+		break;
+	default:
+		return EAI_SOCKTYPE;
+	}
+
+	if (service) {
+		port = service_number(service);
+		if (port < 0 && (hints->ai_flags & AI_NUMERICSERV)) {
+			return EAI_NONAME;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(addrinfo_socktypes); i++) {
+		ports[i] = -1;
+		if (hints->ai_socktype &&
+				hints->ai_socktype != addrinfo_socktypes[i].socktype) {
+			continue;
+		}
+		/* Any protocol goes with a raw socket. */
+		if (hints->ai_protocol && addrinfo_socktypes[i].protocol &&
+				hints->ai_protocol != addrinfo_socktypes[i].protocol) {
+			continue;
+		}
+		if (!service) {
+			ports[i] = 0;
+		} else if (!addrinfo_socktypes[i].proto) {
+			continue;
+		} else if (port >= 0) {
+			ports[i] = port;
+		} else {
+			ports[i] = service_lookup(service, addrinfo_socktypes[i].proto);
+		}
+		if (ports[i] >= 0) {
+			nb++;
+		}
+	}
+	if (!nb) {
+		return service ? EAI_SERVICE : EAI_SOCKTYPE;
+	}
+
+	tail = res;
+	*res = NULL;
+	for (j = 0; j < nb_addrs; j++) {
+		assert(addrs[j].af == AF_INET || addrs[j].af == AF_INET6);
+
+		for (i = 0; i < ARRAY_SIZE(addrinfo_socktypes); i++) {
+			if (ports[i] < 0) {
+				continue;
+			}
+			entry = zmalloc(sizeof(*entry));
+			if (!entry) {
+				goto error;
+			}
+			if (addrs[j].af == AF_INET) {
+				entry->addr.sin.sin_family = AF_INET;
+				entry->addr.sin.sin_port = htons(ports[i]);
+				entry->addr.sin.sin_addr = addrs[j].u.v4;
+				entry->ai.ai_addrlen = sizeof(struct sockaddr_in);
+			} else {
+				entry->addr.sin6.sin6_family = AF_INET6;
+				entry->addr.sin6.sin6_port = htons(ports[i]);
+				entry->addr.sin6.sin6_addr = addrs[j].u.v6;
+				entry->ai.ai_addrlen = sizeof(struct sockaddr_in6);
+			}
+			entry->ai.ai_flags = hints->ai_flags;
+			entry->ai.ai_family = addrs[j].af;
+			entry->ai.ai_socktype = addrinfo_socktypes[i].socktype;
+			entry->ai.ai_protocol = addrinfo_socktypes[i].protocol ?
+				addrinfo_socktypes[i].protocol : hints->ai_protocol;
+			entry->ai.ai_addr = (struct sockaddr *) &entry->addr;
+			*tail = &entry->ai;
+			tail = &entry->ai.ai_next;
+		}
+	}
+	if (canonname && (hints->ai_flags & AI_CANONNAME)) {
+		(*res)->ai_canonname = strdup(canonname);
+		if (!(*res)->ai_canonname) {
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	addrinfo_free(*res);
+	*res = NULL;
+	return EAI_MEMORY;
+}
+
+/*
+ * Build the result of getaddrinfo(3) for a single address of the given
+ * family.
+ *
+ * Return 0 on success or else an EAI_* value.
+ */
+ATTR_HIDDEN
+int addrinfo_build(const char *canonname, int af, const void *addr,
+		const char *service, const struct addrinfo *hints,
+		struct addrinfo **res)
+{
+	struct addrinfo_addr one;
+
+	assert(addr);
+	assert(af == AF_INET || af == AF_INET6);
+
+	one.af = af;
+	if (af == AF_INET) {
+		memcpy(&one.u.v4, addr, sizeof(one.u.v4));
+	} else {
+		memcpy(&one.u.v6, addr, sizeof(one.u.v6));
+	}
+
+	return addrinfo_build_list(canonname, &one, 1, service, hints, res);
+}
+
+/*
+ * Free a result built by torsocks. Each entry is freed on its own, like
+ * freeaddrinfo(3) of the libc does.
+ */
+ATTR_HIDDEN
+void addrinfo_free(struct addrinfo *ai)
+{
+	struct addrinfo *next;
+
+	for (; ai; ai = next) {
+		next = ai->ai_next;
+		free(ai->ai_canonname);
+		free(ai);
+	}
+}
+
+/*
+ * Copy a result built by torsocks.
+ *
+ * Return the copy or NULL if out of memory.
+ */
+ATTR_HIDDEN
+struct addrinfo *addrinfo_copy(const struct addrinfo *ai)
+{
+	struct addrinfo *copy = NULL, **tail = &copy;
+	struct addrinfo_entry *entry;
+
+	for (; ai; ai = ai->ai_next) {
+		assert(ai->ai_addrlen <= sizeof(entry->addr));
+
+		entry = zmalloc(sizeof(*entry));
+		if (!entry) {
+			goto error;
+		}
+		entry->ai = *ai;
+		entry->ai.ai_next = NULL;
+		entry->ai.ai_canonname = NULL;
+		memcpy(&entry->addr, ai->ai_addr, ai->ai_addrlen);
+		entry->ai.ai_addr = (struct sockaddr *) &entry->addr;
+		*tail = &entry->ai;
+		tail = &entry->ai.ai_next;
+
+		if (ai->ai_canonname) {
+			entry->ai.ai_canonname = strdup(ai->ai_canonname);
+			if (!entry->ai.ai_canonname) {
+				goto error;
+			}
+		}
+	}
+
+	return copy;
+
+error:
+	addrinfo_free(copy);
+	return NULL;
+}
+
+/*
+ * FNV-1a hash of the cache key.
+ */
+static uint32_t cache_hash(const char *node, const char *service,
+		const struct addrinfo *hints)
+{
+	uint32_t hash = 2166136261U;
+	const char *p;
+
+	for (p = node; *p; p++) {
+		hash = (hash ^ (unsigned char) *p) * 16777619U;
+	}
+	hash = (hash ^ '/') * 16777619U;
+	for (p = service ? service : ""; *p; p++) {
+		hash = (hash ^ (unsigned char) *p) * 16777619U;
+	}
+	hash ^= hints->ai_family ^ (hints->ai_socktype << 8) ^
+		(hints->ai_protocol << 16) ^ ((uint32_t) hints->ai_flags << 24);
+	return hash * 16777619U;
+}
+
+static void cache_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&cache.lock);
+	tsocks_mutex_lock(&services.lock);
+}
+
+static void cache_atfork_release(void)
+{
+	tsocks_mutex_unlock(&services.lock);
+	tsocks_mutex_unlock(&cache.lock);
+}
+
+static void cache_atfork_init(void)
+{
+	(void) pthread_atfork(cache_atfork_prepare, cache_atfork_release,
+			cache_atfork_release);
+}
+
+/*
+ * Keep the results of the resolutions ttl seconds, 0 to disable the cache.
+ */
+ATTR_HIDDEN
+void addrinfo_cache_init(unsigned int ttl)
+{
+	tsocks_once(&cache_atfork_once, cache_atfork_init);
+
+	tsocks_mutex_lock(&cache.lock);
+	cache.ttl = ttl;
+	tsocks_mutex_unlock(&cache.lock);
+}
+
+/*
+ * Find the cached result of a getaddrinfo(3) call. The caller gets its own
+ * copy, freed by freeaddrinfo(3).
+ *
+ * Return the result or NULL if not cached or out of memory.
+ */
+ATTR_HIDDEN
+struct addrinfo *addrinfo_cache_lookup(const char *node, const char *service,
+		const struct addrinfo *hints)
+{
+	unsigned int i;
+	uint32_t hash;
+	uint64_t now;
+	struct addrinfo *ai = NULL;
+
+	assert(node);
+	assert(hints);
+
+	if (!__atomic_load_n(&cache.ttl, __ATOMIC_RELAXED)) {
+		goto end;
+	}
+
+	hash = cache_hash(node, service, hints);
+	now = now_sec();
+
+	tsocks_mutex_lock(&cache.lock);
+	for (i = 0; i < ADDRINFO_CACHE_SIZE; i++) {
+		if (!cache.entries[i].ai || cache.entries[i].hash != hash ||
+				cache.entries[i].expire <= now ||
+				cache.entries[i].family != hints->ai_family ||
+				cache.entries[i].socktype != hints->ai_socktype ||
+				cache.entries[i].protocol != hints->ai_protocol ||
+				cache.entries[i].flags != hints->ai_flags ||
+				strcmp(cache.entries[i].node, node) != 0 ||
+				strcmp(cache.entries[i].service, service ? service : "") != 0) {
+			continue;
+		}
+		ai = addrinfo_copy(cache.entries[i].ai);
+		break;
+	}
+	tsocks_mutex_unlock(&cache.lock);
+
+end:
+	return ai;
+}
+
+/*
+ * Cache a copy of the result of a getaddrinfo(3) call, replacing an expired
+ * entry or else the one closest to expire.
+ */
+ATTR_HIDDEN
+void addrinfo_cache_insert(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo *ai)
+{
+	unsigned int i, slot = 0;
+	struct addrinfo *old, *copy;
+
+	assert(node);
+	assert(hints);
+	assert(ai);
+
+	if (!__atomic_load_n(&cache.ttl, __ATOMIC_RELAXED) ||
+			strlen(node) >= sizeof(cache.entries[0].node) ||
+			(service && strlen(service) >= SERVICE_NAME_MAX)) {
+		return;
+	}
+
+	copy = addrinfo_copy(ai);
+	if (!copy) {
+		return;
+	}
+
+	tsocks_mutex_lock(&cache.lock);
+	for (i = 0; i < ADDRINFO_CACHE_SIZE; i++) {
+		if (!cache.entries[i].ai) {
+			slot = i;
+			break;
+		}
+		if (cache.entries[i].expire < cache.entries[slot].expire) {
+			slot = i;
+		}
+	}
+
+	old = cache.entries[slot].ai;
+	cache.entries[slot].ai = copy;
+	cache.entries[slot].hash = cache_hash(node, service, hints);
+	cache.entries[slot].expire = now_sec() + cache.ttl;
+	cache.entries[slot].family = hints->ai_family;
+	cache.entries[slot].socktype = hints->ai_socktype;
+	cache.entries[slot].protocol = hints->ai_protocol;
+	cache.entries[slot].flags = hints->ai_flags;
+	strcpy(cache.entries[slot].node, node);
+	strcpy(cache.entries[slot].service, service ? service : "");
+	tsocks_mutex_unlock(&cache.lock);
+
+	addrinfo_free(old);
+}
+
+/*
+ * Free every cached result.
+ */
+ATTR_HIDDEN
+void addrinfo_cache_destroy(void)
+{
+	unsigned int i;
+	struct addrinfo *ai;
+
+	tsocks_mutex_lock(&cache.lock);
+	cache.ttl = 0;
+	for (i = 0; i < ADDRINFO_CACHE_SIZE; i++) {
+		ai = cache.entries[i].ai;
+		cache.entries[i].ai = NULL;
+		addrinfo_free(ai);
+	}
+	tsocks_mutex_unlock(&cache.lock);
+}
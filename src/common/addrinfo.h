@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_ADDRINFO_H
+#define TORSOCKS_ADDRINFO_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * getaddrinfo(3) results built by torsocks. They are allocated entry by entry
+ * like the libc ones so the application frees them with freeaddrinfo(3) of
+ * the libc. The cache keeps its own copy and hands out a new one to every
+ * caller.
+ */
+
+/* An address of a name, IPv4 or IPv6. */
+struct addrinfo_addr {
+	int af;
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	} u;
+};
+
+int addrinfo_build(const char *canonname, int af, const void *addr,
+		const char *service, const struct addrinfo *hints,
+		struct addrinfo **res);
+int addrinfo_build_list(const char *canonname,
+		const struct addrinfo_addr *addrs, unsigned int nb_addrs,
+		const char *service, const struct addrinfo *hints,
+		struct addrinfo **res);
+void addrinfo_free(struct addrinfo *ai);
+struct addrinfo *addrinfo_copy(const struct addrinfo *ai);
+
+void addrinfo_cache_init(unsigned int ttl);
+struct addrinfo *addrinfo_cache_lookup(const char *node, const char *service,
+		const struct addrinfo *hints);
+void addrinfo_cache_insert(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo *ai);
+void addrinfo_cache_destroy(void);
+
+#endif /* TORSOCKS_ADDRINFO_H */
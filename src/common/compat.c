@@ -16,11 +16,53 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 
 #include "compat.h"
 
 #if (defined(__GLIBC__) || defined(__FreeBSD__) || defined(__darwin__) || defined(__NetBSD__))
 
+#ifdef TSOCKS_LOCK_STATS
+static uint64_t lock_stats_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lock_stats_max(uint64_t *max, uint64_t value)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > cur && !__atomic_compare_exchange_n(max, &cur, value, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		continue;
+	}
+}
+
+/*
+ * Copy the statistics of a mutex. They are read one by one without the mutex
+ * so they can be off by the acquisitions in progress.
+ */
+void tsocks_mutex_stats(tsocks_mutex_t *m, struct tsocks_lock_stats *stats)
+{
+	assert(m);
+	assert(stats);
+
+	stats->acquired = __atomic_load_n(&m->stats.acquired, __ATOMIC_RELAXED);
+	stats->contended = __atomic_load_n(&m->stats.contended, __ATOMIC_RELAXED);
+	stats->wait_ns = __atomic_load_n(&m->stats.wait_ns, __ATOMIC_RELAXED);
+	stats->wait_max_ns = __atomic_load_n(&m->stats.wait_max_ns,
+			__ATOMIC_RELAXED);
+	stats->hold_ns = __atomic_load_n(&m->stats.hold_ns, __ATOMIC_RELAXED);
+	stats->hold_max_ns = __atomic_load_n(&m->stats.hold_max_ns,
+			__ATOMIC_RELAXED);
+}
+#endif /* TSOCKS_LOCK_STATS */
+
 /*
  * Initialize a pthread mutex. This never fails.
  */
@@ -28,6 +70,9 @@ void tsocks_mutex_init(tsocks_mutex_t *m)
 {
 	assert(m);
 	pthread_mutex_init(&m->mutex, NULL);
+#ifdef TSOCKS_LOCK_STATS
+	memset(&m->stats, 0, sizeof(m->stats));
+#endif
 }
 
 /*
@@ -45,14 +90,33 @@ void tsocks_mutex_destroy(tsocks_mutex_t *m)
 void tsocks_mutex_lock(tsocks_mutex_t *m)
 {
 	int ret;
+#ifdef TSOCKS_LOCK_STATS
+	uint64_t start, wait;
+#endif
 
 	assert(m);
+#ifdef TSOCKS_LOCK_STATS
+	ret = pthread_mutex_trylock(&m->mutex);
+	if (ret == EBUSY) {
+		start = lock_stats_now();
+		ret = pthread_mutex_lock(&m->mutex);
+		wait = lock_stats_now() - start;
+		__atomic_add_fetch(&m->stats.contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&m->stats.wait_ns, wait, __ATOMIC_RELAXED);
+		lock_stats_max(&m->stats.wait_max_ns, wait);
+	}
+#else
 	ret = pthread_mutex_lock(&m->mutex);
+#endif
 	/*
 	 * Unable to lock the mutex could lead to undefined behavior and potential
 	 * security issues. Stop everything so torsocks can't continue.
 	 */
 	assert(!ret);
+#ifdef TSOCKS_LOCK_STATS
+	__atomic_add_fetch(&m->stats.acquired, 1, __ATOMIC_RELAXED);
+	m->locked_at = lock_stats_now();
+#endif
 }
 
 /*
@@ -61,8 +125,16 @@ void tsocks_mutex_lock(tsocks_mutex_t *m)
 void tsocks_mutex_unlock(tsocks_mutex_t *m)
 {
 	int ret;
+#ifdef TSOCKS_LOCK_STATS
+	uint64_t hold;
+#endif
 
 	assert(m);
+#ifdef TSOCKS_LOCK_STATS
+	hold = lock_stats_now() - m->locked_at;
+	__atomic_add_fetch(&m->stats.hold_ns, hold, __ATOMIC_RELAXED);
+	lock_stats_max(&m->stats.hold_max_ns, hold);
+#endif
 	ret = pthread_mutex_unlock(&m->mutex);
 	/*
 	 * Unable to unlock the mutex could lead to undefined behavior and potential
@@ -72,10 +144,9 @@ void tsocks_mutex_unlock(tsocks_mutex_t *m)
 }
 
 /*
- * Call the given routine once, and only once. tsocks_once returning
- * guarantees that the routine has succeded.
+ * Slow path of tsocks_once() taken until the routine has been called.
  */
-void tsocks_once(tsocks_once_t *o, void (*init_routine)(void))
+void tsocks_once_slow(tsocks_once_t *o, void (*init_routine)(void))
 {
 
 	/* Why, yes, pthread_once(3P) exists. Said routine requires linking in a
@@ -83,15 +154,10 @@ void tsocks_once(tsocks_once_t *o, void (*init_routine)(void))
 	 * thing even with the stub implementation. */
 	assert(o);
 
-	/* This looks scary and incorrect, till you realize that the
-	 * pthread_mutex routines include memory barriers. */
-	if (!o->once) {
-		return;
-	}
 	tsocks_mutex_lock(&o->mutex);
 	if (o->once) {
 		init_routine();
-		o->once = 0;
+		__atomic_store_n(&o->once, 0, __ATOMIC_RELEASE);
 	}
 	tsocks_mutex_unlock(&o->mutex);
 }
@@ -28,8 +28,30 @@
 
 #include <pthread.h>
 
+#ifdef TSOCKS_LOCK_STATS
+#include <stdint.h>
+
+/*
+ * Contention of a mutex, built with --enable-lock-stats. The wait is only
+ * measured when the mutex was already taken.
+ */
+struct tsocks_lock_stats {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_ns;
+	uint64_t hold_max_ns;
+};
+#endif /* TSOCKS_LOCK_STATS */
+
 typedef struct tsocks_mutex_t {
 	pthread_mutex_t mutex;
+#ifdef TSOCKS_LOCK_STATS
+	struct tsocks_lock_stats stats;
+	/* Time the owner took the mutex, only accessed with it held. */
+	uint64_t locked_at;
+#endif
 } tsocks_mutex_t;
 
 /* Define a tsock mutex variable with the mutex statically initialized. */
@@ -41,9 +63,12 @@ void tsocks_mutex_init(tsocks_mutex_t *m);
 void tsocks_mutex_destroy(tsocks_mutex_t *m);
 void tsocks_mutex_lock(tsocks_mutex_t *m);
 void tsocks_mutex_unlock(tsocks_mutex_t *m);
+#ifdef TSOCKS_LOCK_STATS
+void tsocks_mutex_stats(tsocks_mutex_t *m, struct tsocks_lock_stats *stats);
+#endif
 
 typedef struct tsocks_once_t {
-	int once:1;
+	int once;
 	tsocks_mutex_t mutex;
 } tsocks_once_t;
 
@@ -51,7 +76,23 @@ typedef struct tsocks_once_t {
 #define TSOCKS_INIT_ONCE(name) \
 	tsocks_once_t name = { .once = 1, .mutex = TSOCKS_MUTEX_INIT }
 
-void tsocks_once(tsocks_once_t *o, void (*init_routine)(void));
+void tsocks_once_slow(tsocks_once_t *o, void (*init_routine)(void));
+
+/*
+ * Call the given routine once, and only once. tsocks_once returning
+ * guarantees that the routine has succeded.
+ *
+ * This is called on every hijacked libc call so once the routine has run,
+ * the cost is a single acquire load and a branch. The acquire pairs with the
+ * release store done after the routine so everything it wrote is visible.
+ */
+static inline void tsocks_once(tsocks_once_t *o, void (*init_routine)(void))
+{
+	if (__builtin_expect(!__atomic_load_n(&o->once, __ATOMIC_ACQUIRE), 1)) {
+		return;
+	}
+	tsocks_once_slow(o, init_routine);
+}
 
 #else
 #error "OS not supported."
@@ -108,6 +149,24 @@ void tsocks_once(tsocks_once_t *o, void (*init_routine)(void));
 #ifndef __NR_accept4
 #define __NR_accept4 -13
 #endif
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup -14
+#endif
+#ifndef __NR_recvmmsg
+#define __NR_recvmmsg -15
+#endif
+#ifndef __NR_sendmmsg
+#define __NR_sendmmsg -16
+#endif
+#ifndef __NR_dup2
+#define __NR_dup2 -17
+#endif
+#ifndef __NR_dup3
+#define __NR_dup3 -18
+#endif
+#ifndef __NR_close_range
+#define __NR_close_range -19
+#endif
 
 #define TSOCKS_NR_SOCKET    __NR_socket
 #define TSOCKS_NR_CONNECT   __NR_connect
@@ -122,6 +181,12 @@ void tsocks_once(tsocks_once_t *o, void (*init_routine)(void));
 #define TSOCKS_NR_GETRANDOM __NR_getrandom
 #define TSOCKS_NR_FUTEX     __NR_futex
 #define TSOCKS_NR_ACCEPT4   __NR_accept4
+#define TSOCKS_NR_IO_URING_SETUP __NR_io_uring_setup
+#define TSOCKS_NR_RECVMMSG  __NR_recvmmsg
+#define TSOCKS_NR_SENDMMSG  __NR_sendmmsg
+#define TSOCKS_NR_DUP2      __NR_dup2
+#define TSOCKS_NR_DUP3      __NR_dup3
+#define TSOCKS_NR_CLOSE_RANGE __NR_close_range
 
 /*
  * Despite glibc providing wrappers for these calls for a long time
@@ -213,15 +278,19 @@ void tsocks_once(tsocks_once_t *o, void (*init_routine)(void));
 #endif
 
 /*
- * Macro to tell if a given socket type is a SOCK_STREAM or not. The macro
- * resolve to 1 if yes else 0.
+ * Macros to tell if a given socket type is a SOCK_STREAM or a SOCK_DGRAM. The
+ * macros resolve to 1 if yes else 0.
  */
 #if defined(__NetBSD__)
 #define IS_SOCK_STREAM(type) \
 	((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC | SOCK_NOSIGPIPE)) == SOCK_STREAM)
+#define IS_SOCK_DGRAM(type) \
+	((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC | SOCK_NOSIGPIPE)) == SOCK_DGRAM)
 #else /* __NetBSD__ */
 #define IS_SOCK_STREAM(type) \
 	((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_STREAM)
+#define IS_SOCK_DGRAM(type) \
+	((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_DGRAM)
 #endif /* __NetBSD__ */
 
 #endif /* TORSOCKS_COMPAT_H */
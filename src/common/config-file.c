@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include "config-file.h"
 #include "log.h"
@@ -34,12 +35,20 @@
  */
 static const char *conf_toraddr_str = "TorAddress";
 static const char *conf_torport_str = "TorPort";
+static const char *conf_tor_ipv6_port_str = "TorIPv6Port";
+static const char *conf_tor_dns_port_str = "TorDNSPort";
+static const char *conf_tor_control_port_str = "TorControlPort";
+static const char *conf_tor_control_cookie_file_str = "TorControlCookieFile";
+static const char *conf_tor_control_password_str = "TorControlPassword";
 static const char *conf_onion_str = "OnionAddrRange";
 static const char *conf_socks5_user_str = "SOCKS5Username";
 static const char *conf_socks5_pass_str = "SOCKS5Password";
 static const char *conf_allow_inbound_str = "AllowInbound";
 static const char *conf_allow_outbound_localhost_str = "AllowOutboundLocalhost";
 static const char *conf_isolate_pid_str = "IsolatePID";
+static const char *conf_use_io_uring_str = "UseIOUring";
+static const char *conf_prefer_ipv6_str = "PreferIPv6";
+static const char *conf_allow_udp_dns_str = "AllowUDPDNS";
 
 /*
  * Once this value reaches 2, it means both user and password for a SOCKS5
@@ -115,20 +124,17 @@ error:
 }
 
 /*
- * Set the given string port in a configuration object.
+ * Parse the given string port.
  *
  * Return 0 on success or else a negative EINVAL if the port is equal to 0 or
  * over 65535.
  */
-static int set_tor_port(const char *port, struct configuration *config)
+static int parse_port(const char *port, in_port_t *value)
 {
 	int ret = 0;
 	char *endptr;
 	unsigned long _port;
 
-	assert(port);
-	assert(config);
-
 	/* Let's avoid a integer overflow here ;). */
 	_port = strtoul(port, &endptr, 10);
 	if (_port == 0 || _port > 65535) {
@@ -137,9 +143,153 @@ static int set_tor_port(const char *port, struct configuration *config)
 		goto error;
 	}
 
-	config->conf_file.tor_port = (in_port_t) _port;
+	*value = (in_port_t) _port;
+
+error:
+	return ret;
+}
+
+/*
+ * Set the given string port in a configuration object.
+ *
+ * Return 0 on success or else a negative EINVAL if the port is equal to 0 or
+ * over 65535.
+ */
+static int set_tor_port(const char *port, struct configuration *config)
+{
+	int ret;
+
+	assert(port);
+	assert(config);
+
+	ret = parse_port(port, &config->conf_file.tor_port);
+	if (ret < 0) {
+		goto error;
+	}
+
+	DBG("Config file setting tor port to %u", config->conf_file.tor_port);
+
+error:
+	return ret;
+}
+
+/*
+ * Set the given string port of the IPv6 Tor SOCKS in a configuration object.
+ *
+ * Return 0 on success or else a negative EINVAL if the port is equal to 0 or
+ * over 65535.
+ */
+static int set_tor_ipv6_port(const char *port, struct configuration *config)
+{
+	int ret;
+
+	assert(port);
+	assert(config);
+
+	ret = parse_port(port, &config->conf_file.tor_ipv6_port);
+	if (ret < 0) {
+		goto error;
+	}
+
+	DBG("Config file setting tor IPv6 port to %u",
+			config->conf_file.tor_ipv6_port);
+
+error:
+	return ret;
+}
+
+/*
+ * Set the given string port of the Tor DNSPort in a configuration object.
+ *
+ * Return 0 on success or else a negative EINVAL if the port is equal to 0 or
+ * over 65535.
+ */
+static int set_tor_dns_port(const char *port, struct configuration *config)
+{
+	int ret;
+
+	assert(port);
+	assert(config);
+
+	ret = parse_port(port, &config->conf_file.tor_dns_port);
+	if (ret < 0) {
+		goto error;
+	}
+
+	DBG("Config file setting tor DNS port to %u",
+			config->conf_file.tor_dns_port);
 
-	DBG("Config file setting tor port to %lu", _port);
+error:
+	return ret;
+}
+
+/*
+ * Set the given string ControlPort of Tor in a configuration object. It is
+ * either a port on the Tor address or "unix:" followed by the path of a unix
+ * socket, like in torrc.
+ *
+ * Return 0 on success or else a negative EINVAL.
+ */
+static int set_tor_control_port(const char *port,
+		struct configuration *config)
+{
+	int ret;
+	const char *path;
+
+	assert(port);
+	assert(config);
+
+	if (strncmp(port, "unix:", 5) != 0) {
+		ret = parse_port(port, &config->conf_file.tor_control_port);
+		if (ret < 0) {
+			goto error;
+		}
+		DBG("Config file setting tor control port to %u",
+				config->conf_file.tor_control_port);
+		goto error;
+	}
+
+	/* The path is copied in a sockaddr_un, NUL byte included. */
+	path = port + 5;
+	if (*path == '\0' ||
+			strlen(path) >= sizeof(config->conf_file.tor_control_socket) ||
+			strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+		ERR("[config] Invalid %s value for %s", port,
+				conf_tor_control_port_str);
+		ret = -EINVAL;
+		goto error;
+	}
+	strcpy(config->conf_file.tor_control_socket, path);
+	DBG("Config file setting tor control socket to %s", path);
+	ret = 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Set the given string value of a ControlPort authentication option in the
+ * given buffer of a configuration object.
+ *
+ * Return 0 on success or else a negative EINVAL if it is too long.
+ */
+static int set_tor_control_auth(const char *value, const char *name,
+		char *buf, size_t len)
+{
+	int ret;
+
+	assert(value);
+	assert(name);
+	assert(buf);
+
+	if (strlen(value) >= len) {
+		ERR("[config] Invalid %s value", name);
+		ret = -EINVAL;
+		goto error;
+	}
+	strcpy(buf, value);
+	DBG("[config] %s set", name);
+	ret = 0;
 
 error:
 	return ret;
@@ -217,6 +367,36 @@ static int parse_config_line(const char *line, struct configuration *config)
 		if (ret < 0) {
 			goto error;
 		}
+	} else if (!strcmp(tokens[0], conf_tor_ipv6_port_str)) {
+		ret = set_tor_ipv6_port(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_tor_dns_port_str)) {
+		ret = set_tor_dns_port(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_tor_control_port_str)) {
+		ret = set_tor_control_port(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_tor_control_cookie_file_str)) {
+		ret = set_tor_control_auth(tokens[1],
+				conf_tor_control_cookie_file_str,
+				config->conf_file.tor_control_cookie_file,
+				sizeof(config->conf_file.tor_control_cookie_file));
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_tor_control_password_str)) {
+		ret = set_tor_control_auth(tokens[1], conf_tor_control_password_str,
+				config->conf_file.tor_control_password,
+				sizeof(config->conf_file.tor_control_password));
+		if (ret < 0) {
+			goto error;
+		}
 	} else if (!strcmp(tokens[0], conf_onion_str)) {
 		ret = set_onion_info(tokens[1], config);
 		if (ret < 0) {
@@ -247,6 +427,21 @@ static int parse_config_line(const char *line, struct configuration *config)
 		if (ret < 0) {
 			goto error;
 		}
+	} else if (!strcmp(tokens[0], conf_use_io_uring_str)) {
+		ret = conf_file_set_use_io_uring(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_prefer_ipv6_str)) {
+		ret = conf_file_set_prefer_ipv6(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
+	} else if (!strcmp(tokens[0], conf_allow_udp_dns_str)) {
+		ret = conf_file_set_allow_udp_dns(tokens[1], config);
+		if (ret < 0) {
+			goto error;
+		}
 	} else {
 		WARN("Config file contains unknown value: %s", line);
 	}
@@ -444,6 +639,97 @@ int conf_file_set_isolate_pid(const char *val, struct configuration *config)
 	return ret;
 }
 
+/*
+ * Set the use io_uring option for the given config. If torsocks was built
+ * without io_uring support, the option is accepted but has no effect.
+ *
+ * Return 0 if option is off, 1 if on and negative value on error.
+ */
+ATTR_HIDDEN
+int conf_file_set_use_io_uring(const char *val, struct configuration *config)
+{
+	int ret;
+
+	assert(val);
+	assert(config);
+
+	ret = atoi(val);
+	if (ret == 0) {
+		config->use_io_uring = 0;
+		DBG("[config] io_uring SOCKS5 handshake disabled.");
+	} else if (ret == 1) {
+#ifdef HAVE_IO_URING
+		config->use_io_uring = 1;
+		DBG("[config] io_uring SOCKS5 handshake enabled.");
+#else
+		WARN("[config] %s is set but torsocks was built without io_uring.",
+				conf_use_io_uring_str);
+#endif
+	} else {
+		ERR("[config] Invalid %s value for %s", val,
+				conf_use_io_uring_str);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+/*
+ * Set the prefer IPv6 option for the given config.
+ *
+ * Return 0 if option is off, 1 if on and negative value on error.
+ */
+ATTR_HIDDEN
+int conf_file_set_prefer_ipv6(const char *val, struct configuration *config)
+{
+	int ret;
+
+	assert(val);
+	assert(config);
+
+	ret = atoi(val);
+	if (ret == 0) {
+		config->prefer_ipv6 = 0;
+		DBG("[config] IPv4 addresses preferred.");
+	} else if (ret == 1) {
+		config->prefer_ipv6 = 1;
+		DBG("[config] IPv6 addresses preferred.");
+	} else {
+		ERR("[config] Invalid %s value for %s", val, conf_prefer_ipv6_str);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+/*
+ * Set the allow UDP DNS option for the given config.
+ *
+ * Return 0 if option is off, 1 if on and negative value on error.
+ */
+ATTR_HIDDEN
+int conf_file_set_allow_udp_dns(const char *val, struct configuration *config)
+{
+	int ret;
+
+	assert(val);
+	assert(config);
+
+	ret = atoi(val);
+	if (ret == 0) {
+		config->allow_udp_dns = 0;
+		DBG("[config] UDP DNS queries denied.");
+	} else if (ret == 1) {
+		config->allow_udp_dns = 1;
+		DBG("[config] UDP DNS queries answered through Tor.");
+	} else {
+		ERR("[config] Invalid %s value for %s", val, conf_allow_udp_dns_str);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
 /*
  * Applies the SOCKS authentication configuration and sets the final SOCKS
  * username and password.
@@ -25,6 +25,11 @@
 #include "connection.h"
 #include "socks5.h"
 
+/* Length of the path of a unix socket, sun_path included. */
+#define CONFIG_PATH_LEN			108
+/* Tor accepts a HashedControlPassword of any length, this is plenty. */
+#define CONFIG_PASSWORD_LEN		256
+
 /*
  * Represent the values in a configuration file (torsocks.conf). Basically,
  * this is the data structure of a parsed config file.
@@ -36,6 +41,25 @@ struct config_file {
 	char *tor_address;
 	/* The port of the Tor SOCKS. */
 	in_port_t tor_port;
+	/*
+	 * Port of a Tor SOCKS on the same address answering resolve requests
+	 * with an IPv6 address, 0 if there is none.
+	 */
+	in_port_t tor_ipv6_port;
+	/*
+	 * DNSPort of Tor on the same address used to resolve names instead of
+	 * the SOCKS port, 0 if there is none.
+	 */
+	in_port_t tor_dns_port;
+	/*
+	 * ControlPort of Tor on the same address, or the path of its unix
+	 * socket, used to resolve names. Neither is set if there is none.
+	 */
+	in_port_t tor_control_port;
+	char tor_control_socket[CONFIG_PATH_LEN];
+	/* Authentication to the ControlPort, none if both are empty. */
+	char tor_control_cookie_file[CONFIG_PATH_LEN];
+	char tor_control_password[CONFIG_PASSWORD_LEN];
 
 	/*
 	 * Base for onion address pool and the mask. In the config file, this is
@@ -90,6 +114,24 @@ struct configuration {
 	 * username or password.
 	 */
 	unsigned int isolate_pid:1;
+
+	/*
+	 * Do the SOCKS5 handshake of a connection with io_uring. Falls back to
+	 * the normal socket calls if the kernel does not support it.
+	 */
+	unsigned int use_io_uring:1;
+
+	/*
+	 * Put the IPv6 addresses of a name resolved for any family before its
+	 * IPv4 ones.
+	 */
+	unsigned int prefer_ipv6:1;
+
+	/*
+	 * Allow INET UDP sockets sending only to port 53 and answer their DNS
+	 * queries through Tor.
+	 */
+	unsigned int allow_udp_dns:1;
 };
 
 int config_file_read(const char *filename, struct configuration *config);
@@ -102,6 +144,9 @@ int conf_file_set_allow_inbound(const char *val, struct configuration *config);
 int conf_file_set_allow_outbound_localhost(const char *val, struct
 		configuration *config);
 int conf_file_set_isolate_pid(const char *val, struct configuration *config);
+int conf_file_set_use_io_uring(const char *val, struct configuration *config);
+int conf_file_set_prefer_ipv6(const char *val, struct configuration *config);
+int conf_file_set_allow_udp_dns(const char *val, struct configuration *config);
 
 int conf_apply_socks_auth(struct configuration *config);
 
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Needed for memfd_create(2) and the file seals. */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config-snapshot.h"
+#include "defaults.h"
+#include "log.h"
+#include "macros.h"
+
+/* FNV-1a 64 bit parameters. */
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+
+/*
+ * Every environment variable that changes the configuration. A child having a
+ * different value for any of them can't use the snapshot of its parent.
+ */
+static const char *fingerprint_env[] = {
+	DEFAULT_ALLOW_INBOUND_ENV,
+	DEFAULT_ISOLATE_PID_ENV,
+	DEFAULT_USE_IO_URING_ENV,
+	DEFAULT_PREFER_IPV6_ENV,
+	DEFAULT_ALLOW_UDP_DNS_ENV,
+	DEFAULT_SOCKS5_USER_ENV,
+	DEFAULT_SOCKS5_PASS_ENV,
+};
+
+static uint64_t fnv_hash(uint64_t hash, const void *data, size_t len)
+{
+	size_t i;
+	const unsigned char *p = data;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * Hash a string including its NUL byte so that consecutive strings can't be
+ * confused. A NULL string is hashed as a single 0xff byte which can't start a
+ * valid string.
+ */
+static uint64_t fnv_hash_str(uint64_t hash, const char *str)
+{
+	static const unsigned char none = 0xff;
+
+	if (!str) {
+		return fnv_hash(hash, &none, sizeof(none));
+	}
+	return fnv_hash(hash, str, strlen(str) + 1);
+}
+
+/*
+ * Compute the fingerprint of everything a configuration is built from that is
+ * the given configuration file (NULL for the default one), its metadata and
+ * the environment variables overriding it.
+ *
+ * Stating the file is a lot cheaper than opening and parsing it and catches
+ * any modification made to it since the snapshot was taken. The environment
+ * variables are read with get_env.
+ */
+ATTR_HIDDEN
+uint64_t config_snapshot_fingerprint(const char *filename,
+		config_snapshot_getenv_cb get_env)
+{
+	unsigned int i;
+	uint64_t hash = FNV_OFFSET_BASIS, meta[5];
+	struct stat st;
+
+	if (!filename) {
+		filename = DEFAULT_CONF_FILE;
+	}
+
+	memset(meta, 0, sizeof(meta));
+	if (stat(filename, &st) == 0) {
+		meta[0] = st.st_dev;
+		meta[1] = st.st_ino;
+		meta[2] = st.st_size;
+		meta[3] = st.st_mtime;
+		meta[4] = st.st_ctime;
+	}
+
+	hash = fnv_hash_str(hash, filename);
+	hash = fnv_hash(hash, meta, sizeof(meta));
+	for (i = 0; i < ARRAY_SIZE(fingerprint_env); i++) {
+		hash = fnv_hash_str(hash, fingerprint_env[i]);
+		hash = fnv_hash_str(hash, get_env(fingerprint_env[i]));
+	}
+
+	return hash;
+}
+
+/*
+ * Serialize the given configuration in a snapshot.
+ *
+ * Return 0 on success, -EPERM if the configuration holds a password or else a
+ * negative value.
+ */
+ATTR_HIDDEN
+int config_snapshot_encode(const struct configuration *config,
+		uint64_t fingerprint, struct config_snapshot *snap)
+{
+	int ret;
+	const struct connection_addr *addr;
+
+	assert(config);
+	assert(snap);
+
+	if (config->conf_file.socks5_password[0] != '\0' ||
+			config->conf_file.tor_control_password[0] != '\0') {
+		ret = -EPERM;
+		goto error;
+	}
+
+	/* Padding bytes are part of the checksum. */
+	memset(snap, 0, sizeof(*snap));
+
+	snap->magic = CONFIG_SNAPSHOT_MAGIC;
+	snap->version = CONFIG_SNAPSHOT_VERSION;
+	snap->length = sizeof(*snap);
+	snap->fingerprint = fingerprint;
+
+	snap->flags |= config->socks5_use_auth ? CONFIG_SNAPSHOT_USE_AUTH : 0;
+	snap->flags |= config->allow_inbound ? CONFIG_SNAPSHOT_ALLOW_INBOUND : 0;
+	snap->flags |= config->allow_outbound_localhost ?
+		CONFIG_SNAPSHOT_ALLOW_LOCALHOST : 0;
+	snap->flags |= config->isolate_pid ? CONFIG_SNAPSHOT_ISOLATE_PID : 0;
+	snap->flags |= config->use_io_uring ? CONFIG_SNAPSHOT_USE_IO_URING : 0;
+	snap->flags |= config->prefer_ipv6 ? CONFIG_SNAPSHOT_PREFER_IPV6 : 0;
+	snap->flags |= config->allow_udp_dns ? CONFIG_SNAPSHOT_ALLOW_UDP_DNS : 0;
+
+	snap->tor_domain = config->conf_file.tor_domain;
+	snap->tor_port = config->conf_file.tor_port;
+	snap->tor_ipv6_port = config->conf_file.tor_ipv6_port;
+	snap->tor_dns_port = config->conf_file.tor_dns_port;
+	snap->tor_control_port = config->conf_file.tor_control_port;
+	snap->onion_base = config->conf_file.onion_base;
+	snap->onion_mask = config->conf_file.onion_mask;
+
+	addr = &config->socks5_addr;
+	switch (addr->domain) {
+	case CONNECTION_DOMAIN_INET:
+		memcpy(snap->tor_addr, &addr->u.sin.sin_addr,
+				sizeof(addr->u.sin.sin_addr));
+		break;
+	case CONNECTION_DOMAIN_INET6:
+		memcpy(snap->tor_addr, &addr->u.sin6.sin6_addr,
+				sizeof(addr->u.sin6.sin6_addr));
+		break;
+	default:
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (!config->conf_file.tor_address ||
+			strlen(config->conf_file.tor_address) >=
+			sizeof(snap->tor_address)) {
+		ret = -EINVAL;
+		goto error;
+	}
+	strcpy(snap->tor_address, config->conf_file.tor_address);
+	memcpy(snap->socks5_username, config->conf_file.socks5_username,
+			sizeof(snap->socks5_username));
+	memcpy(snap->tor_control_socket, config->conf_file.tor_control_socket,
+			sizeof(snap->tor_control_socket));
+	memcpy(snap->tor_control_cookie_file,
+			config->conf_file.tor_control_cookie_file,
+			sizeof(snap->tor_control_cookie_file));
+
+	snap->checksum = fnv_hash(FNV_OFFSET_BASIS, snap,
+			offsetof(struct config_snapshot, checksum));
+
+	return 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Validate the snapshot in the given buffer and, if it matches the given
+ * fingerprint, populate the configuration with it. The configuration is
+ * cleared first.
+ *
+ * Return 0 on success, -ESTALE if the snapshot is valid but was taken from a
+ * different configuration or else a negative value.
+ */
+ATTR_HIDDEN
+int config_snapshot_decode(const void *buf, size_t len, uint64_t fingerprint,
+		struct configuration *config)
+{
+	int ret;
+	struct config_snapshot snap;
+	struct connection_addr *addr;
+
+	assert(buf);
+	assert(config);
+
+	if (len != sizeof(snap)) {
+		ret = -EINVAL;
+		goto error;
+	}
+	/* The buffer might be shared memory so work on a copy of it. */
+	memcpy(&snap, buf, sizeof(snap));
+
+	if (snap.magic != CONFIG_SNAPSHOT_MAGIC ||
+			snap.version != CONFIG_SNAPSHOT_VERSION ||
+			snap.length != sizeof(snap) ||
+			snap.checksum != fnv_hash(FNV_OFFSET_BASIS, &snap,
+				offsetof(struct config_snapshot, checksum))) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	if (snap.fingerprint != fingerprint) {
+		ret = -ESTALE;
+		goto error;
+	}
+
+	/* Never trust the strings to be terminated. */
+	if (!memchr(snap.tor_address, '\0', sizeof(snap.tor_address)) ||
+			!memchr(snap.socks5_username, '\0',
+				sizeof(snap.socks5_username)) ||
+			!memchr(snap.tor_control_socket, '\0',
+				sizeof(snap.tor_control_socket)) ||
+			!memchr(snap.tor_control_cookie_file, '\0',
+				sizeof(snap.tor_control_cookie_file)) ||
+			snap.tor_port == 0 || snap.onion_mask > 32) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	memset(config, 0, sizeof(*config));
+
+	addr = &config->socks5_addr;
+	switch (snap.tor_domain) {
+	case CONNECTION_DOMAIN_INET:
+		addr->u.sin.sin_family = AF_INET;
+		addr->u.sin.sin_port = htons(snap.tor_port);
+		memcpy(&addr->u.sin.sin_addr, snap.tor_addr,
+				sizeof(addr->u.sin.sin_addr));
+		break;
+	case CONNECTION_DOMAIN_INET6:
+		addr->u.sin6.sin6_family = AF_INET6;
+		addr->u.sin6.sin6_port = htons(snap.tor_port);
+		memcpy(&addr->u.sin6.sin6_addr, snap.tor_addr,
+				sizeof(addr->u.sin6.sin6_addr));
+		break;
+	default:
+		ret = -EINVAL;
+		goto error;
+	}
+	addr->domain = snap.tor_domain;
+
+	config->conf_file.tor_address = strdup(snap.tor_address);
+	if (!config->conf_file.tor_address) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	config->conf_file.tor_domain = snap.tor_domain;
+	config->conf_file.tor_port = snap.tor_port;
+	config->conf_file.tor_ipv6_port = snap.tor_ipv6_port;
+	config->conf_file.tor_dns_port = snap.tor_dns_port;
+	config->conf_file.tor_control_port = snap.tor_control_port;
+	config->conf_file.onion_base = snap.onion_base;
+	config->conf_file.onion_mask = snap.onion_mask;
+	memcpy(config->conf_file.socks5_username, snap.socks5_username,
+			sizeof(config->conf_file.socks5_username));
+	memcpy(config->conf_file.tor_control_socket, snap.tor_control_socket,
+			sizeof(config->conf_file.tor_control_socket));
+	memcpy(config->conf_file.tor_control_cookie_file,
+			snap.tor_control_cookie_file,
+			sizeof(config->conf_file.tor_control_cookie_file));
+
+	config->socks5_use_auth = !!(snap.flags & CONFIG_SNAPSHOT_USE_AUTH);
+	config->allow_inbound = !!(snap.flags & CONFIG_SNAPSHOT_ALLOW_INBOUND);
+	config->allow_outbound_localhost =
+		!!(snap.flags & CONFIG_SNAPSHOT_ALLOW_LOCALHOST);
+	config->isolate_pid = !!(snap.flags & CONFIG_SNAPSHOT_ISOLATE_PID);
+	config->use_io_uring = !!(snap.flags & CONFIG_SNAPSHOT_USE_IO_URING);
+	config->prefer_ipv6 = !!(snap.flags & CONFIG_SNAPSHOT_PREFER_IPV6);
+	config->allow_udp_dns = !!(snap.flags & CONFIG_SNAPSHOT_ALLOW_UDP_DNS);
+
+	return 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Return 1 if the calling process has a single thread else 0, also when it
+ * can't be found out.
+ */
+static int is_single_threaded(void)
+{
+	struct stat st;
+
+	/* Every thread is a directory in there besides "." and "..". */
+	if (stat("/proc/self/task", &st) < 0) {
+		return 0;
+	}
+	return st.st_nlink == 3;
+}
+
+/*
+ * Publish a snapshot of the given configuration to our children. It is
+ * written in a sealed memfd inherited across exec and its fd number is set in
+ * the environment.
+ *
+ * Changing the environment is not thread safe thus nothing is published once
+ * the application started a thread, which can happen when we are loaded by
+ * dlopen(3) rather than preloaded.
+ *
+ * Return 0 on success, -EBUSY if the process has more than one thread or else
+ * a negative value.
+ */
+ATTR_HIDDEN
+int config_snapshot_publish(const struct configuration *config,
+		uint64_t fingerprint)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int ret, fd;
+	ssize_t written;
+	char fd_str[16];
+	struct config_snapshot snap;
+
+	assert(config);
+
+	if (!is_single_threaded()) {
+		ret = -EBUSY;
+		goto error;
+	}
+
+	ret = config_snapshot_encode(config, fingerprint, &snap);
+	if (ret < 0) {
+		goto error;
+	}
+
+	/* No close on exec, our children need it. */
+	fd = memfd_create("torsocks-config", MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	do {
+		written = write(fd, &snap, sizeof(snap));
+	} while (written < 0 && errno == EINTR);
+	if (written != sizeof(snap)) {
+		ret = -EIO;
+		goto error_close;
+	}
+
+	/* Nobody inheriting it can modify it from now on. */
+	(void) fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+	snprintf(fd_str, sizeof(fd_str), "%d", fd);
+	if (setenv(DEFAULT_CONFIG_FD_ENV, fd_str, 1) < 0) {
+		ret = -errno;
+		goto error_close;
+	}
+
+	DBG("[config] Configuration snapshot published on fd %d", fd);
+	return 0;
+
+error_close:
+	close(fd);
+error:
+	return ret;
+#else
+	return -ENOSYS;
+#endif /* HAVE_MEMFD_CREATE */
+}
+
+/*
+ * Load the configuration snapshot published by a parent process if any and
+ * if it was taken from a configuration matching the given fingerprint. Its fd
+ * is found with get_env.
+ *
+ * A snapshot not matching is useless to our children as well so its fd is
+ * closed and the variable unset, once more only if the process has a single
+ * thread. The snapshot published in its place uses another fd.
+ *
+ * Return 0 on success, -ENOENT if there is no snapshot or else a negative
+ * value in which case the configuration MUST be read from the file.
+ */
+ATTR_HIDDEN
+int config_snapshot_load(uint64_t fingerprint, struct configuration *config,
+		config_snapshot_getenv_cb get_env)
+{
+	int ret;
+	long fd;
+	char *endptr;
+	const char *fd_str;
+	void *buf;
+	struct stat st;
+
+	assert(config);
+
+	fd_str = get_env(DEFAULT_CONFIG_FD_ENV);
+	if (!fd_str) {
+		ret = -ENOENT;
+		goto error;
+	}
+
+	errno = 0;
+	fd = strtol(fd_str, &endptr, 10);
+	if (errno || *endptr != '\0' || endptr == fd_str || fd < 0 ||
+			fd > INT_MAX) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	/*
+	 * The fd number might have been reused by the application for something
+	 * else so only map a regular file of the exact size of a snapshot.
+	 */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+			st.st_size != sizeof(struct config_snapshot)) {
+		ret = -EINVAL;
+		goto error;
+	}
+#ifdef F_GET_SEALS
+	/* Only our sealed memfd can be closed behind the application. */
+	ret = fcntl(fd, F_GET_SEALS);
+	if (ret < 0 || !(ret & F_SEAL_WRITE)) {
+		ret = -EINVAL;
+		goto error;
+	}
+#endif
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = config_snapshot_decode(buf, st.st_size, fingerprint, config);
+	munmap(buf, st.st_size);
+	if (ret < 0) {
+		goto error_drop;
+	}
+
+	DBG("[config] Configuration loaded from the snapshot on fd %ld", fd);
+	return 0;
+
+error_drop:
+#ifdef F_GET_SEALS
+	if (is_single_threaded()) {
+		DBG("[config] Dropping the snapshot on fd %ld", fd);
+		close(fd);
+		unsetenv(DEFAULT_CONFIG_FD_ENV);
+	}
+#endif
+error:
+	return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "config-file.h"
+
+/* "TSCS" in memory. Also catches a snapshot of a different endianness. */
+#define CONFIG_SNAPSHOT_MAGIC		0x53435354
+/* Bump this every time the layout of the snapshot changes. */
+#define CONFIG_SNAPSHOT_VERSION		5
+
+/* Enough for the text form of any IPv4 or IPv6 address. */
+#define CONFIG_SNAPSHOT_ADDR_LEN	64
+
+/* Flags of the snapshot mapping the bits of struct configuration. */
+#define CONFIG_SNAPSHOT_USE_AUTH		(1U << 0)
+#define CONFIG_SNAPSHOT_ALLOW_INBOUND	(1U << 1)
+#define CONFIG_SNAPSHOT_ALLOW_LOCALHOST	(1U << 2)
+#define CONFIG_SNAPSHOT_ISOLATE_PID		(1U << 3)
+#define CONFIG_SNAPSHOT_USE_IO_URING	(1U << 4)
+#define CONFIG_SNAPSHOT_PREFER_IPV6		(1U << 5)
+#define CONFIG_SNAPSHOT_ALLOW_UDP_DNS	(1U << 6)
+
+/*
+ * Binary form of a parsed configuration shared with our children so they
+ * don't have to read and parse the configuration file again. Only fixed size
+ * types are used so the layout is the same for a 32 and 64 bit process.
+ *
+ * The snapshot is taken before the SOCKS5 authentication is finalized so the
+ * PID based isolation is computed by every process for itself.
+ *
+ * The memory file is inherited by every child, even one not using torsocks,
+ * thus it never holds a password. A configuration having one is not shared.
+ */
+struct config_snapshot {
+	uint32_t magic;
+	uint16_t version;
+	/* Size of this structure. */
+	uint16_t length;
+	/*
+	 * Fingerprint of everything the configuration was built from. A child
+	 * computing a different one parses the configuration file itself.
+	 */
+	uint64_t fingerprint;
+
+	uint32_t flags;
+	uint32_t tor_domain;
+	/* Network byte order. */
+	uint32_t onion_base;
+	uint16_t tor_port;
+	uint16_t tor_ipv6_port;
+	uint16_t tor_dns_port;
+	uint16_t tor_control_port;
+	uint8_t onion_mask;
+	uint8_t pad[3];
+	/* Tor SOCKS5 address in network byte order, 4 or 16 bytes used. */
+	uint8_t tor_addr[16];
+	char tor_address[CONFIG_SNAPSHOT_ADDR_LEN];
+	char socks5_username[SOCKS5_USERNAME_LEN];
+	char tor_control_socket[CONFIG_PATH_LEN];
+	char tor_control_cookie_file[CONFIG_PATH_LEN];
+
+	/* Checksum of every byte above. MUST be the last field. */
+	uint64_t checksum;
+};
+
+/*
+ * Lookup of the environment variables, getenv(3) or the copy of the
+ * environment taken by the library at startup.
+ */
+typedef char *(*config_snapshot_getenv_cb)(const char *name);
+
+uint64_t config_snapshot_fingerprint(const char *filename,
+		config_snapshot_getenv_cb get_env);
+int config_snapshot_encode(const struct configuration *config,
+		uint64_t fingerprint, struct config_snapshot *snap);
+int config_snapshot_decode(const void *buf, size_t len, uint64_t fingerprint,
+		struct configuration *config);
+
+int config_snapshot_publish(const struct configuration *config,
+		uint64_t fingerprint);
+int config_snapshot_load(uint64_t fingerprint, struct configuration *config,
+		config_snapshot_getenv_cb get_env);
+
+#endif /* CONFIG_SNAPSHOT_H */
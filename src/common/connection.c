@@ -17,7 +17,9 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "connection.h"
 #include "macros.h"
@@ -32,6 +34,180 @@
  */
 static TSOCKS_INIT_MUTEX(connection_registry_mutex);
 
+/* Connections allocated at once from the heap when no free one is left. */
+#define CONN_SLAB_SIZE		64
+/*
+ * Free connections a thread keeps. Above that, half of them go back to the
+ * shared list so objects freed by one thread and allocated by another do not
+ * pile up.
+ */
+#define CONN_CACHE_MAX		32
+
+/*
+ * Block of connections from the heap. Never freed, its objects move between
+ * the free lists.
+ */
+struct conn_slab {
+	struct conn_slab *next;
+	struct connection conns[CONN_SLAB_SIZE];
+};
+
+/* Free connections shared by every thread and the slabs they come from. */
+static struct {
+	tsocks_mutex_t lock;
+	struct connection *free;
+	struct conn_slab *slabs;
+} conn_pool = {
+	.lock = TSOCKS_MUTEX_INIT,
+};
+
+/*
+ * Free connections of a thread. A connect and close cycle takes and gives
+ * back an object here without any lock.
+ */
+static __thread struct conn_cache {
+	struct connection *free;
+	unsigned int count;
+	/* Set once the exit destructor is registered for this thread. */
+	int registered;
+} conn_cache;
+
+static pthread_key_t conn_cache_key;
+static TSOCKS_INIT_ONCE(conn_cache_once);
+
+/*
+ * Move up to count objects from a free list to another.
+ *
+ * Return the number of objects moved.
+ */
+static unsigned int move_free(struct connection **from, struct connection **to,
+		unsigned int count)
+{
+	unsigned int i;
+	struct connection *conn;
+
+	for (i = 0; i < count && *from; i++) {
+		conn = *from;
+		*from = conn->next_free;
+		conn->next_free = *to;
+		*to = conn;
+	}
+	return i;
+}
+
+/*
+ * Thread exit. Give the free objects of the thread back to the shared list.
+ */
+static void conn_cache_release(void *data)
+{
+	struct conn_cache *cache = data;
+
+	tsocks_mutex_lock(&conn_pool.lock);
+	(void) move_free(&cache->free, &conn_pool.free, cache->count);
+	tsocks_mutex_unlock(&conn_pool.lock);
+	cache->count = 0;
+	cache->registered = 0;
+}
+
+static void conn_cache_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&conn_pool.lock);
+}
+
+static void conn_cache_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&conn_pool.lock);
+}
+
+/*
+ * The objects cached by the other threads are lost in the child, the ones of
+ * the forking thread and of the shared list stay usable.
+ */
+static void conn_cache_atfork_child(void)
+{
+	tsocks_mutex_unlock(&conn_pool.lock);
+}
+
+static void conn_cache_key_init(void)
+{
+	(void) pthread_key_create(&conn_cache_key, conn_cache_release);
+	(void) pthread_atfork(conn_cache_atfork_prepare, conn_cache_atfork_parent,
+			conn_cache_atfork_child);
+}
+
+/*
+ * Register the thread exit destructor of the calling thread's cache.
+ */
+static void conn_cache_register(void)
+{
+	tsocks_once(&conn_cache_once, conn_cache_key_init);
+	(void) pthread_setspecific(conn_cache_key, &conn_cache);
+	conn_cache.registered = 1;
+}
+
+/*
+ * Take a zeroed connection object from the thread cache, refilled from the
+ * shared list or from a new slab when empty.
+ *
+ * Return the object or NULL on allocation error.
+ */
+static struct connection *conn_alloc(void)
+{
+	unsigned int i;
+	struct connection *conn;
+	struct conn_slab *slab;
+
+	if (!conn_cache.free) {
+		if (!conn_cache.registered) {
+			conn_cache_register();
+		}
+
+		tsocks_mutex_lock(&conn_pool.lock);
+		if (!conn_pool.free) {
+			slab = zmalloc(sizeof(*slab));
+			if (!slab) {
+				tsocks_mutex_unlock(&conn_pool.lock);
+				return NULL;
+			}
+			for (i = 0; i < CONN_SLAB_SIZE; i++) {
+				slab->conns[i].next_free = conn_pool.free;
+				conn_pool.free = &slab->conns[i];
+			}
+			slab->next = conn_pool.slabs;
+			conn_pool.slabs = slab;
+		}
+		conn_cache.count += move_free(&conn_pool.free, &conn_cache.free,
+				CONN_CACHE_MAX / 2);
+		tsocks_mutex_unlock(&conn_pool.lock);
+	}
+
+	conn = conn_cache.free;
+	conn_cache.free = conn->next_free;
+	conn_cache.count--;
+
+	memset(conn, 0, sizeof(*conn));
+	return conn;
+}
+
+/*
+ * Give a connection object back to the thread cache.
+ */
+static void conn_free(struct connection *conn)
+{
+	if (!conn_cache.registered) {
+		conn_cache_register();
+	}
+
+	conn->next_free = conn_cache.free;
+	conn_cache.free = conn;
+	if (++conn_cache.count > CONN_CACHE_MAX) {
+		tsocks_mutex_lock(&conn_pool.lock);
+		conn_cache.count -= move_free(&conn_cache.free, &conn_pool.free,
+				CONN_CACHE_MAX / 2);
+		tsocks_mutex_unlock(&conn_pool.lock);
+	}
+}
+
 /*
  * Release connection using the given refcount located inside the connection
  * object. This is ONLY called from the connection put reference. After this
@@ -106,6 +282,27 @@ void connection_registry_unlock(void)
 	tsocks_mutex_unlock(&connection_registry_mutex);
 }
 
+#ifdef TSOCKS_LOCK_STATS
+/*
+ * Copy the contention statistics of the registry mutex.
+ */
+ATTR_HIDDEN
+void connection_registry_lock_stats(struct tsocks_lock_stats *stats)
+{
+	tsocks_mutex_stats(&connection_registry_mutex, stats);
+}
+#endif
+
+/*
+ * Return the number of connections in the registry. MUST be called with the
+ * registry lock held.
+ */
+ATTR_HIDDEN
+unsigned int connection_registry_size(void)
+{
+	return HT_SIZE(&connection_registry_root);
+}
+
 /*
  * Set an already allocated connection address using the given IPv4/6 address,
  * domain and port.
@@ -177,7 +374,7 @@ struct connection *connection_create(int fd, const struct sockaddr *dest)
 {
 	struct connection *conn = NULL;
 
-	conn = zmalloc(sizeof(*conn));
+	conn = conn_alloc();
 	if (!conn) {
 		PERROR("zmalloc connection");
 		goto error;
@@ -207,10 +404,39 @@ struct connection *connection_create(int fd, const struct sockaddr *dest)
 	return conn;
 
 error:
-	free(conn);
+	if (conn) {
+		conn_free(conn);
+	}
 	return NULL;
 }
 
+/*
+ * Set the destination host name of a connection, stored in the object when
+ * short enough.
+ *
+ * Return 0 on success or else -ENOMEM.
+ */
+ATTR_HIDDEN
+int connection_set_hostname(struct connection *conn, const char *name)
+{
+	size_t len;
+
+	assert(conn);
+	assert(name);
+
+	len = strlen(name);
+	if (len < sizeof(conn->hostname)) {
+		memcpy(conn->hostname, name, len + 1);
+		conn->dest_addr.hostname.addr = conn->hostname;
+	} else {
+		conn->dest_addr.hostname.addr = strdup(name);
+		if (!conn->dest_addr.hostname.addr) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /*
  * Return the matching element with the given key or NULL if not found.
  */
@@ -237,6 +463,12 @@ void connection_insert(struct connection *conn)
 	c_tmp = connection_find(conn->fd);
 	assert(!c_tmp);
 
+	/* Sized once so the first connections never resize the table. */
+	if (!connection_registry_root.hth_table) {
+		(void) connection_registry_HT_GROW(&connection_registry_root,
+				DEFAULT_CONN_REGISTRY_SIZE);
+	}
+
 	HT_INSERT(connection_registry, &connection_registry_root, conn);
 }
 
@@ -251,7 +483,7 @@ void connection_remove(struct connection *conn)
 }
 
 /*
- * Destroy a connection by freeing its memory.
+ * Destroy a connection by giving its memory back to the connection cache.
  */
 ATTR_HIDDEN
 void connection_destroy(struct connection *conn)
@@ -260,8 +492,10 @@ void connection_destroy(struct connection *conn)
 		return;
 	}
 
-	free(conn->dest_addr.hostname.addr);
-	free(conn);
+	if (conn->dest_addr.hostname.addr != conn->hostname) {
+		free(conn->dest_addr.hostname.addr);
+	}
+	conn_free(conn);
 }
 
 /*
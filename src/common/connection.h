@@ -22,11 +22,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include "compat.h"
 #include "defaults.h"
 #include "ht.h"
 #include "macros.h"
 #include "ref.h"
 
+/*
+ * Host names shorter than this, such as every .onion address, are stored in
+ * the connection object instead of being allocated.
+ */
+#define CONNECTION_HOSTNAME_INLINE	64
+
 enum connection_domain {
 	CONNECTION_DOMAIN_INET	= 1,
 	CONNECTION_DOMAIN_INET6	= 2,
@@ -70,12 +77,19 @@ struct connection {
 
 	/* Hash table node. */
 	HT_ENTRY(connection) node;
+
+	/* Next free object when in a free list of the connection cache. */
+	struct connection *next_free;
+
+	/* Storage of dest_addr.hostname.addr when it fits. */
+	char hostname[CONNECTION_HOSTNAME_INLINE];
 };
 
 int connection_addr_set(enum connection_domain domain, const char *ip,
 		in_port_t port, struct connection_addr *addr);
 
 struct connection *connection_create(int fd, const struct sockaddr *dest);
+int connection_set_hostname(struct connection *conn, const char *name);
 struct connection *connection_find(int key);
 void connection_destroy(struct connection *conn);
 void connection_remove(struct connection *conn);
@@ -83,6 +97,10 @@ void connection_insert(struct connection *conn);
 
 void connection_registry_lock(void);
 void connection_registry_unlock(void);
+unsigned int connection_registry_size(void);
+#ifdef TSOCKS_LOCK_STATS
+void connection_registry_lock_stats(struct tsocks_lock_stats *stats);
+#endif
 
 void connection_get_ref(struct connection *c);
 void connection_put_ref(struct connection *c);
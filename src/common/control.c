@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <lib/torsocks.h>
+
+#include "connection.h"
+#include "control.h"
+#include "flight.h"
+#include "log.h"
+#include "macros.h"
+#include "metrics.h"
+#include "onion.h"
+
+/* A client has this much time to send its command. */
+#define CONTROL_RECV_TIMEOUT_SEC	1
+
+struct control_command {
+	const char *name;
+	/* Write the answer in the given fd. */
+	int (*handler)(int fd);
+};
+
+static int control_stats(int fd);
+
+static const struct control_command control_commands[] = {
+	{ "dump", flight_dump },
+	{ "stats", control_stats },
+};
+
+static struct {
+	/* Directory of the socket, empty if the control socket is disabled. */
+	char dir[PATH_MAX];
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	int fd;
+	/* Process that owns the socket. The thread does not survive a fork. */
+	pid_t pid;
+} control = {
+	.fd = -1,
+};
+
+static tsocks_mutex_t control_lock = TSOCKS_MUTEX_INIT;
+
+/*
+ * Write the metrics along with the state of the onion pool and registry.
+ */
+static int control_stats(int fd)
+{
+	struct metrics_gauges gauges;
+
+#ifdef TSOCKS_LOCK_STATS
+	/* Before the locks below so they are not counted. */
+	connection_registry_lock_stats(&gauges.registry_lock);
+	tsocks_mutex_stats(&tsocks_onion_pool.lock, &gauges.onion_lock);
+#endif
+
+	onion_pool_lock(&tsocks_onion_pool);
+	gauges.onion_entries = tsocks_onion_pool.count;
+	gauges.onion_capacity = tsocks_onion_pool.max_pos -
+		tsocks_onion_pool.base + 1;
+	onion_pool_unlock(&tsocks_onion_pool);
+
+	connection_registry_lock();
+	gauges.connections = connection_registry_size();
+	connection_registry_unlock();
+
+	return metrics_write(fd, &gauges);
+}
+
+/*
+ * Read a command line from a client and answer it.
+ */
+static void handle_client(int fd)
+{
+	ssize_t ret;
+	size_t len = 0;
+	unsigned int i;
+	char buf[64];
+	struct timeval tv = { .tv_sec = CONTROL_RECV_TIMEOUT_SEC };
+	static const char unknown[] = "ERR unknown command\n";
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(buf) - 1) {
+		ret = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		len += ret;
+		if (memchr(buf, '\n', len)) {
+			break;
+		}
+	}
+	buf[len] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+
+	for (i = 0; i < ARRAY_SIZE(control_commands); i++) {
+		if (strcmp(buf, control_commands[i].name) == 0) {
+			(void) control_commands[i].handler(fd);
+			return;
+		}
+	}
+
+	(void) send(fd, unknown, sizeof(unknown) - 1, MSG_NOSIGNAL);
+}
+
+/*
+ * Accept and serve the clients one at a time until the socket is shut down.
+ */
+static void *control_thread(void *data)
+{
+	int fd, listen_fd = (int) (intptr_t) data;
+	sigset_t mask;
+
+	/* Signals are for the application threads. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+	for (;;) {
+		fd = tsocks_libc_accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		handle_client(fd);
+		tsocks_libc_close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Create the socket of this process and its thread. MUST be called with the
+ * control lock held.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int control_start(void)
+{
+	int ret, fd;
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct sockaddr_un addr;
+
+	control.pid = getpid();
+
+	ret = snprintf(control.path, sizeof(control.path), "%s/torsocks-%d.sock",
+			control.dir, (int) control.pid);
+	if (ret < 0 || (size_t) ret >= sizeof(control.path)) {
+		ERR("[control] Socket path too long in %s", control.dir);
+		ret = -ENAMETOOLONG;
+		goto error;
+	}
+
+	fd = tsocks_libc_socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		PERROR("[control] socket");
+		goto error;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, control.path);
+
+	/*
+	 * Linux creates the socket file with the mode of the socket thus only
+	 * our user can connect whatever the umask is. Elsewhere this might fail
+	 * and the file is fixed up once bound, the directory being private.
+	 */
+	(void) fchmod(fd, S_IRUSR | S_IWUSR);
+
+	/* A stale socket of a dead process with the same pid. */
+	(void) unlink(control.path);
+	if (tsocks_libc_bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		PERROR("[control] bind %s", control.path);
+		goto error_close;
+	}
+	if (chmod(control.path, S_IRUSR | S_IWUSR) < 0 ||
+			tsocks_libc_listen(fd, 4) < 0) {
+		ret = -errno;
+		PERROR("[control] listen %s", control.path);
+		goto error_unlink;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, control_thread,
+			(void *) (intptr_t) fd);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		ret = -ret;
+		ERR("[control] Unable to create thread");
+		goto error_unlink;
+	}
+
+	control.fd = fd;
+	DBG("[control] Listening on %s", control.path);
+	return 0;
+
+error_unlink:
+	(void) unlink(control.path);
+error_close:
+	tsocks_libc_close(fd);
+error:
+	control.path[0] = '\0';
+	return ret;
+}
+
+/*
+ * Start the control socket in the given directory. It MUST be a directory of
+ * our user that nobody else can write to else anyone could replace the socket
+ * and impersonate us.
+ *
+ * Return 0 on success, -EPERM if the directory is not private or else a
+ * negative value.
+ */
+ATTR_HIDDEN
+int control_init(const char *dir)
+{
+	int ret;
+	struct stat st;
+
+	assert(dir);
+
+	if (strlen(dir) >= sizeof(control.dir)) {
+		return -ENAMETOOLONG;
+	}
+
+	if (stat(dir, &st) < 0) {
+		ret = -errno;
+		PERROR("[control] stat %s", dir);
+		return ret;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+			(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		ERR("[control] %s must be a directory of ours not writable by "
+				"group or others", dir);
+		return -EPERM;
+	}
+
+	tsocks_mutex_lock(&control_lock);
+	strcpy(control.dir, dir);
+	ret = control_start();
+	tsocks_mutex_unlock(&control_lock);
+
+	return ret;
+}
+
+/*
+ * Start a new control socket if we are a forked child of the process that
+ * created it since its thread is gone.
+ */
+ATTR_HIDDEN
+void control_check_fork(void)
+{
+	if (control.dir[0] == '\0' ||
+			__atomic_load_n(&control.pid, __ATOMIC_RELAXED) == getpid()) {
+		return;
+	}
+
+	tsocks_mutex_lock(&control_lock);
+	if (control.pid != getpid()) {
+		/* The socket of the parent is not ours to serve. */
+		if (control.fd >= 0) {
+			tsocks_libc_close(control.fd);
+			control.fd = -1;
+		}
+		(void) control_start();
+	}
+	tsocks_mutex_unlock(&control_lock);
+}
+
+/*
+ * Remove the socket of this process. The thread is left blocked in accept()
+ * since the process is exiting.
+ */
+ATTR_HIDDEN
+void control_destroy(void)
+{
+	tsocks_mutex_lock(&control_lock);
+	if (control.fd >= 0 && control.pid == getpid()) {
+		(void) unlink(control.path);
+		(void) shutdown(control.fd, SHUT_RDWR);
+	}
+	tsocks_mutex_unlock(&control_lock);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_CONTROL_H
+#define TORSOCKS_CONTROL_H
+
+/*
+ * Control socket of a torsocks process. A thread answers one line commands
+ * sent on <dir>/torsocks-<pid>.sock.
+ */
+
+int control_init(const char *dir);
+void control_check_fork(void);
+void control_destroy(void);
+
+#endif /* TORSOCKS_CONTROL_H */
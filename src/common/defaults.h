@@ -29,6 +29,8 @@
 #define DEFAULT_LOG_LEVEL_ENV		"TORSOCKS_LOG_LEVEL"
 #define DEFAULT_LOG_TIME_ENV		"TORSOCKS_LOG_TIME"
 #define DEFAULT_LOG_FILEPATH_ENV	"TORSOCKS_LOG_FILE_PATH"
+#define DEFAULT_LOG_ASYNC_ENV		"TORSOCKS_LOG_ASYNC"
+#define DEFAULT_LOG_FORMAT_ENV		"TORSOCKS_LOG_FORMAT"
 #define DEFAULT_LOG_TIME_STATUS		LOG_TIME_ADD
 #define DEFAULT_LOG_LEVEL			MSGWARN
 
@@ -53,6 +55,12 @@
  */
 #define DEFAULT_ONION_POOL_SIZE		8
 
+/*
+ * Number of connections the registry holds before its table is resized. The
+ * table is allocated at this size on the first insert.
+ */
+#define DEFAULT_CONN_REGISTRY_SIZE	256
+
 /*
  * The default onion pool cookie range starting at 0 up to 255.
  */
@@ -69,4 +77,37 @@
 /* Control if torsocks isolates based on PID or not. */
 #define DEFAULT_ISOLATE_PID_ENV     "TORSOCKS_ISOLATE_PID"
 
+/* Control if torsocks does the SOCKS5 handshake with io_uring. */
+#define DEFAULT_USE_IO_URING_ENV    "TORSOCKS_USE_IO_URING"
+
+/* Control if torsocks puts the IPv6 addresses of a name first. */
+#define DEFAULT_PREFER_IPV6_ENV     "TORSOCKS_PREFER_IPV6"
+
+/* Control if torsocks answers the DNS queries of UDP sockets through Tor. */
+#define DEFAULT_ALLOW_UDP_DNS_ENV   "TORSOCKS_ALLOW_UDP_DNS"
+
+/* Control if torsocks defers its initialization to the first network call. */
+#define DEFAULT_LAZY_INIT_ENV       "TORSOCKS_LAZY_INIT"
+
+/* Control if torsocks shares its parsed configuration with its children. */
+#define DEFAULT_SHARE_CONFIG_ENV    "TORSOCKS_SHARE_CONFIG"
+
+/* Set by torsocks to the fd of the shared configuration snapshot. */
+#define DEFAULT_CONFIG_FD_ENV       "TORSOCKS_CONFIG_FD"
+
+/* Control the flight recorder of handshake events and where it dumps. */
+#define DEFAULT_FLIGHT_ENV          "TORSOCKS_FLIGHT_RECORDER"
+#define DEFAULT_FLIGHT_DIR_ENV      "TORSOCKS_FLIGHT_DIR"
+#define DEFAULT_FLIGHT_SIGNAL_ENV   "TORSOCKS_FLIGHT_SIGNAL"
+
+/* Directory of the control socket of a torsocks process. */
+#define DEFAULT_CONTROL_DIR_ENV     "TORSOCKS_CONTROL_DIR"
+
+/* File where every hijacked call is recorded for trace-replay. */
+#define DEFAULT_TRACE_FILE_ENV      "TORSOCKS_TRACE_FILE"
+
+/* Seconds a getaddrinfo() result of a name resolved by Tor is reused. */
+#define DEFAULT_ADDRINFO_CACHE_ENV  "TORSOCKS_ADDRINFO_CACHE_TTL"
+#define DEFAULT_ADDRINFO_CACHE_TTL  60
+
 #endif /* TORSOCKS_DEFAULTS_H */
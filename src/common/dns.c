@@ -0,0 +1,927 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <lib/torsocks.h>
+
+#include "compat.h"
+#include "dns.h"
+#include "log.h"
+#include "macros.h"
+
+/* A name can't have more compression pointers than that in a message. */
+#define DNS_MAX_POINTERS	32
+
+/*
+ * Queries in flight at once. The low byte of a query ID is its slot and the
+ * high one a generation so a late reply to a previous query of the slot is
+ * recognized.
+ */
+#define DNS_MAX_QUERIES		256
+
+/*
+ * Retransmit a query after that long, doubled on each try, so a query with
+ * no reply fails after 7 seconds.
+ */
+#define DNS_RETRANSMIT_MS	1000
+#define DNS_MAX_TRIES		3
+
+enum dns_slot_state {
+	DNS_SLOT_FREE		= 0,
+	DNS_SLOT_PENDING	= 1,
+	DNS_SLOT_DONE		= 2,
+};
+
+struct dns_slot {
+	enum dns_slot_state state;
+	uint8_t generation;
+	unsigned int tries;
+	/* Monotonic time in ms of the next retransmit. */
+	uint64_t deadline;
+	/* Result once done. */
+	int ret;
+	struct dns_answer answer;
+	/* The waiter of the query sleeps on it while another thread reads. */
+	pthread_cond_t cond;
+	int waiting;
+	size_t query_len;
+	unsigned char query[DNS_QUERY_MAX];
+};
+
+/*
+ * The thread waiting for a query that finds no other thread reading the
+ * socket becomes the reader. It dispatches every reply to its slot and
+ * retransmits the queries that timed out until its own is done, then hands
+ * the socket over to another waiter. No thread is ever created.
+ */
+static struct {
+	tsocks_mutex_t lock;
+	/* Connected UDP socket, opened on the first query. */
+	int fd;
+	/* Set when a thread is reading the socket. */
+	int reader;
+	unsigned int next;
+	int initialized;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct dns_slot slots[DNS_MAX_QUERIES];
+} dns = {
+	.lock = TSOCKS_MUTEX_INIT,
+	.fd = -1,
+};
+
+static TSOCKS_INIT_ONCE(dns_atfork_once);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put_u16(unsigned char *p, uint16_t value)
+{
+	p[0] = value >> 8;
+	p[1] = value & 0xff;
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+	return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+/*
+ * Encode the given name in wire format at buf + pos, keeping extra bytes of
+ * room after it.
+ *
+ * Return the position after the name on success else a negative value.
+ */
+static ssize_t encode_name(const char *name, unsigned char *buf, size_t pos,
+		size_t len, size_t extra)
+{
+	size_t start = pos, label_len;
+	const char *label, *dot;
+
+	for (label = name; *label != '\0'; label = dot + 1) {
+		dot = strchr(label, '.');
+		if (!dot) {
+			dot = label + strlen(label);
+		}
+		label_len = dot - label;
+		if (label_len == 0 || label_len > 63) {
+			return -EINVAL;
+		}
+		/* Room for the label, the root and the extra bytes. */
+		if (pos + 1 + label_len + 1 + extra > len ||
+				pos + 1 + label_len + 1 - start > DEFAULT_DOMAIN_NAME_SIZE) {
+			return -ERANGE;
+		}
+		buf[pos++] = label_len;
+		memcpy(buf + pos, label, label_len);
+		pos += label_len;
+		if (*dot == '\0') {
+			break;
+		}
+	}
+	if (pos == start) {
+		/* An empty name or the root alone is never resolved. */
+		return -EINVAL;
+	}
+
+	buf[pos++] = 0;
+	return pos;
+}
+
+/*
+ * Encode a recursive query for the given name and record type in buf.
+ *
+ * Return the length of the query on success else a negative value.
+ */
+ATTR_HIDDEN
+ssize_t dns_encode_query(uint16_t id, const char *name, uint16_t type,
+		unsigned char *buf, size_t len)
+{
+	ssize_t pos;
+
+	assert(name);
+	assert(buf);
+
+	if (len < DNS_HEADER_LEN) {
+		return -ERANGE;
+	}
+
+	memset(buf, 0, DNS_HEADER_LEN);
+	put_u16(buf, id);
+	put_u16(buf + 2, DNS_FLAG_RD);
+	/* A single question. */
+	put_u16(buf + 4, 1);
+
+	pos = encode_name(name, buf, DNS_HEADER_LEN, len, 4);
+	if (pos < 0) {
+		return pos;
+	}
+	put_u16(buf + pos, type);
+	put_u16(buf + pos + 2, DNS_CLASS_IN);
+	pos += 4;
+
+	return pos;
+}
+
+/*
+ * Read the possibly compressed name at *pos of a message. *pos is moved after
+ * the name in place. If out is not NULL, the name is written in it without a
+ * trailing dot.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int read_name(const unsigned char *buf, size_t len, size_t *pos,
+		char *out, size_t outlen)
+{
+	size_t cur = *pos, out_pos = 0, label_len;
+	unsigned int pointers = 0;
+	int jumped = 0;
+
+	for (;;) {
+		if (cur >= len) {
+			return -EBADMSG;
+		}
+		label_len = buf[cur];
+		if ((label_len & 0xc0) == 0xc0) {
+			if (cur + 1 >= len || ++pointers > DNS_MAX_POINTERS) {
+				return -EBADMSG;
+			}
+			if (!jumped) {
+				*pos = cur + 2;
+				jumped = 1;
+			}
+			cur = ((label_len & 0x3f) << 8) | buf[cur + 1];
+			continue;
+		}
+		if (label_len & 0xc0) {
+			/* Extended label types are not used. */
+			return -EBADMSG;
+		}
+		cur++;
+		if (label_len == 0) {
+			break;
+		}
+		if (cur + label_len > len) {
+			return -EBADMSG;
+		}
+		if (out) {
+			if (out_pos + label_len + 1 > outlen) {
+				return -ERANGE;
+			}
+			if (out_pos) {
+				out[out_pos++] = '.';
+			}
+			memcpy(out + out_pos, buf + cur, label_len);
+			out_pos += label_len;
+		}
+		cur += label_len;
+	}
+
+	if (!jumped) {
+		*pos = cur;
+	}
+	if (out) {
+		if (out_pos >= outlen) {
+			return -ERANGE;
+		}
+		out[out_pos] = '\0';
+	}
+	return 0;
+}
+
+/*
+ * Decode the reply in buf to the given query. The answer is the first record
+ * of the type asked, the CNAME records leading to it are skipped.
+ *
+ * Return 0 on success, -EBADMSG if the message is not a reply to the query,
+ * -ENOENT if the name does not exist, -ENODATA if it has no record of the
+ * type asked or else a negative value.
+ */
+ATTR_HIDDEN
+int dns_decode_reply(const unsigned char *buf, size_t len,
+		const unsigned char *query, size_t query_len,
+		struct dns_answer *answer)
+{
+	int ret;
+	uint16_t flags, type, qtype, rdlen, ancount;
+	size_t pos;
+
+	assert(buf);
+	assert(query);
+	assert(query_len > DNS_HEADER_LEN + 4);
+	assert(answer);
+
+	/* Same ID and question, the header is the one of a reply. */
+	if (len < query_len || memcmp(buf, query, 2) != 0 ||
+			memcmp(buf + DNS_HEADER_LEN, query + DNS_HEADER_LEN,
+				query_len - DNS_HEADER_LEN) != 0 ||
+			get_u16(buf + 4) != 1) {
+		return -EBADMSG;
+	}
+	flags = get_u16(buf + 2);
+	if (!(flags & DNS_FLAG_QR)) {
+		return -EBADMSG;
+	}
+
+	switch (flags & DNS_RCODE_MASK) {
+	case 0:
+		break;
+	case DNS_RCODE_NXDOMAIN:
+		return -ENOENT;
+	default:
+		DBG("[dns] Query failed with rcode %u", flags & DNS_RCODE_MASK);
+		return -ECONNABORTED;
+	}
+
+	qtype = get_u16(query + query_len - 4);
+	ancount = get_u16(buf + 6);
+	pos = query_len;
+	while (ancount--) {
+		ret = read_name(buf, len, &pos, NULL, 0);
+		if (ret < 0) {
+			return ret;
+		}
+		/* Type, class, TTL and the length of the data. */
+		if (pos + 10 > len) {
+			return -EBADMSG;
+		}
+		type = get_u16(buf + pos);
+		rdlen = get_u16(buf + pos + 8);
+		pos += 10;
+		if (pos + rdlen > len) {
+			return -EBADMSG;
+		}
+
+		if (type == qtype) {
+			answer->type = type;
+			switch (type) {
+			case DNS_TYPE_A:
+				if (rdlen != sizeof(answer->u.v4)) {
+					return -EBADMSG;
+				}
+				memcpy(&answer->u.v4, buf + pos, rdlen);
+				return 0;
+			case DNS_TYPE_AAAA:
+				if (rdlen != sizeof(answer->u.v6)) {
+					return -EBADMSG;
+				}
+				memcpy(&answer->u.v6, buf + pos, rdlen);
+				return 0;
+			case DNS_TYPE_PTR:
+				return read_name(buf, pos + rdlen, &pos, answer->u.name,
+						sizeof(answer->u.name));
+			default:
+				return -EINVAL;
+			}
+		}
+		pos += rdlen;
+	}
+
+	return -ENODATA;
+}
+
+/*
+ * Write in buf the name of the PTR record of the given address.
+ *
+ * Return 0 on success else a negative value.
+ */
+ATTR_HIDDEN
+int dns_ptr_name(int af, const void *addr, char *buf, size_t len)
+{
+	int ret;
+	unsigned int i;
+	size_t pos = 0;
+	const unsigned char *p = addr;
+	static const char hex[] = "0123456789abcdef";
+
+	assert(addr);
+	assert(buf);
+
+	switch (af) {
+	case AF_INET:
+		ret = snprintf(buf, len, "%u.%u.%u.%u.in-addr.arpa", p[3], p[2], p[1],
+				p[0]);
+		if (ret < 0 || (size_t) ret >= len) {
+			return -ERANGE;
+		}
+		return 0;
+	case AF_INET6:
+		if (len < DNS_PTR_NAME_MAX) {
+			return -ERANGE;
+		}
+		for (i = 16; i-- > 0;) {
+			buf[pos++] = hex[p[i] & 0x0f];
+			buf[pos++] = '.';
+			buf[pos++] = hex[p[i] >> 4];
+			buf[pos++] = '.';
+		}
+		strcpy(buf + pos, "ip6.arpa");
+		return 0;
+	default:
+		return -EAFNOSUPPORT;
+	}
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c = tolower((unsigned char) c);
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Parse the name of the PTR record of an address, the reverse of
+ * dns_ptr_name(). Its family is set in af and the address in addr which has
+ * room for an IPv6 one.
+ *
+ * Return 0 on success else -EINVAL if it is not the name of an address.
+ */
+ATTR_HIDDEN
+int dns_ptr_addr(const char *name, int *af, void *addr)
+{
+	int low, high;
+	unsigned int i, value, digits;
+	const char *p = name;
+	unsigned char *out = addr;
+
+	assert(name);
+	assert(af);
+	assert(addr);
+
+	if (strlen(name) == DNS_PTR_NAME_MAX - 1 &&
+			strcasecmp(name + 64, "ip6.arpa") == 0) {
+		for (i = 16; i-- > 0; p += 4) {
+			low = hex_value(p[0]);
+			high = hex_value(p[2]);
+			if (low < 0 || high < 0 || p[1] != '.' || p[3] != '.') {
+				return -EINVAL;
+			}
+			out[i] = (high << 4) | low;
+		}
+		*af = AF_INET6;
+		return 0;
+	}
+
+	for (i = 4; i-- > 0; p++) {
+		for (value = 0, digits = 0; isdigit((unsigned char) *p) && digits < 3;
+				p++, digits++) {
+			value = value * 10 + (*p - '0');
+		}
+		if (digits == 0 || value > 255 || *p != '.') {
+			return -EINVAL;
+		}
+		out[i] = value;
+	}
+	if (strcasecmp(p, "in-addr.arpa") != 0) {
+		return -EINVAL;
+	}
+	*af = AF_INET;
+	return 0;
+}
+
+/*
+ * Decode the first question of the query in buf.
+ *
+ * Return the length of the header and the question on success, -EBADMSG if
+ * the message has no well formed question or else a negative value.
+ */
+ATTR_HIDDEN
+ssize_t dns_decode_query(const unsigned char *buf, size_t len,
+		struct dns_question *question)
+{
+	int ret;
+	size_t pos = DNS_HEADER_LEN;
+
+	assert(buf);
+	assert(question);
+
+	if (len < DNS_HEADER_LEN || get_u16(buf + 4) == 0) {
+		return -EBADMSG;
+	}
+	question->flags = get_u16(buf + 2);
+
+	ret = read_name(buf, len, &pos, question->name, sizeof(question->name));
+	if (ret < 0) {
+		return ret;
+	}
+	if (pos + 4 > len) {
+		return -EBADMSG;
+	}
+	question->type = get_u16(buf + pos);
+	question->class = get_u16(buf + pos + 2);
+
+	return pos + 4;
+}
+
+/*
+ * Encode in buf the reply to a query. The first query_len bytes of the query,
+ * its header and question, are copied as is and followed by the answers, the
+ * records of the name asked. The answers not fitting in buf are left out and
+ * the reply is marked truncated.
+ *
+ * Return the length of the reply on success, -EMSGSIZE if not even the
+ * question fits or else a negative value.
+ */
+ATTR_HIDDEN
+ssize_t dns_encode_reply(const unsigned char *query, size_t query_len,
+		unsigned int rcode, const struct dns_answer *answers,
+		unsigned int nb_answers, uint32_t ttl, unsigned char *buf, size_t len)
+{
+	ssize_t end;
+	size_t pos, rdlen;
+	uint16_t flags;
+	unsigned int i;
+
+	assert(query);
+	assert(query_len >= DNS_HEADER_LEN);
+	assert(answers || nb_answers == 0);
+	assert(query_len > DNS_HEADER_LEN || nb_answers == 0);
+	assert(buf);
+
+	if (len < query_len) {
+		return -EMSGSIZE;
+	}
+
+	flags = get_u16(query + 2);
+	memmove(buf, query, query_len);
+	flags = DNS_FLAG_QR | (flags & (DNS_OPCODE_MASK | DNS_FLAG_RD)) |
+		DNS_FLAG_RA | (rcode & DNS_RCODE_MASK);
+	put_u16(buf + 4, query_len > DNS_HEADER_LEN ? 1 : 0);
+	memset(buf + 6, 0, 6);
+	pos = query_len;
+
+	for (i = 0; i < nb_answers; i++) {
+		/* Name pointing to the question, type, class, TTL and data length. */
+		if (pos + 12 > len) {
+			break;
+		}
+		buf[pos] = 0xc0;
+		buf[pos + 1] = DNS_HEADER_LEN;
+		put_u16(buf + pos + 2, answers[i].type);
+		put_u16(buf + pos + 4, DNS_CLASS_IN);
+		put_u16(buf + pos + 6, ttl >> 16);
+		put_u16(buf + pos + 8, ttl & 0xffff);
+
+		switch (answers[i].type) {
+		case DNS_TYPE_A:
+			rdlen = sizeof(answers[i].u.v4);
+			break;
+		case DNS_TYPE_AAAA:
+			rdlen = sizeof(answers[i].u.v6);
+			break;
+		case DNS_TYPE_PTR:
+			end = encode_name(answers[i].u.name, buf, pos + 12, len, 0);
+			if (end == -EINVAL) {
+				return end;
+			}
+			rdlen = end < 0 ? len : end - (pos + 12);
+			break;
+		default:
+			return -EINVAL;
+		}
+		if (pos + 12 + rdlen > len) {
+			break;
+		}
+		if (answers[i].type != DNS_TYPE_PTR) {
+			memcpy(buf + pos + 12, &answers[i].u, rdlen);
+		}
+		put_u16(buf + pos + 10, rdlen);
+		pos += 12 + rdlen;
+	}
+
+	if (i < nb_answers) {
+		flags |= DNS_FLAG_TC;
+	}
+	put_u16(buf + 2, flags);
+	put_u16(buf + 6, i);
+
+	return pos;
+}
+
+static void dns_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&dns.lock);
+}
+
+static void dns_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&dns.lock);
+}
+
+/*
+ * The queries in flight are the ones of the threads of the parent. The child
+ * opens its own socket so the replies to the parent never reach it.
+ */
+static void dns_atfork_child(void)
+{
+	unsigned int i;
+
+	if (dns.fd >= 0) {
+		(void) tsocks_libc_close(dns.fd);
+		dns.fd = -1;
+	}
+	for (i = 0; i < DNS_MAX_QUERIES; i++) {
+		dns.slots[i].state = DNS_SLOT_FREE;
+	}
+	dns.reader = 0;
+	tsocks_mutex_unlock(&dns.lock);
+}
+
+static void dns_atfork_init(void)
+{
+	(void) pthread_atfork(dns_atfork_prepare, dns_atfork_parent,
+			dns_atfork_child);
+}
+
+/*
+ * Set the address of the DNSPort of Tor. No socket is opened until the first
+ * query.
+ */
+ATTR_HIDDEN
+void dns_resolver_init(const struct sockaddr *addr, socklen_t addrlen)
+{
+	unsigned int i;
+
+	assert(addr);
+	assert(addrlen <= sizeof(dns.addr));
+
+	tsocks_once(&dns_atfork_once, dns_atfork_init);
+
+	tsocks_mutex_lock(&dns.lock);
+	if (!dns.initialized) {
+		for (i = 0; i < DNS_MAX_QUERIES; i++) {
+			(void) pthread_cond_init(&dns.slots[i].cond, NULL);
+		}
+		dns.initialized = 1;
+	}
+	memcpy(&dns.addr, addr, addrlen);
+	dns.addrlen = addrlen;
+	tsocks_mutex_unlock(&dns.lock);
+}
+
+/*
+ * Open the socket to the DNSPort. MUST be called with the lock held.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int open_socket(void)
+{
+	int ret, fd;
+
+	fd = tsocks_libc_socket(dns.addr.ss_family,
+			SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		PERROR("[dns] socket");
+		goto error;
+	}
+
+	/* Connected so only the replies of the DNSPort are received. */
+	ret = tsocks_libc_connect(fd, (const struct sockaddr *) &dns.addr,
+			dns.addrlen);
+	if (ret < 0) {
+		ret = -errno;
+		PERROR("[dns] connect");
+		(void) tsocks_libc_close(fd);
+		goto error;
+	}
+
+	dns.fd = fd;
+	DBG("[dns] Resolver socket %d opened", fd);
+	return 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Send the query of a slot. A datagram not sent is as good as lost, the
+ * retransmit takes care of it. MUST be called with the lock held.
+ */
+static void send_query(struct dns_slot *slot)
+{
+	if (send(dns.fd, slot->query, slot->query_len, MSG_NOSIGNAL) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK) {
+		DBG("[dns] Unable to send query: %s", strerror(errno));
+	}
+}
+
+/*
+ * Complete a slot with the given result and wake up its waiter. MUST be
+ * called with the lock held.
+ */
+static void complete(struct dns_slot *slot, int ret)
+{
+	slot->ret = ret;
+	slot->state = DNS_SLOT_DONE;
+	(void) pthread_cond_signal(&slot->cond);
+}
+
+/*
+ * Send a query for the given name and record type to the DNSPort. It MUST be
+ * waited for with dns_query_wait().
+ *
+ * Return 0 on success, -EAGAIN if too many queries are in flight or else a
+ * negative value.
+ */
+ATTR_HIDDEN
+int dns_query_send(const char *name, uint16_t type, struct dns_query *query)
+{
+	int ret;
+	ssize_t len;
+	unsigned int i, index;
+	struct dns_slot *slot = NULL;
+
+	assert(name);
+	assert(query);
+
+	tsocks_mutex_lock(&dns.lock);
+
+	if (!dns.initialized) {
+		ret = -ENOTCONN;
+		goto end;
+	}
+	if (dns.fd < 0) {
+		ret = open_socket();
+		if (ret < 0) {
+			goto end;
+		}
+	}
+
+	for (i = 0; i < DNS_MAX_QUERIES; i++) {
+		index = (dns.next + i) % DNS_MAX_QUERIES;
+		if (dns.slots[index].state == DNS_SLOT_FREE) {
+			slot = &dns.slots[index];
+			break;
+		}
+	}
+	if (!slot) {
+		ret = -EAGAIN;
+		goto end;
+	}
+	dns.next = index + 1;
+
+	slot->generation++;
+	query->slot = index;
+	query->id = (slot->generation << 8) | index;
+	len = dns_encode_query(query->id, name, type, slot->query,
+			sizeof(slot->query));
+	if (len < 0) {
+		ret = len;
+		goto end;
+	}
+	slot->query_len = len;
+	slot->state = DNS_SLOT_PENDING;
+	slot->tries = 1;
+	slot->deadline = now_ms() + DNS_RETRANSMIT_MS;
+	send_query(slot);
+	ret = 0;
+
+end:
+	tsocks_mutex_unlock(&dns.lock);
+	return ret;
+}
+
+/*
+ * Dispatch the reply in buf to the slot of its query. Replies to no query in
+ * flight are dropped. MUST be called with the lock held.
+ */
+static void dispatch(const unsigned char *buf, size_t len)
+{
+	int ret;
+	struct dns_slot *slot;
+
+	if (len < DNS_HEADER_LEN) {
+		return;
+	}
+
+	slot = &dns.slots[buf[1] % DNS_MAX_QUERIES];
+	if (slot->state != DNS_SLOT_PENDING) {
+		return;
+	}
+
+	ret = dns_decode_reply(buf, len, slot->query, slot->query_len,
+			&slot->answer);
+	if (ret == -EBADMSG) {
+		/* Not for this query, maybe a late reply of a previous one. */
+		return;
+	}
+	complete(slot, ret);
+}
+
+/*
+ * Retransmit the queries whose deadline passed and fail the ones out of
+ * tries.
+ *
+ * Return the time in ms until the next deadline. MUST be called with the lock
+ * held.
+ */
+static int retransmit(void)
+{
+	unsigned int i;
+	uint64_t now = now_ms(), next = now + DNS_RETRANSMIT_MS;
+	struct dns_slot *slot;
+
+	for (i = 0; i < DNS_MAX_QUERIES; i++) {
+		slot = &dns.slots[i];
+		if (slot->state != DNS_SLOT_PENDING) {
+			continue;
+		}
+		if (slot->deadline <= now) {
+			if (slot->tries >= DNS_MAX_TRIES) {
+				DBG("[dns] Query %u timed out", get_u16(slot->query));
+				complete(slot, -ETIMEDOUT);
+				continue;
+			}
+			slot->deadline = now + ((uint64_t) DNS_RETRANSMIT_MS << slot->tries);
+			slot->tries++;
+			send_query(slot);
+		}
+		if (slot->deadline < next) {
+			next = slot->deadline;
+		}
+	}
+
+	return next - now;
+}
+
+/*
+ * Read the socket until the given slot is done. MUST be called with the lock
+ * held, it is released while polling.
+ */
+static void read_replies(struct dns_slot *own)
+{
+	int timeout;
+	ssize_t len;
+	struct pollfd pfd;
+	unsigned char buf[DNS_MSG_MAX];
+
+	pfd.fd = dns.fd;
+	pfd.events = POLLIN;
+
+	while (own->state == DNS_SLOT_PENDING) {
+		timeout = retransmit();
+		if (own->state != DNS_SLOT_PENDING) {
+			break;
+		}
+
+		tsocks_mutex_unlock(&dns.lock);
+		(void) poll(&pfd, 1, timeout);
+		tsocks_mutex_lock(&dns.lock);
+
+		for (;;) {
+			len = recv(dns.fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (len < 0) {
+				break;
+			}
+			dispatch(buf, len);
+		}
+	}
+}
+
+/*
+ * Wait for the reply of a query sent with dns_query_send() and free its slot.
+ *
+ * Return 0 with the answer set on success else a negative value, see
+ * dns_decode_reply().
+ */
+ATTR_HIDDEN
+int dns_query_wait(const struct dns_query *query, struct dns_answer *answer)
+{
+	int ret;
+	unsigned int i;
+	struct dns_slot *slot;
+
+	assert(query);
+	assert(query->slot < DNS_MAX_QUERIES);
+	assert(answer);
+
+	slot = &dns.slots[query->slot];
+
+	tsocks_mutex_lock(&dns.lock);
+
+	while (slot->state == DNS_SLOT_PENDING) {
+		if (dns.reader) {
+			/*
+			 * Woken up once done or when the reader leaves. The lock
+			 * statistics, if enabled, count this wait as held time.
+			 */
+			slot->waiting = 1;
+			(void) pthread_cond_wait(&slot->cond, &dns.lock.mutex);
+			slot->waiting = 0;
+			continue;
+		}
+
+		dns.reader = 1;
+		read_replies(slot);
+		dns.reader = 0;
+
+		/*
+		 * Hand the socket over to a waiter of a query in flight. A query not
+		 * waited for yet makes its thread the reader once it waits.
+		 */
+		for (i = 0; i < DNS_MAX_QUERIES; i++) {
+			if (dns.slots[i].state == DNS_SLOT_PENDING &&
+					dns.slots[i].waiting) {
+				(void) pthread_cond_signal(&dns.slots[i].cond);
+				break;
+			}
+		}
+	}
+
+	ret = slot->ret;
+	if (ret == 0) {
+		memcpy(answer, &slot->answer, sizeof(*answer));
+	}
+	slot->state = DNS_SLOT_FREE;
+
+	tsocks_mutex_unlock(&dns.lock);
+	return ret;
+}
+
+/*
+ * Close the socket of the resolver.
+ */
+ATTR_HIDDEN
+void dns_resolver_destroy(void)
+{
+	tsocks_mutex_lock(&dns.lock);
+	if (dns.fd >= 0) {
+		(void) tsocks_libc_close(dns.fd);
+		dns.fd = -1;
+	}
+	tsocks_mutex_unlock(&dns.lock);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_DNS_H
+#define TORSOCKS_DNS_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "defaults.h"
+
+/* Record types asked to the DNSPort of Tor. */
+#define DNS_TYPE_A		1
+#define DNS_TYPE_PTR	12
+#define DNS_TYPE_AAAA	28
+
+#define DNS_CLASS_IN	1
+
+/* Port DNS servers listen on. */
+#define DNS_PORT		53
+
+#define DNS_HEADER_LEN		12
+
+/* Header flags. */
+#define DNS_FLAG_QR			0x8000
+#define DNS_OPCODE_MASK		0x7800
+#define DNS_FLAG_TC			0x0200
+#define DNS_FLAG_RD			0x0100
+#define DNS_FLAG_RA			0x0080
+#define DNS_RCODE_MASK		0x000f
+
+/* Response codes of a reply. */
+#define DNS_RCODE_NOERROR	0
+#define DNS_RCODE_FORMERR	1
+#define DNS_RCODE_SERVFAIL	2
+#define DNS_RCODE_NXDOMAIN	3
+#define DNS_RCODE_NOTIMP	4
+
+/* Largest DNS message over UDP without EDNS. */
+#define DNS_MSG_MAX		512
+
+/* Header, the longest name in wire format, its type and class. */
+#define DNS_QUERY_MAX	(DNS_HEADER_LEN + DEFAULT_DOMAIN_NAME_SIZE + 2 + 4)
+
+/* Longest PTR name of an address, the one of an IPv6 in ip6.arpa. */
+#define DNS_PTR_NAME_MAX	(64 + sizeof("ip6.arpa"))
+
+/* Answer of a query, the first record of the type asked. */
+struct dns_answer {
+	uint16_t type;
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+		char name[DEFAULT_DOMAIN_NAME_SIZE + 1];
+	} u;
+};
+
+/* Question of a query, the first one of the message. */
+struct dns_question {
+	uint16_t flags;
+	uint16_t type;
+	uint16_t class;
+	char name[DEFAULT_DOMAIN_NAME_SIZE + 1];
+};
+
+/* A query sent and not yet waited for. */
+struct dns_query {
+	unsigned int slot;
+	uint16_t id;
+};
+
+/* Wire format. */
+ssize_t dns_encode_query(uint16_t id, const char *name, uint16_t type,
+		unsigned char *buf, size_t len);
+int dns_decode_reply(const unsigned char *buf, size_t len,
+		const unsigned char *query, size_t query_len,
+		struct dns_answer *answer);
+int dns_ptr_name(int af, const void *addr, char *buf, size_t len);
+int dns_ptr_addr(const char *name, int *af, void *addr);
+ssize_t dns_decode_query(const unsigned char *buf, size_t len,
+		struct dns_question *question);
+ssize_t dns_encode_reply(const unsigned char *query, size_t query_len,
+		unsigned int rcode, const struct dns_answer *answers,
+		unsigned int nb_answers, uint32_t ttl, unsigned char *buf, size_t len);
+
+/*
+ * Resolver multiplexing every query of the process on a single UDP socket to
+ * the DNSPort of Tor. A query is sent then waited for so many can be in
+ * flight, from one or many threads.
+ */
+void dns_resolver_init(const struct sockaddr *addr, socklen_t addrlen);
+int dns_query_send(const char *name, uint16_t type, struct dns_query *query);
+int dns_query_wait(const struct dns_query *query, struct dns_answer *answer);
+void dns_resolver_destroy(void);
+
+#endif /* TORSOCKS_DNS_H */
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+
+#include "compat.h"
+#include "fd-table.h"
+#include "macros.h"
+#include "utils.h"
+
+ATTR_HIDDEN
+uint8_t fd_table_entries[FD_TABLE_SIZE];
+
+/*
+ * Replace the classification of the given fd.
+ */
+ATTR_HIDDEN
+void fd_table_set(int fd, uint8_t flags)
+{
+	if (fd < 0 || fd >= FD_TABLE_SIZE) {
+		return;
+	}
+	__atomic_store_n(&fd_table_entries[fd], flags, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add classification flags to the given fd keeping the existing ones.
+ */
+ATTR_HIDDEN
+void fd_table_add(int fd, uint8_t flags)
+{
+	if (fd < 0 || fd >= FD_TABLE_SIZE) {
+		return;
+	}
+	(void) __atomic_fetch_or(&fd_table_entries[fd], flags, __ATOMIC_RELAXED);
+}
+
+/*
+ * Forget everything about the given fd. MUST be called when the fd is closed
+ * so a new file using the same number does not inherit the classification.
+ */
+ATTR_HIDDEN
+void fd_table_clear(int fd)
+{
+	fd_table_set(fd, 0);
+}
+
+/*
+ * The new fd refers to the same socket as the old one thus copy its entry.
+ */
+ATTR_HIDDEN
+void fd_table_dup(int oldfd, int newfd)
+{
+	fd_table_set(newfd, fd_table_get(oldfd));
+}
+
+/*
+ * Return the classification flags of a socket created with the given domain
+ * and type as passed to socket(2).
+ */
+ATTR_HIDDEN
+uint8_t fd_table_classify(int domain, int type)
+{
+	uint8_t flags = 0;
+
+	switch (domain) {
+	case AF_UNIX:
+		flags |= FD_TABLE_UNIX;
+		break;
+	case AF_INET:
+	case AF_INET6:
+		flags |= FD_TABLE_INET;
+		break;
+	default:
+		break;
+	}
+
+	if (IS_SOCK_STREAM(type)) {
+		flags |= FD_TABLE_STREAM;
+	}
+
+	return flags;
+}
+
+/*
+ * Return the classification flags of a socket bound to the given address.
+ */
+ATTR_HIDDEN
+uint8_t fd_table_classify_addr(const struct sockaddr *sa)
+{
+	uint8_t flags = 0;
+
+	assert(sa);
+
+	switch (sa->sa_family) {
+	case AF_UNIX:
+		flags |= FD_TABLE_UNIX;
+		break;
+	case AF_INET:
+	case AF_INET6:
+		flags |= FD_TABLE_INET;
+		if (utils_sockaddr_is_localhost(sa)) {
+			flags |= FD_TABLE_LOCAL;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return flags;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_FD_TABLE_H
+#define TORSOCKS_FD_TABLE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Number of file descriptors tracked by the table. Anything above is always
+ * unknown and the callers use the system calls to find out.
+ */
+#define FD_TABLE_SIZE		65536
+
+/*
+ * Classification of a file descriptor. Each flag is a fact learned from a
+ * call we intercepted, thus a zeroed entry means nothing is known. Callers
+ * MUST only use a flag being set to skip a system call and never its absence
+ * to deny something.
+ */
+#define FD_TABLE_UNIX		(1 << 0)	/* AF_UNIX socket. */
+#define FD_TABLE_INET		(1 << 1)	/* AF_INET or AF_INET6 socket. */
+#define FD_TABLE_STREAM		(1 << 2)	/* SOCK_STREAM socket. */
+#define FD_TABLE_LOCAL		(1 << 3)	/* Bound to a localhost address. */
+#define FD_TABLE_LISTEN		(1 << 4)	/* listen() succeeded on it. */
+#define FD_TABLE_UDP_DNS	(1 << 5)	/* UDP socket of the DNS responder. */
+
+/*
+ * Indexed by fd number. Entries are accessed atomically without any lock
+ * since the table is as racy as the fd space of the process itself.
+ */
+extern uint8_t fd_table_entries[FD_TABLE_SIZE];
+
+/*
+ * Return the classification flags of the given fd or 0 if unknown.
+ */
+static inline uint8_t fd_table_get(int fd)
+{
+	if (fd < 0 || fd >= FD_TABLE_SIZE) {
+		return 0;
+	}
+	return __atomic_load_n(&fd_table_entries[fd], __ATOMIC_RELAXED);
+}
+
+void fd_table_set(int fd, uint8_t flags);
+void fd_table_add(int fd, uint8_t flags);
+void fd_table_clear(int fd);
+void fd_table_dup(int oldfd, int newfd);
+
+uint8_t fd_table_classify(int domain, int type);
+uint8_t fd_table_classify_addr(const struct sockaddr *sa);
+
+#endif /* TORSOCKS_FD_TABLE_H */
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lib/torsocks.h>
+
+#include "flight.h"
+#include "macros.h"
+
+#define FLIGHT_RING_MASK	(FLIGHT_RING_EVENTS - 1)
+
+/* Number of events copied at once by a dump. Small since it is on stack. */
+#define FLIGHT_DUMP_CHUNK	64
+
+/*
+ * Event ring of a thread. Only the owner thread writes in it. Old events are
+ * overwritten so it always holds the last FLIGHT_RING_EVENTS events.
+ */
+struct flight_ring {
+	/* Free running index of the next event. */
+	uint64_t head;
+	/* Set while a thread owns the ring. */
+	int in_use;
+	uint32_t tid;
+	/* Rings are never freed thus the list can be walked without a lock. */
+	struct flight_ring *next;
+	struct flight_event events[FLIGHT_RING_EVENTS];
+};
+
+/* The recorder is always on unless disabled by the user. */
+static int flight_enabled = 1;
+
+/* Every ring ever created. Only appended to. */
+static struct flight_ring *flight_rings;
+static uint32_t flight_next_tid;
+
+/* Ring of the calling thread, NULL until it records. */
+static __thread struct flight_ring *thread_ring;
+
+static pthread_key_t flight_key;
+static TSOCKS_INIT_ONCE(flight_key_once);
+
+/* Directory where the dumps are written. Empty if none. */
+static char flight_dump_dir[PATH_MAX];
+
+/*
+ * Thread key destructor. The ring is kept with its events for another thread.
+ */
+static void ring_release(void *data)
+{
+	struct flight_ring *ring = data;
+
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void)
+{
+	(void) pthread_key_create(&flight_key, ring_release);
+}
+
+/*
+ * Get a ring for the calling thread, reusing the one of an exited thread if
+ * possible.
+ */
+static struct flight_ring *ring_get(void)
+{
+	int unused = 0;
+	struct flight_ring *ring;
+
+	tsocks_once(&flight_key_once, ring_key_init);
+
+	for (ring = __atomic_load_n(&flight_rings, __ATOMIC_ACQUIRE); ring;
+			ring = ring->next) {
+		if (!__atomic_load_n(&ring->in_use, __ATOMIC_RELAXED) &&
+				__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto end;
+		}
+		unused = 0;
+	}
+
+	ring = zmalloc(sizeof(*ring));
+	if (!ring) {
+		goto error;
+	}
+	ring->in_use = 1;
+	ring->tid = __atomic_fetch_add(&flight_next_tid, 1, __ATOMIC_RELAXED);
+	ring->next = __atomic_load_n(&flight_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&flight_rings, &ring->next, ring, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		/* ring->next was updated with the current head. */
+	}
+
+end:
+	(void) pthread_setspecific(flight_key, ring);
+	thread_ring = ring;
+error:
+	return ring;
+}
+
+/*
+ * Enable or disable the recording of events.
+ */
+ATTR_HIDDEN
+void flight_set_enabled(int enabled)
+{
+	__atomic_store_n(&flight_enabled, !!enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record an event in the ring of the calling thread. This is a clock read and
+ * a few stores, no lock and no system call.
+ */
+ATTR_HIDDEN
+void flight_record(int fd, enum flight_phase phase,
+		enum flight_backend backend, uint8_t reply, int err)
+{
+	uint64_t head;
+	struct timespec ts;
+	struct flight_ring *ring;
+	struct flight_event *ev;
+
+	if (!__atomic_load_n(&flight_enabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	ring = thread_ring;
+	if (!ring) {
+		ring = ring_get();
+		if (!ring) {
+			return;
+		}
+	}
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	head = ring->head;
+	ev = &ring->events[head & FLIGHT_RING_MASK];
+	ev->ts = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->fd = fd;
+	ev->err = err < 0 ? -err : err;
+	ev->tid = ring->tid;
+	ev->phase = phase;
+	ev->backend = backend;
+	ev->reply = reply;
+
+	/* Publish the event to a concurrent dump. */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write a whole buffer to the given fd.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+	const char *p = buf;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the events of a ring, oldest first. The owner thread might record
+ * while we copy so an event is only kept if it was not overwritten during the
+ * copy.
+ */
+static int dump_ring(int fd, struct flight_ring *ring)
+{
+	int ret = 0;
+	uint64_t head, idx, end, first, valid;
+	unsigned int i, nb;
+	struct flight_event chunk[FLIGHT_DUMP_CHUNK];
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	idx = head > FLIGHT_RING_EVENTS ? head - FLIGHT_RING_EVENTS : 0;
+
+	while (idx < head) {
+		end = min(idx + FLIGHT_DUMP_CHUNK, head);
+		for (i = 0; idx + i < end; i++) {
+			chunk[i] = ring->events[(idx + i) & FLIGHT_RING_MASK];
+		}
+
+		/*
+		 * The slot of the event being recorded is the one of index
+		 * head - FLIGHT_RING_EVENTS so only later ones are intact.
+		 */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		valid = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		valid = valid >= FLIGHT_RING_EVENTS ?
+			valid - FLIGHT_RING_EVENTS + 1 : 0;
+
+		first = max(idx, valid);
+		if (first < end) {
+			nb = end - first;
+			ret = write_all(fd, &chunk[first - idx], nb * sizeof(chunk[0]));
+			if (ret < 0) {
+				break;
+			}
+		}
+		idx = end;
+	}
+
+	return ret;
+}
+
+/*
+ * Write a dump of every ring in the given fd. This is async signal safe.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+ATTR_HIDDEN
+int flight_dump(int fd)
+{
+	int ret;
+	struct timespec rt, mono;
+	struct flight_dump_header hdr;
+	struct flight_ring *ring;
+
+	(void) clock_gettime(CLOCK_REALTIME, &rt);
+	(void) clock_gettime(CLOCK_MONOTONIC, &mono);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FLIGHT_DUMP_MAGIC;
+	hdr.version = FLIGHT_DUMP_VERSION;
+	hdr.event_size = sizeof(struct flight_event);
+	hdr.pid = getpid();
+	hdr.realtime_sec = rt.tv_sec;
+	hdr.realtime_nsec = rt.tv_nsec;
+	hdr.monotonic = (uint64_t) mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+
+	ret = write_all(fd, &hdr, sizeof(hdr));
+	if (ret < 0) {
+		goto error;
+	}
+
+	for (ring = __atomic_load_n(&flight_rings, __ATOMIC_ACQUIRE); ring;
+			ring = ring->next) {
+		ret = dump_ring(fd, ring);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+error:
+	return ret;
+}
+
+/*
+ * Set the directory where flight_dump_to_file() writes.
+ *
+ * Return 0 on success else a negative value.
+ */
+ATTR_HIDDEN
+int flight_set_dump_dir(const char *dir)
+{
+	assert(dir);
+
+	/* Room for "/torsocks-<pid>.flight". */
+	if (strlen(dir) + 32 >= sizeof(flight_dump_dir)) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(flight_dump_dir, dir);
+	return 0;
+}
+
+/*
+ * Append the decimal form of a number to a string. snprintf() is not async
+ * signal safe.
+ */
+static char *append_uint(char *p, unsigned long value)
+{
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	while (i > 0) {
+		*p++ = tmp[--i];
+	}
+	*p = '\0';
+	return p;
+}
+
+/*
+ * Dump every ring in <dir>/torsocks-<pid>.flight. This is async signal safe.
+ *
+ * Return 0 on success, -ENOENT if no dump directory is set or else a negative
+ * errno value.
+ */
+ATTR_HIDDEN
+int flight_dump_to_file(void)
+{
+	int ret, fd;
+	char path[PATH_MAX], *p;
+
+	if (flight_dump_dir[0] == '\0') {
+		ret = -ENOENT;
+		goto error;
+	}
+
+	p = path + strlen(flight_dump_dir);
+	memcpy(path, flight_dump_dir, p - path);
+	memcpy(p, "/torsocks-", sizeof("/torsocks-"));
+	p = append_uint(p + strlen(p), (unsigned long) getpid());
+	memcpy(p, ".flight", sizeof(".flight"));
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = flight_dump(fd);
+	/* Our close() takes locks which is not safe in a signal handler. */
+	(void) tsocks_libc_close(fd);
+
+error:
+	return ret;
+}
+
+/* Action of the dump signal before we took it over, chained to. */
+static struct sigaction flight_signal_old;
+
+static void flight_signal_handler(int signo, siginfo_t *info, void *ucontext)
+{
+	int saved_errno = errno;
+
+	(void) flight_dump_to_file();
+	errno = saved_errno;
+
+	if (flight_signal_old.sa_flags & SA_SIGINFO) {
+		flight_signal_old.sa_sigaction(signo, info, ucontext);
+	} else if (flight_signal_old.sa_handler != SIG_DFL &&
+			flight_signal_old.sa_handler != SIG_IGN) {
+		flight_signal_old.sa_handler(signo);
+	}
+}
+
+/*
+ * Dump before dying of a fatal signal. The default action is restored so
+ * the signal kills the process once we return.
+ */
+static void flight_crash_handler(int signo)
+{
+	(void) flight_dump_to_file();
+	(void) raise(signo);
+}
+
+/*
+ * Dump every ring to the dump directory when the process is killed by a crash
+ * signal. The handlers set by the application are left untouched.
+ */
+ATTR_HIDDEN
+void flight_install_crash_handlers(void)
+{
+	unsigned int i;
+	struct sigaction sa, old;
+	static const int signals[] = { SIGSEGV, SIGBUS, SIGABRT, SIGILL, SIGFPE };
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flight_crash_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+
+	for (i = 0; i < ARRAY_SIZE(signals); i++) {
+		if (sigaction(signals[i], NULL, &old) < 0 ||
+				old.sa_handler != SIG_DFL) {
+			continue;
+		}
+		(void) sigaction(signals[i], &sa, NULL);
+	}
+}
+
+/*
+ * Dump every ring to the dump directory when the given signal is received.
+ * A handler already set by the application is called right after the dump.
+ *
+ * Return 0 on success else a negative value.
+ */
+ATTR_HIDDEN
+int flight_install_signal(int signo)
+{
+	struct sigaction sa;
+
+	if (sigaction(signo, NULL, &flight_signal_old) < 0) {
+		return -errno;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = flight_signal_handler;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sa.sa_mask = flight_signal_old.sa_mask;
+
+	if (sigaction(signo, &sa, NULL) < 0) {
+		return -errno;
+	}
+	return 0;
+}
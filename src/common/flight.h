@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_FLIGHT_H
+#define TORSOCKS_FLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* "TSFR" in memory. */
+#define FLIGHT_DUMP_MAGIC	0x52465354
+#define FLIGHT_DUMP_VERSION	1
+
+/*
+ * Number of events kept per thread. MUST be a power of 2. A dump has one less
+ * since the oldest slot is the one being written next.
+ */
+#define FLIGHT_RING_EVENTS	1024
+
+/* Steps of a Tor connection or resolution recorded. */
+enum flight_phase {
+	FLIGHT_CONNECT_START	= 1,
+	FLIGHT_TOR_CONNECTED	= 2,
+	FLIGHT_METHOD			= 3,
+	FLIGHT_AUTH				= 4,
+	FLIGHT_REQUEST			= 5,
+	FLIGHT_REPLY			= 6,
+	FLIGHT_CONNECT_END		= 7,
+	FLIGHT_RESOLVE_START	= 8,
+	FLIGHT_RESOLVE_END		= 9,
+	FLIGHT_CLOSE			= 10,
+};
+
+/* How the SOCKS5 handshake or the resolution was done. */
+enum flight_backend {
+	FLIGHT_BACKEND_SOCKET	= 0,
+	FLIGHT_BACKEND_URING	= 1,
+	FLIGHT_BACKEND_DNS		= 2,
+	FLIGHT_BACKEND_CONTROL	= 3,
+};
+
+/*
+ * A recorded event. Kept small so recording it is a few stores.
+ */
+struct flight_event {
+	/* CLOCK_MONOTONIC time in nanoseconds. */
+	uint64_t ts;
+	int32_t fd;
+	/* Positive errno value of the step, 0 on success. */
+	int32_t err;
+	/* Ring slot of the recording thread, reused once a thread exits. */
+	uint32_t tid;
+	uint16_t phase;
+	uint8_t backend;
+	/* SOCKS5 reply code for FLIGHT_REPLY. */
+	uint8_t reply;
+};
+
+/*
+ * Header of a dump. The events of every thread follow it until the end of the
+ * stream, oldest first for each thread.
+ */
+struct flight_dump_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t event_size;
+	uint32_t pid;
+	uint32_t pad;
+	/* Wall clock and monotonic time at dump time to date the events. */
+	int64_t realtime_sec;
+	int64_t realtime_nsec;
+	uint64_t monotonic;
+};
+
+void flight_set_enabled(int enabled);
+void flight_record(int fd, enum flight_phase phase,
+		enum flight_backend backend, uint8_t reply, int err);
+int flight_dump(int fd);
+
+int flight_set_dump_dir(const char *dir);
+int flight_dump_to_file(void);
+int flight_install_signal(int signo);
+void flight_install_crash_handlers(void);
+
+#endif /* TORSOCKS_FLIGHT_H */
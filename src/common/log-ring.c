@@ -0,0 +1,618 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "log-ring.h"
+#include "macros.h"
+
+/*
+ * Size of the ring buffer of a thread. MUST be a power of 2. A message bigger
+ * than a quarter of it is truncated.
+ */
+#define LOG_RING_SIZE		(64 * 1024)
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+#define LOG_RECORD_MAX		(LOG_RING_SIZE / 4)
+
+/* Size of the buffer the writer thread fills before writing it out. */
+#define LOG_BATCH_SIZE		(64 * 1024)
+
+/* Records are aligned on 8 bytes in a ring. */
+#define LOG_RECORD_ALIGN(len) (((len) + 7) & ~((size_t) 7))
+
+/*
+ * Single producer single consumer ring buffer of a thread. Only the owner
+ * thread moves the tail and only the writer moves the head. Both are free
+ * running counters thus the used space is always tail - head.
+ */
+struct log_ring {
+	uint64_t head;
+	uint64_t tail;
+	/* Number of records dropped because the ring was full. */
+	uint64_t dropped;
+	/* Last value of the drop counter reported by the writer. */
+	uint64_t dropped_reported;
+	/* Set when the owner thread exits. The writer frees it once drained. */
+	int dead;
+	uint32_t tid;
+	struct log_ring *next;
+	char data[LOG_RING_SIZE] __attribute__((aligned(8)));
+};
+
+static struct {
+	int fd;
+	enum log_format format;
+	int add_time;
+
+	int writer_running;
+	int writer_failed;
+	int stop;
+	pthread_t writer;
+
+	/*
+	 * Set while the writer waits on wake for a record. A thread logging only
+	 * takes the lock to wake it up then.
+	 */
+	int writer_sleeping;
+	pthread_cond_t wake;
+
+	/*
+	 * Protects the list of rings, the creation of the writer thread and its
+	 * wake up. It is never taken by a thread logging to an existing ring
+	 * while the writer is awake.
+	 */
+	tsocks_mutex_t lock;
+	struct log_ring *rings;
+	uint32_t next_tid;
+	pthread_key_t key;
+
+	/* Writer only. Time prefix of the last second seen. */
+	int64_t cached_sec;
+	char cached_time[32];
+	size_t cached_time_len;
+
+	/* Writer only. Output buffer. */
+	char batch[LOG_BATCH_SIZE];
+	size_t batch_len;
+} ring_log = {
+	.fd = -1,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.lock = TSOCKS_MUTEX_INIT,
+	.cached_sec = -1,
+};
+
+/* Ring of the calling thread, NULL until it logs and once it exits. */
+static __thread struct log_ring *thread_ring;
+
+/* Set once the thread key destructor ran, no ring is created anymore. */
+static __thread int thread_exited;
+
+/* Set up the thread key and fork handlers. */
+static TSOCKS_INIT_ONCE(ring_key_once);
+
+/*
+ * Get the current time as cheaply as possible. The coarse clock is read from
+ * the vDSO without a system call and has a resolution of a few milliseconds
+ * which is plenty for logging.
+ */
+static void get_coarse_time(struct timespec *ts)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	if (clock_gettime(CLOCK_REALTIME_COARSE, ts) == 0) {
+		return;
+	}
+#endif
+	ts->tv_sec = time(NULL);
+	ts->tv_nsec = 0;
+}
+
+/*
+ * Write the whole batch buffer to the log fd.
+ */
+static void batch_flush(void)
+{
+	ssize_t ret;
+	size_t written = 0;
+
+	while (written < ring_log.batch_len) {
+		ret = write(ring_log.fd, ring_log.batch + written,
+				ring_log.batch_len - written);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* Nothing else can be done, logs are lost. */
+			break;
+		}
+		written += ret;
+	}
+	ring_log.batch_len = 0;
+}
+
+/*
+ * Append data to the batch buffer. Data is never split between two writes so
+ * records from different processes appending to the same file don't mix.
+ */
+static void batch_append(const void *data, size_t len)
+{
+	if (ring_log.batch_len + len > sizeof(ring_log.batch)) {
+		batch_flush();
+	}
+	memcpy(ring_log.batch + ring_log.batch_len, data, len);
+	ring_log.batch_len += len;
+}
+
+/*
+ * Output a record using the configured format.
+ */
+static void emit_record(const struct log_record *rec, const char *msg)
+{
+	char line[LOG_RECORD_MAX + sizeof(ring_log.cached_time)];
+	size_t len = 0;
+
+	if (ring_log.format == LOG_FORMAT_BINARY) {
+		if (ring_log.batch_len + sizeof(*rec) + rec->len >
+				sizeof(ring_log.batch)) {
+			batch_flush();
+		}
+		batch_append(rec, sizeof(*rec));
+		batch_append(msg, rec->len);
+		return;
+	}
+
+	if (ring_log.add_time) {
+		if (rec->sec != ring_log.cached_sec) {
+			ring_log.cached_time_len = log_record_time(rec,
+					ring_log.cached_time, sizeof(ring_log.cached_time));
+			ring_log.cached_sec = rec->sec;
+		}
+		memcpy(line, ring_log.cached_time, ring_log.cached_time_len);
+		len = ring_log.cached_time_len;
+	}
+	memcpy(line + len, msg, rec->len);
+	len += rec->len;
+
+	batch_append(line, len);
+}
+
+/*
+ * Report the records dropped by a ring since the last report.
+ */
+static void report_dropped(struct log_ring *ring)
+{
+	int ret;
+	uint64_t dropped;
+	char msg[128];
+	struct log_record rec;
+	struct timespec ts;
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped == ring->dropped_reported) {
+		return;
+	}
+
+	ret = snprintf(msg, sizeof(msg),
+			"WARNING torsocks[%ld]: %" PRIu64 " log messages dropped by "
+			"thread %" PRIu32 "\n", (long) getpid(),
+			dropped - ring->dropped_reported, ring->tid);
+	ring->dropped_reported = dropped;
+	if (ret < 0 || ret >= (int) sizeof(msg)) {
+		return;
+	}
+
+	get_coarse_time(&ts);
+	rec.magic = LOG_RECORD_MAGIC;
+	rec.len = ret;
+	rec.pid = getpid();
+	rec.tid = ring->tid;
+	rec.sec = ts.tv_sec;
+	rec.nsec = ts.tv_nsec;
+	emit_record(&rec, msg);
+}
+
+/*
+ * Consume every record of a ring.
+ */
+static void drain_ring(struct log_ring *ring)
+{
+	uint64_t head, tail;
+	size_t off, contig;
+	const struct log_record *rec;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		off = head & LOG_RING_MASK;
+		contig = LOG_RING_SIZE - off;
+		rec = (const struct log_record *) (ring->data + off);
+
+		/* Records never wrap. The end of the buffer is skipped instead. */
+		if (contig < sizeof(*rec) || rec->magic == LOG_RECORD_PAD) {
+			head += contig;
+			continue;
+		}
+
+		emit_record(rec, (const char *) (rec + 1));
+		head += LOG_RECORD_ALIGN(sizeof(*rec) + rec->len);
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	report_dropped(ring);
+}
+
+/*
+ * Drain every ring and release the ones of exited threads.
+ */
+static void drain_all(void)
+{
+	struct log_ring *ring, **prev;
+
+	tsocks_mutex_lock(&ring_log.lock);
+	prev = &ring_log.rings;
+	while ((ring = *prev)) {
+		drain_ring(ring);
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+				ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+			*prev = ring->next;
+			free(ring);
+			continue;
+		}
+		prev = &ring->next;
+	}
+	tsocks_mutex_unlock(&ring_log.lock);
+
+	batch_flush();
+}
+
+/*
+ * Return 1 if a ring has records to drain or is to be released else 0. MUST
+ * be called with the lock held.
+ */
+static int rings_pending(void)
+{
+	struct log_ring *ring;
+
+	for (ring = ring_log.rings; ring; ring = ring->next) {
+		if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Wake up the writer if it waits for a record. Called after a record is
+ * queued or a ring is dead.
+ */
+static void wake_writer(void)
+{
+	/*
+	 * Pairs with the fence of the writer, either it sees what we did before
+	 * waiting or we see it waiting.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&ring_log.writer_sleeping, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	tsocks_mutex_lock(&ring_log.lock);
+	(void) pthread_cond_signal(&ring_log.wake);
+	tsocks_mutex_unlock(&ring_log.lock);
+}
+
+static void *writer_thread(void *data)
+{
+	sigset_t set;
+
+	/* Never steal a signal from the application. */
+	sigfillset(&set);
+	(void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!__atomic_load_n(&ring_log.stop, __ATOMIC_ACQUIRE)) {
+		drain_all();
+
+		/* Sleep until a thread queues a record. */
+		tsocks_mutex_lock(&ring_log.lock);
+		__atomic_store_n(&ring_log.writer_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!rings_pending() &&
+				!__atomic_load_n(&ring_log.stop, __ATOMIC_ACQUIRE)) {
+			(void) pthread_cond_wait(&ring_log.wake, &ring_log.lock.mutex);
+		}
+		__atomic_store_n(&ring_log.writer_sleeping, 0, __ATOMIC_RELAXED);
+		tsocks_mutex_unlock(&ring_log.lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the writer thread if not running.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int start_writer(void)
+{
+	int ret = 0;
+
+	tsocks_mutex_lock(&ring_log.lock);
+	if (ring_log.writer_running) {
+		goto end;
+	}
+	if (ring_log.writer_failed || ring_log.stop) {
+		ret = -EAGAIN;
+		goto end;
+	}
+
+	ret = pthread_create(&ring_log.writer, NULL, writer_thread, NULL);
+	if (ret) {
+		ring_log.writer_failed = 1;
+		ret = -ret;
+		goto end;
+	}
+	__atomic_store_n(&ring_log.writer_running, 1, __ATOMIC_RELEASE);
+
+end:
+	tsocks_mutex_unlock(&ring_log.lock);
+	return ret;
+}
+
+/*
+ * Thread key destructor. The writer releases the ring once drained thus the
+ * thread must not use it anymore, nor create a new one which would never be
+ * released.
+ */
+static void ring_thread_exit(void *data)
+{
+	struct log_ring *ring = data;
+
+	thread_ring = NULL;
+	thread_exited = 1;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+	wake_writer();
+}
+
+/*
+ * Create the ring of the calling thread.
+ */
+static struct log_ring *ring_create(void)
+{
+	struct log_ring *ring;
+
+	ring = zmalloc(sizeof(*ring));
+	if (!ring) {
+		goto end;
+	}
+
+	tsocks_mutex_lock(&ring_log.lock);
+	ring->tid = ring_log.next_tid++;
+	ring->next = ring_log.rings;
+	ring_log.rings = ring;
+	tsocks_mutex_unlock(&ring_log.lock);
+
+	(void) pthread_setspecific(ring_log.key, ring);
+	thread_ring = ring;
+
+end:
+	return ring;
+}
+
+static void ring_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&ring_log.lock);
+}
+
+static void ring_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&ring_log.lock);
+}
+
+/*
+ * The child has no writer thread and the pending records are the ones of the
+ * parent which writes them out. Discard them and forget the rings of the
+ * threads that don't exist in the child.
+ */
+static void ring_atfork_child(void)
+{
+	struct log_ring *ring;
+
+	for (ring = ring_log.rings; ring; ring = ring->next) {
+		ring->head = ring->tail;
+		ring->dropped_reported = ring->dropped;
+		if (ring != thread_ring) {
+			ring->dead = 1;
+		}
+	}
+	ring_log.writer_running = 0;
+	ring_log.writer_sleeping = 0;
+	ring_log.batch_len = 0;
+	/* The writer of the parent might be waiting on it. */
+	(void) pthread_cond_init(&ring_log.wake, NULL);
+	tsocks_mutex_unlock(&ring_log.lock);
+}
+
+static void ring_key_init(void)
+{
+	(void) pthread_key_create(&ring_log.key, ring_thread_exit);
+	(void) pthread_atfork(ring_atfork_prepare, ring_atfork_parent,
+			ring_atfork_child);
+}
+
+/*
+ * Enable the asynchronous logger writing to the given fd.
+ *
+ * Return 0 on success else a negative value.
+ */
+ATTR_HIDDEN
+int log_ring_init(int fd, enum log_format format, int add_time)
+{
+	assert(fd >= 0);
+
+	tsocks_once(&ring_key_once, ring_key_init);
+
+	tsocks_mutex_lock(&ring_log.lock);
+	ring_log.fd = fd;
+	ring_log.format = format;
+	ring_log.add_time = add_time;
+	ring_log.cached_sec = -1;
+	ring_log.stop = 0;
+	ring_log.writer_failed = 0;
+	tsocks_mutex_unlock(&ring_log.lock);
+
+	return 0;
+}
+
+/*
+ * Queue a message in the ring of the calling thread. This never blocks nor
+ * takes a lock once the thread has a ring.
+ *
+ * Return 0 on success, -ENOBUFS if the message was dropped because the ring
+ * is full or else a negative value in which case the caller should write the
+ * message itself, as it must once the thread is exiting.
+ */
+ATTR_HIDDEN
+int log_ring_write(const char *msg, size_t len)
+{
+	int ret;
+	uint64_t head, tail;
+	size_t off, contig, pad, need;
+	struct log_ring *ring;
+	struct log_record *rec;
+	struct timespec ts;
+
+	assert(msg);
+
+	if (thread_exited) {
+		ret = -ESRCH;
+		goto error;
+	}
+
+	if (!__atomic_load_n(&ring_log.writer_running, __ATOMIC_ACQUIRE)) {
+		ret = start_writer();
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	ring = thread_ring;
+	if (!ring) {
+		ring = ring_create();
+		if (!ring) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	if (len > LOG_RECORD_MAX - sizeof(*rec)) {
+		len = LOG_RECORD_MAX - sizeof(*rec);
+	}
+	need = LOG_RECORD_ALIGN(sizeof(*rec) + len);
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	off = tail & LOG_RING_MASK;
+	contig = LOG_RING_SIZE - off;
+	pad = (contig < need) ? contig : 0;
+
+	if (tail + pad + need - head > LOG_RING_SIZE) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		ret = -ENOBUFS;
+		goto error;
+	}
+
+	if (pad) {
+		/* Always room for the magic since records are 8 bytes aligned. */
+		((struct log_record *) (ring->data + off))->magic = LOG_RECORD_PAD;
+		tail += pad;
+	}
+
+	get_coarse_time(&ts);
+	rec = (struct log_record *) (ring->data + (tail & LOG_RING_MASK));
+	rec->magic = LOG_RECORD_MAGIC;
+	rec->len = len;
+	rec->pid = getpid();
+	rec->tid = ring->tid;
+	rec->sec = ts.tv_sec;
+	rec->nsec = ts.tv_nsec;
+	memcpy(rec + 1, msg, len);
+
+	__atomic_store_n(&ring->tail, tail + need, __ATOMIC_RELEASE);
+	wake_writer();
+
+	return 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Stop the writer thread and write out every pending record.
+ */
+ATTR_HIDDEN
+void log_ring_destroy(void)
+{
+	if (ring_log.fd < 0) {
+		return;
+	}
+
+	__atomic_store_n(&ring_log.stop, 1, __ATOMIC_RELEASE);
+	tsocks_mutex_lock(&ring_log.lock);
+	(void) pthread_cond_signal(&ring_log.wake);
+	tsocks_mutex_unlock(&ring_log.lock);
+	if (__atomic_load_n(&ring_log.writer_running, __ATOMIC_ACQUIRE)) {
+		(void) pthread_join(ring_log.writer, NULL);
+		ring_log.writer_running = 0;
+	}
+
+	drain_all();
+	ring_log.fd = -1;
+}
+
+/*
+ * Format the time of a record in the given buffer like the synchronous logger
+ * does.
+ *
+ * Return the number of bytes written.
+ */
+ATTR_HIDDEN
+size_t log_record_time(const struct log_record *rec, char *buf, size_t len)
+{
+	time_t sec;
+	struct tm tm;
+
+	assert(rec);
+	assert(buf);
+
+	sec = rec->sec;
+	if (!localtime_r(&sec, &tm)) {
+		return 0;
+	}
+	return strftime(buf, len, "[%b %d %H:%M:%S] ", &tm);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_LOG_RING_H
+#define TORSOCKS_LOG_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* "TSLR" in memory. */
+#define LOG_RECORD_MAGIC	0x524c5354
+/* Filler at the end of a ring buffer. Never written out. */
+#define LOG_RECORD_PAD		0x44415054
+
+/*
+ * Header of a log record. The message follows it, without the NUL byte. This
+ * is the layout in the thread ring buffers and also the one written in a log
+ * file using the binary format, in which case the records are packed.
+ */
+struct log_record {
+	uint32_t magic;
+	/* Length of the message following this header. */
+	uint32_t len;
+	uint32_t pid;
+	/* Number of the thread in the process, in creation order. */
+	uint32_t tid;
+	/* Coarse wall clock time of the record. */
+	int64_t sec;
+	int64_t nsec;
+};
+
+/* Output format of the asynchronous logger. */
+enum log_format {
+	LOG_FORMAT_TEXT		= 0,
+	LOG_FORMAT_BINARY	= 1,
+};
+
+int log_ring_init(int fd, enum log_format format, int add_time);
+int log_ring_write(const char *msg, size_t len);
+void log_ring_destroy(void);
+
+size_t log_record_time(const struct log_record *rec, char *buf, size_t len);
+
+#endif /* TORSOCKS_LOG_RING_H */
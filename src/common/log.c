@@ -25,6 +25,7 @@
 #include <unistd.h>
 
 #include "defaults.h"
+#include "log-ring.h"
 #include "macros.h"
 
 static struct log_config {
@@ -32,6 +33,10 @@ static struct log_config {
 	char *filepath;
 	/* Add time or not to the log entry. */
 	enum log_time_status time_status;
+	/* Messages are queued and written by the log_ring writer thread. */
+	int async;
+	/* Format of the asynchronous logger output. */
+	enum log_format format;
 } logconfig;
 
 /*
@@ -88,6 +93,35 @@ end:
     return;
 }
 
+/*
+ * Queue a message for the writer thread of the asynchronous logger. The time
+ * is added by the writer from the record.
+ *
+ * Return 0 if the message was handled else the caller MUST write it.
+ */
+static int log_queue(const char *fmt, va_list ap)
+{
+	int ret;
+	char buf[4096];
+
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (ret < 0) {
+		goto end;
+	}
+
+	ret = log_ring_write(buf, min((size_t) ret, sizeof(buf) - 1));
+	if (ret == -ENOBUFS || logconfig.format == LOG_FORMAT_BINARY) {
+		/*
+		 * Accounted as dropped by the ring or lost since writing text in a
+		 * binary log would corrupt it.
+		 */
+		ret = 0;
+	}
+
+end:
+	return ret;
+}
+
 /*
  * Log messages using the logconfig configuration.
  */
@@ -96,7 +130,7 @@ void log_print(const char *fmt, ...)
 {
 	int ret;
 	size_t written = 0;
-	va_list ap;
+	va_list ap, aq;
 	/* This is a hard limit for the size of the line. */
 	char buf[4096];
 
@@ -106,9 +140,17 @@ void log_print(const char *fmt, ...)
 		goto end;
 	}
 
-	memset(buf, 0, sizeof(buf));
 	va_start(ap, fmt);
 
+	if (logconfig.async) {
+		va_copy(aq, ap);
+		ret = log_queue(fmt, aq);
+		va_end(aq);
+		if (ret == 0) {
+			goto done;
+		}
+	}
+
 	if (logconfig.time_status == LOG_TIME_ADD) {
 		written = add_time_to_log(buf, sizeof(buf));
 	}
@@ -121,6 +163,7 @@ void log_print(const char *fmt, ...)
 
 	_log_write(buf, sizeof(buf));
 
+done:
 error:
 	va_end(ap);
 end:
@@ -177,17 +220,65 @@ error:
 	return ret;
 }
 
+/*
+ * Make the logging asynchronous. Messages are queued in a per thread ring
+ * buffer and written by a background thread in the given format. MUST be
+ * called after log_init().
+ *
+ * Return 0 on success or else a negative errno value.
+ */
+ATTR_HIDDEN
+int log_init_async(enum log_format format)
+{
+	int ret, fd;
+
+	if (!logconfig.fp) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	fd = fileno(logconfig.fp);
+	if (fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = log_ring_init(fd, format, logconfig.time_status == LOG_TIME_ADD);
+	if (ret < 0) {
+		goto error;
+	}
+	logconfig.format = format;
+	logconfig.async = 1;
+
+error:
+	return ret;
+}
+
 /*
  * Cleanup the logconfig data structure.
  */
 ATTR_HIDDEN
 void log_destroy(void)
 {
+	FILE *fp = logconfig.fp;
+
+	/*
+	 * Nothing is logged from now on, including by the fclose() below which
+	 * goes through our own fclose(3).
+	 */
+	logconfig.fp = NULL;
+
+	if (logconfig.async) {
+		/* Write out every pending message before closing the file. */
+		logconfig.async = 0;
+		log_ring_destroy();
+	}
+
 	free(logconfig.filepath);
-	if (logconfig.fp) {
+	if (fp) {
 		int ret;
 
-		ret = fclose(logconfig.fp);
+		ret = fclose(fp);
 		if (ret) {
 			perror("[tsocks] fclose log destroy");
 		}
@@ -26,6 +26,7 @@
 #include <unistd.h>
 
 #include "compat.h"
+#include "log-ring.h"
 
 /* Stringify the expansion of a define */
 #define XSTR(d) STR(d)
@@ -50,6 +51,7 @@ extern int tsocks_loglevel;
 
 void log_print(const char *fmt, ...);
 int log_init(int level, const char *filepath, enum log_time_status t_status);
+int log_init_async(enum log_format format);
 void log_destroy(void);
 
 #define __tsocks_print(level, fmt, args...) \
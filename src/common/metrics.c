@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "macros.h"
+#include "metrics.h"
+
+/*
+ * Metrics of a thread. Only the owner thread writes in it so recording is a
+ * plain increment, readers merge every thread.
+ */
+struct metrics_thread {
+	struct metrics_data data;
+	/* Set while a thread owns it. */
+	int in_use;
+	/* Never freed thus the list can be walked without a lock. */
+	struct metrics_thread *next;
+};
+
+/* Every metrics_thread ever created. Only appended to. */
+static struct metrics_thread *metrics_threads;
+
+static __thread struct metrics_thread *thread_metrics;
+
+static pthread_key_t metrics_key;
+static TSOCKS_INIT_ONCE(metrics_key_once);
+
+/* Output buffer of metrics_write(). */
+struct metrics_out {
+	int fd;
+	int error;
+	size_t len;
+	char buf[4096];
+};
+
+static const char *counter_names[] = {
+	[METRICS_CONNECT_OK] = "torsocks_connects_total{result=\"ok\"}",
+	[METRICS_CONNECT_FAILED] = "torsocks_connects_total{result=\"failed\"}",
+	[METRICS_CONNECT_DENIED] = "torsocks_connects_total{result=\"denied\"}",
+	[METRICS_CONNECT_DIRECT] = "torsocks_connects_total{result=\"direct\"}",
+	[METRICS_RESOLVE_HIT] = "torsocks_resolves_total{result=\"hit\"}",
+	[METRICS_RESOLVE_MISS] = "torsocks_resolves_total{result=\"miss\"}",
+	[METRICS_RESOLVE_ERROR] = "torsocks_resolves_total{result=\"error\"}",
+};
+
+static const struct {
+	const char *name;
+	/* Label of the histogram, empty if none. */
+	const char *label;
+} hist_names[] = {
+	[METRICS_PHASE_CONNECT] = { "torsocks_socks5_phase_duration_seconds",
+		"phase=\"connect\"" },
+	[METRICS_PHASE_METHOD] = { "torsocks_socks5_phase_duration_seconds",
+		"phase=\"method\"" },
+	[METRICS_PHASE_AUTH] = { "torsocks_socks5_phase_duration_seconds",
+		"phase=\"auth\"" },
+	[METRICS_PHASE_REQUEST] = { "torsocks_socks5_phase_duration_seconds",
+		"phase=\"request\"" },
+	[METRICS_PHASE_REPLY] = { "torsocks_socks5_phase_duration_seconds",
+		"phase=\"reply\"" },
+	[METRICS_HANDSHAKE] = { "torsocks_handshake_duration_seconds", "" },
+	[METRICS_RESOLVE] = { "torsocks_resolve_duration_seconds", "" },
+};
+
+/*
+ * A forked child starts with no metrics. Only the forking thread exists in
+ * the child thus nobody is recording.
+ */
+static void metrics_atfork_child(void)
+{
+	struct metrics_thread *t;
+
+	for (t = metrics_threads; t; t = t->next) {
+		memset(&t->data, 0, sizeof(t->data));
+	}
+}
+
+/*
+ * Thread key destructor. The values are kept for the next thread.
+ */
+static void metrics_release(void *data)
+{
+	struct metrics_thread *t = data;
+
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void metrics_key_init(void)
+{
+	(void) pthread_key_create(&metrics_key, metrics_release);
+	(void) pthread_atfork(NULL, NULL, metrics_atfork_child);
+}
+
+/*
+ * Get the metrics of the calling thread, reusing the ones of an exited thread
+ * if possible. errno is preserved since this is called in the hijacked calls.
+ */
+static struct metrics_thread *metrics_get(void)
+{
+	int unused = 0, saved_errno = errno;
+	struct metrics_thread *t;
+
+	tsocks_once(&metrics_key_once, metrics_key_init);
+
+	for (t = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE); t;
+			t = t->next) {
+		if (!__atomic_load_n(&t->in_use, __ATOMIC_RELAXED) &&
+				__atomic_compare_exchange_n(&t->in_use, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto end;
+		}
+		unused = 0;
+	}
+
+	t = zmalloc(sizeof(*t));
+	if (!t) {
+		goto error;
+	}
+	t->in_use = 1;
+	t->next = __atomic_load_n(&metrics_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&metrics_threads, &t->next, t, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		/* t->next was updated with the current head. */
+	}
+
+end:
+	(void) pthread_setspecific(metrics_key, t);
+	thread_metrics = t;
+error:
+	errno = saved_errno;
+	return t;
+}
+
+/*
+ * Increment a value only written by the calling thread. Readers see either
+ * the old or the new value.
+ */
+static inline void metrics_add(uint64_t *value, uint64_t n)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Return the histogram bucket of a value in microseconds.
+ */
+ATTR_HIDDEN
+unsigned int metrics_bucket(uint64_t us)
+{
+	unsigned int msb, bucket;
+
+	if (us < METRICS_HIST_SUB) {
+		return us;
+	}
+
+	msb = 63 - __builtin_clzll(us);
+	bucket = (msb - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB +
+		((us >> (msb - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1));
+	return min(bucket, METRICS_HIST_BUCKETS - 1);
+}
+
+/*
+ * Return the upper bound in microseconds of a bucket. Every value of the
+ * bucket is lower than it.
+ */
+ATTR_HIDDEN
+uint64_t metrics_bucket_bound(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < METRICS_HIST_SUB) {
+		return bucket + 1;
+	}
+
+	shift = bucket / METRICS_HIST_SUB - 1;
+	return (uint64_t) (METRICS_HIST_SUB + bucket % METRICS_HIST_SUB + 1) <<
+		shift;
+}
+
+/*
+ * Increment a counter of the calling thread.
+ */
+ATTR_HIDDEN
+void metrics_inc(enum metrics_counter counter)
+{
+	struct metrics_thread *t = thread_metrics;
+
+	assert(counter < METRICS_COUNTER_MAX);
+
+	if (!t) {
+		t = metrics_get();
+		if (!t) {
+			return;
+		}
+	}
+	metrics_add(&t->data.counters[counter], 1);
+}
+
+/*
+ * Add a duration in nanoseconds to a histogram of the calling thread.
+ */
+ATTR_HIDDEN
+void metrics_observe(enum metrics_hist hist, uint64_t ns)
+{
+	struct metrics_thread *t = thread_metrics;
+	struct metrics_hist_data *h;
+
+	assert(hist < METRICS_HIST_MAX);
+
+	if (!t) {
+		t = metrics_get();
+		if (!t) {
+			return;
+		}
+	}
+	h = &t->data.hists[hist];
+	metrics_add(&h->buckets[metrics_bucket(ns / 1000)], 1);
+	metrics_add(&h->sum, ns);
+}
+
+/*
+ * Merge the metrics of every thread in the given data.
+ */
+ATTR_HIDDEN
+void metrics_read(struct metrics_data *data)
+{
+	unsigned int i, j;
+	struct metrics_thread *t;
+
+	assert(data);
+
+	memset(data, 0, sizeof(*data));
+
+	for (t = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE); t;
+			t = t->next) {
+		for (i = 0; i < METRICS_COUNTER_MAX; i++) {
+			data->counters[i] += __atomic_load_n(&t->data.counters[i],
+					__ATOMIC_RELAXED);
+		}
+		for (i = 0; i < METRICS_HIST_MAX; i++) {
+			struct metrics_hist_data *h = &t->data.hists[i];
+
+			for (j = 0; j < METRICS_HIST_BUCKETS; j++) {
+				data->hists[i].buckets[j] +=
+					__atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+			}
+			data->hists[i].sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void out_flush(struct metrics_out *out)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < out->len && !out->error) {
+		ret = write(out->fd, out->buf + done, out->len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			out->error = -errno;
+			break;
+		}
+		done += ret;
+	}
+	out->len = 0;
+}
+
+static void out_printf(struct metrics_out *out, const char *fmt, ...)
+{
+	int ret;
+	va_list ap;
+
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt,
+				ap);
+		va_end(ap);
+		if (ret < 0) {
+			out->error = -EINVAL;
+			return;
+		}
+		if ((size_t) ret < sizeof(out->buf) - out->len) {
+			out->len += ret;
+			return;
+		}
+		if (out->len == 0) {
+			/* No line is that long. */
+			out->error = -ENOBUFS;
+			return;
+		}
+		out_flush(out);
+	}
+}
+
+static void write_hist(struct metrics_out *out, const char *name,
+		const char *label, const struct metrics_hist_data *h)
+{
+	unsigned int i;
+	uint64_t count = 0;
+	const char *sep = label[0] ? "," : "";
+
+	/* The last bucket has no upper bound, it is only in +Inf. */
+	for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+		count += h->buckets[i];
+		out_printf(out, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n", name,
+				label, sep, metrics_bucket_bound(i) / 1e6, count);
+	}
+	count += h->buckets[i];
+	out_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label,
+			sep, count);
+	out_printf(out, "%s_sum%s%s%s %.9g\n", name, label[0] ? "{" : "", label,
+			label[0] ? "}" : "", h->sum / 1e9);
+	out_printf(out, "%s_count%s%s%s %" PRIu64 "\n", name, label[0] ? "{" : "",
+			label, label[0] ? "}" : "", count);
+}
+
+#ifdef TSOCKS_LOCK_STATS
+static void write_lock_stats(struct metrics_out *out, const char *name,
+		const struct tsocks_lock_stats *stats)
+{
+	out_printf(out, "torsocks_lock_acquired_total{lock=\"%s\"} %" PRIu64 "\n"
+			"torsocks_lock_contended_total{lock=\"%s\"} %" PRIu64 "\n"
+			"torsocks_lock_wait_seconds_total{lock=\"%s\"} %.9g\n"
+			"torsocks_lock_wait_seconds_max{lock=\"%s\"} %.9g\n"
+			"torsocks_lock_hold_seconds_total{lock=\"%s\"} %.9g\n"
+			"torsocks_lock_hold_seconds_max{lock=\"%s\"} %.9g\n",
+			name, stats->acquired, name, stats->contended, name,
+			stats->wait_ns / 1e9, name, stats->wait_max_ns / 1e9, name,
+			stats->hold_ns / 1e9, name, stats->hold_max_ns / 1e9);
+}
+#endif /* TSOCKS_LOCK_STATS */
+
+/*
+ * Write the metrics in the Prometheus text format in the given fd.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+ATTR_HIDDEN
+int metrics_write(int fd, const struct metrics_gauges *gauges)
+{
+	int ret;
+	unsigned int i;
+	struct metrics_data *data;
+	struct metrics_out *out;
+	struct {
+		struct metrics_data data;
+		struct metrics_out out;
+	} *w;
+
+	assert(gauges);
+
+	/* Too big for the stack of the control thread. */
+	w = malloc(sizeof(*w));
+	if (!w) {
+		return -ENOMEM;
+	}
+	data = &w->data;
+	out = &w->out;
+	out->fd = fd;
+	out->error = 0;
+	out->len = 0;
+
+	metrics_read(data);
+
+	out_printf(out, "# HELP torsocks_connects_total Inet connect() calls by "
+			"outcome.\n# TYPE torsocks_connects_total counter\n");
+	for (i = METRICS_CONNECT_OK; i <= METRICS_CONNECT_DIRECT; i++) {
+		out_printf(out, "%s %" PRIu64 "\n", counter_names[i],
+				data->counters[i]);
+	}
+
+	out_printf(out, "# HELP torsocks_resolves_total Name resolutions by "
+			"result, a hit needs no Tor lookup.\n"
+			"# TYPE torsocks_resolves_total counter\n");
+	for (i = METRICS_RESOLVE_HIT; i <= METRICS_RESOLVE_ERROR; i++) {
+		out_printf(out, "%s %" PRIu64 "\n", counter_names[i],
+				data->counters[i]);
+	}
+
+	out_printf(out, "# HELP torsocks_handshakes_in_flight SOCKS5 handshakes "
+			"in progress.\n# TYPE torsocks_handshakes_in_flight gauge\n"
+			"torsocks_handshakes_in_flight %" PRId64 "\n",
+			(int64_t) (data->counters[METRICS_HANDSHAKE_STARTED] -
+				data->counters[METRICS_HANDSHAKE_DONE]));
+
+	for (i = 0; i < METRICS_HIST_MAX; i++) {
+		if (i == 0 || strcmp(hist_names[i].name, hist_names[i - 1].name)) {
+			out_printf(out, "# TYPE %s histogram\n", hist_names[i].name);
+		}
+		write_hist(out, hist_names[i].name, hist_names[i].label,
+				&data->hists[i]);
+	}
+
+	out_printf(out, "# HELP torsocks_onion_pool_entries Onion addresses "
+			"mapped to a cookie address.\n"
+			"# TYPE torsocks_onion_pool_entries gauge\n"
+			"torsocks_onion_pool_entries %ld\n"
+			"# TYPE torsocks_onion_pool_capacity gauge\n"
+			"torsocks_onion_pool_capacity %ld\n", gauges->onion_entries,
+			gauges->onion_capacity);
+	out_printf(out, "# HELP torsocks_connections Connections through Tor in "
+			"the registry.\n# TYPE torsocks_connections gauge\n"
+			"torsocks_connections %ld\n", gauges->connections);
+
+#ifdef TSOCKS_LOCK_STATS
+	out_printf(out, "# HELP torsocks_lock_wait_seconds_total Time spent "
+			"waiting for a mutex already taken.\n"
+			"# TYPE torsocks_lock_acquired_total counter\n"
+			"# TYPE torsocks_lock_contended_total counter\n"
+			"# TYPE torsocks_lock_wait_seconds_total counter\n"
+			"# TYPE torsocks_lock_wait_seconds_max gauge\n"
+			"# TYPE torsocks_lock_hold_seconds_total counter\n"
+			"# TYPE torsocks_lock_hold_seconds_max gauge\n");
+	write_lock_stats(out, "connection_registry", &gauges->registry_lock);
+	write_lock_stats(out, "onion_pool", &gauges->onion_lock);
+#endif
+
+	out_flush(out);
+	ret = out->error;
+	free(w);
+	return ret;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_METRICS_H
+#define TORSOCKS_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "compat.h"
+
+/*
+ * Histogram buckets of a microsecond value. Below 4us, one bucket per value,
+ * then 4 linear buckets per power of 2 thus a relative error of at most 25%.
+ * The last bucket also holds everything above ~29 seconds.
+ */
+#define METRICS_HIST_SUB_BITS	2
+#define METRICS_HIST_SUB		(1U << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_BUCKETS	96
+
+enum metrics_counter {
+	/* Outcome of a connect() on an inet socket. */
+	METRICS_CONNECT_OK			= 0,
+	METRICS_CONNECT_FAILED		= 1,
+	METRICS_CONNECT_DENIED		= 2,
+	METRICS_CONNECT_DIRECT		= 3,
+	/* Answered locally, through Tor or not at all. */
+	METRICS_RESOLVE_HIT			= 4,
+	METRICS_RESOLVE_MISS		= 5,
+	METRICS_RESOLVE_ERROR		= 6,
+	/* Their difference is the number of handshakes in flight. */
+	METRICS_HANDSHAKE_STARTED	= 7,
+	METRICS_HANDSHAKE_DONE		= 8,
+
+	METRICS_COUNTER_MAX,
+};
+
+enum metrics_hist {
+	/* SOCKS5 steps with the Tor daemon. */
+	METRICS_PHASE_CONNECT		= 0,
+	METRICS_PHASE_METHOD		= 1,
+	METRICS_PHASE_AUTH			= 2,
+	METRICS_PHASE_REQUEST		= 3,
+	METRICS_PHASE_REPLY			= 4,
+	/* A whole connection or resolution through Tor. */
+	METRICS_HANDSHAKE			= 5,
+	METRICS_RESOLVE				= 6,
+
+	METRICS_HIST_MAX,
+};
+
+struct metrics_hist_data {
+	uint64_t buckets[METRICS_HIST_BUCKETS];
+	/* Sum of the values in nanoseconds. */
+	uint64_t sum;
+};
+
+/* Values of every thread merged. */
+struct metrics_data {
+	uint64_t counters[METRICS_COUNTER_MAX];
+	struct metrics_hist_data hists[METRICS_HIST_MAX];
+};
+
+/* Values owned by the library and read when the metrics are written. */
+struct metrics_gauges {
+	long onion_entries;
+	long onion_capacity;
+	long connections;
+#ifdef TSOCKS_LOCK_STATS
+	struct tsocks_lock_stats registry_lock;
+	struct tsocks_lock_stats onion_lock;
+#endif
+};
+
+/*
+ * Monotonic time in nanoseconds to measure a duration.
+ */
+static inline uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned int metrics_bucket(uint64_t us);
+uint64_t metrics_bucket_bound(unsigned int bucket);
+
+void metrics_inc(enum metrics_counter counter);
+void metrics_observe(enum metrics_hist hist, uint64_t ns);
+void metrics_read(struct metrics_data *data);
+int metrics_write(int fd, const struct metrics_gauges *gauges);
+
+#endif /* TORSOCKS_METRICS_H */
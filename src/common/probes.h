@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_PROBES_H
+#define TORSOCKS_PROBES_H
+
+/*
+ * USDT probes of the "torsocks" provider for perf, bpftrace or SystemTap.
+ * sys/sdt.h only emits a nop and an ELF note per probe, so a probe costs
+ * nothing until a tracer attaches to it and there is no runtime dependency.
+ *
+ * Every hijacked call fires <call>_entry(arg0, arg1) and <call>_return(arg0,
+ * ret) where arg0 is the fd, name or first argument of the call and arg1 the
+ * address given to it, if any. The SOCKS5 steps fire
+ * socks5_phase_start(fd, phase) and socks5_phase_end(fd, phase, ret), a whole
+ * connection handshake_start(fd, addr, hostname) and handshake_end(fd, ret)
+ * and a resolution resolve_start(fd, name) and resolve_end(fd, ret).
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TSOCKS_PROBE2(name, a, b) DTRACE_PROBE2(torsocks, name, a, b)
+#define TSOCKS_PROBE3(name, a, b, c) DTRACE_PROBE3(torsocks, name, a, b, c)
+
+#else /* HAVE_SYS_SDT_H */
+
+#define TSOCKS_PROBE2(name, a, b)
+#define TSOCKS_PROBE3(name, a, b, c)
+
+#endif /* HAVE_SYS_SDT_H */
+
+/* Phase argument of the socks5_phase_* probes. */
+enum probe_socks5_phase {
+	PROBE_SOCKS5_CONNECT			= 1,
+	PROBE_SOCKS5_SEND_METHOD		= 2,
+	PROBE_SOCKS5_RECV_METHOD		= 3,
+	PROBE_SOCKS5_SEND_AUTH			= 4,
+	PROBE_SOCKS5_RECV_AUTH			= 5,
+	PROBE_SOCKS5_SEND_CONNECT		= 6,
+	PROBE_SOCKS5_RECV_CONNECT		= 7,
+	PROBE_SOCKS5_SEND_RESOLVE		= 8,
+	PROBE_SOCKS5_RECV_RESOLVE		= 9,
+	PROBE_SOCKS5_SEND_RESOLVE_PTR	= 10,
+	PROBE_SOCKS5_RECV_RESOLVE_PTR	= 11,
+	PROBE_SOCKS5_URING				= 12,
+};
+
+#endif /* TORSOCKS_PROBES_H */
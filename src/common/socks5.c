@@ -19,12 +19,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
 #include <stdlib.h>
 
 #include <lib/torsocks.h>
 
+#include "flight.h"
 #include "log.h"
+#include "probes.h"
 #include "socks5.h"
+#include "uring.h"
 
 /*
  * Receive data on a given file descriptor using recv(2). This handles partial
@@ -129,25 +133,21 @@ error:
 static ssize_t (*send_data)(int, const void *, size_t) = send_data_impl;
 
 /*
- * Connect to socks5 server address from the global configuration.
+ * Get the Tor SOCKS5 address to use for the given connection.
  *
- * Return 0 on success or else a negative value.
+ * We use the connection domain here since the connect() call MUST match the
+ * right socket family. Thus, trying to establish a connection to a remote
+ * IPv6, we have to connect to the Tor daemon in v6.
+ *
+ * Return 0 on success or else a negative errno value.
  */
-ATTR_HIDDEN
-int socks5_connect(struct connection *conn)
+static int get_tor_address(const struct connection *conn,
+		const struct sockaddr **addr, socklen_t *len)
 {
-	int ret;
-	socklen_t len;
-	struct sockaddr *socks5_addr = NULL;
-
 	assert(conn);
-	assert(conn->fd >= 0);
+	assert(addr);
+	assert(len);
 
-	/*
-	 * We use the connection domain here since the connect() call MUST match
-	 * the right socket family. Thus, trying to establish a connection to a
-	 * remote IPv6, we have to connect to the Tor daemon in v6.
-	 */
 	switch (conn->dest_addr.domain) {
 	case CONNECTION_DOMAIN_NAME:
 		/*
@@ -155,21 +155,72 @@ int socks5_connect(struct connection *conn)
 		 * connect to the Tor SOCKS port.
 		 */
 	case CONNECTION_DOMAIN_INET:
-		socks5_addr = (struct sockaddr *) &tsocks_config.socks5_addr.u.sin;
-		len = sizeof(tsocks_config.socks5_addr.u.sin);
+		*addr = (const struct sockaddr *) &tsocks_config.socks5_addr.u.sin;
+		*len = sizeof(tsocks_config.socks5_addr.u.sin);
 		break;
 	case CONNECTION_DOMAIN_INET6:
-		socks5_addr = (struct sockaddr *) &tsocks_config.socks5_addr.u.sin6;
-		len = sizeof(tsocks_config.socks5_addr.u.sin6);
+		*addr = (const struct sockaddr *) &tsocks_config.socks5_addr.u.sin6;
+		*len = sizeof(tsocks_config.socks5_addr.u.sin6);
 		break;
 	default:
 		ERR("Socks5 connect domain unknown %d",
 				tsocks_config.socks5_addr.domain);
 		assert(0);
-		ret = -EBADF;
+		return -EBADF;
+	}
+
+	return 0;
+}
+
+/*
+ * Connect to socks5 server address from the global configuration.
+ *
+ * Return 0 on success or else a negative value.
+ */
+ATTR_HIDDEN
+int socks5_connect(struct connection *conn)
+{
+	return socks5_connect_port(conn, 0);
+}
+
+/*
+ * Connect to socks5 server address from the global configuration but on the
+ * given port instead of the configured one if not 0. Tor can have many
+ * SocksPort on the same address, each with its own flags.
+ *
+ * Return 0 on success or else a negative value.
+ */
+ATTR_HIDDEN
+int socks5_connect_port(struct connection *conn, in_port_t port)
+{
+	int ret;
+	socklen_t len;
+	const struct sockaddr *socks5_addr = NULL;
+	union {
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} addr;
+
+	assert(conn);
+	assert(conn->fd >= 0);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_CONNECT);
+
+	ret = get_tor_address(conn, &socks5_addr, &len);
+	if (ret < 0) {
 		goto error;
 	}
 
+	if (port) {
+		memcpy(&addr, socks5_addr, len);
+		if (socks5_addr->sa_family == AF_INET6) {
+			addr.sin6.sin6_port = htons(port);
+		} else {
+			addr.sin.sin_port = htons(port);
+		}
+		socks5_addr = (const struct sockaddr *) &addr;
+	}
+
 	do {
 		/* Use the original libc connect() to the Tor. */
 		ret = tsocks_libc_connect(conn->fd, socks5_addr, len);
@@ -186,6 +237,7 @@ int socks5_connect(struct connection *conn)
 	}
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_CONNECT, ret);
 	return ret;
 }
 
@@ -204,6 +256,8 @@ int socks5_send_method(struct connection *conn, uint8_t type)
 	assert(conn);
 	assert(conn->fd >= 0);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_SEND_METHOD);
+
 	msg.ver = SOCKS5_VERSION;
 	msg.nmethods = 0x01;
 	msg.methods = type;
@@ -218,6 +272,7 @@ int socks5_send_method(struct connection *conn, uint8_t type)
 	}
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_SEND_METHOD, ret);
 	return ret;
 }
 
@@ -236,6 +291,8 @@ int socks5_recv_method(struct connection *conn)
 	assert(conn);
 	assert(conn->fd >= 0);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_RECV_METHOD);
+
 	ret_recv = recv_data(conn->fd, &msg, sizeof(msg));
 	if (ret_recv < 0) {
 		ret = ret_recv;
@@ -254,31 +311,22 @@ int socks5_recv_method(struct connection *conn)
 	ret = 0;
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_METHOD, ret);
 	return ret;
 }
 
 /*
- * Send a username/password request to the given connection connected to the
- * SOCKS5 Tor port.
+ * Setup a username/password request as described in rfc1929 in the given
+ * buffer that MUST be at least of size SOCKS5_USER_PASS_REQ_LEN.
  *
- * Return 0 on success else a negative errno value.
+ * Return the size of the request or else a negative errno value.
  */
-ATTR_HIDDEN
-int socks5_send_user_pass_request(struct connection *conn,
-		const char *user, const char *pass)
+static int build_user_pass_request(unsigned char *buffer, const char *user,
+		const char *pass)
 {
-	int ret;
 	size_t data_len, user_len, pass_len;
-	ssize_t ret_send;
-	/*
-	 * As stated in rfc1929, 3 bytes for ver, ulen, plen, the maximum len for
-	 * the username and the password.
-	 */
-	unsigned char buffer[(3 * sizeof(uint8_t)) +
-		(SOCKS5_USERNAME_LEN + SOCKS5_PASSWORD_LEN)];
 
-	assert(conn);
-	assert(conn->fd >= 0);
+	assert(buffer);
 	assert(user);
 	assert(pass);
 
@@ -287,8 +335,7 @@ int socks5_send_user_pass_request(struct connection *conn,
 	/* Extra protection. */
 	if (user_len > SOCKS5_USERNAME_LEN ||
 			pass_len > SOCKS5_PASSWORD_LEN) {
-		ret = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 
 	/*
@@ -300,11 +347,42 @@ int socks5_send_user_pass_request(struct connection *conn,
 	data_len = 2;
 	memcpy(buffer + data_len, user, user_len);
 	data_len += user_len;
-	memcpy(buffer + data_len, &pass_len, 1);
+	buffer[data_len] = pass_len;
 	data_len += 1;
 	memcpy(buffer + data_len, pass, pass_len);
 	data_len += pass_len;
 
+	return data_len;
+}
+
+/*
+ * Send a username/password request to the given connection connected to the
+ * SOCKS5 Tor port.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+ATTR_HIDDEN
+int socks5_send_user_pass_request(struct connection *conn,
+		const char *user, const char *pass)
+{
+	int ret;
+	size_t data_len;
+	ssize_t ret_send;
+	unsigned char buffer[SOCKS5_USER_PASS_REQ_LEN];
+
+	assert(conn);
+	assert(conn->fd >= 0);
+	assert(user);
+	assert(pass);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_SEND_AUTH);
+
+	ret = build_user_pass_request(buffer, user, pass);
+	if (ret < 0) {
+		goto error;
+	}
+	data_len = ret;
+
 	ret_send = send_data(conn->fd, buffer, data_len);
 	if (ret_send < 0) {
 		ret = ret_send;
@@ -316,6 +394,7 @@ int socks5_send_user_pass_request(struct connection *conn,
 	DBG("Socks5 username %s and password %s sent successfully", user, pass);
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_SEND_AUTH, ret);
 	return ret;
 }
 
@@ -335,6 +414,8 @@ int socks5_recv_user_pass_reply(struct connection *conn)
 	assert(conn);
 	assert(conn->fd >= 0);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_RECV_AUTH);
+
 	ret_recv = recv_data(conn->fd, &msg, sizeof(msg));
 	if (ret_recv < 0) {
 		ret = ret_recv;
@@ -350,29 +431,26 @@ int socks5_recv_user_pass_reply(struct connection *conn)
 
 error:
 	DBG("Socks5 username/password auth status %d", msg.status);
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_AUTH, ret);
 	return ret;
 }
 
 /*
- * Send a connect request to the SOCKS5 server using the given connection and
- * the destination address in it pointing to the destination that needs to be
- * reached through Tor.
+ * Setup a connect request in the given buffer using the destination address
+ * of the connection. The buffer MUST be at least of size
+ * SOCKS5_CONNECT_REQ_LEN.
  *
- * Return 0 on success or else a negative value.
+ * Return the size of the request or else a negative errno value.
  */
-ATTR_HIDDEN
-int socks5_send_connect_request(struct connection *conn)
+static int build_connect_request(const struct connection *conn,
+		unsigned char *buffer)
 {
-	int ret;
-	/* Buffer to send won't go over a full TCP size. */
-	unsigned char buffer[1500];
-	ssize_t buf_len, ret_send;
+	size_t buf_len;
 	struct socks5_request msg;
 
 	assert(conn);
-	assert(conn->fd >= 0);
+	assert(buffer);
 
-	memset(buffer, 0, sizeof(buffer));
 	buf_len = sizeof(msg);
 
 	msg.ver = SOCKS5_VERSION;
@@ -441,44 +519,23 @@ int socks5_send_connect_request(struct connection *conn)
 	}
 	default:
 		ERR("Socks5 connection domain unknown %d", conn->dest_addr.domain);
-		ret = -EINVAL;
-		goto error;
-	}
-
-	DBG("Socks5 sending connect request to fd %d", conn->fd);
-
-	ret_send = send_data(conn->fd, &buffer, buf_len);
-	if (ret_send < 0) {
-		ret = ret_send;
-		goto error;
+		return -EINVAL;
 	}
 
-	/* Data was sent successfully. */
-	ret = 0;
-
-error:
-	return ret;
+	return buf_len;
 }
 
 /*
- * Receive on the given connection the SOCKS5 connect reply.
- *
- * Return 0 on success or else a negative value.
+ * Return the size of the connect reply expected for the given connection.
  */
-ATTR_HIDDEN
-int socks5_recv_connect_reply(struct connection *conn)
+static size_t connect_reply_len(const struct connection *conn)
 {
-	int ret;
-	ssize_t ret_recv;
-	unsigned char buffer[22];	/* Maximum size possible (with IPv6). */
-	struct socks5_reply msg;
 	size_t recv_len;
 
 	assert(conn);
-	assert(conn->fd >= 0);
 
 	/* Beginning of the payload we are receiving. */
-	recv_len = sizeof(msg);
+	recv_len = sizeof(struct socks5_reply);
 	/* Len of BND.PORT */
 	recv_len += sizeof(uint16_t);
 
@@ -495,19 +552,24 @@ int socks5_recv_connect_reply(struct connection *conn)
 		break;
 	}
 
-	ret_recv = recv_data(conn->fd, buffer, recv_len);
-	if (ret_recv < 0) {
-		ret = ret_recv;
-		goto error;
-	}
+	return recv_len;
+}
 
-	/* Copy the beginning of the reply so we can parse it easily. */
-	memcpy(&msg, buffer, sizeof(msg));
+/*
+ * Translate the reply code of a SOCKS5 connect reply.
+ *
+ * Return 0 on success or else a negative errno value.
+ */
+static int connect_reply_status(const struct socks5_reply *msg)
+{
+	int ret;
+
+	assert(msg);
 
 	DBG("Socks5 received connect reply - ver: %d, rep: 0x%02x, atype: 0x%02x",
-			msg.ver, msg.rep, msg.atyp);
+			msg->ver, msg->rep, msg->atyp);
 
-	switch (msg.rep) {
+	switch (msg->rep) {
 	case SOCKS5_REPLY_SUCCESS:
 		DBG("Socks5 connection is successful.");
 		ret = 0;
@@ -545,15 +607,355 @@ int socks5_recv_connect_reply(struct connection *conn)
 		ret = -ECONNREFUSED;
 		break;
 	default:
-		ERR("Socks5 server replied an unknown code %d", msg.rep);
+		ERR("Socks5 server replied an unknown code %d", msg->rep);
 		ret = -ECONNABORTED;
 		break;
 	}
 
+	return ret;
+}
+
+/*
+ * Send a connect request to the SOCKS5 server using the given connection and
+ * the destination address in it pointing to the destination that needs to be
+ * reached through Tor.
+ *
+ * Return 0 on success or else a negative value.
+ */
+ATTR_HIDDEN
+int socks5_send_connect_request(struct connection *conn)
+{
+	int ret;
+	unsigned char buffer[SOCKS5_CONNECT_REQ_LEN];
+	ssize_t buf_len, ret_send;
+
+	assert(conn);
+	assert(conn->fd >= 0);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_SEND_CONNECT);
+
+	memset(buffer, 0, sizeof(buffer));
+
+	ret = build_connect_request(conn, buffer);
+	if (ret < 0) {
+		goto error;
+	}
+	buf_len = ret;
+
+	DBG("Socks5 sending connect request to fd %d", conn->fd);
+
+	ret_send = send_data(conn->fd, &buffer, buf_len);
+	if (ret_send < 0) {
+		ret = ret_send;
+		goto error;
+	}
+
+	/* Data was sent successfully. */
+	ret = 0;
+
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_SEND_CONNECT, ret);
 	return ret;
 }
 
+/*
+ * Receive on the given connection the SOCKS5 connect reply.
+ *
+ * Return 0 on success or else a negative value.
+ */
+ATTR_HIDDEN
+int socks5_recv_connect_reply(struct connection *conn)
+{
+	int ret;
+	ssize_t ret_recv;
+	unsigned char buffer[22];	/* Maximum size possible (with IPv6). */
+	struct socks5_reply msg;
+
+	assert(conn);
+	assert(conn->fd >= 0);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_RECV_CONNECT);
+
+	ret_recv = recv_data(conn->fd, buffer, connect_reply_len(conn));
+	if (ret_recv < 0) {
+		ret = ret_recv;
+		goto error;
+	}
+
+	/* Copy the beginning of the reply so we can parse it easily. */
+	memcpy(&msg, buffer, sizeof(msg));
+	flight_record(conn->fd, FLIGHT_REPLY, FLIGHT_BACKEND_SOCKET, msg.rep, 0);
+
+	ret = connect_reply_status(&msg);
+
+error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_CONNECT, ret);
+	return ret;
+}
+
+#ifdef HAVE_IO_URING
+
+/* Identifiers of the linked requests of an io_uring handshake. */
+enum uring_handshake_op {
+	URING_OP_CONNECT	= 0,
+	URING_OP_SEND		= 1,
+	URING_OP_RECV		= 2,
+	URING_OP_NUM		= 3,
+};
+
+/*
+ * Failed waits for the completions of a handshake after which its ring is
+ * abandoned with the requests still in flight.
+ */
+#define URING_WAIT_MAX_FAILURES	8
+
+/*
+ * Do the complete SOCKS5 handshake for the given connection using io_uring.
+ *
+ * The method, the optional username/password request and the connect request
+ * are pipelined in a single buffer and the connect to the Tor daemon, the send
+ * of that buffer and the receive of every reply are submitted as one chain of
+ * linked requests. In the common case, this costs a single system call instead
+ * of six or eight with the synchronous path.
+ *
+ * Only blocking sockets are handled since the application expects its
+ * non blocking socket to be left untouched by the kernel while we wait.
+ *
+ * Return 0 on success or else a negative errno value. If -ENOSYS is returned,
+ * nothing was done on the socket and the caller MUST use the synchronous path.
+ */
+ATTR_HIDDEN
+int socks5_uring_handshake(struct connection *conn, uint8_t method,
+		const char *user, const char *pass)
+{
+	int ret, flags, nr_failures = 0;
+	unsigned int i, nr_done = 0, nr_dropped = 0;
+	int32_t res[URING_OP_NUM];
+	uint64_t op;
+	socklen_t addr_len;
+	size_t req_len, reply_len, offset;
+	const struct sockaddr *addr;
+	struct uring *ring;
+	struct io_uring_sqe *sqe;
+	struct socks5_method_req method_req;
+	struct socks5_method_res method_res;
+	struct socks5_user_pass_reply auth_reply;
+	struct socks5_reply connect_reply;
+	/*
+	 * Buffers of the requests, in the ring since they might be left in the
+	 * kernel. The reply is the maximum size possible which is with an IPv6
+	 * connect reply.
+	 */
+	struct {
+		unsigned char req[sizeof(method_req) + SOCKS5_USER_PASS_REQ_LEN +
+			SOCKS5_CONNECT_REQ_LEN];
+		unsigned char reply[sizeof(method_res) + sizeof(auth_reply) + 22];
+	} *buf;
+	unsigned char *req, *reply;
+
+	assert(conn);
+	assert(conn->fd >= 0);
+	assert(sizeof(*buf) <= URING_BUF_SIZE);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_URING);
+
+	flags = fcntl(conn->fd, F_GETFL);
+	if (flags < 0 || (flags & O_NONBLOCK)) {
+		ret = -ENOSYS;
+		goto error;
+	}
+
+	ring = uring_get_thread_ring();
+	if (!ring) {
+		ret = -ENOSYS;
+		goto error;
+	}
+
+	ret = get_tor_address(conn, &addr, &addr_len);
+	if (ret < 0) {
+		goto error;
+	}
+
+	buf = (void *) ring->buf;
+	req = buf->req;
+	reply = buf->reply;
+
+	/* Setup every request in the same buffer. */
+	method_req.ver = SOCKS5_VERSION;
+	method_req.nmethods = 0x01;
+	method_req.methods = method;
+	memcpy(req, &method_req, sizeof(method_req));
+	req_len = sizeof(method_req);
+	reply_len = sizeof(method_res);
+
+	if (method == SOCKS5_USER_PASS_METHOD) {
+		ret = build_user_pass_request(req + req_len, user, pass);
+		if (ret < 0) {
+			goto error;
+		}
+		req_len += ret;
+		reply_len += sizeof(auth_reply);
+	}
+
+	ret = build_connect_request(conn, req + req_len);
+	if (ret < 0) {
+		goto error;
+	}
+	req_len += ret;
+	reply_len += connect_reply_len(conn);
+
+	DBG("Socks5 io_uring handshake on fd %d (%zu bytes request)", conn->fd,
+			req_len);
+
+	/*
+	 * The ring can't be full here since every previous handshake reaped all
+	 * of its completions before returning.
+	 */
+	sqe = uring_get_sqe(ring);
+	assert(sqe);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = conn->fd;
+	sqe->addr = (uintptr_t) addr;
+	sqe->off = addr_len;
+	sqe->user_data = URING_OP_CONNECT;
+
+	sqe = uring_get_sqe(ring);
+	assert(sqe);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = conn->fd;
+	sqe->addr = (uintptr_t) req;
+	sqe->len = req_len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_OP_SEND;
+
+	sqe = uring_get_sqe(ring);
+	assert(sqe);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->addr = (uintptr_t) reply;
+	sqe->len = reply_len;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->user_data = URING_OP_RECV;
+
+	/* A request never submitted is cancelled like the rest of a chain. */
+	for (i = 0; i < URING_OP_NUM; i++) {
+		res[i] = -ECANCELED;
+	}
+
+	/*
+	 * Every completion is reaped before leaving so the ring can be used
+	 * again. If waiting fails, the requests the kernel did not take are
+	 * dropped and the socket is shutdown so the others complete right away.
+	 */
+	while (nr_done + nr_dropped < URING_OP_NUM) {
+		int32_t op_res;
+
+		if (uring_reap(ring, &op, &op_res)) {
+			assert(op < URING_OP_NUM);
+			res[op] = op_res;
+			nr_done++;
+			continue;
+		}
+
+		ret = uring_submit_and_wait(ring,
+				URING_OP_NUM - nr_done - nr_dropped);
+		if (ret == 0) {
+			continue;
+		}
+		DBG("Socks5 io_uring wait failed with %d on fd %d", ret, conn->fd);
+
+		nr_dropped += uring_drop_unsubmitted(ring);
+		if (nr_dropped == URING_OP_NUM) {
+			/* Nothing was done on the socket, use the normal path. */
+			ret = -ENOSYS;
+			goto error;
+		}
+		if (nr_failures++ == 0) {
+			(void) shutdown(conn->fd, SHUT_RDWR);
+		}
+		if (nr_failures == URING_WAIT_MAX_FAILURES) {
+			uring_abandon(ring);
+			goto error;
+		}
+	}
+
+	/* A failing request cancels the rest of the chain. */
+	if (res[URING_OP_CONNECT] < 0) {
+		ret = res[URING_OP_CONNECT];
+		errno = -ret;
+		PERROR("socks5 io_uring connect");
+		goto error;
+	}
+	if (res[URING_OP_SEND] < 0) {
+		ret = res[URING_OP_SEND];
+		goto error;
+	}
+
+	offset = res[URING_OP_SEND];
+	if (offset < req_len) {
+		ssize_t ret_send;
+
+		/* A short send breaks the chain. Finish the job synchronously. */
+		ret_send = send_data(conn->fd, req + offset, req_len - offset);
+		if (ret_send < 0) {
+			ret = ret_send;
+			goto error;
+		}
+		if (res[URING_OP_RECV] == -ECANCELED) {
+			res[URING_OP_RECV] = 0;
+		}
+	}
+	if (res[URING_OP_RECV] < 0) {
+		ret = res[URING_OP_RECV];
+		goto error;
+	}
+
+	offset = res[URING_OP_RECV];
+	if (offset < reply_len) {
+		ssize_t ret_recv;
+
+		ret_recv = recv_data(conn->fd, reply + offset, reply_len - offset);
+		if (ret_recv < 0) {
+			ret = ret_recv;
+			goto error;
+		}
+	}
+
+	/* Every reply is in the buffer, validate them in order. */
+	memcpy(&method_res, reply, sizeof(method_res));
+	offset = sizeof(method_res);
+	DBG("Socks5 received method ver: %d, method 0x%02x", method_res.ver,
+			method_res.method);
+	if (method_res.ver != SOCKS5_VERSION ||
+			method_res.method == SOCKS5_NO_ACCPT_METHOD) {
+		ret = -ECONNABORTED;
+		goto error;
+	}
+
+	if (method == SOCKS5_USER_PASS_METHOD) {
+		memcpy(&auth_reply, reply + offset, sizeof(auth_reply));
+		offset += sizeof(auth_reply);
+		DBG("Socks5 username/password auth status %d", auth_reply.status);
+		if (auth_reply.status != SOCKS5_REPLY_SUCCESS) {
+			ret = -EINVAL;
+			goto error;
+		}
+	}
+
+	memcpy(&connect_reply, reply + offset, sizeof(connect_reply));
+	flight_record(conn->fd, FLIGHT_REPLY, FLIGHT_BACKEND_URING,
+			connect_reply.rep, 0);
+	ret = connect_reply_status(&connect_reply);
+
+error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_URING, ret);
+	return ret;
+}
+
+#endif /* HAVE_IO_URING */
+
 /*
  * Send a SOCKS5 Tor resolve request for a given hostname using an already
  * connected connection.
@@ -575,6 +977,8 @@ int socks5_send_resolve_request(const char *hostname, struct connection *conn)
 	assert(conn);
 	assert(conn->fd >= 0);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_SEND_RESOLVE);
+
 	memset(buffer, 0, sizeof(buffer));
 	memset(&req, 0, sizeof(req));
 	msg_len = sizeof(msg);
@@ -622,18 +1026,21 @@ int socks5_send_resolve_request(const char *hostname, struct connection *conn)
 	DBG("[socks5] Resolve for %s sent successfully", hostname);
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_SEND_RESOLVE, ret);
 	return ret;
 }
 
 /*
  * Receive a Tor resolve reply on the given connection. The ip address pointer
- * is populated with the replied value or else untouched on error.
+ * is populated with the replied value or else untouched on error. Tor replies
+ * with an IPv4 or an IPv6 address depending on the flags of its SocksPort so
+ * the family of the address is set in af.
  *
  * Return 0 on success else a negative value.
  */
 ATTR_HIDDEN
 int socks5_recv_resolve_reply(struct connection *conn, void *addr,
-		size_t addrlen)
+		size_t addrlen, int *af)
 {
 	int ret;
 	size_t recv_len;
@@ -649,6 +1056,9 @@ int socks5_recv_resolve_reply(struct connection *conn, void *addr,
 	assert(conn);
 	assert(conn->fd >= 0);
 	assert(addr);
+	assert(af);
+
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_RECV_RESOLVE);
 
 	ret_recv = recv_data(conn->fd, &buffer, sizeof(buffer.msg));
 	if (ret_recv < 0) {
@@ -693,12 +1103,14 @@ int socks5_recv_resolve_reply(struct connection *conn, void *addr,
 	}
 
 	memcpy(addr, &buffer.addr, recv_len);
+	*af = (buffer.msg.atyp == SOCKS5_ATYP_IPV4) ? AF_INET : AF_INET6;
 
 	/* Everything went well and ip_addr has been populated. */
 	ret = 0;
 	DBG("[socks5] Resolve reply received successfully");
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_RESOLVE, ret);
 	return ret;
 }
 
@@ -721,6 +1133,8 @@ int socks5_send_resolve_ptr_request(struct connection *conn, const void *ip, int
 	assert(conn);
 	assert(conn->fd >= 0);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_SEND_RESOLVE_PTR);
+
 	DBG("[socks5] Resolve ptr request for ip %u", ip);
 
 	memset(buffer, 0, sizeof(buffer));
@@ -771,6 +1185,7 @@ int socks5_send_resolve_ptr_request(struct connection *conn, const void *ip, int
 	DBG("[socks5] Resolve PTR for %u sent successfully", ip);
 
 error:
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_SEND_RESOLVE_PTR, ret);
 	return ret;
 }
 
@@ -796,6 +1211,8 @@ int socks5_recv_resolve_ptr_reply(struct connection *conn, char **_hostname)
 	assert(conn->fd >= 0);
 	assert(_hostname);
 
+	TSOCKS_PROBE2(socks5_phase_start, conn->fd, PROBE_SOCKS5_RECV_RESOLVE_PTR);
+
 	ret_recv = recv_data(conn->fd, &buffer, sizeof(buffer));
 	if (ret_recv < 0) {
 		ret = ret_recv;
@@ -835,10 +1252,12 @@ int socks5_recv_resolve_ptr_reply(struct connection *conn, char **_hostname)
 
 	*_hostname = hostname;
 	DBG("[socks5] Resolve reply received: %s", *_hostname);
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_RESOLVE_PTR, 0);
 	return 0;
 
 error:
 	free(hostname);
+	TSOCKS_PROBE3(socks5_phase_end, conn->fd, PROBE_SOCKS5_RECV_RESOLVE_PTR, ret);
 	return ret;
 }
 
@@ -63,6 +63,19 @@
 #define SOCKS5_USERNAME_LEN     255
 #define SOCKS5_PASSWORD_LEN     255
 
+/*
+ * Maximum size of a username/password request. As stated in rfc1929, 3 bytes
+ * for ver, ulen, plen, the maximum len for the username and the password.
+ */
+#define SOCKS5_USER_PASS_REQ_LEN \
+	(3 + SOCKS5_USERNAME_LEN + SOCKS5_PASSWORD_LEN)
+
+/*
+ * Maximum size of a connect request which is with a domain name of 255 bytes.
+ * The fixed part is ver, cmd, rsv, atyp, the len byte and the port.
+ */
+#define SOCKS5_CONNECT_REQ_LEN	(4 + 1 + UINT8_MAX + 2)
+
 /* Request data structure for the method. */
 struct socks5_method_req {
 	uint8_t ver;
@@ -135,6 +148,7 @@ struct socks5_user_pass_reply {
 };
 
 int socks5_connect(struct connection *conn);
+int socks5_connect_port(struct connection *conn, in_port_t port);
 
 /* Method messaging. */
 int socks5_send_method(struct connection *conn, uint8_t type);
@@ -149,10 +163,16 @@ int socks5_recv_user_pass_reply(struct connection *conn);
 int socks5_send_connect_request(struct connection *conn);
 int socks5_recv_connect_reply(struct connection *conn);
 
+#ifdef HAVE_IO_URING
+/* Full handshake (connect, method, auth and connect request) on io_uring. */
+int socks5_uring_handshake(struct connection *conn, uint8_t method,
+		const char *user, const char *pass);
+#endif
+
 /* Tor DNS resolve. */
 int socks5_send_resolve_request(const char *hostname, struct connection *conn);
 int socks5_recv_resolve_reply(struct connection *conn, void *addr,
-		size_t addrlent);
+		size_t addrlent, int *af);
 int socks5_recv_resolve_ptr_reply(struct connection *conn, char **_hostname);
 int socks5_send_resolve_ptr_request(struct connection *conn, const void *ip, int af);
 
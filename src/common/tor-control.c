@@ -0,0 +1,985 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lib/torsocks.h>
+
+#include "compat.h"
+#include "config-file.h"
+#include "dns.h"
+#include "log.h"
+#include "macros.h"
+#include "tor-control.h"
+
+/*
+ * Resolutions in flight at once. A slot has a generation so the reply to a
+ * command of a previous resolution of the slot is recognized.
+ */
+#define TOR_CONTROL_MAX_QUERIES		256
+/* A slot may be reused before the reply to its previous command is read. */
+#define TOR_CONTROL_MAX_SENT		(2 * TOR_CONTROL_MAX_QUERIES)
+
+/* Time given to Tor for a resolution and to connect and authenticate. */
+#define TOR_CONTROL_TIMEOUT_MS		30000
+#define TOR_CONTROL_HANDSHAKE_MS	5000
+
+/* Longest line read or command written, a password escaped included. */
+#define TOR_CONTROL_LINE_MAX		1024
+
+enum tor_control_slot_state {
+	TOR_CONTROL_SLOT_FREE		= 0,
+	TOR_CONTROL_SLOT_PENDING	= 1,
+	TOR_CONTROL_SLOT_DONE		= 2,
+};
+
+struct tor_control_slot {
+	enum tor_control_slot_state state;
+	unsigned int generation;
+	int reverse;
+	/* Monotonic time in ms at which the resolution times out. */
+	uint64_t deadline;
+	/* Result once done. */
+	int ret;
+	struct tor_control_answer answer;
+	/* The waiter of the resolution sleeps on it while another thread reads. */
+	pthread_cond_t cond;
+	int waiting;
+	/*
+	 * Name resolved and, for a reverse resolution, the PTR name of the
+	 * address that Tor may report instead of the address.
+	 */
+	char name[DEFAULT_DOMAIN_NAME_SIZE + 1];
+	char ptr_name[DNS_PTR_NAME_MAX];
+};
+
+/* A command waiting for its reply. Replies come in the order of commands. */
+struct tor_control_sent {
+	unsigned int slot;
+	unsigned int generation;
+};
+
+/*
+ * The thread waiting for a resolution that finds no other thread reading the
+ * connection becomes the reader. It dispatches every event and reply until
+ * its own resolution is done, then hands the connection over to another
+ * waiter. No thread is ever created.
+ */
+static struct {
+	tsocks_mutex_t lock;
+	/* Authenticated connection, opened on the first resolution. */
+	int fd;
+	/* Set when a thread is reading the connection. */
+	int reader;
+	unsigned int next;
+	int initialized;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char password[CONFIG_PASSWORD_LEN];
+	char cookie_file[CONFIG_PATH_LEN];
+	/* Received data not yet split in lines. */
+	char in[4096];
+	size_t in_len;
+	struct tor_control_sent sent[TOR_CONTROL_MAX_SENT];
+	unsigned int sent_head;
+	unsigned int sent_count;
+	struct tor_control_slot slots[TOR_CONTROL_MAX_QUERIES];
+} tc = {
+	.lock = TSOCKS_MUTEX_INIT,
+	.fd = -1,
+};
+
+static TSOCKS_INIT_ONCE(tor_control_atfork_once);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Split a reply line, without its CRLF, into its status code, its separator
+ * and its text. The separator is ' ' on the last line of a reply, '-' or '+'
+ * on the others.
+ *
+ * Return 0 on success else -EBADMSG.
+ */
+ATTR_HIDDEN
+int tor_control_parse_reply(const char *line, int *code, char *sep,
+		const char **text)
+{
+	unsigned int i;
+
+	assert(line);
+	assert(code);
+	assert(sep);
+	assert(text);
+
+	for (i = 0; i < 3; i++) {
+		if (line[i] < '0' || line[i] > '9') {
+			return -EBADMSG;
+		}
+	}
+	if (line[3] != ' ' && line[3] != '-' && line[3] != '+') {
+		return -EBADMSG;
+	}
+
+	*code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+	*sep = line[3];
+	*text = line + 4;
+	return 0;
+}
+
+/*
+ * Copy the space delimited token at *p in buf and move *p after it.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int copy_token(const char **p, char *buf, size_t len)
+{
+	size_t token_len = strcspn(*p, " ");
+
+	if (token_len == 0) {
+		return -EBADMSG;
+	}
+	if (token_len >= len) {
+		return -ERANGE;
+	}
+	memcpy(buf, *p, token_len);
+	buf[token_len] = '\0';
+	*p += token_len;
+	if (**p == ' ') {
+		(*p)++;
+	}
+	return 0;
+}
+
+/*
+ * Parse the text of an ADDRMAP event, "ADDRMAP name address expiry ...", and
+ * copy its name and address. The address is "<error>" if the resolution
+ * failed.
+ *
+ * Return 0 on success, -ENOENT if this is not an ADDRMAP event or else a
+ * negative value.
+ */
+ATTR_HIDDEN
+int tor_control_parse_addrmap(const char *text, char *name, size_t name_len,
+		char *addr, size_t addr_len)
+{
+	int ret;
+	const char *p;
+
+	assert(text);
+	assert(name);
+	assert(addr);
+
+	if (strncmp(text, "ADDRMAP ", 8) != 0) {
+		return -ENOENT;
+	}
+	p = text + 8;
+
+	ret = copy_token(&p, name, name_len);
+	if (ret < 0) {
+		return ret;
+	}
+	return copy_token(&p, addr, addr_len);
+}
+
+/*
+ * Set the answer from the address of an ADDRMAP event. The address of a
+ * reverse resolution is a name.
+ *
+ * Return 0 on success, -ENOENT if the resolution failed or else a negative
+ * value.
+ */
+ATTR_HIDDEN
+int tor_control_parse_answer(const char *addr, int reverse,
+		struct tor_control_answer *answer)
+{
+	size_t len;
+	char buf[INET6_ADDRSTRLEN];
+
+	assert(addr);
+	assert(answer);
+
+	if (strcmp(addr, "<error>") == 0) {
+		return -ENOENT;
+	}
+
+	if (reverse) {
+		if (strlen(addr) >= sizeof(answer->u.name)) {
+			return -ERANGE;
+		}
+		answer->af = AF_UNSPEC;
+		strcpy(answer->u.name, addr);
+		return 0;
+	}
+
+	if (inet_pton(AF_INET, addr, &answer->u.v4) == 1) {
+		answer->af = AF_INET;
+		return 0;
+	}
+	/* An IPv6 address might be in brackets. */
+	len = strlen(addr);
+	if (len > 2 && addr[0] == '[' && addr[len - 1] == ']' &&
+			len - 2 < sizeof(buf)) {
+		memcpy(buf, addr + 1, len - 2);
+		buf[len - 2] = '\0';
+		addr = buf;
+	}
+	if (inet_pton(AF_INET6, addr, &answer->u.v6) == 1) {
+		answer->af = AF_INET6;
+		return 0;
+	}
+	return -EBADMSG;
+}
+
+/*
+ * Write in buf the AUTHENTICATE command with the given cookie, else the given
+ * password, else none of them.
+ *
+ * Return the length of the command on success else a negative value.
+ */
+ATTR_HIDDEN
+ssize_t tor_control_auth_command(const char *password,
+		const unsigned char *cookie, char *buf, size_t len)
+{
+	int ret;
+	size_t pos, i;
+	static const char hex[] = "0123456789ABCDEF";
+
+	assert(buf);
+
+	if (cookie) {
+		if (len < sizeof("AUTHENTICATE \r\n") + 2 * TOR_CONTROL_COOKIE_LEN) {
+			return -ERANGE;
+		}
+		pos = sprintf(buf, "AUTHENTICATE ");
+		for (i = 0; i < TOR_CONTROL_COOKIE_LEN; i++) {
+			buf[pos++] = hex[cookie[i] >> 4];
+			buf[pos++] = hex[cookie[i] & 0x0f];
+		}
+		strcpy(buf + pos, "\r\n");
+		return pos + 2;
+	}
+
+	if (!password || *password == '\0') {
+		ret = snprintf(buf, len, "AUTHENTICATE\r\n");
+		return (ret < 0 || (size_t) ret >= len) ? -ERANGE : ret;
+	}
+
+	/* A quoted string, its quotes and backslashes escaped. */
+	pos = snprintf(buf, len, "AUTHENTICATE \"");
+	for (i = 0; password[i] != '\0'; i++) {
+		if (pos + 2 >= len) {
+			return -ERANGE;
+		}
+		if (password[i] == '"' || password[i] == '\\') {
+			buf[pos++] = '\\';
+		}
+		buf[pos++] = password[i];
+	}
+	if (pos + sizeof("\"\r\n") > len) {
+		return -ERANGE;
+	}
+	strcpy(buf + pos, "\"\r\n");
+	return pos + 3;
+}
+
+static void tor_control_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&tc.lock);
+}
+
+static void tor_control_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&tc.lock);
+}
+
+/*
+ * The resolutions in flight are the ones of the threads of the parent. The
+ * child opens its own connection so it never reads the events of the parent.
+ */
+static void tor_control_atfork_child(void)
+{
+	unsigned int i;
+
+	if (tc.fd >= 0) {
+		(void) tsocks_libc_close(tc.fd);
+		tc.fd = -1;
+	}
+	for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+		tc.slots[i].state = TOR_CONTROL_SLOT_FREE;
+	}
+	tc.in_len = 0;
+	tc.sent_count = 0;
+	tc.reader = 0;
+	tsocks_mutex_unlock(&tc.lock);
+}
+
+static void tor_control_atfork_init(void)
+{
+	(void) pthread_atfork(tor_control_atfork_prepare,
+			tor_control_atfork_parent, tor_control_atfork_child);
+}
+
+/*
+ * Set the address of the ControlPort of Tor, TCP or unix, and how to
+ * authenticate to it. No connection is opened until the first resolution.
+ */
+ATTR_HIDDEN
+void tor_control_init(const struct sockaddr *addr, socklen_t addrlen,
+		const char *password, const char *cookie_file)
+{
+	unsigned int i;
+
+	assert(addr);
+	assert(addrlen <= sizeof(tc.addr));
+
+	tsocks_once(&tor_control_atfork_once, tor_control_atfork_init);
+
+	tsocks_mutex_lock(&tc.lock);
+	if (!tc.initialized) {
+		for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+			(void) pthread_cond_init(&tc.slots[i].cond, NULL);
+		}
+		tc.initialized = 1;
+	}
+	memcpy(&tc.addr, addr, addrlen);
+	tc.addrlen = addrlen;
+	tc.password[0] = '\0';
+	if (password) {
+		snprintf(tc.password, sizeof(tc.password), "%s", password);
+	}
+	tc.cookie_file[0] = '\0';
+	if (cookie_file) {
+		snprintf(tc.cookie_file, sizeof(tc.cookie_file), "%s", cookie_file);
+	}
+	tsocks_mutex_unlock(&tc.lock);
+}
+
+/*
+ * Complete a slot with the given result and wake up its waiter. MUST be
+ * called with the lock held.
+ */
+static void complete(struct tor_control_slot *slot, int ret)
+{
+	slot->ret = ret;
+	slot->state = TOR_CONTROL_SLOT_DONE;
+	(void) pthread_cond_signal(&slot->cond);
+}
+
+/*
+ * Close the connection and fail every resolution in flight with the given
+ * error. MUST be called with the lock held.
+ */
+static void reset_connection(int err)
+{
+	unsigned int i;
+
+	DBG("[tor-control] Connection to the ControlPort lost: %s", strerror(-err));
+
+	if (tc.fd >= 0) {
+		(void) tsocks_libc_close(tc.fd);
+		tc.fd = -1;
+	}
+	tc.in_len = 0;
+	tc.sent_count = 0;
+	for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+		if (tc.slots[i].state == TOR_CONTROL_SLOT_PENDING) {
+			complete(&tc.slots[i], err);
+		}
+	}
+}
+
+/*
+ * Wait for the given events on fd for at most timeout ms.
+ *
+ * Return 0 once ready, -ETIMEDOUT or a negative errno value.
+ */
+static int wait_fd(int fd, short events, int timeout)
+{
+	int ret;
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		return -errno;
+	}
+	return ret == 0 ? -ETIMEDOUT : 0;
+}
+
+/*
+ * Write a whole command on the connection. MUST be called with the lock held.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int send_all(const char *buf, size_t len)
+{
+	int ret;
+	ssize_t sent;
+
+	while (len > 0) {
+		sent = send(tc.fd, buf, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -errno;
+			}
+			ret = wait_fd(tc.fd, POLLOUT, TOR_CONTROL_HANDSHAKE_MS);
+			if (ret < 0) {
+				return ret;
+			}
+			continue;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+/*
+ * Read what is available on the connection in the input buffer. MUST be
+ * called with the lock held.
+ *
+ * Return the number of bytes read, 0 if none is available or else a negative
+ * value, the connection being closed or the buffer full of a single line.
+ */
+static ssize_t fill(void)
+{
+	ssize_t len;
+
+	if (tc.in_len == sizeof(tc.in)) {
+		return -EMSGSIZE;
+	}
+	do {
+		len = recv(tc.fd, tc.in + tc.in_len, sizeof(tc.in) - tc.in_len,
+				MSG_DONTWAIT);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+	}
+	if (len == 0) {
+		return -ECONNRESET;
+	}
+	tc.in_len += len;
+	return len;
+}
+
+/*
+ * Take the next complete line, without its CRLF, out of the input buffer.
+ * MUST be called with the lock held.
+ *
+ * Return 1 if a line is set else 0.
+ */
+static int take_line(char *line, size_t len)
+{
+	char *nl;
+	size_t line_len, consumed;
+
+	nl = memchr(tc.in, '\n', tc.in_len);
+	if (!nl) {
+		return 0;
+	}
+	consumed = nl - tc.in + 1;
+	line_len = consumed - 1;
+	if (line_len > 0 && tc.in[line_len - 1] == '\r') {
+		line_len--;
+	}
+	if (line_len >= len) {
+		line_len = len - 1;
+	}
+	memcpy(line, tc.in, line_len);
+	line[line_len] = '\0';
+
+	tc.in_len -= consumed;
+	memmove(tc.in, tc.in + consumed, tc.in_len);
+	return 1;
+}
+
+/*
+ * Send a command while connecting and read the status code of its reply.
+ * MUST be called with the lock held.
+ *
+ * Return 0 if it is 250 else a negative value.
+ */
+static int command_sync(const char *cmd, size_t len)
+{
+	int ret, code;
+	char sep;
+	const char *text;
+	char line[TOR_CONTROL_LINE_MAX];
+
+	ret = send_all(cmd, len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (;;) {
+		while (take_line(line, sizeof(line))) {
+			if (tor_control_parse_reply(line, &code, &sep, &text) < 0) {
+				return -EBADMSG;
+			}
+			if (sep != ' ' || code == 650) {
+				continue;
+			}
+			if (code != 250) {
+				ERR("[tor-control] ControlPort replied: %s", line);
+				return -EACCES;
+			}
+			return 0;
+		}
+
+		ret = wait_fd(tc.fd, POLLIN, TOR_CONTROL_HANDSHAKE_MS);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = fill();
+		if (ret < 0) {
+			return ret;
+		}
+	}
+}
+
+/*
+ * Read the authentication cookie of Tor from the given file.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int read_cookie(const char *path, unsigned char *cookie)
+{
+	int fd, ret;
+	ssize_t len;
+	unsigned char buf[TOR_CONTROL_COOKIE_LEN + 1];
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		PERROR("[tor-control] open cookie %s", path);
+		goto error;
+	}
+	len = read(fd, buf, sizeof(buf));
+	/* Not through our close() which takes the registry lock. */
+	(void) tsocks_libc_close(fd);
+	if (len != TOR_CONTROL_COOKIE_LEN) {
+		ERR("[tor-control] Invalid cookie file %s", path);
+		ret = -EINVAL;
+		goto error;
+	}
+	memcpy(cookie, buf, TOR_CONTROL_COOKIE_LEN);
+	return 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Connect to the ControlPort, authenticate and ask for the ADDRMAP events.
+ * MUST be called with the lock held.
+ *
+ * Return 0 on success else a negative value.
+ */
+static int open_connection(void)
+{
+	int ret, err = 0;
+	ssize_t len;
+	socklen_t err_len = sizeof(err);
+	char cmd[TOR_CONTROL_LINE_MAX];
+	unsigned char cookie[TOR_CONTROL_COOKIE_LEN];
+	static const char setevents[] = "SETEVENTS ADDRMAP\r\n";
+
+	if (tc.cookie_file[0] != '\0') {
+		ret = read_cookie(tc.cookie_file, cookie);
+		if (ret < 0) {
+			goto error;
+		}
+		len = tor_control_auth_command(NULL, cookie, cmd, sizeof(cmd));
+	} else {
+		len = tor_control_auth_command(tc.password, NULL, cmd, sizeof(cmd));
+	}
+	if (len < 0) {
+		ret = len;
+		goto error;
+	}
+
+	tc.fd = tsocks_libc_socket(tc.addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (tc.fd < 0) {
+		ret = -errno;
+		PERROR("[tor-control] socket");
+		goto error;
+	}
+	tc.in_len = 0;
+	tc.sent_count = 0;
+
+	ret = tsocks_libc_connect(tc.fd, (const struct sockaddr *) &tc.addr,
+			tc.addrlen);
+	if (ret < 0 && errno == EINPROGRESS) {
+		ret = wait_fd(tc.fd, POLLOUT, TOR_CONTROL_HANDSHAKE_MS);
+		if (ret == 0) {
+			(void) getsockopt(tc.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+			ret = -err;
+		}
+	} else if (ret < 0) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		ERR("[tor-control] Unable to connect to the ControlPort: %s",
+				strerror(-ret));
+		goto error_close;
+	}
+
+	ret = command_sync(cmd, len);
+	if (ret < 0) {
+		goto error_close;
+	}
+	ret = command_sync(setevents, sizeof(setevents) - 1);
+	if (ret < 0) {
+		goto error_close;
+	}
+
+	DBG("[tor-control] Connected to the ControlPort on fd %d", tc.fd);
+	return 0;
+
+error_close:
+	(void) tsocks_libc_close(tc.fd);
+	tc.fd = -1;
+error:
+	return ret;
+}
+
+/*
+ * A name goes as is in a command so only the characters of a host name or
+ * an address are accepted, anything else could inject arguments.
+ */
+static int valid_name(const char *name)
+{
+	size_t len = strspn(name, "abcdefghijklmnopqrstuvwxyz"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_:");
+
+	return len > 0 && name[len] == '\0' &&
+		len < sizeof(((struct tor_control_slot *) NULL)->name);
+}
+
+/*
+ * Send a RESOLVE command for the given name, or address if reverse, to the
+ * ControlPort. It MUST be waited for with tor_control_resolve_wait().
+ *
+ * Return 0 on success, -EAGAIN if too many resolutions are in flight or else
+ * a negative value.
+ */
+ATTR_HIDDEN
+int tor_control_resolve_send(const char *name, int reverse,
+		struct tor_control_query *query)
+{
+	int ret;
+	unsigned int i, index;
+	struct tor_control_slot *slot = NULL;
+	struct tor_control_sent *sent;
+	struct in6_addr addr;
+	char cmd[TOR_CONTROL_LINE_MAX];
+
+	assert(name);
+	assert(query);
+
+	if (!valid_name(name)) {
+		return -EINVAL;
+	}
+
+	tsocks_mutex_lock(&tc.lock);
+
+	if (!tc.initialized) {
+		ret = -ENOTCONN;
+		goto end;
+	}
+	if (tc.fd < 0) {
+		ret = open_connection();
+		if (ret < 0) {
+			goto end;
+		}
+	}
+
+	if (tc.sent_count == TOR_CONTROL_MAX_SENT) {
+		ret = -EAGAIN;
+		goto end;
+	}
+	for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+		index = (tc.next + i) % TOR_CONTROL_MAX_QUERIES;
+		if (tc.slots[index].state == TOR_CONTROL_SLOT_FREE) {
+			slot = &tc.slots[index];
+			break;
+		}
+	}
+	if (!slot) {
+		ret = -EAGAIN;
+		goto end;
+	}
+	tc.next = index + 1;
+
+	strcpy(slot->name, name);
+	slot->ptr_name[0] = '\0';
+	if (reverse) {
+		if (inet_pton(AF_INET, name, &addr) == 1) {
+			(void) dns_ptr_name(AF_INET, &addr, slot->ptr_name,
+					sizeof(slot->ptr_name));
+		} else if (inet_pton(AF_INET6, name, &addr) == 1) {
+			(void) dns_ptr_name(AF_INET6, &addr, slot->ptr_name,
+					sizeof(slot->ptr_name));
+		}
+	}
+	ret = snprintf(cmd, sizeof(cmd), "RESOLVE %s%s\r\n",
+			reverse ? "mode=reverse " : "", name);
+
+	ret = send_all(cmd, ret);
+	if (ret < 0) {
+		reset_connection(ret);
+		goto end;
+	}
+
+	slot->generation++;
+	slot->reverse = reverse;
+	slot->state = TOR_CONTROL_SLOT_PENDING;
+	slot->deadline = now_ms() + TOR_CONTROL_TIMEOUT_MS;
+	query->slot = index;
+	query->generation = slot->generation;
+
+	sent = &tc.sent[(tc.sent_head + tc.sent_count) % TOR_CONTROL_MAX_SENT];
+	sent->slot = index;
+	sent->generation = slot->generation;
+	tc.sent_count++;
+	ret = 0;
+
+end:
+	tsocks_mutex_unlock(&tc.lock);
+	return ret;
+}
+
+/*
+ * Dispatch a line read on the connection. An ADDRMAP event completes every
+ * resolution of its name and the last line of a reply is the one of the
+ * oldest command. MUST be called with the lock held.
+ */
+static void dispatch(const char *line)
+{
+	int code;
+	char sep;
+	unsigned int i;
+	const char *text;
+	struct tor_control_slot *slot;
+	struct tor_control_sent *sent;
+	char name[DEFAULT_DOMAIN_NAME_SIZE + 1], addr[DEFAULT_DOMAIN_NAME_SIZE + 1];
+
+	if (tor_control_parse_reply(line, &code, &sep, &text) < 0) {
+		return;
+	}
+
+	if (code == 650) {
+		if (sep != ' ' || tor_control_parse_addrmap(text, name, sizeof(name),
+					addr, sizeof(addr)) < 0) {
+			return;
+		}
+		for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+			slot = &tc.slots[i];
+			if (slot->state != TOR_CONTROL_SLOT_PENDING) {
+				continue;
+			}
+			if (strcasecmp(name, slot->name) == 0 ||
+					(slot->reverse && strcasecmp(name, slot->ptr_name) == 0)) {
+				complete(slot, tor_control_parse_answer(addr, slot->reverse,
+							&slot->answer));
+			}
+		}
+		return;
+	}
+
+	if (sep != ' ' || tc.sent_count == 0) {
+		return;
+	}
+	sent = &tc.sent[tc.sent_head];
+	tc.sent_head = (tc.sent_head + 1) % TOR_CONTROL_MAX_SENT;
+	tc.sent_count--;
+
+	slot = &tc.slots[sent->slot];
+	if (code != 250 && slot->state == TOR_CONTROL_SLOT_PENDING &&
+			slot->generation == sent->generation) {
+		DBG("[tor-control] RESOLVE %s refused: %s", slot->name, line);
+		complete(slot, -ECONNABORTED);
+	}
+}
+
+/*
+ * Fail the resolutions whose deadline passed.
+ *
+ * Return the time in ms until the next deadline. MUST be called with the lock
+ * held.
+ */
+static int expire(void)
+{
+	unsigned int i;
+	uint64_t now = now_ms(), next = now + TOR_CONTROL_TIMEOUT_MS;
+	struct tor_control_slot *slot;
+
+	for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+		slot = &tc.slots[i];
+		if (slot->state != TOR_CONTROL_SLOT_PENDING) {
+			continue;
+		}
+		if (slot->deadline <= now) {
+			DBG("[tor-control] RESOLVE %s timed out", slot->name);
+			complete(slot, -ETIMEDOUT);
+			continue;
+		}
+		if (slot->deadline < next) {
+			next = slot->deadline;
+		}
+	}
+
+	return next - now;
+}
+
+/*
+ * Read the connection until the given slot is done. MUST be called with the
+ * lock held, it is released while polling.
+ */
+static void read_replies(struct tor_control_slot *own)
+{
+	int fd, timeout;
+	ssize_t ret;
+	struct pollfd pfd;
+	char line[TOR_CONTROL_LINE_MAX];
+
+	while (own->state == TOR_CONTROL_SLOT_PENDING) {
+		timeout = expire();
+		if (own->state != TOR_CONTROL_SLOT_PENDING) {
+			break;
+		}
+
+		fd = tc.fd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		tsocks_mutex_unlock(&tc.lock);
+		(void) poll(&pfd, 1, timeout);
+		tsocks_mutex_lock(&tc.lock);
+		if (tc.fd != fd) {
+			/* Reset while polling, every resolution on it failed. */
+			continue;
+		}
+
+		do {
+			ret = fill();
+			while (take_line(line, sizeof(line))) {
+				dispatch(line);
+			}
+		} while (ret > 0);
+		if (ret < 0) {
+			reset_connection(ret);
+		}
+	}
+}
+
+/*
+ * Wait for the result of a resolution sent with tor_control_resolve_send()
+ * and free its slot.
+ *
+ * Return 0 with the answer set on success, -ENOENT if Tor failed to resolve
+ * it or else a negative value.
+ */
+ATTR_HIDDEN
+int tor_control_resolve_wait(const struct tor_control_query *query,
+		struct tor_control_answer *answer)
+{
+	int ret;
+	unsigned int i;
+	struct tor_control_slot *slot;
+
+	assert(query);
+	assert(query->slot < TOR_CONTROL_MAX_QUERIES);
+	assert(answer);
+
+	slot = &tc.slots[query->slot];
+
+	tsocks_mutex_lock(&tc.lock);
+	assert(slot->generation == query->generation);
+
+	while (slot->state == TOR_CONTROL_SLOT_PENDING) {
+		if (tc.reader) {
+			/*
+			 * Woken up once done or when the reader leaves. The lock
+			 * statistics, if enabled, count this wait as held time.
+			 */
+			slot->waiting = 1;
+			(void) pthread_cond_wait(&slot->cond, &tc.lock.mutex);
+			slot->waiting = 0;
+			continue;
+		}
+
+		tc.reader = 1;
+		read_replies(slot);
+		tc.reader = 0;
+
+		/*
+		 * Hand the connection over to a waiter of a resolution in flight. A
+		 * resolution not waited for yet makes its thread the reader once it
+		 * waits.
+		 */
+		for (i = 0; i < TOR_CONTROL_MAX_QUERIES; i++) {
+			if (tc.slots[i].state == TOR_CONTROL_SLOT_PENDING &&
+					tc.slots[i].waiting) {
+				(void) pthread_cond_signal(&tc.slots[i].cond);
+				break;
+			}
+		}
+	}
+
+	ret = slot->ret;
+	if (ret == 0) {
+		memcpy(answer, &slot->answer, sizeof(*answer));
+	}
+	slot->state = TOR_CONTROL_SLOT_FREE;
+
+	tsocks_mutex_unlock(&tc.lock);
+	return ret;
+}
+
+/*
+ * Close the connection to the ControlPort.
+ */
+ATTR_HIDDEN
+void tor_control_destroy(void)
+{
+	tsocks_mutex_lock(&tc.lock);
+	if (tc.fd >= 0) {
+		(void) tsocks_libc_close(tc.fd);
+		tc.fd = -1;
+	}
+	tsocks_mutex_unlock(&tc.lock);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_TOR_CONTROL_H
+#define TORSOCKS_TOR_CONTROL_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "defaults.h"
+
+/* Length of the authentication cookie of Tor. */
+#define TOR_CONTROL_COOKIE_LEN	32
+
+/* Answer of a resolution, an address or the name of a reverse one. */
+struct tor_control_answer {
+	/* AF_INET or AF_INET6 for an address, AF_UNSPEC for a name. */
+	int af;
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+		char name[DEFAULT_DOMAIN_NAME_SIZE + 1];
+	} u;
+};
+
+/* A resolution sent and not yet waited for. */
+struct tor_control_query {
+	unsigned int slot;
+	unsigned int generation;
+};
+
+/* Control protocol. */
+int tor_control_parse_reply(const char *line, int *code, char *sep,
+		const char **text);
+int tor_control_parse_addrmap(const char *text, char *name, size_t name_len,
+		char *addr, size_t addr_len);
+int tor_control_parse_answer(const char *addr, int reverse,
+		struct tor_control_answer *answer);
+ssize_t tor_control_auth_command(const char *password,
+		const unsigned char *cookie, char *buf, size_t len);
+
+/*
+ * Resolver sending every RESOLVE command of the process on a single
+ * authenticated connection to the ControlPort of Tor. The results come back
+ * as ADDRMAP events matched to the resolutions in flight by name so many are
+ * in flight at once, from one or many threads.
+ */
+void tor_control_init(const struct sockaddr *addr, socklen_t addrlen,
+		const char *password, const char *cookie_file);
+int tor_control_resolve_send(const char *name, int reverse,
+		struct tor_control_query *query);
+int tor_control_resolve_wait(const struct tor_control_query *query,
+		struct tor_control_answer *answer);
+void tor_control_destroy(void);
+
+#endif /* TORSOCKS_TOR_CONTROL_H */
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lib/torsocks.h>
+
+#include "compat.h"
+#include "macros.h"
+#include "trace.h"
+
+/* Records are written to the file by blocks of that size per thread. */
+#define TRACE_BUF_SIZE		16384
+/* Longer names are truncated. */
+#define TRACE_NAME_MAX		1024
+
+/*
+ * Records of a thread not written yet. The owner appends with the lock held
+ * so a block can be flushed by another thread at exit.
+ */
+struct trace_thread {
+	tsocks_mutex_t lock;
+	size_t len;
+	/* Set while a thread owns it. */
+	int in_use;
+	/* Never freed thus the list can be walked without a lock. */
+	struct trace_thread *next;
+	char buf[TRACE_BUF_SIZE] __attribute__((aligned(8)));
+};
+
+/* Set once the trace file is open, read by every hijacked call. */
+ATTR_HIDDEN int trace_enabled;
+
+static struct {
+	int fd;
+	/* Path given, "%p" is replaced by the pid when opened. */
+	char path[PATH_MAX];
+} trace = {
+	.fd = -1,
+};
+
+/* Every trace_thread ever created. Only appended to. */
+static struct trace_thread *trace_threads;
+
+static __thread struct trace_thread *thread_trace;
+static __thread uint32_t thread_tid;
+
+static pthread_key_t trace_key;
+static TSOCKS_INIT_ONCE(trace_key_once);
+
+/*
+ * Write a whole buffer, retrying on partial writes. Errors drop the records.
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/*
+ * Write the records of a thread. MUST be called with its lock held.
+ */
+static void trace_flush(struct trace_thread *t)
+{
+	int fd = __atomic_load_n(&trace.fd, __ATOMIC_RELAXED);
+
+	if (t->len && fd >= 0) {
+		write_all(fd, t->buf, t->len);
+	}
+	t->len = 0;
+}
+
+/*
+ * Create the file of the given path, expanding "%p", and write its header.
+ *
+ * Return the fd or a negative errno value.
+ */
+static int trace_create(const char *path)
+{
+	int fd;
+	size_t i, len = 0;
+	char expanded[PATH_MAX];
+	struct trace_header hdr;
+	struct timespec ts;
+
+	for (i = 0; path[i] && len < sizeof(expanded) - 1; i++) {
+		if (path[i] == '%' && path[i + 1] == 'p') {
+			len += snprintf(expanded + len, sizeof(expanded) - len, "%d",
+					(int) getpid());
+			i++;
+			continue;
+		}
+		expanded[len++] = path[i];
+	}
+	if (len >= sizeof(expanded) - 1) {
+		return -ENAMETOOLONG;
+	}
+	expanded[len] = '\0';
+
+	fd = open(expanded, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+			0600);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.pid = getpid();
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.realtime_sec = ts.tv_sec;
+	hdr.realtime_nsec = ts.tv_nsec;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	hdr.monotonic = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	write_all(fd, (const char *) &hdr, sizeof(hdr));
+
+	return fd;
+}
+
+/*
+ * A forked child drops the records of its parent. With "%p" in the path it
+ * gets its own file else it appends to the one of its parent.
+ */
+static void trace_atfork_child(void)
+{
+	int fd;
+	struct trace_thread *t;
+
+	for (t = trace_threads; t; t = t->next) {
+		t->len = 0;
+	}
+	thread_tid = 0;
+
+	if (trace.fd >= 0 && strstr(trace.path, "%p")) {
+		fd = trace_create(trace.path);
+		tsocks_libc_close(trace.fd);
+		trace.fd = fd;
+		if (fd < 0) {
+			trace_enabled = 0;
+		}
+	}
+}
+
+/*
+ * Thread key destructor. The records are written and the buffer kept for the
+ * next thread.
+ */
+static void trace_release(void *data)
+{
+	struct trace_thread *t = data;
+
+	tsocks_mutex_lock(&t->lock);
+	trace_flush(t);
+	tsocks_mutex_unlock(&t->lock);
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void)
+{
+	(void) pthread_key_create(&trace_key, trace_release);
+	(void) pthread_atfork(NULL, NULL, trace_atfork_child);
+}
+
+/*
+ * Get the buffer of the calling thread, reusing the one of an exited thread
+ * if possible.
+ */
+static struct trace_thread *trace_get(void)
+{
+	int unused = 0;
+	struct trace_thread *t;
+
+	tsocks_once(&trace_key_once, trace_key_init);
+
+	for (t = __atomic_load_n(&trace_threads, __ATOMIC_ACQUIRE); t;
+			t = t->next) {
+		if (!__atomic_load_n(&t->in_use, __ATOMIC_RELAXED) &&
+				__atomic_compare_exchange_n(&t->in_use, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto end;
+		}
+		unused = 0;
+	}
+
+	t = zmalloc(sizeof(*t));
+	if (!t) {
+		goto error;
+	}
+	tsocks_mutex_init(&t->lock);
+	t->in_use = 1;
+	t->next = __atomic_load_n(&trace_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_threads, &t->next, t, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		/* t->next was updated with the current head. */
+	}
+
+end:
+	(void) pthread_setspecific(trace_key, t);
+	thread_trace = t;
+error:
+	return t;
+}
+
+/*
+ * Record a call started at the given time. The address is a raw IPv4 or IPv6
+ * address of the given family, the name can be NULL. errno is preserved since
+ * this is called in the hijacked calls.
+ */
+ATTR_HIDDEN
+void trace_record(uint64_t start, enum trace_hook hook, int fd, int arg,
+		long ret, int family, const void *addr, uint16_t port,
+		const char *name)
+{
+	int saved_errno = errno;
+	size_t name_len = 0, space;
+	struct trace_thread *t = thread_trace;
+	struct trace_record *rec;
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (!t) {
+		t = trace_get();
+		if (!t) {
+			goto end;
+		}
+	}
+	if (!thread_tid) {
+		thread_tid = tsocks_libc_syscall(TSOCKS_NR_GETTID);
+	}
+
+	if (name) {
+		name_len = strnlen(name, TRACE_NAME_MAX);
+	}
+	space = TRACE_RECORD_SPACE(name_len);
+
+	tsocks_mutex_lock(&t->lock);
+	if (t->len + space > sizeof(t->buf)) {
+		trace_flush(t);
+	}
+
+	rec = (struct trace_record *) (t->buf + t->len);
+	memset(rec, 0, space);
+	rec->start = start;
+	rec->duration = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+	rec->tid = thread_tid;
+	rec->fd = fd;
+	rec->arg = arg;
+	rec->ret = ret < INT32_MIN ? INT32_MIN : ret > INT32_MAX ? INT32_MAX : ret;
+	rec->err = ret < 0 ? saved_errno : 0;
+	rec->hook = hook;
+	rec->port = port;
+	rec->name_len = name_len;
+	if (family == AF_INET && addr) {
+		rec->family = AF_INET;
+		memcpy(rec->addr, addr, sizeof(struct in_addr));
+	} else if (family == AF_INET6 && addr) {
+		rec->family = AF_INET6;
+		memcpy(rec->addr, addr, sizeof(struct in6_addr));
+	} else {
+		rec->family = family;
+	}
+	if (name_len) {
+		memcpy(rec + 1, name, name_len);
+	}
+	t->len += space;
+	tsocks_mutex_unlock(&t->lock);
+
+end:
+	errno = saved_errno;
+}
+
+/*
+ * Record a call with its socket address, NULL if none.
+ */
+ATTR_HIDDEN
+void trace_record_sockaddr(uint64_t start, enum trace_hook hook, int fd,
+		int arg, long ret, const struct sockaddr *sa, const char *name)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+
+	if (!sa) {
+		trace_record(start, hook, fd, arg, ret, 0, NULL, 0, name);
+		return;
+	}
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *) sa;
+		trace_record(start, hook, fd, arg, ret, AF_INET, &sin->sin_addr,
+				sin->sin_port, name);
+		break;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *) sa;
+		trace_record(start, hook, fd, arg, ret, AF_INET6, &sin6->sin6_addr,
+				sin6->sin6_port, name);
+		break;
+	default:
+		trace_record(start, hook, fd, arg, ret, sa->sa_family, NULL, 0, name);
+		break;
+	}
+}
+
+/*
+ * Record a resolution returning a hostent, NULL on failure, with its first
+ * address.
+ */
+ATTR_HIDDEN
+void trace_record_hostent(uint64_t start, enum trace_hook hook, int arg,
+		const struct hostent *he, const char *name)
+{
+	if (!he) {
+		trace_record(start, hook, -1, arg, -1, 0, NULL, 0, name);
+		return;
+	}
+	trace_record(start, hook, -1, arg, 0, he->h_addrtype,
+			he->h_addr_list && he->h_addr_list[0] ? he->h_addr_list[0] : NULL,
+			0, name);
+}
+
+/*
+ * Open the trace file and start recording every hijacked call.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+ATTR_HIDDEN
+int trace_open(const char *path)
+{
+	int fd;
+
+	assert(path);
+
+	if (strlen(path) >= sizeof(trace.path)) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(trace.path, path);
+
+	fd = trace_create(path);
+	if (fd < 0) {
+		return fd;
+	}
+	trace.fd = fd;
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Stop recording, write the records of every thread and close the file.
+ */
+ATTR_HIDDEN
+void trace_destroy(void)
+{
+	int fd = trace.fd;
+	struct trace_thread *t;
+
+	if (fd < 0) {
+		return;
+	}
+
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	for (t = __atomic_load_n(&trace_threads, __ATOMIC_ACQUIRE); t;
+			t = t->next) {
+		tsocks_mutex_lock(&t->lock);
+		trace_flush(t);
+		tsocks_mutex_unlock(&t->lock);
+	}
+	__atomic_store_n(&trace.fd, -1, __ATOMIC_RELAXED);
+	tsocks_libc_close(fd);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_TRACE_H
+#define TORSOCKS_TRACE_H
+
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* "TSTR" in memory. */
+#define TRACE_MAGIC		0x52545354
+#define TRACE_VERSION	1
+
+/* Hijacked calls recorded. The values are part of the file format. */
+enum trace_hook {
+	TRACE_SOCKET				= 1,
+	TRACE_SOCKETPAIR			= 2,
+	TRACE_CONNECT				= 3,
+	TRACE_CLOSE					= 4,
+	TRACE_FCLOSE				= 5,
+	TRACE_GETPEERNAME			= 6,
+	TRACE_ACCEPT				= 7,
+	TRACE_ACCEPT4				= 8,
+	TRACE_LISTEN				= 9,
+	TRACE_BIND					= 10,
+	TRACE_DUP					= 11,
+	TRACE_DUP2					= 12,
+	TRACE_DUP3					= 13,
+	TRACE_RECVMSG				= 14,
+	TRACE_RECVMMSG				= 15,
+	TRACE_SENDTO				= 16,
+	TRACE_SENDMMSG				= 17,
+	TRACE_GETADDRINFO			= 18,
+	TRACE_GETHOSTBYNAME			= 19,
+	TRACE_GETHOSTBYNAME2		= 20,
+	TRACE_GETHOSTBYNAME_R		= 21,
+	TRACE_GETHOSTBYNAME2_R		= 22,
+	TRACE_GETHOSTBYADDR			= 23,
+	TRACE_GETHOSTBYADDR_R		= 24,
+	TRACE_SYSCALL				= 25,
+	TRACE_IO_URING_SETUP		= 26,
+	TRACE_IO_URING_QUEUE_INIT	= 27,
+	TRACE_RECVFROM				= 28,
+	TRACE_SENDMSG				= 29,
+	TRACE_FCNTL					= 30,
+	TRACE_CLOSE_RANGE			= 31,
+	TRACE_CLOSEFROM				= 32,
+
+	TRACE_HOOK_MAX,
+};
+
+/*
+ * Header at the start of a trace file, the records follow it.
+ */
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t pid;
+	uint32_t pad;
+	/* Wall clock and monotonic time at open time to date the records. */
+	int64_t realtime_sec;
+	int64_t realtime_nsec;
+	uint64_t monotonic;
+};
+
+/*
+ * A recorded call. The records of a thread are in call order, the threads
+ * are interleaved by blocks.
+ */
+struct trace_record {
+	/* CLOCK_MONOTONIC time of the call and its duration in nanoseconds. */
+	uint64_t start;
+	uint64_t duration;
+	/* Kernel thread id of the caller. */
+	uint32_t tid;
+	/* The fd or the first integer argument such as the domain of socket(). */
+	int32_t fd;
+	/*
+	 * Second integer argument: type of socket(), backlog of listen(), new fd
+	 * of dup2(), flags, family of gethostbyname2() or syscall number.
+	 */
+	int32_t arg;
+	/* Returned value, 0 or -1 for the calls returning a pointer. */
+	int32_t ret;
+	/* errno when the call failed else 0. */
+	int32_t err;
+	uint16_t hook;
+	/*
+	 * Address given to the call or, for a resolution, the first one
+	 * returned. Family 0 if none, port in network order.
+	 */
+	uint16_t family;
+	uint16_t port;
+	/* Length of the name that follows the record, padded to 8 bytes. */
+	uint16_t name_len;
+	uint32_t pad;
+	uint8_t addr[16];
+};
+
+/* Space of a record and its name in the file. */
+#define TRACE_RECORD_SPACE(name_len) \
+	(sizeof(struct trace_record) + (((name_len) + 7) & ~7U))
+
+extern int trace_enabled;
+
+int trace_open(const char *path);
+void trace_destroy(void);
+void trace_record(uint64_t start, enum trace_hook hook, int fd, int arg,
+		long ret, int family, const void *addr, uint16_t port,
+		const char *name);
+void trace_record_sockaddr(uint64_t start, enum trace_hook hook, int fd,
+		int arg, long ret, const struct sockaddr *sa, const char *name);
+void trace_record_hostent(uint64_t start, enum trace_hook hook, int arg,
+		const struct hostent *he, const char *name);
+
+/*
+ * Start time of a call to record, 0 if tracing is off. The cost is a load and
+ * a branch when off.
+ */
+static inline uint64_t trace_begin(void)
+{
+	struct timespec ts;
+
+	if (__builtin_expect(!trace_enabled, 1)) {
+		return 0;
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Record a call started at the given time. The address can be NULL.
+ */
+static inline void trace_call(uint64_t start, enum trace_hook hook, int fd,
+		int arg, long ret, const struct sockaddr *sa)
+{
+	if (__builtin_expect(!start, 1)) {
+		return;
+	}
+	trace_record_sockaddr(start, hook, fd, arg, ret, sa, NULL);
+}
+
+#endif /* TORSOCKS_TRACE_H */
@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <lib/torsocks.h>
+
+#include "log.h"
+#include "macros.h"
+#include "uring.h"
+
+/*
+ * Number of entries of a thread ring. A SOCKS5 handshake uses at most three
+ * linked requests so this is plenty.
+ */
+#define URING_ENTRIES	8
+
+/*
+ * Set to 1 if the kernel supports every operation we need, 0 if not and -1 if
+ * it has not been probed yet. Once 0, no ring is ever created again. Accessed
+ * atomically since any thread can probe.
+ */
+static int uring_supported = -1;
+
+/*
+ * Incremented in the child after a fork(). A ring created in the parent is
+ * shared with the child through the mapping thus it can't be used anymore.
+ */
+static unsigned int uring_generation;
+
+/* Thread specific key holding the ring of a thread. */
+static pthread_key_t uring_key;
+static TSOCKS_INIT_ONCE(uring_key_once);
+
+/*
+ * Thin wrappers around the io_uring system calls. The libc syscall(2) is used
+ * directly since our own syscall() wrapper denies those.
+ */
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) tsocks_libc_syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return (int) tsocks_libc_syscall(__NR_io_uring_enter, fd, to_submit,
+			min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+		unsigned int nr_args)
+{
+	return (int) tsocks_libc_syscall(__NR_io_uring_register, fd, opcode, arg,
+			nr_args);
+}
+
+/*
+ * Release every resource of a ring. The ring object itself is not freed.
+ */
+static void ring_release(struct uring *ring)
+{
+	assert(ring);
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	if (ring->fd >= 0) {
+		tsocks_libc_close(ring->fd);
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/*
+ * Check that the kernel knows about every opcode used by the SOCKS5 engine.
+ *
+ * Return 1 if supported else 0.
+ */
+static int ring_probe(struct uring *ring)
+{
+	int ret, supported = 0;
+	size_t len;
+	struct io_uring_probe *probe;
+
+	len = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	probe = zmalloc(len);
+	if (!probe) {
+		goto end;
+	}
+
+	ret = sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe,
+			IORING_OP_LAST);
+	if (ret < 0) {
+		DBG("[uring] Unable to probe io_uring opcodes");
+		goto end;
+	}
+
+	if (probe->last_op < IORING_OP_RECV) {
+		goto end;
+	}
+	supported = (probe->ops[IORING_OP_CONNECT].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+
+end:
+	free(probe);
+	return supported;
+}
+
+/*
+ * Create a new io_uring instance and map its rings.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+static int ring_setup(struct uring *ring)
+{
+	int ret;
+	struct io_uring_params p;
+
+	assert(ring);
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		ret = -errno;
+		DBG("[uring] io_uring_setup failed with %d", ret);
+		goto error;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_len = ring->cq_len = max(ring->sq_len, ring->cq_len);
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		ret = -errno;
+		goto error;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			ret = -errno;
+			goto error;
+		}
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		ret = -errno;
+		goto error;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+	ring->generation = uring_generation;
+
+	return 0;
+
+error:
+	ring_release(ring);
+	return ret;
+}
+
+/*
+ * Thread key destructor releasing the ring of an exiting thread.
+ */
+static void ring_destroy(void *data)
+{
+	struct uring *ring = data;
+
+	if (!ring) {
+		return;
+	}
+	ring_release(ring);
+	free(ring);
+}
+
+/*
+ * Called in the child process after a fork().
+ */
+static void ring_atfork_child(void)
+{
+	uring_generation++;
+}
+
+static void ring_key_init(void)
+{
+	(void) pthread_key_create(&uring_key, ring_destroy);
+	(void) pthread_atfork(NULL, NULL, ring_atfork_child);
+}
+
+/*
+ * Return the io_uring instance of the calling thread creating it if needed.
+ *
+ * Return NULL if io_uring is not usable on this system in which case the
+ * caller MUST fallback to the normal socket calls.
+ */
+ATTR_HIDDEN
+struct uring *uring_get_thread_ring(void)
+{
+	int ret;
+	struct uring *ring;
+
+	if (__atomic_load_n(&uring_supported, __ATOMIC_RELAXED) == 0) {
+		goto error;
+	}
+
+	tsocks_once(&uring_key_once, ring_key_init);
+
+	ring = pthread_getspecific(uring_key);
+	if (ring) {
+		if (ring->generation == uring_generation) {
+			goto end;
+		}
+		/* Inherited from our parent. Drop our copy of it. */
+		ring_release(ring);
+	} else {
+		ring = zmalloc(sizeof(*ring));
+		if (!ring) {
+			goto error;
+		}
+	}
+
+	ret = ring_setup(ring);
+	if (ret < 0) {
+		if (ret == -ENOSYS || ret == -EPERM) {
+			/* Kernel without io_uring or disabled by policy. */
+			__atomic_store_n(&uring_supported, 0, __ATOMIC_RELAXED);
+		}
+		goto error_free;
+	}
+
+	if (__atomic_load_n(&uring_supported, __ATOMIC_RELAXED) < 0) {
+		ret = ring_probe(ring);
+		__atomic_store_n(&uring_supported, ret, __ATOMIC_RELAXED);
+		if (!ret) {
+			DBG("[uring] Kernel lacks needed io_uring operations");
+			ring_release(ring);
+			goto error_free;
+		}
+	}
+
+	(void) pthread_setspecific(uring_key, ring);
+
+end:
+	return ring;
+
+error_free:
+	(void) pthread_setspecific(uring_key, NULL);
+	free(ring);
+error:
+	return NULL;
+}
+
+/*
+ * Get the next free submission queue entry of the ring. The entry is zeroed.
+ *
+ * Return NULL if the submission queue is full.
+ */
+ATTR_HIDDEN
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int head, tail, idx;
+	struct io_uring_sqe *sqe;
+
+	assert(ring);
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail + ring->to_submit;
+	if (tail - head >= URING_ENTRIES) {
+		return NULL;
+	}
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->to_submit++;
+
+	return sqe;
+}
+
+/*
+ * Submit every prepared entry and wait for at least wait_nr completions.
+ *
+ * Return 0 on success else a negative errno value.
+ */
+ATTR_HIDDEN
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr)
+{
+	int ret;
+	unsigned int tail;
+
+	assert(ring);
+
+	/* Publish every prepared entry to the kernel. */
+	tail = *ring->sq_tail + ring->to_submit;
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	ring->to_submit = 0;
+
+	do {
+		/*
+		 * Entries not consumed by a previous call are still pending between
+		 * the kernel head and our tail so resubmit them.
+		 */
+		ret = sys_io_uring_enter(ring->fd,
+				tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+				wait_nr, IORING_ENTER_GETEVENTS);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = 0;
+
+error:
+	return ret;
+}
+
+/*
+ * Pop the next completion of the ring.
+ *
+ * Return 1 if a completion was reaped, 0 if the queue is empty.
+ */
+ATTR_HIDDEN
+int uring_reap(struct uring *ring, uint64_t *user_data, int32_t *res)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+
+	assert(ring);
+	assert(user_data);
+	assert(res);
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return 0;
+	}
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/*
+ * Take back every entry the kernel has not consumed, the prepared ones and
+ * the ones left by a failed submission. Those never complete.
+ *
+ * Return the number of entries dropped.
+ */
+ATTR_HIDDEN
+unsigned int uring_drop_unsubmitted(struct uring *ring)
+{
+	unsigned int head, nr;
+
+	assert(ring);
+
+	/* Without SQPOLL, the kernel only consumes entries in io_uring_enter. */
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	nr = *ring->sq_tail - head + ring->to_submit;
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	ring->to_submit = 0;
+
+	return nr;
+}
+
+/*
+ * Give up on a ring with requests still in the kernel. It is detached from
+ * its thread and never released so the requests can still use it and its
+ * buffer. The thread gets a new ring on its next use.
+ */
+ATTR_HIDDEN
+void uring_abandon(struct uring *ring)
+{
+	assert(ring);
+	assert(pthread_getspecific(uring_key) == ring);
+
+	DBG("[uring] Abandoning ring %d with requests in flight", ring->fd);
+	(void) pthread_setspecific(uring_key, NULL);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TORSOCKS_URING_H
+#define TORSOCKS_URING_H
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* Size of the buffer of a ring for the data of its requests. */
+#define URING_BUF_SIZE	1024
+
+/*
+ * Minimal io_uring instance driven with the raw system calls so torsocks does
+ * not depend on liburing. Only what is needed to submit a short chain of
+ * linked requests and wait for their completion is implemented.
+ *
+ * An instance is owned by a single thread and is never shared.
+ */
+struct uring {
+	int fd;
+
+	/* Submission queue ring. */
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	/* Completion queue ring. Might be the same mapping as the SQ ring. */
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Number of SQE prepared but not yet submitted to the kernel. */
+	unsigned int to_submit;
+
+	/* Fork generation this ring was created in. */
+	unsigned int generation;
+
+	/*
+	 * Data of the requests. It lives as long as the ring so a request left
+	 * in the kernel never writes to memory given back.
+	 */
+	unsigned char buf[URING_BUF_SIZE];
+};
+
+struct uring *uring_get_thread_ring(void);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+int uring_reap(struct uring *ring, uint64_t *user_data, int32_t *res);
+unsigned int uring_drop_unsubmitted(struct uring *ring);
+void uring_abandon(struct uring *ring);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* TORSOCKS_URING_H */
@@ -17,6 +17,8 @@
 
 #include <assert.h>
 
+#include <common/fd-table.h>
+#include <common/trace.h>
 #include <common/utils.h>
 
 #include "torsocks.h"
@@ -30,7 +32,7 @@ LIBC_ACCEPT_RET_TYPE tsocks_accept(LIBC_ACCEPT_SIG)
 {
 	int ret;
 	socklen_t sa_len;
-	struct sockaddr sa;
+	struct sockaddr_storage sa;
 
 	if (tsocks_config.allow_inbound) {
 		/* Allowed by the user so directly go to the libc. */
@@ -42,24 +44,29 @@ LIBC_ACCEPT_RET_TYPE tsocks_accept(LIBC_ACCEPT_SIG)
 		goto error;
 	}
 
+	/*
+	 * Always ask the kernel, a stale fd table entry must never allow an
+	 * inbound connection.
+	 */
 	sa_len = sizeof(sa);
 
-	ret = getsockname(sockfd, &sa, &sa_len);
+	ret = getsockname(sockfd, (struct sockaddr *) &sa, &sa_len);
 	if (ret < 0) {
 		PERROR("[accept] getsockname");
 		goto error;
 	}
+	fd_table_add(sockfd, fd_table_classify_addr((struct sockaddr *) &sa));
 
 	/*
 	 * accept() on a Unix socket is allowed else we are going to try to match
 	 * it on INET localhost socket.
 	 */
-	if (sa.sa_family == AF_UNIX) {
+	if (sa.ss_family == AF_UNIX) {
 		goto libc_call;
 	}
 
 	/* Inbound localhost connections are allowed. */
-	ret = utils_sockaddr_is_localhost(&sa);
+	ret = utils_sockaddr_is_localhost((struct sockaddr *) &sa);
 	if (!ret) {
 
 		/*
@@ -73,7 +80,13 @@ LIBC_ACCEPT_RET_TYPE tsocks_accept(LIBC_ACCEPT_SIG)
 	}
 
 libc_call:
-	return tsocks_libc_accept(LIBC_ACCEPT_ARGS);
+	ret = tsocks_libc_accept(LIBC_ACCEPT_ARGS);
+	if (ret >= 0) {
+		/* The new socket has the family and local address of the listener. */
+		fd_table_add(sockfd, FD_TABLE_LISTEN);
+		fd_table_set(ret, fd_table_get(sockfd) & ~FD_TABLE_LISTEN);
+	}
+	return ret;
 
 error:
 	return -1;
@@ -84,13 +97,18 @@ error:
  */
 LIBC_ACCEPT_DECL
 {
-	if (!tsocks_libc_accept) {
-		tsocks_initialize();
-		tsocks_libc_accept = tsocks_find_libc_symbol(
-				LIBC_ACCEPT_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_ACCEPT_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(accept_entry, sockfd, addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_accept(LIBC_ACCEPT_ARGS);
+	trace_call(start, TRACE_ACCEPT, sockfd, 0, ret, ret >= 0 ? addr : NULL);
+	TSOCKS_PROBE2(accept_return, sockfd, ret);
 
-	return tsocks_accept(LIBC_ACCEPT_ARGS);
+	return ret;
 }
 
 #if (defined(__linux__))
@@ -104,7 +122,7 @@ LIBC_ACCEPT4_RET_TYPE tsocks_accept4(LIBC_ACCEPT4_SIG)
 {
 	int ret;
 	socklen_t sa_len;
-	struct sockaddr sa;
+	struct sockaddr_storage sa;
 
 	if (tsocks_config.allow_inbound) {
 		/* Allowed by the user so directly go to the libc. */
@@ -116,24 +134,29 @@ LIBC_ACCEPT4_RET_TYPE tsocks_accept4(LIBC_ACCEPT4_SIG)
 		goto error;
 	}
 
+	/*
+	 * Always ask the kernel, a stale fd table entry must never allow an
+	 * inbound connection.
+	 */
 	sa_len = sizeof(sa);
 
-	ret = getsockname(sockfd, &sa, &sa_len);
+	ret = getsockname(sockfd, (struct sockaddr *) &sa, &sa_len);
 	if (ret < 0) {
 		PERROR("[accept4] getsockname");
 		goto error;
 	}
+	fd_table_add(sockfd, fd_table_classify_addr((struct sockaddr *) &sa));
 
 	/*
 	 * accept4() on a Unix socket is allowed else we are going to try to match
 	 * it on INET localhost socket.
 	 */
-	if (sa.sa_family == AF_UNIX) {
+	if (sa.ss_family == AF_UNIX) {
 		goto libc_call;
 	}
 
 	/* Inbound localhost connections are allowed. */
-	ret = utils_sockaddr_is_localhost(&sa);
+	ret = utils_sockaddr_is_localhost((struct sockaddr *) &sa);
 	if (!ret) {
 
 		/*
@@ -147,7 +170,13 @@ LIBC_ACCEPT4_RET_TYPE tsocks_accept4(LIBC_ACCEPT4_SIG)
 	}
 
 libc_call:
-	return tsocks_libc_accept4(LIBC_ACCEPT4_ARGS);
+	ret = tsocks_libc_accept4(LIBC_ACCEPT4_ARGS);
+	if (ret >= 0) {
+		/* The new socket has the family and local address of the listener. */
+		fd_table_add(sockfd, FD_TABLE_LISTEN);
+		fd_table_set(ret, fd_table_get(sockfd) & ~FD_TABLE_LISTEN);
+	}
+	return ret;
 
 error:
 	return -1;
@@ -158,12 +187,17 @@ error:
  */
 LIBC_ACCEPT4_DECL
 {
-	if (!tsocks_libc_accept4) {
-		tsocks_initialize();
-		tsocks_libc_accept4 = tsocks_find_libc_symbol(
-				LIBC_ACCEPT4_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_ACCEPT4_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(accept4_entry, sockfd, addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_accept4(LIBC_ACCEPT4_ARGS);
+	trace_call(start, TRACE_ACCEPT4, sockfd, flags, ret, ret >= 0 ? addr : NULL);
+	TSOCKS_PROBE2(accept4_return, sockfd, ret);
 
-	return tsocks_accept4(LIBC_ACCEPT4_ARGS);
+	return ret;
 }
 #endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <common/fd-table.h>
+#include <common/log.h>
+#include <common/trace.h>
+
+#include "torsocks.h"
+
+/* bind(2) */
+TSOCKS_LIBC_DECL(bind, LIBC_BIND_RET_TYPE, LIBC_BIND_SIG)
+
+/*
+ * Torsocks call for bind(2).
+ *
+ * Binding is always allowed. It is only hijacked to remember the address the
+ * socket is bound to so listen() and accept() don't have to ask the kernel.
+ */
+LIBC_BIND_RET_TYPE tsocks_bind(LIBC_BIND_SIG)
+{
+	int ret;
+
+	ret = tsocks_libc_bind(LIBC_BIND_ARGS);
+	if (ret == 0 && addr && addrlen >= sizeof(addr->sa_family)) {
+		fd_table_add(sockfd, fd_table_classify_addr(addr));
+	}
+
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol bind(2).
+ */
+LIBC_BIND_DECL
+{
+	LIBC_BIND_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(bind_entry, sockfd, addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_bind(LIBC_BIND_ARGS);
+	trace_call(start, TRACE_BIND, sockfd, 0, ret, addr);
+	TSOCKS_PROBE2(bind_return, sockfd, ret);
+
+	return ret;
+}
@@ -15,8 +15,14 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/* For close_range(2) and closefrom(3). */
+#define _GNU_SOURCE
+
 #include <common/connection.h>
+#include <common/fd-table.h>
+#include <common/flight.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -24,14 +30,12 @@
 TSOCKS_LIBC_DECL(close, LIBC_CLOSE_RET_TYPE, LIBC_CLOSE_SIG)
 
 /*
- * Torsocks call for close(2).
+ * Forget everything known about the fd once it is closed.
  */
-LIBC_CLOSE_RET_TYPE tsocks_close(LIBC_CLOSE_SIG)
+static void forget_fd(int fd)
 {
 	struct connection *conn;
 
-	DBG("Close catched for fd %d", fd);
-
 	connection_registry_lock();
 	conn = connection_find(fd);
 	if (conn) {
@@ -49,9 +53,25 @@ LIBC_CLOSE_RET_TYPE tsocks_close(LIBC_CLOSE_SIG)
 	 */
 	if (conn) {
 		DBG("Close connection putting back ref");
+		flight_record(fd, FLIGHT_CLOSE, FLIGHT_BACKEND_SOCKET, 0, 0);
 		connection_put_ref(conn);
 	}
 
+	if (fd_table_get(fd) & FD_TABLE_UDP_DNS) {
+		udp_dns_unregister(fd);
+	}
+	fd_table_clear(fd);
+}
+
+/*
+ * Torsocks call for close(2).
+ */
+LIBC_CLOSE_RET_TYPE tsocks_close(LIBC_CLOSE_SIG)
+{
+	DBG("Close catched for fd %d", fd);
+
+	forget_fd(fd);
+
 	/* Return the original libc close. */
 	return tsocks_libc_close(fd);
 }
@@ -61,8 +81,123 @@ LIBC_CLOSE_RET_TYPE tsocks_close(LIBC_CLOSE_SIG)
  */
 LIBC_CLOSE_DECL
 {
-	if (!tsocks_libc_close) {
-		tsocks_initialize();
+	LIBC_CLOSE_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(close_entry, fd, 0);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_close(LIBC_CLOSE_ARGS);
+	trace_call(start, TRACE_CLOSE, fd, 0, ret, NULL);
+	TSOCKS_PROBE2(close_return, fd, ret);
+
+	return ret;
+}
+
+#if (defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM))
+
+/*
+ * Forget the fds of the range closed behind close(2). Only the fds of the
+ * table can be known, a connection always has its entry set.
+ */
+static void forget_fd_range(unsigned int first, unsigned int last)
+{
+	unsigned int fd;
+
+	if (last >= FD_TABLE_SIZE) {
+		last = FD_TABLE_SIZE - 1;
+	}
+	for (fd = first; fd <= last; fd++) {
+		if (fd_table_get(fd)) {
+			forget_fd(fd);
+		}
+	}
+}
+
+#endif /* HAVE_CLOSE_RANGE, HAVE_CLOSEFROM */
+
+#if (defined(HAVE_CLOSE_RANGE))
+
+/* close_range(2) */
+TSOCKS_LIBC_DECL(close_range, LIBC_CLOSE_RANGE_RET_TYPE, LIBC_CLOSE_RANGE_SIG)
+
+/*
+ * Torsocks call for close_range(2).
+ */
+LIBC_CLOSE_RANGE_RET_TYPE tsocks_close_range(LIBC_CLOSE_RANGE_SIG)
+{
+	int ret;
+
+	DBG("Close range catched for fd %u to %u", first, last);
+
+	ret = tsocks_libc_close_range(LIBC_CLOSE_RANGE_ARGS);
+#ifdef CLOSE_RANGE_CLOEXEC
+	/* Nothing is closed before an exec. */
+	if (flags & CLOSE_RANGE_CLOEXEC) {
+		return ret;
 	}
-	return tsocks_close(LIBC_CLOSE_ARGS);
+#endif
+	if (ret == 0) {
+		forget_fd_range(first, last);
+	}
+
+	return ret;
 }
+
+/*
+ * Libc hijacked symbol close_range(2).
+ */
+LIBC_CLOSE_RANGE_DECL
+{
+	LIBC_CLOSE_RANGE_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(close_range_entry, first, last);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_close_range(LIBC_CLOSE_RANGE_ARGS);
+	trace_call(start, TRACE_CLOSE_RANGE, first, last, ret, NULL);
+	TSOCKS_PROBE2(close_range_return, first, ret);
+
+	return ret;
+}
+
+#endif /* HAVE_CLOSE_RANGE */
+
+#if (defined(HAVE_CLOSEFROM))
+
+/* closefrom(3) */
+TSOCKS_LIBC_DECL(closefrom, LIBC_CLOSEFROM_RET_TYPE, LIBC_CLOSEFROM_SIG)
+
+/*
+ * Torsocks call for closefrom(3). It can't fail.
+ */
+LIBC_CLOSEFROM_RET_TYPE tsocks_closefrom(LIBC_CLOSEFROM_SIG)
+{
+	DBG("Closefrom catched for fd %d", lowfd);
+
+	tsocks_libc_closefrom(LIBC_CLOSEFROM_ARGS);
+	if (lowfd >= 0) {
+		forget_fd_range(lowfd, FD_TABLE_SIZE - 1);
+	}
+}
+
+/*
+ * Libc hijacked symbol closefrom(3).
+ */
+LIBC_CLOSEFROM_DECL
+{
+	uint64_t start;
+
+	TSOCKS_PROBE2(closefrom_entry, lowfd, 0);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	tsocks_closefrom(LIBC_CLOSEFROM_ARGS);
+	trace_call(start, TRACE_CLOSEFROM, lowfd, 0, 0, NULL);
+	TSOCKS_PROBE2(closefrom_return, lowfd, 0);
+}
+
+#endif /* HAVE_CLOSEFROM */
@@ -20,8 +20,11 @@
 #include <assert.h>
 
 #include <common/connection.h>
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/metrics.h>
 #include <common/onion.h>
+#include <common/trace.h>
 #include <common/utils.h>
 
 #include "torsocks.h"
@@ -65,12 +68,20 @@ static int validate_socket(int sockfd, const struct sockaddr *addr)
 		goto libc_call;
 	}
 
-	optlen = sizeof(sock_type);
-	ret = getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &sock_type, &optlen);
-	if (ret < 0) {
-		DBG("[connect] Fail getsockopt() on sock %d", sockfd);
-		errno = EBADF;
-		goto error;
+	if (fd_table_get(sockfd) & FD_TABLE_STREAM) {
+		/* Created by our socket() thus no need to ask the kernel. */
+		sock_type = SOCK_STREAM;
+	} else {
+		optlen = sizeof(sock_type);
+		ret = getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &sock_type, &optlen);
+		if (ret < 0) {
+			DBG("[connect] Fail getsockopt() on sock %d", sockfd);
+			errno = EBADF;
+			goto error;
+		}
+		if (IS_SOCK_STREAM(sock_type)) {
+			fd_table_add(sockfd, FD_TABLE_STREAM);
+		}
 	}
 
 	DBG("[connect] Socket family %s and type %d",
@@ -100,6 +111,38 @@ error:
 	return -1;
 }
 
+/*
+ * Connect a UDP socket allowed by AllowUDPDNS. Only a DNS server is accepted
+ * and the socket is connected to the responder instead. AF_UNSPEC dissolves
+ * the association as usual.
+ */
+static int connect_udp_dns(int sockfd, const struct sockaddr *addr,
+		socklen_t addrlen)
+{
+	int ret;
+	socklen_t to_len;
+	struct sockaddr_storage to;
+
+	if (!addr || addr->sa_family == AF_UNSPEC) {
+		ret = tsocks_libc_connect(sockfd, addr, addrlen);
+		if (ret == 0) {
+			udp_dns_set_connected(sockfd, 0);
+		}
+		return ret;
+	}
+
+	ret = udp_dns_redirect(sockfd, addr, addrlen, &to, &to_len);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	ret = tsocks_libc_connect(sockfd, (struct sockaddr *) &to, to_len);
+	if (ret == 0) {
+		udp_dns_set_connected(sockfd, 1);
+	}
+	return ret;
+}
+
 /*
  * Torsocks call for connect(2).
  */
@@ -111,6 +154,10 @@ LIBC_CONNECT_RET_TYPE tsocks_connect(LIBC_CONNECT_SIG)
 
 	DBG("Connect catched on fd %d", sockfd);
 
+	if (fd_table_get(sockfd) & FD_TABLE_UDP_DNS) {
+		return connect_udp_dns(LIBC_CONNECT_ARGS);
+	}
+
 	/*
 	 * Validate socket values in order to see if we can handle this connect
 	 * through Tor.
@@ -160,8 +207,7 @@ LIBC_CONNECT_RET_TYPE tsocks_connect(LIBC_CONNECT_SIG)
 		}
 		new_conn->dest_addr.domain = CONNECTION_DOMAIN_NAME;
 		new_conn->dest_addr.hostname.port = utils_get_port_from_addr(addr);
-		new_conn->dest_addr.hostname.addr = strdup(on_entry->hostname);
-		if (!new_conn->dest_addr.hostname.addr) {
+		if (connection_set_hostname(new_conn, on_entry->hostname) < 0) {
 			ret_errno = ENOMEM;
 			goto error_free;
 		}
@@ -207,11 +253,16 @@ LIBC_CONNECT_RET_TYPE tsocks_connect(LIBC_CONNECT_SIG)
 	connection_insert(new_conn);
 	connection_registry_unlock();
 
+	metrics_inc(METRICS_CONNECT_OK);
+
 	/* Flag errno for success */
 	ret = errno = 0;
 	return ret;
 
 libc_connect:
+	if (addr && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+		metrics_inc(METRICS_CONNECT_DIRECT);
+	}
 	return tsocks_libc_connect(LIBC_CONNECT_ARGS);
 
 error_free:
@@ -220,8 +271,12 @@ error_free:
 	 * refcount goes down to 0.
 	 */
 	connection_put_ref(new_conn);
+	metrics_inc(METRICS_CONNECT_FAILED);
 	errno = ret_errno;
+	return -1;
+
 error:
+	metrics_inc(METRICS_CONNECT_DENIED);
 	/* At this point, errno MUST be set to a valid connect() error value. */
 	return -1;
 }
@@ -231,7 +286,16 @@ error:
  */
 LIBC_CONNECT_DECL
 {
-	if (!tsocks_libc_connect)
-		tsocks_initialize();
-	return tsocks_connect(LIBC_CONNECT_ARGS);
+	LIBC_CONNECT_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(connect_entry, sockfd, addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_connect(LIBC_CONNECT_ARGS);
+	trace_call(start, TRACE_CONNECT, sockfd, 0, ret, addr);
+	TSOCKS_PROBE2(connect_return, sockfd, ret);
+
+	return ret;
 }
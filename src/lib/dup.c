@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* For F_DUPFD_CLOEXEC and fcntl64(2). */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdarg.h>
+
+#include <common/fd-table.h>
+#include <common/log.h>
+#include <common/trace.h>
+
+#include "torsocks.h"
+
+/*
+ * The dup family is only hijacked to keep the fd classification table in
+ * sync. The new fd refers to the same socket as the old one and, for dup2()
+ * and dup3(), the file previously using the new fd number is closed. fcntl()
+ * is part of it with F_DUPFD and F_DUPFD_CLOEXEC.
+ */
+
+/* dup(2) */
+TSOCKS_LIBC_DECL(dup, LIBC_DUP_RET_TYPE, LIBC_DUP_SIG)
+
+/*
+ * Give newfd the classification of oldfd, the UDP DNS socket included.
+ */
+static void dup_fd(int oldfd, int newfd)
+{
+	if ((fd_table_get(oldfd) | fd_table_get(newfd)) & FD_TABLE_UDP_DNS) {
+		udp_dns_dup(oldfd, newfd);
+	}
+	fd_table_dup(oldfd, newfd);
+}
+
+/*
+ * Torsocks call for dup(2).
+ */
+LIBC_DUP_RET_TYPE tsocks_dup(LIBC_DUP_SIG)
+{
+	int ret;
+
+	ret = tsocks_libc_dup(LIBC_DUP_ARGS);
+	if (ret >= 0) {
+		dup_fd(oldfd, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol dup(2).
+ */
+LIBC_DUP_DECL
+{
+	LIBC_DUP_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(dup_entry, oldfd, 0);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_dup(LIBC_DUP_ARGS);
+	trace_call(start, TRACE_DUP, oldfd, 0, ret, NULL);
+	TSOCKS_PROBE2(dup_return, oldfd, ret);
+
+	return ret;
+}
+
+/* dup2(2) */
+TSOCKS_LIBC_DECL(dup2, LIBC_DUP2_RET_TYPE, LIBC_DUP2_SIG)
+
+/*
+ * Torsocks call for dup2(2).
+ */
+LIBC_DUP2_RET_TYPE tsocks_dup2(LIBC_DUP2_SIG)
+{
+	int ret;
+
+	ret = tsocks_libc_dup2(LIBC_DUP2_ARGS);
+	if (ret >= 0) {
+		dup_fd(oldfd, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol dup2(2).
+ */
+LIBC_DUP2_DECL
+{
+	LIBC_DUP2_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(dup2_entry, oldfd, newfd);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_dup2(LIBC_DUP2_ARGS);
+	trace_call(start, TRACE_DUP2, oldfd, newfd, ret, NULL);
+	TSOCKS_PROBE2(dup2_return, oldfd, ret);
+
+	return ret;
+}
+
+#if (defined(__linux__))
+
+/* dup3(2) */
+TSOCKS_LIBC_DECL(dup3, LIBC_DUP3_RET_TYPE, LIBC_DUP3_SIG)
+
+/*
+ * Torsocks call for dup3(2).
+ */
+LIBC_DUP3_RET_TYPE tsocks_dup3(LIBC_DUP3_SIG)
+{
+	int ret;
+
+	ret = tsocks_libc_dup3(LIBC_DUP3_ARGS);
+	if (ret >= 0) {
+		dup_fd(oldfd, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol dup3(2).
+ */
+LIBC_DUP3_DECL
+{
+	LIBC_DUP3_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(dup3_entry, oldfd, newfd);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_dup3(LIBC_DUP3_ARGS);
+	trace_call(start, TRACE_DUP3, oldfd, newfd, ret, NULL);
+	TSOCKS_PROBE2(dup3_return, oldfd, ret);
+
+	return ret;
+}
+
+#endif /* __linux__ */
+
+/* fcntl(2) */
+TSOCKS_LIBC_DECL(fcntl, LIBC_FCNTL_RET_TYPE, LIBC_FCNTL_SIG)
+
+/*
+ * Return 1 if the fcntl(2) command duplicates the fd else 0.
+ */
+static int is_dupfd(int cmd)
+{
+	switch (cmd) {
+	case F_DUPFD:
+#ifdef F_DUPFD_CLOEXEC
+	case F_DUPFD_CLOEXEC:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Torsocks call for fcntl(2).
+ */
+LIBC_FCNTL_RET_TYPE tsocks_fcntl(int fd, int cmd, void *arg)
+{
+	int ret;
+
+	ret = tsocks_libc_fcntl(LIBC_FCNTL_ARGS);
+	if (ret >= 0 && is_dupfd(cmd)) {
+		dup_fd(fd, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol fcntl(2).
+ */
+LIBC_FCNTL_DECL
+{
+	LIBC_FCNTL_RET_TYPE ret;
+	uint64_t start;
+	va_list args;
+	void *arg;
+
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	TSOCKS_PROBE2(fcntl_entry, fd, cmd);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_fcntl(LIBC_FCNTL_ARGS);
+	trace_call(start, TRACE_FCNTL, fd, cmd, ret, NULL);
+	TSOCKS_PROBE2(fcntl_return, fd, ret);
+
+	return ret;
+}
+
+#if (defined(HAVE_FCNTL64))
+
+/* fcntl64(2) */
+TSOCKS_LIBC_DECL(fcntl64, LIBC_FCNTL64_RET_TYPE, LIBC_FCNTL64_SIG)
+
+/*
+ * Libc hijacked symbol fcntl64(2), what fcntl(2) is with a 64 bit off_t.
+ */
+LIBC_FCNTL64_DECL
+{
+	LIBC_FCNTL64_RET_TYPE ret;
+	uint64_t start;
+	va_list args;
+	void *arg;
+
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	TSOCKS_PROBE2(fcntl64_entry, fd, cmd);
+	tsocks_initialize_libc();
+
+	start = trace_begin();
+	ret = tsocks_libc_fcntl64(LIBC_FCNTL64_ARGS);
+	if (ret >= 0 && is_dupfd(cmd)) {
+		dup_fd(fd, ret);
+	}
+	trace_call(start, TRACE_FCNTL, fd, cmd, ret, NULL);
+	TSOCKS_PROBE2(fcntl64_return, fd, ret);
+
+	return ret;
+}
+
+#endif /* HAVE_FCNTL64 */
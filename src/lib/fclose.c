@@ -16,7 +16,9 @@
  */
 
 #include <common/connection.h>
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -64,6 +66,8 @@ LIBC_FCLOSE_RET_TYPE tsocks_fclose(LIBC_FCLOSE_SIG)
 		connection_put_ref(conn);
 	}
 
+	fd_table_clear(fd);
+
 	/* Return the original libc fclose. */
 	return tsocks_libc_fclose(fp);
 
@@ -76,6 +80,12 @@ error:
  */
 LIBC_FCLOSE_DECL
 {
+	LIBC_FCLOSE_RET_TYPE ret;
+	uint64_t start;
+	int fd = -1;
+
+	TSOCKS_PROBE2(fclose_entry, fp, 0);
+
 	/* fclose(3) is unique in that it does not call torsocks_initialize(), as
 	 * it is used from within the initialization routine to close the config
 	 * file/log file. This would be a problem, except that all of the global
@@ -84,5 +94,15 @@ LIBC_FCLOSE_DECL
 		tsocks_libc_fclose = tsocks_find_libc_symbol(
 				LIBC_FCLOSE_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
 	}
-	return tsocks_fclose(LIBC_FCLOSE_ARGS);
+
+	start = trace_begin();
+	if (start && fp) {
+		/* The stream is gone after the call. */
+		fd = fileno(fp);
+	}
+	ret = tsocks_fclose(LIBC_FCLOSE_ARGS);
+	trace_call(start, TRACE_FCLOSE, fd, 0, ret, NULL);
+	TSOCKS_PROBE2(fclose_return, fp, ret);
+
+	return ret;
 }
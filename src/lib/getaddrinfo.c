@@ -19,8 +19,11 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <string.h>
 
+#include <common/addrinfo.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -30,16 +33,16 @@ TSOCKS_LIBC_DECL(getaddrinfo, LIBC_GETADDRINFO_RET_TYPE,
 
 /*
  * Torsocks call for getaddrinfo(3).
+ *
+ * The result is built here from the addresses given or resolved by Tor, the
+ * libc is only used when there is no node to resolve. With AF_UNSPEC, a name
+ * resolved by Tor can have an IPv4 and an IPv6 address.
  */
 LIBC_GETADDRINFO_RET_TYPE tsocks_getaddrinfo(LIBC_GETADDRINFO_SIG)
 {
-	int ret, af;
-	struct in_addr addr4;
-	struct in6_addr addr6;
-	void *addr;
-	char *ip_str, ipv4[INET_ADDRSTRLEN], ipv6[INET6_ADDRSTRLEN];
-	socklen_t ip_str_size;
-	const char *tmp_node;
+	int ret, nb_addrs;
+	struct addrinfo_addr addrs[2];
+	struct addrinfo default_hints;
 
 	DBG("[getaddrinfo] Requesting %s hostname", node);
 
@@ -49,7 +52,6 @@ LIBC_GETADDRINFO_RET_TYPE tsocks_getaddrinfo(LIBC_GETADDRINFO_SIG)
 		 * return a valid socket address but NO external DNS resolution is
 		 * possible since there is no host name to resolve.
 		 */
-		tmp_node = node;
 		goto libc_call;
 	}
 
@@ -62,63 +64,91 @@ LIBC_GETADDRINFO_RET_TYPE tsocks_getaddrinfo(LIBC_GETADDRINFO_SIG)
 	 * 0;  ai_family to AF_UNSPEC; and ai_flags to (AI_V4MAPPED |
 	 * AI_ADDRCONFIG).
 	 *
-	 * This means that for sure the ai_family will be treated as AF_UNSPEC.
+	 * Those flags don't change anything for a single address so the name
+	 * is resolved through Tor like with AF_UNSPEC.
 	 */
 	if (!hints) {
-		tmp_node = node;
-		goto libc_call;
+		memset(&default_hints, 0, sizeof(default_hints));
+		default_hints.ai_family = AF_UNSPEC;
+		hints = &default_hints;
 	}
 
-	/* Use right domain for the next step. */
 	switch (hints->ai_family) {
-	default:
-		/* Default value is to use IPv4. */
+	case AF_UNSPEC:
 	case AF_INET:
-		addr = &addr4;
-		ip_str = ipv4;
-		ip_str_size = sizeof(ipv4);
-		af = AF_INET;
-		break;
 	case AF_INET6:
-		addr = &addr6;
-		ip_str = ipv6;
-		ip_str_size = sizeof(ipv6);
-		af = AF_INET6;
 		break;
+	default:
+		ret = EAI_FAMILY;
+		goto end;
 	}
 
-	ret = inet_pton(af, node, addr);
-	if (ret == 0) {
-		/* If AI_NUMERICHOST is set, return a error. */
-		if (hints->ai_flags & AI_NUMERICHOST) {
-			ret = EAI_NONAME;
-			goto error;
-		}
+	/* A numeric address of the requested family needs no resolution. */
+	nb_addrs = 1;
+	if (hints->ai_family != AF_INET6 &&
+			inet_pton(AF_INET, node, &addrs[0].u.v4) == 1) {
+		addrs[0].af = AF_INET;
+		goto build;
+	}
+	if (hints->ai_family != AF_INET &&
+			inet_pton(AF_INET6, node, &addrs[0].u.v6) == 1) {
+		addrs[0].af = AF_INET6;
+		goto build;
+	}
 
-		/* The node most probably is a DNS name. */
-		ret = tsocks_tor_resolve(af, node, addr);
-		if (ret < 0) {
-			ret = EAI_FAIL;
-			goto error;
-		}
+	/* If AI_NUMERICHOST is set, return a error. */
+	if (hints->ai_flags & AI_NUMERICHOST) {
+		ret = EAI_NONAME;
+		goto end;
+	}
 
-		(void) inet_ntop(af, addr, ip_str, ip_str_size);
-		tmp_node = ip_str;
-		DBG("[getaddrinfo] Node %s resolved to %s", node,tmp_node);
+	*res = addrinfo_cache_lookup(node, service, hints);
+	if (*res) {
+		DBG("[getaddrinfo] Node %s found in cache", node);
+		return 0;
+	}
+
+	/* The node most probably is a DNS name. */
+	if (hints->ai_family == AF_UNSPEC) {
+		nb_addrs = tsocks_tor_resolve_all(node, addrs);
+		ret = nb_addrs;
 	} else {
-		tmp_node = node;
-		DBG("[getaddrinfo] Node %s will be passed to the libc call", tmp_node);
+		addrs[0].af = hints->ai_family;
+		ret = tsocks_tor_resolve(hints->ai_family, node, &addrs[0].u);
+		if (ret == -EAFNOSUPPORT && hints->ai_family == AF_INET6 &&
+				(hints->ai_flags & AI_V4MAPPED)) {
+			/* No IPv6 address, return the IPv4 one mapped as asked. */
+			ret = tsocks_tor_resolve(AF_INET, node, &addrs[0].u.v6.s6_addr[12]);
+			if (ret == 0) {
+				memset(&addrs[0].u.v6.s6_addr[0], 0, 10);
+				memset(&addrs[0].u.v6.s6_addr[10], 0xff, 2);
+			}
+		}
+	}
+	if (ret < 0) {
+		/*
+		 * The name does not exist or not with an address of the family
+		 * asked.
+		 */
+		ret = (ret == -EAFNOSUPPORT || ret == -ENOENT) ? EAI_NONAME : EAI_FAIL;
+		goto end;
 	}
+	DBG("[getaddrinfo] Node %s resolved through Tor", node);
 
-libc_call:
-	ret = tsocks_libc_getaddrinfo(tmp_node, service, hints, res);
-	if (ret) {
-		goto error;
+	ret = addrinfo_build_list(node, addrs, nb_addrs, service, hints, res);
+	if (ret == 0) {
+		addrinfo_cache_insert(node, service, hints, *res);
 	}
+	goto end;
 
-	return 0;
+build:
+	ret = addrinfo_build_list(node, addrs, nb_addrs, service, hints, res);
+	goto end;
 
-error:
+libc_call:
+	ret = tsocks_libc_getaddrinfo(node, service, hints, res);
+
+end:
 	return ret;
 }
 
@@ -127,11 +157,20 @@ error:
  */
 LIBC_GETADDRINFO_DECL
 {
-	if (!tsocks_libc_getaddrinfo) {
-		tsocks_initialize();
-		tsocks_libc_getaddrinfo = tsocks_find_libc_symbol(
-				LIBC_GETADDRINFO_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
+	LIBC_GETADDRINFO_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(getaddrinfo_entry, node, service);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_getaddrinfo(LIBC_GETADDRINFO_ARGS);
+	if (start) {
+		trace_record_sockaddr(start, TRACE_GETADDRINFO, -1,
+				hints ? hints->ai_family : AF_UNSPEC, ret,
+				ret == 0 && *res ? (*res)->ai_addr : NULL, node);
 	}
+	TSOCKS_PROBE2(getaddrinfo_return, node, ret);
 
-	return tsocks_getaddrinfo(LIBC_GETADDRINFO_ARGS);
+	return ret;
 }
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* For struct gaicb. */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/addrinfo.h>
+#include <common/compat.h>
+#include <common/log.h>
+#include <common/macros.h>
+
+#include "torsocks.h"
+
+#if (defined(__GLIBC__))
+
+/*
+ * The requests of getaddrinfo_a(3) are run by a pool of worker threads
+ * calling the torsocks getaddrinfo(3), so through Tor and its result cache.
+ * A request identical to one being resolved waits for it and shares its
+ * result instead of being resolved again. The state of a request is in the
+ * __return field of its gaicb as with glibc, EAI_INPROGRESS until done.
+ */
+
+/* Worker threads at most, each resolves one name at a time. */
+#define GAI_MAX_WORKERS		16
+/* Requests queued at most before getaddrinfo_a() fails with EAI_AGAIN. */
+#define GAI_MAX_QUEUED		4096
+/* A worker idle for that long exits. */
+#define GAI_IDLE_SEC		10
+
+struct gai_batch;
+
+struct gai_job {
+	struct gaicb *req;
+	struct gai_batch *batch;
+	/*
+	 * Next job of the queue, of the active list for a job being resolved or
+	 * of the followers of its leader.
+	 */
+	struct gai_job *next;
+	/* Identical jobs completed with this one once resolved. */
+	struct gai_job *followers;
+};
+
+/* The requests of a getaddrinfo_a() call. */
+struct gai_batch {
+	/* Jobs not completed yet. */
+	unsigned int pending;
+	/* Set if the caller waits for the batch, GAI_WAIT. */
+	int waited;
+	/* Notification once every job is completed, GAI_NOWAIT. */
+	struct sigevent sev;
+	pid_t pid;
+	/* Next batch to notify. */
+	struct gai_batch *next;
+	struct gai_job jobs[];
+};
+
+/* Argument of a SIGEV_THREAD notification thread. */
+struct gai_notify {
+	void (*function)(union sigval);
+	union sigval value;
+};
+
+static struct {
+	tsocks_mutex_t lock;
+	/* Signaled when a job is queued. */
+	pthread_cond_t work;
+	/* Broadcast when a job is completed. */
+	pthread_cond_t done;
+	struct gai_job *queue;
+	struct gai_job *queue_tail;
+	unsigned int queued;
+	/* Jobs being resolved, leaders of their followers. */
+	struct gai_job *active;
+	unsigned int workers;
+	unsigned int busy;
+} gai = {
+	.lock = TSOCKS_MUTEX_INIT,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static TSOCKS_INIT_ONCE(gai_atfork_once);
+
+static int same_string(const char *a, const char *b)
+{
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/*
+ * Return 1 if both requests give the same result.
+ */
+static int same_request(const struct gaicb *a, const struct gaicb *b)
+{
+	const struct addrinfo *ha = a->ar_request, *hb = b->ar_request;
+
+	if (!same_string(a->ar_name, b->ar_name) ||
+			!same_string(a->ar_service, b->ar_service)) {
+		return 0;
+	}
+	if (!ha || !hb) {
+		return ha == hb;
+	}
+	return ha->ai_flags == hb->ai_flags && ha->ai_family == hb->ai_family &&
+		ha->ai_socktype == hb->ai_socktype &&
+		ha->ai_protocol == hb->ai_protocol;
+}
+
+static void queue_push(struct gai_job *job)
+{
+	job->next = NULL;
+	if (gai.queue_tail) {
+		gai.queue_tail->next = job;
+	} else {
+		gai.queue = job;
+	}
+	gai.queue_tail = job;
+	gai.queued++;
+}
+
+/*
+ * Remove a job from the queue.
+ *
+ * Return 1 if it was queued else 0.
+ */
+static int queue_remove(struct gai_job *job)
+{
+	struct gai_job **p, *prev = NULL;
+
+	for (p = &gai.queue; *p; prev = *p, p = &(*p)->next) {
+		if (*p != job) {
+			continue;
+		}
+		*p = job->next;
+		if (gai.queue_tail == job) {
+			gai.queue_tail = prev;
+		}
+		gai.queued--;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Take the next job to resolve from the queue. A job identical to one being
+ * resolved follows it instead. MUST be called with the lock held.
+ */
+static struct gai_job *take_job(void)
+{
+	struct gai_job *job, *leader;
+
+	while ((job = gai.queue)) {
+		(void) queue_remove(job);
+		job->followers = NULL;
+
+		/* Without a name the result is the one of the libc, not shared. */
+		for (leader = job->req->ar_name ? gai.active : NULL; leader;
+				leader = leader->next) {
+			if (same_request(leader->req, job->req)) {
+				break;
+			}
+		}
+		if (!leader) {
+			job->next = gai.active;
+			gai.active = job;
+			return job;
+		}
+		job->next = leader->followers;
+		leader->followers = job;
+	}
+	return NULL;
+}
+
+/*
+ * Set the result of a job. The batch is added to the notify list once all its
+ * jobs are completed and not waited for. MUST be called with the lock held.
+ */
+static void complete_job(struct gai_job *job, int ret, struct addrinfo *res,
+		struct gai_batch **notify)
+{
+	struct gai_batch *batch = job->batch;
+
+	job->req->ar_result = res;
+	__atomic_store_n(&job->req->__return, ret, __ATOMIC_RELEASE);
+
+	assert(batch->pending > 0);
+	if (--batch->pending == 0 && !batch->waited) {
+		batch->next = *notify;
+		*notify = batch;
+	}
+}
+
+/*
+ * Complete a resolved job and its followers with a copy of its result. MUST
+ * be called with the lock held.
+ */
+static void complete_leader(struct gai_job *leader, int ret,
+		struct addrinfo *res, struct gai_batch **notify)
+{
+	int job_ret;
+	struct gai_job **p, *job;
+	struct addrinfo *copy;
+
+	for (p = &gai.active; *p != leader; p = &(*p)->next) {
+		assert(*p);
+	}
+	*p = leader->next;
+
+	while ((job = leader->followers)) {
+		leader->followers = job->next;
+		copy = NULL;
+		job_ret = ret;
+		/* A named request is always built by torsocks, each gets a copy. */
+		if (ret == 0) {
+			copy = addrinfo_copy(res);
+			if (!copy) {
+				job_ret = EAI_MEMORY;
+			}
+		}
+		complete_job(job, job_ret, copy, notify);
+	}
+	complete_job(leader, ret, res, notify);
+}
+
+static void *notify_thread(void *data)
+{
+	struct gai_notify notify = *(struct gai_notify *) data;
+
+	free(data);
+	notify.function(notify.value);
+	return NULL;
+}
+
+/*
+ * Send the notification of a completed batch and free it. MUST be called
+ * without the lock since a notification thread can call back into torsocks.
+ */
+static void notify_batch(struct gai_batch *batch)
+{
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr, *attrp;
+	struct gai_notify *notify;
+
+	switch (batch->sev.sigev_notify) {
+	case SIGEV_SIGNAL:
+		(void) sigqueue(batch->pid, batch->sev.sigev_signo,
+				batch->sev.sigev_value);
+		break;
+	case SIGEV_THREAD:
+		notify = zmalloc(sizeof(*notify));
+		if (!notify) {
+			ERR("[getaddrinfo_a] Unable to allocate the notification");
+			break;
+		}
+		notify->function = batch->sev.sigev_notify_function;
+		notify->value = batch->sev.sigev_value;
+
+		attrp = batch->sev.sigev_notify_attributes;
+		if (!attrp) {
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			attrp = &attr;
+		}
+		ret = pthread_create(&thread, attrp, notify_thread, notify);
+		if (attrp == &attr) {
+			pthread_attr_destroy(&attr);
+		}
+		if (ret) {
+			ERR("[getaddrinfo_a] Unable to create the notification thread");
+			free(notify);
+		}
+		break;
+	default:
+		break;
+	}
+	free(batch);
+}
+
+static void notify_all(struct gai_batch *notify)
+{
+	struct gai_batch *batch;
+
+	while ((batch = notify)) {
+		notify = batch->next;
+		notify_batch(batch);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	int ret;
+	sigset_t set;
+	struct timespec deadline;
+	struct addrinfo *res;
+	struct gai_job *job;
+	struct gai_batch *notify;
+
+	/* Never steal a signal from the application. */
+	sigfillset(&set);
+	(void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	tsocks_mutex_lock(&gai.lock);
+	for (;;) {
+		job = take_job();
+		if (!job) {
+			(void) clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += GAI_IDLE_SEC;
+			ret = pthread_cond_timedwait(&gai.work, &gai.lock.mutex,
+					&deadline);
+			if (ret == ETIMEDOUT && !gai.queue) {
+				break;
+			}
+			continue;
+		}
+		gai.busy++;
+		tsocks_mutex_unlock(&gai.lock);
+
+		res = NULL;
+		ret = tsocks_getaddrinfo(job->req->ar_name, job->req->ar_service,
+				job->req->ar_request, &res);
+
+		notify = NULL;
+		tsocks_mutex_lock(&gai.lock);
+		gai.busy--;
+		complete_leader(job, ret, ret == 0 ? res : NULL, &notify);
+		pthread_cond_broadcast(&gai.done);
+		if (notify) {
+			tsocks_mutex_unlock(&gai.lock);
+			notify_all(notify);
+			tsocks_mutex_lock(&gai.lock);
+		}
+	}
+	gai.workers--;
+	tsocks_mutex_unlock(&gai.lock);
+
+	return NULL;
+}
+
+/*
+ * Start workers for the queued jobs no idle worker can take, up to the
+ * maximum. MUST be called with the lock held.
+ *
+ * Return the number of workers.
+ */
+static unsigned int start_workers(void)
+{
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (gai.workers < GAI_MAX_WORKERS &&
+			gai.workers - gai.busy < gai.queued) {
+		ret = pthread_create(&thread, &attr, worker_thread, NULL);
+		if (ret) {
+			ERR("[getaddrinfo_a] Unable to create a worker: %s",
+					strerror(ret));
+			break;
+		}
+		gai.workers++;
+	}
+	pthread_attr_destroy(&attr);
+
+	return gai.workers;
+}
+
+static void gai_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&gai.lock);
+}
+
+static void gai_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&gai.lock);
+}
+
+/*
+ * The workers are gone in the child. The jobs they were resolving are queued
+ * again for the workers started by the next call.
+ */
+static void gai_atfork_child(void)
+{
+	struct gai_job *leader, *job;
+
+	while ((leader = gai.active)) {
+		gai.active = leader->next;
+		while ((job = leader->followers)) {
+			leader->followers = job->next;
+			queue_push(job);
+		}
+		queue_push(leader);
+	}
+	gai.workers = 0;
+	gai.busy = 0;
+	(void) pthread_cond_init(&gai.work, NULL);
+	(void) pthread_cond_init(&gai.done, NULL);
+	tsocks_mutex_unlock(&gai.lock);
+}
+
+static void gai_atfork_init(void)
+{
+	(void) pthread_atfork(gai_atfork_prepare, gai_atfork_parent,
+			gai_atfork_child);
+}
+
+/*
+ * Torsocks call for getaddrinfo_a(3).
+ */
+LIBC_GETADDRINFO_A_RET_TYPE tsocks_getaddrinfo_a(LIBC_GETADDRINFO_A_SIG)
+{
+	int i, ret = 0;
+	struct gai_batch *batch;
+	struct gai_job *job;
+
+	if ((mode != GAI_WAIT && mode != GAI_NOWAIT) || nitems < 0) {
+		errno = EINVAL;
+		return EAI_SYSTEM;
+	}
+
+	tsocks_once(&gai_atfork_once, gai_atfork_init);
+
+	batch = zmalloc(sizeof(*batch) + nitems * sizeof(batch->jobs[0]));
+	if (!batch) {
+		return EAI_MEMORY;
+	}
+	batch->waited = mode == GAI_WAIT;
+	if (mode == GAI_NOWAIT && sevp) {
+		batch->sev = *sevp;
+	} else {
+		batch->sev.sigev_notify = SIGEV_NONE;
+	}
+	batch->pid = getpid();
+
+	tsocks_mutex_lock(&gai.lock);
+
+	if (gai.queued + nitems > GAI_MAX_QUEUED) {
+		ret = EAI_AGAIN;
+		goto error;
+	}
+	for (i = 0; i < nitems; i++) {
+		if (!list[i]) {
+			continue;
+		}
+		job = &batch->jobs[batch->pending++];
+		job->req = list[i];
+		job->batch = batch;
+		list[i]->ar_result = NULL;
+		__atomic_store_n(&list[i]->__return, EAI_INPROGRESS,
+				__ATOMIC_RELEASE);
+		queue_push(job);
+	}
+	DBG("[getaddrinfo_a] %u requests queued", batch->pending);
+
+	if (batch->pending == 0) {
+		/* Nothing to resolve, done already. */
+		tsocks_mutex_unlock(&gai.lock);
+		if (batch->waited) {
+			free(batch);
+		} else {
+			notify_batch(batch);
+		}
+		goto end;
+	}
+
+	if (start_workers() == 0) {
+		/* Nobody to run them. */
+		for (i = batch->pending - 1; i >= 0; i--) {
+			(void) queue_remove(&batch->jobs[i]);
+			batch->jobs[i].req->__return = EAI_AGAIN;
+		}
+		ret = EAI_AGAIN;
+		goto error;
+	}
+	pthread_cond_broadcast(&gai.work);
+
+	if (batch->waited) {
+		while (batch->pending > 0) {
+			pthread_cond_wait(&gai.done, &gai.lock.mutex);
+		}
+		free(batch);
+	}
+	tsocks_mutex_unlock(&gai.lock);
+
+end:
+	return ret;
+
+error:
+	tsocks_mutex_unlock(&gai.lock);
+	free(batch);
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol getaddrinfo_a(3).
+ */
+LIBC_GETADDRINFO_A_DECL
+{
+	LIBC_GETADDRINFO_A_RET_TYPE ret;
+
+	TSOCKS_PROBE2(getaddrinfo_a_entry, mode, nitems);
+	tsocks_initialize();
+	ret = tsocks_getaddrinfo_a(LIBC_GETADDRINFO_A_ARGS);
+	TSOCKS_PROBE2(getaddrinfo_a_return, mode, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for gai_suspend(3). A signal does not interrupt the wait,
+ * EAI_INTR is never returned.
+ */
+LIBC_GAI_SUSPEND_RET_TYPE tsocks_gai_suspend(LIBC_GAI_SUSPEND_SIG)
+{
+	int i, ret, any;
+	struct timespec deadline;
+
+	if (timeout) {
+		(void) clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout->tv_sec;
+		deadline.tv_nsec += timeout->tv_nsec;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	tsocks_mutex_lock(&gai.lock);
+	/* Jobs queued again in a forked child need workers. */
+	if (gai.queued > 0) {
+		(void) start_workers();
+	}
+	for (;;) {
+		any = 0;
+		for (i = 0; i < nitems; i++) {
+			if (!list[i]) {
+				continue;
+			}
+			any = 1;
+			if (__atomic_load_n(&list[i]->__return, __ATOMIC_ACQUIRE) !=
+					EAI_INPROGRESS) {
+				ret = 0;
+				goto end;
+			}
+		}
+		if (!any) {
+			ret = EAI_ALLDONE;
+			goto end;
+		}
+
+		if (!timeout) {
+			pthread_cond_wait(&gai.done, &gai.lock.mutex);
+		} else if (pthread_cond_timedwait(&gai.done, &gai.lock.mutex,
+					&deadline) == ETIMEDOUT) {
+			ret = EAI_AGAIN;
+			goto end;
+		}
+	}
+
+end:
+	tsocks_mutex_unlock(&gai.lock);
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol gai_suspend(3).
+ */
+LIBC_GAI_SUSPEND_DECL
+{
+	LIBC_GAI_SUSPEND_RET_TYPE ret;
+
+	TSOCKS_PROBE2(gai_suspend_entry, nitems, timeout);
+	tsocks_initialize();
+	ret = tsocks_gai_suspend(LIBC_GAI_SUSPEND_ARGS);
+	TSOCKS_PROBE2(gai_suspend_return, nitems, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for gai_error(3).
+ */
+LIBC_GAI_ERROR_RET_TYPE tsocks_gai_error(LIBC_GAI_ERROR_SIG)
+{
+	assert(req);
+
+	return __atomic_load_n(&req->__return, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Libc hijacked symbol gai_error(3).
+ */
+LIBC_GAI_ERROR_DECL
+{
+	LIBC_GAI_ERROR_RET_TYPE ret;
+
+	TSOCKS_PROBE2(gai_error_entry, req, 0);
+	tsocks_initialize();
+	ret = tsocks_gai_error(LIBC_GAI_ERROR_ARGS);
+	TSOCKS_PROBE2(gai_error_return, req, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for gai_cancel(3). Only a request still queued can be
+ * canceled, it then counts as completed for the notification of its batch.
+ */
+LIBC_GAI_CANCEL_RET_TYPE tsocks_gai_cancel(LIBC_GAI_CANCEL_SIG)
+{
+	int ret;
+	struct gai_job *job;
+	struct gai_batch *notify = NULL;
+
+	if (!req) {
+		return EAI_ALLDONE;
+	}
+
+	tsocks_mutex_lock(&gai.lock);
+	if (__atomic_load_n(&req->__return, __ATOMIC_ACQUIRE) != EAI_INPROGRESS) {
+		ret = EAI_ALLDONE;
+		goto end;
+	}
+
+	ret = EAI_NOTCANCELED;
+	for (job = gai.queue; job; job = job->next) {
+		if (job->req == req) {
+			(void) queue_remove(job);
+			complete_job(job, EAI_CANCELED, NULL, &notify);
+			pthread_cond_broadcast(&gai.done);
+			ret = EAI_CANCELED;
+			break;
+		}
+	}
+
+end:
+	tsocks_mutex_unlock(&gai.lock);
+	notify_all(notify);
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol gai_cancel(3).
+ */
+LIBC_GAI_CANCEL_DECL
+{
+	LIBC_GAI_CANCEL_RET_TYPE ret;
+
+	TSOCKS_PROBE2(gai_cancel_entry, req, 0);
+	tsocks_initialize();
+	ret = tsocks_gai_cancel(LIBC_GAI_CANCEL_ARGS);
+	TSOCKS_PROBE2(gai_cancel_return, req, ret);
+
+	return ret;
+}
+
+#endif /* __GLIBC__ */
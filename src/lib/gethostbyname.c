@@ -21,14 +21,35 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <common/defaults.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
-struct hostent tsocks_he;
-char *tsocks_he_addr_list[2];
-char tsocks_he_addr[INET_ADDRSTRLEN];
-char tsocks_he_name[255];
+/*
+ * Everything a host entry built by torsocks points to. The name follows.
+ */
+struct hostent_data {
+	char *addr_list[2];
+	char *aliases[1];
+	/* Large enough for an IPv6 address. */
+	char addr[16];
+	char name[];
+};
+
+/*
+ * The man page specifies that the non reentrant calls can return a pointer to
+ * static data meaning that the caller needs to copy the returned data and not
+ * forced to use free(). Like the glibc, that storage is per thread so
+ * concurrent callers don't overwrite each other's result. It is valid until
+ * the next call in the same thread. This also void the need of hijacking
+ * freehostent(3).
+ */
+static __thread struct {
+	struct hostent he;
+	char buf[sizeof(struct hostent_data) + DEFAULT_DOMAIN_NAME_SIZE + 1];
+} tsocks_he;
 
 /* gethostbyname(3) */
 TSOCKS_LIBC_DECL(gethostbyname, LIBC_GETHOSTBYNAME_RET_TYPE,
@@ -55,53 +76,69 @@ TSOCKS_LIBC_DECL(gethostbyaddr_r, LIBC_GETHOSTBYADDR_R_RET_TYPE,
 		LIBC_GETHOSTBYADDR_R_SIG)
 
 /*
- * Torsocks call for gethostbyname(3).
- *
- * NOTE: This call is OBSOLETE in the glibc.
+ * Return the host entry data in the given buffer aligned for its pointers or
+ * NULL if the buffer can't hold it with a name of the given length.
  */
-LIBC_GETHOSTBYNAME_RET_TYPE tsocks_gethostbyname(LIBC_GETHOSTBYNAME_SIG)
+static struct hostent_data *hostent_data(char *buf, size_t buflen,
+		size_t name_len)
 {
-	int ret;
-	uint32_t ip;
+	size_t pad = -(uintptr_t) buf & (sizeof(char *) - 1);
 
-	DBG("[gethostbyname] Requesting %s hostname", name);
-
-	if (!name) {
-		h_errno = HOST_NOT_FOUND;
-		goto error;
-	}
-
-	/* Resolve the given hostname through Tor. */
-	ret = tsocks_tor_resolve(AF_INET, name, &ip);
-	if (ret < 0) {
-		goto error;
+	if (buflen < pad + sizeof(struct hostent_data) + name_len + 1) {
+		return NULL;
 	}
+	return (struct hostent_data *) (buf + pad);
+}
 
-	/* Reset static host entry of tsocks. */
-	memset(&tsocks_he, 0, sizeof(tsocks_he));
-	memset(tsocks_he_addr_list, 0, sizeof(tsocks_he_addr_list));
-	memset(tsocks_he_addr, 0, sizeof(tsocks_he_addr));
+/*
+ * Fill a host entry with the given name and a single address of the given
+ * family. Everything it points to is stored in the given buffer so nothing
+ * is allocated.
+ *
+ * Return 0 on success or ERANGE if the buffer is too small.
+ */
+static int build_hostent(struct hostent *he, char *buf, size_t buflen,
+		const char *name, int af, const void *addr)
+{
+	size_t name_len, addr_len;
+	struct hostent_data *data;
 
-	/* Copy resolved network byte order IP address. */
-	memcpy(tsocks_he_addr, &ip, sizeof(tsocks_he_addr));
+	assert(he);
+	assert(name);
+	assert(addr);
 
-	tsocks_he_addr_list[0] = tsocks_he_addr;
-	tsocks_he_addr_list[1] = NULL;
+	name_len = strlen(name);
+	data = hostent_data(buf, buflen, name_len);
+	if (!data) {
+		return ERANGE;
+	}
 
-	tsocks_he.h_name = (char *) name;
-	tsocks_he.h_aliases = NULL;
-	tsocks_he.h_length = sizeof(in_addr_t);
-	tsocks_he.h_addrtype = AF_INET;
-	tsocks_he.h_addr_list = tsocks_he_addr_list;
+	addr_len = (af == AF_INET6) ? sizeof(struct in6_addr) :
+		sizeof(struct in_addr);
+	memcpy(data->addr, addr, addr_len);
+	memcpy(data->name, name, name_len + 1);
+	data->addr_list[0] = data->addr;
+	data->addr_list[1] = NULL;
+	data->aliases[0] = NULL;
 
-	DBG("[gethostbyname] Hostname %s resolved to %u.%u.%u.%u", name,
-			ip & 0XFF, (ip >> 8) & 0XFF, (ip >> 16) & 0XFF, (ip >> 24) & 0xFF);
+	he->h_name = data->name;
+	he->h_aliases = data->aliases;
+	he->h_addrtype = af;
+	he->h_length = addr_len;
+	he->h_addr_list = data->addr_list;
 
-	errno = 0;
-	return &tsocks_he;
+	return 0;
+}
 
-error:
-	return NULL;
+/*
+ * Torsocks call for gethostbyname(3).
+ *
+ * NOTE: This call is OBSOLETE in the glibc. The result is in the storage of
+ * the calling thread.
+ */
+LIBC_GETHOSTBYNAME_RET_TYPE tsocks_gethostbyname(LIBC_GETHOSTBYNAME_SIG)
+{
+	return tsocks_gethostbyname2(name, AF_INET);
 }
 
 /*
@@ -109,28 +146,38 @@ error:
  */
 LIBC_GETHOSTBYNAME_DECL
 {
+	LIBC_GETHOSTBYNAME_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(gethostbyname_entry, name, 0);
 	tsocks_initialize();
-	return tsocks_gethostbyname(LIBC_GETHOSTBYNAME_ARGS);
+
+	start = trace_begin();
+	ret = tsocks_gethostbyname(LIBC_GETHOSTBYNAME_ARGS);
+	if (start) {
+		trace_record_hostent(start, TRACE_GETHOSTBYNAME, 0, ret, name);
+	}
+	TSOCKS_PROBE2(gethostbyname_return, name, ret);
+
+	return ret;
 }
 
 /*
  * Torsocks call for gethostbyname2(3).
  *
- * This call, like gethostbyname(), returns pointer to static data thus is
- * absolutely not reentrant.
+ * Like gethostbyname(), this returns a pointer to the storage of the calling
+ * thread thus is not reentrant but safe to use from multiple threads.
  */
 LIBC_GETHOSTBYNAME2_RET_TYPE tsocks_gethostbyname2(LIBC_GETHOSTBYNAME2_SIG)
 {
-	/*
-	 * For now, there is no way of resolving a domain name to IPv6 through Tor
-	 * so only accept INET request thus using the original gethostbyname().
-	 */
-	if (af != AF_INET) {
-		h_errno = HOST_NOT_FOUND;
-		return NULL;
-	}
+	struct hostent *result;
 
-	return tsocks_gethostbyname(name);
+	(void) tsocks_gethostbyname2_r(name, af, &tsocks_he.he, tsocks_he.buf,
+			sizeof(tsocks_he.buf), &result, &h_errno);
+	if (result) {
+		errno = 0;
+	}
+	return result;
 }
 
 /*
@@ -138,65 +185,38 @@ LIBC_GETHOSTBYNAME2_RET_TYPE tsocks_gethostbyname2(LIBC_GETHOSTBYNAME2_SIG)
  */
 LIBC_GETHOSTBYNAME2_DECL
 {
+	LIBC_GETHOSTBYNAME2_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(gethostbyname2_entry, name, af);
 	tsocks_initialize();
-	return tsocks_gethostbyname2(LIBC_GETHOSTBYNAME2_ARGS);
+
+	start = trace_begin();
+	ret = tsocks_gethostbyname2(LIBC_GETHOSTBYNAME2_ARGS);
+	if (start) {
+		trace_record_hostent(start, TRACE_GETHOSTBYNAME2, af, ret, name);
+	}
+	TSOCKS_PROBE2(gethostbyname2_return, name, ret);
+
+	return ret;
 }
 
 /*
  * Torsocks call for gethostbyaddr(3).
  *
  * NOTE: This call is OBSOLETE in the glibc. Also, this call returns a pointer
- * to a static pointer.
+ * to the storage of the calling thread.
  */
 LIBC_GETHOSTBYADDR_RET_TYPE tsocks_gethostbyaddr(LIBC_GETHOSTBYADDR_SIG)
 {
-	int ret;
-	char *hostname;
-
-	/*
-	 * Tor does not allow to resolve to an IPv6 pointer so only accept inet
-	 * return address.
-	 */
-	if (!addr || type != AF_INET) {
-		h_errno = HOST_NOT_FOUND;
-		goto error;
-	}
-
-	DBG("[gethostbyaddr] Requesting address %s of len %d and type %d",
-			inet_ntoa(*((struct in_addr *) addr)), len, type);
+	struct hostent *result;
 
-	/* Reset static host entry of tsocks. */
-	memset(&tsocks_he, 0, sizeof(tsocks_he));
-	memset(tsocks_he_addr_list, 0, sizeof(tsocks_he_addr_list));
-	memset(tsocks_he_name, 0, sizeof(tsocks_he_name));
-
-	ret = tsocks_tor_resolve_ptr(addr, &hostname, type);
-	if (ret < 0) {
-		const char *ret_str;
-
-		ret_str = inet_ntop(type, addr, tsocks_he_name,
-				sizeof(tsocks_he_name));
-		if (!ret_str) {
-			h_errno = HOST_NOT_FOUND;
-			goto error;
-		}
-	} else {
-		memcpy(tsocks_he_name, hostname, sizeof(tsocks_he_name));
-		free(hostname);
-		tsocks_he_addr_list[0] = (char *) addr;
+	(void) tsocks_gethostbyaddr_r(addr, len, type, &tsocks_he.he,
+			tsocks_he.buf, sizeof(tsocks_he.buf), &result, &h_errno);
+	if (result) {
+		errno = 0;
 	}
-
-	tsocks_he.h_name = tsocks_he_name;
-	tsocks_he.h_aliases = NULL;
-	tsocks_he.h_length = strlen(tsocks_he_name);
-	tsocks_he.h_addrtype = type;
-	tsocks_he.h_addr_list = tsocks_he_addr_list;
-
-	errno = 0;
-	return &tsocks_he;
-
-error:
-	return NULL;
+	return result;
 }
 
 /*
@@ -204,32 +224,36 @@ error:
  */
 LIBC_GETHOSTBYADDR_DECL
 {
+	LIBC_GETHOSTBYADDR_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(gethostbyaddr_entry, addr, type);
 	tsocks_initialize();
-	return tsocks_gethostbyaddr(LIBC_GETHOSTBYADDR_ARGS);
+
+	start = trace_begin();
+	ret = tsocks_gethostbyaddr(LIBC_GETHOSTBYADDR_ARGS);
+	if (start) {
+		trace_record(start, TRACE_GETHOSTBYADDR, -1, type, ret ? 0 : -1, type,
+				addr, 0, NULL);
+	}
+	TSOCKS_PROBE2(gethostbyaddr_return, addr, ret);
+
+	return ret;
 }
 
 /*
  * Torsocks call for gethostbyaddr_r(3).
  *
- * NOTE: GNU extension. Reentrant version.
+ * NOTE: GNU extension. Reentrant version. When Tor can't resolve the address,
+ * the entry is named by the address in numbers and dots notation.
  */
 LIBC_GETHOSTBYADDR_R_RET_TYPE tsocks_gethostbyaddr_r(LIBC_GETHOSTBYADDR_R_SIG)
 {
 	int ret;
-	struct hostent *he = NULL;
-
-	struct data {
-		char *hostname;
-		char *addr_list[2];
-		char padding[];
-	} *data;
+	char *hostname = NULL;
+	char numeric[INET_ADDRSTRLEN];
 
-	if (buflen < sizeof(struct data)) {
-		ret = ERANGE;
-		goto error;
-	}
-	data = (struct data *) buf;
-	memset(data, 0, sizeof(*data));
+	*result = NULL;
 
 	/*
 	 * Tor does not allow to resolve to an IPv6 pointer so only accept inet
@@ -237,69 +261,41 @@ LIBC_GETHOSTBYADDR_R_RET_TYPE tsocks_gethostbyaddr_r(LIBC_GETHOSTBYADDR_R_SIG)
 	 */
 	if (!addr || type != AF_INET) {
 		ret = HOST_NOT_FOUND;
-		if (h_errnop) {
-			*h_errnop = HOST_NOT_FOUND;
-		}
+		*h_errnop = HOST_NOT_FOUND;
 		goto error;
 	}
 
 	DBG("[gethostbyaddr_r] Requesting address %s of len %d and type %d",
 			inet_ntoa(*((struct in_addr *) addr)), len, type);
 
-	/* This call allocates hostname. On error, it's untouched. */
-	ret = tsocks_tor_resolve_ptr(addr, &data->hostname, type);
-	if (ret < 0) {
-		const char *ret_str;
-
-		ret_str = inet_ntop(type, addr, buf, buflen);
-		if (!ret_str) {
-			ret = HOST_NOT_FOUND;
-			if (errno == ENOSPC) {
-				ret = ERANGE;
-			}
-			if (h_errnop) {
-				*h_errnop = HOST_NOT_FOUND;
-			}
-			goto error;
-		}
-	}
-
-	/* Ease our life a bit. */
-	he = hret;
-
-	if (!he) {
-		ret = NO_RECOVERY;
-		if (h_errnop) {
-			*h_errnop = NO_RECOVERY;
-		}
+	/* Not even room for the address as name, don't ask Tor. */
+	if (!hostent_data(buf, buflen, INET_ADDRSTRLEN)) {
+		ret = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
 		goto error;
 	}
 
-	if (data->hostname) {
-		he->h_name = data->hostname;
-	} else {
-		ret = NO_RECOVERY;
-		if (h_errnop) {
-			*h_errnop = NO_RECOVERY;
-		}
+	/* This call allocates hostname. On error, it's untouched. */
+	ret = tsocks_tor_resolve_ptr(addr, &hostname, type);
+	if (ret < 0 && !inet_ntop(type, addr, numeric, sizeof(numeric))) {
+		ret = HOST_NOT_FOUND;
+		*h_errnop = HOST_NOT_FOUND;
 		goto error;
 	}
 
-	he->h_aliases = NULL;
-	he->h_length = strlen(he->h_name);
-	/* Assign the address list within the data of the given buffer. */
-	data->addr_list[0] = (char *) addr;
-	data->addr_list[1] = NULL;
-	he->h_addr_list = data->addr_list;
-
-	if (result) {
-		*result = he;
+	ret = build_hostent(hret, buf, buflen, hostname ? hostname : numeric, type,
+			addr);
+	free(hostname);
+	if (ret) {
+		*h_errnop = NETDB_INTERNAL;
+		goto error;
 	}
-
-	/* Everything went good. */
-	ret = 0;
+	*result = hret;
 
 error:
+	if (ret == ERANGE) {
+		errno = ERANGE;
+	}
 	return ret;
 }
 
@@ -308,113 +304,125 @@ error:
  */
 LIBC_GETHOSTBYADDR_R_DECL
 {
+	LIBC_GETHOSTBYADDR_R_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(gethostbyaddr_r_entry, addr, type);
 	tsocks_initialize();
-	return tsocks_gethostbyaddr_r(LIBC_GETHOSTBYADDR_R_ARGS);
+
+	start = trace_begin();
+	ret = tsocks_gethostbyaddr_r(LIBC_GETHOSTBYADDR_R_ARGS);
+	if (start) {
+		trace_record(start, TRACE_GETHOSTBYADDR_R, -1, type, ret, type, addr, 0,
+				NULL);
+	}
+	TSOCKS_PROBE2(gethostbyaddr_r_return, addr, ret);
+
+	return ret;
 }
 
 /*
- * Torsocks call for gethostbyname(3).
+ * Torsocks call for gethostbyname_r(3).
  *
  * NOTE: GNU extension. Reentrant version.
  */
 LIBC_GETHOSTBYNAME_R_RET_TYPE tsocks_gethostbyname_r(LIBC_GETHOSTBYNAME_R_SIG)
+{
+	return tsocks_gethostbyname2_r(name, AF_INET, hret, buf, buflen, result,
+			h_errnop);
+}
+
+/*
+ * Libc hijacked symbol gethostbyname_r(3).
+ */
+LIBC_GETHOSTBYNAME_R_DECL
+{
+	LIBC_GETHOSTBYNAME_R_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(gethostbyname_r_entry, name, 0);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_gethostbyname_r(LIBC_GETHOSTBYNAME_R_ARGS);
+	if (start) {
+		trace_record_hostent(start, TRACE_GETHOSTBYNAME_R, 0,
+				ret == 0 ? *result : NULL, name);
+	}
+	TSOCKS_PROBE2(gethostbyname_r_return, name, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for gethostbyname2_r(3).
+ *
+ * NOTE: GNU extension. Reentrant version. Every other gethostbyname call ends
+ * up here.
+ */
+LIBC_GETHOSTBYNAME2_R_RET_TYPE tsocks_gethostbyname2_r(LIBC_GETHOSTBYNAME2_R_SIG)
 {
 	int ret;
-	/* This call is always using AF_INET. */
-	uint32_t ip;
-	const char *ret_str;
-	struct hostent *he = NULL;
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	} ip;
+	char ip_str[INET6_ADDRSTRLEN];
 
-	struct data {
-		char addr[INET_ADDRSTRLEN];
-		char *addr_list[2];
-		char padding[];
-	} *data;
+	DBG("[gethostbyname2_r] Requesting %s hostname", name);
 
-	DBG("[gethostbyname_r] Requesting %s hostname", name);
+	*result = NULL;
 
-	if (!name) {
+	if (!name || (af != AF_INET && af != AF_INET6)) {
 		*h_errnop = HOST_NOT_FOUND;
 		ret = -1;
 		goto error;
 	}
 
-	if (buflen < sizeof(*data)) {
+	/* Don't ask Tor for an answer that can't be returned. */
+	if (!hostent_data(buf, buflen, strlen(name))) {
 		ret = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
+		errno = ERANGE;
 		goto error;
 	}
 
 	/* Resolve the given hostname through Tor. */
-	ret = tsocks_tor_resolve(AF_INET, name, &ip);
+	ret = tsocks_tor_resolve(af, name, &ip);
 	if (ret < 0) {
+		*h_errnop = (ret == -EAFNOSUPPORT) ? NO_DATA : HOST_NOT_FOUND;
 		goto error;
 	}
 
-	data = (struct data *) buf;
-	memset(data, 0, sizeof(*data));
-	/* Ease our life a bit. */
-	he = hret;
-
-	ret_str = inet_ntop(AF_INET, &ip, data->addr, sizeof(data->addr));
-	if (!ret_str) {
-		PERROR("inet_ntop");
-		*h_errnop = NO_ADDRESS;
-		goto error;
-	}
-
-	memcpy(data->addr, &ip, sizeof(ip));
-	data->addr_list[0] = data->addr;
-	data->addr_list[1] = NULL;
-	he->h_addr_list = data->addr_list;
-
-	he->h_name = (char *) name;
-	he->h_aliases = NULL;
-	he->h_length = sizeof(in_addr_t);
-	he->h_addrtype = AF_INET;
+	ret = build_hostent(hret, buf, buflen, name, af, &ip);
+	assert(ret == 0);
+	*result = hret;
 
-	DBG("[gethostbyname_r] Hostname %s resolved to %u.%u.%u.%u", name,
-			ip & 0XFF, (ip >> 8) & 0XFF, (ip >> 16) & 0XFF, (ip >> 24) & 0xFF);
+	DBG("[gethostbyname2_r] Hostname %s resolved to %s", name,
+			inet_ntop(af, &ip, ip_str, sizeof(ip_str)));
 
 error:
 	return ret;
 }
 
 /*
- * Libc hijacked symbol gethostbyname_r(3).
+ * Libc hijacked symbol gethostbyname2_r(3).
  */
-LIBC_GETHOSTBYNAME_R_DECL
+LIBC_GETHOSTBYNAME2_R_DECL
 {
-	tsocks_initialize();
-	return tsocks_gethostbyname_r(LIBC_GETHOSTBYNAME_R_ARGS);
-}
+	LIBC_GETHOSTBYNAME2_R_RET_TYPE ret;
+	uint64_t start;
 
-/*
- * Torsocks call for gethostbyname(3).
- *
- * NOTE: GNU extension. Reentrant version.
- */
-LIBC_GETHOSTBYNAME2_R_RET_TYPE tsocks_gethostbyname2_r(LIBC_GETHOSTBYNAME2_R_SIG)
-{
-	DBG("[gethostbyname2_r] Requesting %s hostname", name);
+	TSOCKS_PROBE2(gethostbyname2_r_entry, name, af);
+	tsocks_initialize();
 
-	/*
-	 * For now, there is no way of resolving a domain name to IPv6 through Tor
-	 * so only accept INET request thus using the original gethostbyname().
-	 */
-	if (af != AF_INET) {
-		*h_errnop = HOST_NOT_FOUND;
-		return -1;
+	start = trace_begin();
+	ret = tsocks_gethostbyname2_r(LIBC_GETHOSTBYNAME2_R_ARGS);
+	if (start) {
+		trace_record_hostent(start, TRACE_GETHOSTBYNAME2_R, af,
+				ret == 0 ? *result : NULL, name);
 	}
+	TSOCKS_PROBE2(gethostbyname2_r_return, name, ret);
 
-	return tsocks_gethostbyname_r(name, hret, buf, buflen, result,
-			h_errnop);
-}
-
-/*
- * Libc hijacked symbol gethostbyname2_r(3).
- */
-LIBC_GETHOSTBYNAME2_R_DECL
-{
-	tsocks_initialize();
-	return tsocks_gethostbyname2_r(LIBC_GETHOSTBYNAME2_R_ARGS);
+	return ret;
 }
@@ -18,7 +18,9 @@
 #include <arpa/inet.h>
 #include <assert.h>
 
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -37,6 +39,16 @@ LIBC_GETPEERNAME_RET_TYPE tsocks_getpeername(LIBC_GETPEERNAME_SIG)
 
 	DBG("[getpeername] Requesting address on socket %d", sockfd);
 
+	if (fd_table_get(sockfd) & FD_TABLE_UDP_DNS) {
+		/* Connected to the responder, the DNS server is what was asked. */
+		ret = udp_dns_getpeername(sockfd, addr, addrlen);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		return 0;
+	}
+
 	connection_registry_lock();
 	conn = connection_find(sockfd);
 	if (!conn) {
@@ -97,11 +109,16 @@ libc:
  */
 LIBC_GETPEERNAME_DECL
 {
-	if (!tsocks_libc_getpeername) {
-		tsocks_initialize();
-		tsocks_libc_getpeername = tsocks_find_libc_symbol(
-				LIBC_GETPEERNAME_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_GETPEERNAME_RET_TYPE ret;
+	uint64_t start;
 
-	return tsocks_getpeername(LIBC_GETPEERNAME_ARGS);
+	TSOCKS_PROBE2(getpeername_entry, sockfd, addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_getpeername(LIBC_GETPEERNAME_ARGS);
+	trace_call(start, TRACE_GETPEERNAME, sockfd, 0, ret, NULL);
+	TSOCKS_PROBE2(getpeername_return, sockfd, ret);
+
+	return ret;
 }
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+
+#include <common/log.h>
+#include <common/trace.h>
+
+#include "torsocks.h"
+
+#if (defined(__linux__))
+
+/*
+ * Applications using io_uring(7) never call connect(2). The CONNECT request
+ * is written in memory shared with the kernel and, with IORING_SETUP_SQPOLL,
+ * is consumed by a kernel thread without any system call at all. There is no
+ * point where torsocks could safely rewrite it before it hits the network so
+ * the creation of a ring is denied instead.
+ *
+ * Every user of io_uring we know of (liburing users, libuv, tokio, ...) falls
+ * back to poll/epoll and the normal socket calls when the ring can't be
+ * created, which torsocks does handle.
+ *
+ * The liburing functions return a negative errno value thus do the same and
+ * also set errno for the older versions that return -1.
+ */
+static int deny_ring(const char *name)
+{
+	DBG("[io_uring] %s is not supported by torsocks. Denying the call", name);
+	errno = ENOSYS;
+	return -ENOSYS;
+}
+
+/*
+ * Torsocks call for io_uring_setup(2) of liburing.
+ */
+LIBC_IO_URING_SETUP_RET_TYPE tsocks_io_uring_setup(LIBC_IO_URING_SETUP_SIG)
+{
+	return deny_ring("io_uring_setup");
+}
+
+/*
+ * Libc hijacked symbol io_uring_setup(2).
+ */
+LIBC_IO_URING_SETUP_DECL
+{
+	LIBC_IO_URING_SETUP_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(io_uring_setup_entry, entries, p);
+
+	start = trace_begin();
+	ret = tsocks_io_uring_setup(LIBC_IO_URING_SETUP_ARGS);
+	trace_call(start, TRACE_IO_URING_SETUP, entries, 0, ret, NULL);
+	TSOCKS_PROBE2(io_uring_setup_return, entries, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for io_uring_queue_init(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_RET_TYPE tsocks_io_uring_queue_init(
+		LIBC_IO_URING_QUEUE_INIT_SIG)
+{
+	return deny_ring("io_uring_queue_init");
+}
+
+/*
+ * Libc hijacked symbol io_uring_queue_init(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_DECL
+{
+	LIBC_IO_URING_QUEUE_INIT_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(io_uring_queue_init_entry, entries, ring);
+
+	start = trace_begin();
+	ret = tsocks_io_uring_queue_init(LIBC_IO_URING_QUEUE_INIT_ARGS);
+	trace_call(start, TRACE_IO_URING_QUEUE_INIT, entries, 0, ret, NULL);
+	TSOCKS_PROBE2(io_uring_queue_init_return, entries, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for io_uring_queue_init_params(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_PARAMS_RET_TYPE tsocks_io_uring_queue_init_params(
+		LIBC_IO_URING_QUEUE_INIT_PARAMS_SIG)
+{
+	return deny_ring("io_uring_queue_init_params");
+}
+
+/*
+ * Libc hijacked symbol io_uring_queue_init_params(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_PARAMS_DECL
+{
+	LIBC_IO_URING_QUEUE_INIT_PARAMS_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(io_uring_queue_init_params_entry, entries, ring);
+
+	start = trace_begin();
+	ret = tsocks_io_uring_queue_init_params(
+			LIBC_IO_URING_QUEUE_INIT_PARAMS_ARGS);
+	trace_call(start, TRACE_IO_URING_QUEUE_INIT, entries, 0, ret, NULL);
+	TSOCKS_PROBE2(io_uring_queue_init_params_return, entries, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for io_uring_queue_init_mem(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_MEM_RET_TYPE tsocks_io_uring_queue_init_mem(
+		LIBC_IO_URING_QUEUE_INIT_MEM_SIG)
+{
+	return deny_ring("io_uring_queue_init_mem");
+}
+
+/*
+ * Libc hijacked symbol io_uring_queue_init_mem(3).
+ */
+LIBC_IO_URING_QUEUE_INIT_MEM_DECL
+{
+	LIBC_IO_URING_QUEUE_INIT_MEM_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(io_uring_queue_init_mem_entry, entries, ring);
+
+	start = trace_begin();
+	ret = tsocks_io_uring_queue_init_mem(LIBC_IO_URING_QUEUE_INIT_MEM_ARGS);
+	trace_call(start, TRACE_IO_URING_QUEUE_INIT, entries, 0, ret, NULL);
+	TSOCKS_PROBE2(io_uring_queue_init_mem_return, entries, ret);
+
+	return ret;
+}
+
+#endif /* __linux__ */
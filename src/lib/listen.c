@@ -17,6 +17,8 @@
 
 #include <assert.h>
 
+#include <common/fd-table.h>
+#include <common/trace.h>
 #include <common/utils.h>
 
 #include "torsocks.h"
@@ -30,31 +32,36 @@ LIBC_LISTEN_RET_TYPE tsocks_listen(LIBC_LISTEN_SIG)
 {
 	int ret;
 	socklen_t addrlen;
-	struct sockaddr sa;
+	struct sockaddr_storage sa;
 
 	if (tsocks_config.allow_inbound) {
 		/* Allowed by the user so directly go to the libc. */
 		goto libc_call;
 	}
 
+	/*
+	 * Always ask the kernel, a stale fd table entry must never allow an
+	 * inbound connection.
+	 */
 	addrlen = sizeof(sa);
 
-	ret = getsockname(sockfd, &sa, &addrlen);
+	ret = getsockname(sockfd, (struct sockaddr *) &sa, &addrlen);
 	if (ret < 0) {
 		PERROR("[listen] getsockname");
 		goto error;
 	}
+	fd_table_add(sockfd, fd_table_classify_addr((struct sockaddr *) &sa));
 
 	/*
 	 * Listen () on a Unix socket is allowed else we are going to try to match
 	 * it on INET localhost socket.
 	 */
-	if (sa.sa_family == AF_UNIX) {
+	if (sa.ss_family == AF_UNIX) {
 		goto libc_call;
 	}
 
 	/* Inbound localhost connections are allowed. */
-	ret = utils_sockaddr_is_localhost(&sa);
+	ret = utils_sockaddr_is_localhost((struct sockaddr *) &sa);
 	if (!ret) {
 		/*
 		 * Listen is completely denied here since this means that the
@@ -68,7 +75,11 @@ LIBC_LISTEN_RET_TYPE tsocks_listen(LIBC_LISTEN_SIG)
 
 libc_call:
 	DBG("[listen] Passing listen fd %d to libc", sockfd);
-	return tsocks_libc_listen(LIBC_LISTEN_ARGS);
+	ret = tsocks_libc_listen(LIBC_LISTEN_ARGS);
+	if (ret == 0) {
+		fd_table_add(sockfd, FD_TABLE_LISTEN);
+	}
+	return ret;
 
 error:
 	return -1;
@@ -79,11 +90,16 @@ error:
  */
 LIBC_LISTEN_DECL
 {
-	if (!tsocks_libc_listen) {
-		tsocks_initialize();
-		tsocks_libc_listen = tsocks_find_libc_symbol(
-				LIBC_LISTEN_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_LISTEN_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(listen_entry, sockfd, backlog);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_listen(LIBC_LISTEN_ARGS);
+	trace_call(start, TRACE_LISTEN, sockfd, backlog, ret, NULL);
+	TSOCKS_PROBE2(listen_return, sockfd, ret);
 
-	return tsocks_listen(LIBC_LISTEN_ARGS);
+	return ret;
 }
@@ -15,34 +15,194 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/* For struct mmsghdr. */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/macros.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
+/* recvfrom(2) */
+TSOCKS_LIBC_DECL(recvfrom, LIBC_RECVFROM_RET_TYPE, LIBC_RECVFROM_SIG)
+
 /* recvmsg(2) */
 TSOCKS_LIBC_DECL(recvmsg, LIBC_RECVMSG_RET_TYPE, LIBC_RECVMSG_SIG)
 
 /*
- * This is the maximum hardcoded amount of fd that is possible to pass through
- * a Unix socket in the Linux kernel. On FreeBSD for instance it's MLEN which
- * is defined to MSIZE (256) minus the msg header size thus way below this
- * Linux limit. Such a shame there is no way to dynamically get that value or
- * get it in an exposed ABI...
+ * Torsocks call for recvfrom(2)
+ *
+ * Only the UDP sockets allowed by AllowUDPDNS need anything, the replies of
+ * the responder must look like they come from the DNS server.
  */
-#define SCM_MAX_FD  253
+LIBC_RECVFROM_RET_TYPE tsocks_recvfrom(LIBC_RECVFROM_SIG)
+{
+	ssize_t ret;
+	socklen_t buf_len;
+
+	if (!(fd_table_get(sockfd) & FD_TABLE_UDP_DNS) || !src_addr ||
+			!addrlen) {
+		return tsocks_libc_recvfrom(LIBC_RECVFROM_ARGS);
+	}
+
+	buf_len = *addrlen;
+	ret = tsocks_libc_recvfrom(LIBC_RECVFROM_ARGS);
+	if (ret >= 0) {
+		udp_dns_set_source(sockfd, src_addr, buf_len, addrlen);
+	}
+	return ret;
+}
 
 /*
- * Close all fds in the given array of size count.
+ * Libc hijacked symbol recvfrom(2).
  */
-static void close_fds(int *fds, size_t count)
+LIBC_RECVFROM_DECL
 {
-	int i;
+	LIBC_RECVFROM_RET_TYPE ret;
+	uint64_t start;
 
-	for (i = 0; i < count; i++) {
-		tsocks_libc_close(fds[i]);
+	TSOCKS_PROBE2(recvfrom_entry, sockfd, src_addr);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_recvfrom(LIBC_RECVFROM_ARGS);
+	trace_call(start, TRACE_RECVFROM, sockfd, flags, ret, NULL);
+	TSOCKS_PROBE2(recvfrom_return, sockfd, ret);
+
+	return ret;
+}
+
+/*
+ * Classify every fd passed in the SCM_RIGHTS control messages of the given
+ * received message and store the result in the fd table. The fds are new in
+ * this process thus the table can't be trusted for them and the kernel is
+ * always asked.
+ *
+ * Return 1 if at least one inet socket was passed else 0.
+ */
+static int msg_has_inet_fd(struct msghdr *msg)
+{
+	int found = 0;
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		size_t i, nb_fds;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		/*
+		 * The kernel controls that len value and there is a hard limit on
+		 * the number of fds so no chance here of having a crazy value.
+		 */
+		nb_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nb_fds; i++) {
+			int ret, fd;
+			struct sockaddr addr;
+			socklen_t addrlen = sizeof(addr);
+
+			memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(fd)), sizeof(fd));
+			memset(&addr, 0, addrlen);
+
+			/* Get socket protocol family. */
+			ret = getsockname(fd, &addr, &addrlen);
+			if (ret < 0) {
+				/* Either a bad fd or not a socket. */
+				fd_table_clear(fd);
+				continue;
+			}
+
+			switch (addr.sa_family) {
+			case AF_INET:
+			case AF_INET6:
+				fd_table_set(fd, FD_TABLE_INET);
+				found = 1;
+				break;
+			case AF_UNIX:
+				fd_table_set(fd, FD_TABLE_UNIX);
+				break;
+			default:
+				fd_table_clear(fd);
+				break;
+			}
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Close every fd passed in the SCM_RIGHTS control messages of the given
+ * received message and wipe the control data so the application never sees
+ * them.
+ */
+static void msg_close_fds(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		size_t i, nb_fds;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		nb_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nb_fds; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(fd)), sizeof(fd));
+			fd_table_clear(fd);
+			tsocks_libc_close(fd);
+		}
+	}
+
+	memset(msg->msg_control, 0, msg->msg_controllen);
+	msg->msg_controllen = 0;
+}
+
+/*
+ * Check if the given socket is a Unix socket, the only family able to pass
+ * fds. A Unix flag in the fd table saves the kernel query since a stale one
+ * only costs an inspection. Anything else is asked to the kernel because not
+ * inspecting on a stale flag would let inet fds through.
+ *
+ * Return 1 if Unix, 0 if not or -1 if the fd is not a valid socket.
+ */
+static int is_unix_socket(int sockfd)
+{
+	int ret;
+	socklen_t addrlen;
+	struct sockaddr addr;
+
+	if (fd_table_get(sockfd) & FD_TABLE_UNIX) {
+		return 1;
+	}
+
+	addrlen = sizeof(addr);
+	ret = getsockname(sockfd, &addr, &addrlen);
+	if (ret < 0) {
+		return -1;
+	}
+
+	switch (addr.sa_family) {
+	case AF_UNIX:
+		fd_table_add(sockfd, FD_TABLE_UNIX);
+		return 1;
+	case AF_INET:
+	case AF_INET6:
+		fd_table_add(sockfd, FD_TABLE_INET);
+		return 0;
+	default:
+		return 0;
 	}
 }
 
@@ -50,139 +210,202 @@ static void close_fds(int *fds, size_t count)
  * Torsocks call for recvmsg(2)
  *
  * We only hijack this call to handle the FD passing between process on Unix
- * socket. If an INET/INET6 socket is recevied, we stop everything because at
+ * socket. If an INET/INET6 socket is received, we stop everything because at
  * that point we can't guarantee traffic going through Tor.
  *
- * Note that we don't rely on the given "msg" structure since it's controlled
- * by the user and might not have been zeroed thus containing wrong values for
- * ancillary data. Thus, we are going to expect SCM_MAX_FD and see what we can
- * get from that if any.
+ * The message is received once with the caller's own buffers and the passed
+ * fds are inspected afterwards. The kernel already discarded any fd that did
+ * not fit in the control buffer thus only what was received needs checking.
  */
 LIBC_RECVMSG_RET_TYPE tsocks_recvmsg(LIBC_RECVMSG_SIG)
 {
-	socklen_t addrlen;
-	ssize_t ret = 0;
-	char dummy, recv_fd[CMSG_SPACE(SCM_MAX_FD)];
-	struct iovec iov[1];
-	struct cmsghdr *cmsg;
-	struct msghdr msg_hdr;
-	struct sockaddr addr;
+	ssize_t ret;
+
+	if ((fd_table_get(sockfd) & FD_TABLE_UDP_DNS) && msg) {
+		socklen_t buf_len = msg->msg_namelen;
+
+		/* Reply of the responder, see recvfrom(). */
+		ret = tsocks_libc_recvmsg(LIBC_RECVMSG_ARGS);
+		if (ret >= 0) {
+			udp_dns_set_source(sockfd, msg->msg_name, buf_len,
+					&msg->msg_namelen);
+		}
+		/* A stale flag must not skip the inspection. */
+		goto inspect;
+	}
 
 	/* Don't bother if the socket family is NOT Unix. */
-	addrlen = sizeof(addr);
-	ret = getsockname(sockfd, &addr, &addrlen);
+	ret = is_unix_socket(sockfd);
 	if (ret < 0) {
 		DBG("[recvmsg] Fail getsockname() on sock %d", sockfd);
 		errno = EBADF;
 		goto error;
-	}
-	if (addr.sa_family != AF_UNIX) {
+	} else if (!ret) {
 		goto libc;
 	}
 
-	memset(&msg_hdr, 0, sizeof(msg_hdr));
+	ret = tsocks_libc_recvmsg(LIBC_RECVMSG_ARGS);
 
-	/* Prepare to receive the structures */
-	iov[0].iov_base = &dummy;
-	iov[0].iov_len = 1;
-	msg_hdr.msg_iov = iov;
-	msg_hdr.msg_iovlen = 1;
-	msg_hdr.msg_control = recv_fd;
-	msg_hdr.msg_controllen = sizeof(recv_fd);
+inspect:
+	if (ret < 0 || !msg || !msg->msg_control ||
+			msg->msg_controllen < sizeof(struct cmsghdr)) {
+		/* Nothing received or no control data that could hold fds. */
+		goto end;
+	}
 
-	do {
-		/* Just peek the data to inspect the payload for fd. */
-		ret = tsocks_libc_recvmsg(sockfd, &msg_hdr, MSG_PEEK);
-	} while (ret < 0 && errno == EINTR);
-	if (ret < 0) {
-		/* Use the current errno set by the call above. */
+	/*
+	 * Detecting FD passing, if we get an inet/inet6 socket, we close every
+	 * received socket, wipe clean the cmsg payload and return an unauthorized
+	 * access code.
+	 */
+	if (msg_has_inet_fd(msg)) {
+		DBG("[recvmsg] Inet socket passing detected. Denying it.");
+		msg_close_fds(msg);
+		/*
+		 * The recv(2) man page does *not* mention that errno value however
+		 * it's acceptable because Linux LSM can return this code if the
+		 * access is denied in the application by a security module. We are
+		 * basically simulating this here.
+		 */
+		errno = EACCES;
+		ret = -1;
 		goto error;
 	}
-	cmsg = CMSG_FIRSTHDR(&msg_hdr);
-	if (!cmsg) {
-		/* No control message header, safe to pass to libc. */
-		goto libc;
+
+end:
+	return ret;
+
+libc:
+	return tsocks_libc_recvmsg(LIBC_RECVMSG_ARGS);
+
+error:
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol recvmsg(2).
+ */
+LIBC_RECVMSG_DECL
+{
+	LIBC_RECVMSG_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(recvmsg_entry, sockfd, msg);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_recvmsg(LIBC_RECVMSG_ARGS);
+	trace_call(start, TRACE_RECVMSG, sockfd, flags, ret, NULL);
+	TSOCKS_PROBE2(recvmsg_return, sockfd, ret);
+
+	return ret;
+}
+
+#if (defined(__linux__))
+
+/* recvmmsg(2) */
+TSOCKS_LIBC_DECL(recvmmsg, LIBC_RECVMMSG_RET_TYPE, LIBC_RECVMMSG_SIG)
+
+/*
+ * Torsocks call for recvmmsg(2)
+ *
+ * Same policy as recvmsg(). The batch is received with a single call and the
+ * control data of every received message is inspected in one pass. If any of
+ * them passed an inet socket, the fds of the whole batch are closed and the
+ * call fails.
+ */
+LIBC_RECVMMSG_RET_TYPE tsocks_recvmmsg(LIBC_RECVMMSG_SIG)
+{
+	int ret, i, found = 0;
+
+	if ((fd_table_get(sockfd) & FD_TABLE_UDP_DNS) && msgvec) {
+		socklen_t buf_lens[UIO_MAXIOV];
+
+		/* Replies of the responder, see recvfrom(). */
+		vlen = min(vlen, UIO_MAXIOV);
+		for (i = 0; i < (int) vlen; i++) {
+			buf_lens[i] = msgvec[i].msg_hdr.msg_namelen;
+		}
+		ret = tsocks_libc_recvmmsg(LIBC_RECVMMSG_ARGS);
+		for (i = 0; i < ret; i++) {
+			udp_dns_set_source(sockfd, msgvec[i].msg_hdr.msg_name,
+					buf_lens[i], &msgvec[i].msg_hdr.msg_namelen);
+		}
+		/* A stale flag must not skip the inspection. */
+		goto inspect;
 	}
-	if (msg_hdr.msg_flags & MSG_CTRUNC) {
-		/*
-		 * This means there are actually *more* data in the control thus
-		 * exceeding somehow our hard limit of SCM_MAX_FD. In that case, return
-		 * an error since we can't guarantee anything for socket passing
-		 */
-		errno = EMSGSIZE;
+
+	/* Don't bother if the socket family is NOT Unix. */
+	ret = is_unix_socket(sockfd);
+	if (ret < 0) {
+		DBG("[recvmmsg] Fail getsockname() on sock %d", sockfd);
+		errno = EBADF;
 		goto error;
+	} else if (!ret) {
+		goto libc;
 	}
 
-	/*
-	 * Detecting FD passing, the next snippet of code will check if we get a
-	 * inet/inet6 socket. If so, we are going to close the received socket,
-	 * wipe clean the cmsg payload and return an unauthorized access code.
-	 */
-	if (cmsg->cmsg_type == SCM_RIGHTS || cmsg->cmsg_level == SOL_SOCKET) {
-		/*
-		 * The kernel control that len value and there is a hard limit so no
-		 * chance here of having a crazy high value that could exhaust the
-		 * stack memory.
-		 */
-		size_t sizeof_fds = (cmsg->cmsg_len - sizeof(*cmsg)) / sizeof(int);
-		int i, fds[sizeof_fds];
+	ret = tsocks_libc_recvmmsg(LIBC_RECVMMSG_ARGS);
 
-		memcpy(&fds, CMSG_DATA(cmsg), sizeof(fds));
+inspect:
+	if (ret <= 0) {
+		goto end;
+	}
 
-		/*
-		 * For each received fds, we will inspect them to see if there is an
-		 * inet socket in there and if so, we have to stop, close everything to
-		 * avoid fd leak and return an error.
-		 */
-		for (i = 0; i < sizeof_fds; i++) {
-			struct sockaddr addr;
-			socklen_t addrlen = sizeof(addr);
+	for (i = 0; i < ret; i++) {
+		struct msghdr *msg = &msgvec[i].msg_hdr;
 
-			memset(&addr, 0, addrlen);
+		if (!msg->msg_control || msg->msg_controllen < sizeof(struct cmsghdr)) {
+			continue;
+		}
+		/* Classify everything, the fds of each message are needed below. */
+		found |= msg_has_inet_fd(msg);
+	}
 
-			/* Get socket protocol family. */
-			ret = getsockname(fds[i], &addr, &addrlen);
-			if (ret < 0) {
-				/* Either a bad fd or not a socket. */
-				continue;
-			}
+	if (found) {
+		DBG("[recvmmsg] Inet socket passing detected. Denying it.");
+		for (i = 0; i < ret; i++) {
+			struct msghdr *msg = &msgvec[i].msg_hdr;
 
-			if (addr.sa_family == AF_INET || addr.sa_family == AF_INET6) {
-				DBG("[recvmsg] Inet socket passing detected. Denying it.");
-				/* We found socket, close everything and return error. */
-				close_fds(fds, sizeof_fds);
-				/*
-				 * The recv(2) man page does *not* mention that errno value
-				 * however it's acceptable because Linux LSM can return this
-				 * code if the access is denied in the application by a
-				 * security module. We are basically simulating this here.
-				 */
-				errno = EACCES;
-				ret = -1;
-				goto error;
+			if (!msg->msg_control ||
+					msg->msg_controllen < sizeof(struct cmsghdr)) {
+				continue;
 			}
+			msg_close_fds(msg);
 		}
+		/* See recvmsg() for the errno value. */
+		errno = EACCES;
+		ret = -1;
+		goto error;
 	}
 
-	/* At this point, NO socket was detected, continue to the libc safely. */
+end:
+	return ret;
 
 libc:
-	return tsocks_libc_recvmsg(LIBC_RECVMSG_ARGS);
+	return tsocks_libc_recvmmsg(LIBC_RECVMMSG_ARGS);
 
 error:
 	return ret;
 }
 
 /*
- * Libc hijacked symbol recvmsg(2).
+ * Libc hijacked symbol recvmmsg(2).
  */
-LIBC_RECVMSG_DECL
+LIBC_RECVMMSG_DECL
 {
-	if (!tsocks_libc_recvmsg) {
-		tsocks_initialize();
-		tsocks_libc_recvmsg = tsocks_find_libc_symbol(LIBC_RECVMSG_NAME_STR,
-				TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_RECVMMSG_RET_TYPE ret;
+	uint64_t start;
 
-	return tsocks_recvmsg(LIBC_RECVMSG_ARGS);
+	TSOCKS_PROBE2(recvmmsg_entry, sockfd, vlen);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_recvmmsg(LIBC_RECVMMSG_ARGS);
+	trace_call(start, TRACE_RECVMMSG, sockfd, vlen, ret, NULL);
+	TSOCKS_PROBE2(recvmmsg_return, sockfd, ret);
+
+	return ret;
 }
+
+#endif /* __linux__ */
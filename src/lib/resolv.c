@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/addrinfo.h>
+#include <common/dns.h>
+#include <common/log.h>
+#include <common/macros.h>
+
+#include "torsocks.h"
+
+/*
+ * TTL of the records answered. Short since the application caching them
+ * never sees a change of exit node.
+ */
+#define RES_ANSWER_TTL		60
+
+/*
+ * Resolve the name of the question to its addresses of the given family with
+ * the getaddrinfo(3) of torsocks so the result cache is used. The answers are
+ * set in answers and their number in nb_answers.
+ *
+ * Return the response code of the reply.
+ */
+static unsigned int resolve_addrs(const struct dns_question *question,
+		int af, struct dns_answer *answers, unsigned int *nb_answers)
+{
+	int ret;
+	unsigned int nb = 0;
+	struct addrinfo hints, *res, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	/* A single entry per address. */
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = tsocks_getaddrinfo(question->name, NULL, &hints, &res);
+	switch (ret) {
+	case 0:
+		break;
+	case EAI_NONAME:
+		/*
+		 * Tor gives no way to tell a name without an IPv6 address from one
+		 * that does not exist so only the IPv4 lookup denies the name.
+		 */
+		*nb_answers = 0;
+		return af == AF_INET ? DNS_RCODE_NXDOMAIN : DNS_RCODE_NOERROR;
+	default:
+		DBG("[resolv] Unable to resolve %s: %s", question->name,
+				gai_strerror(ret));
+		return DNS_RCODE_SERVFAIL;
+	}
+
+	for (ai = res; ai && nb < *nb_answers; ai = ai->ai_next) {
+		if (ai->ai_family != af) {
+			continue;
+		}
+		answers[nb].type = question->type;
+		if (af == AF_INET) {
+			answers[nb].u.v4 = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+		} else {
+			answers[nb].u.v6 = ((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+		}
+		nb++;
+	}
+	freeaddrinfo(res);
+
+	*nb_answers = nb;
+	return DNS_RCODE_NOERROR;
+}
+
+/*
+ * Resolve the address of the in-addr.arpa or ip6.arpa name of the question
+ * to its name through Tor. The answer is set in answer.
+ *
+ * Return the response code of the reply.
+ */
+static unsigned int resolve_ptr(const struct dns_question *question,
+		struct dns_answer *answer)
+{
+	int ret, af;
+	char *hostname = NULL;
+	unsigned char addr[sizeof(struct in6_addr)];
+
+	if (dns_ptr_addr(question->name, &af, addr) < 0) {
+		/* Only the names of addresses are resolved by Tor. */
+		return DNS_RCODE_NOTIMP;
+	}
+
+	/* This call allocates hostname. On error, it's untouched. */
+	ret = tsocks_tor_resolve_ptr((const char *) addr, &hostname, af);
+	if (ret < 0) {
+		return ret == -ENOENT ? DNS_RCODE_NXDOMAIN : DNS_RCODE_SERVFAIL;
+	}
+
+	answer->type = DNS_TYPE_PTR;
+	ret = snprintf(answer->u.name, sizeof(answer->u.name), "%s", hostname);
+	free(hostname);
+	if (ret < 0 || (size_t) ret >= sizeof(answer->u.name)) {
+		return DNS_RCODE_SERVFAIL;
+	}
+	return DNS_RCODE_NOERROR;
+}
+
+/*
+ * Answer the query in msg as a DNS server would, with the addresses or name
+ * resolved by Tor. Only the A, AAAA and PTR records of the Internet class are
+ * resolved, any other question is answered right away as not implemented
+ * instead of being sent out of Tor. The reply is written in answer.
+ *
+ * Return the length of the reply on success else a negative value.
+ */
+static int answer_query(const unsigned char *msg, int msglen,
+		unsigned char *answer, int anslen)
+{
+	ssize_t ret, query_len;
+	unsigned int rcode, nb_answers = 0;
+	struct dns_question question;
+	struct dns_answer answers[2];
+
+	if (!msg || msglen < 0 || !answer || anslen < 0) {
+		ret = -EINVAL;
+		goto end;
+	}
+
+	query_len = dns_decode_query(msg, msglen, &question);
+	if (query_len < 0) {
+		if (msglen < DNS_HEADER_LEN) {
+			ret = -EINVAL;
+			goto end;
+		}
+		/* A header alone to say the query is not understood. */
+		query_len = DNS_HEADER_LEN;
+		rcode = DNS_RCODE_FORMERR;
+		goto reply;
+	}
+
+	DBG("[resolv] Query type %u for %s", question.type, question.name);
+
+	/* Only standard queries, not a reply, an update nor a notify. */
+	if ((question.flags & (DNS_FLAG_QR | DNS_OPCODE_MASK)) ||
+			question.class != DNS_CLASS_IN) {
+		rcode = DNS_RCODE_NOTIMP;
+		goto reply;
+	}
+
+	switch (question.type) {
+	case DNS_TYPE_A:
+		nb_answers = ARRAY_SIZE(answers);
+		rcode = resolve_addrs(&question, AF_INET, answers, &nb_answers);
+		break;
+	case DNS_TYPE_AAAA:
+		nb_answers = ARRAY_SIZE(answers);
+		rcode = resolve_addrs(&question, AF_INET6, answers, &nb_answers);
+		break;
+	case DNS_TYPE_PTR:
+		rcode = resolve_ptr(&question, &answers[0]);
+		nb_answers = rcode == DNS_RCODE_NOERROR ? 1 : 0;
+		break;
+	default:
+		DBG("[resolv] Query type %u not supported by Tor", question.type);
+		rcode = DNS_RCODE_NOTIMP;
+		break;
+	}
+
+reply:
+	if (rcode != DNS_RCODE_NOERROR) {
+		nb_answers = 0;
+	}
+	ret = dns_encode_reply(msg, query_len, rcode, answers, nb_answers,
+			RES_ANSWER_TTL, answer, anslen);
+
+end:
+	return ret;
+}
+
+/*
+ * Set h_errno from the reply to a query like the libc does.
+ *
+ * Return the length of the reply if it has answers else -1.
+ */
+static int reply_h_errno(const unsigned char *answer, int len)
+{
+	if (len < 0) {
+		errno = -len;
+		h_errno = NETDB_INTERNAL;
+		return -1;
+	}
+
+	/* The response code and the number of answers of the header. */
+	switch (answer[3] & DNS_RCODE_MASK) {
+	case DNS_RCODE_NOERROR:
+		if (answer[6] == 0 && answer[7] == 0) {
+			h_errno = NO_DATA;
+			return -1;
+		}
+		return len;
+	case DNS_RCODE_NXDOMAIN:
+		h_errno = HOST_NOT_FOUND;
+		return -1;
+	case DNS_RCODE_SERVFAIL:
+		h_errno = TRY_AGAIN;
+		return -1;
+	default:
+		h_errno = NO_RECOVERY;
+		return -1;
+	}
+}
+
+/*
+ * Torsocks call for res_query(3).
+ *
+ * The query is answered by torsocks, the libc resolver is never used since
+ * its queries would be sent out of Tor.
+ */
+LIBC_RES_QUERY_RET_TYPE tsocks_res_query(LIBC_RES_QUERY_SIG)
+{
+	ssize_t len;
+	size_t name_len;
+	unsigned char query[DNS_QUERY_MAX];
+	char name[DEFAULT_DOMAIN_NAME_SIZE + 1];
+
+	if (!dname) {
+		h_errno = NETDB_INTERNAL;
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* An absolute name is the same name to Tor. */
+	name_len = strlen(dname);
+	if (name_len > 1 && dname[name_len - 1] == '.') {
+		name_len--;
+	}
+	if (name_len >= sizeof(name)) {
+		h_errno = NO_RECOVERY;
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(name, dname, name_len);
+	name[name_len] = '\0';
+
+	/* The ID is never checked since the query never goes on the wire. */
+	len = dns_encode_query(0, name, type, query, sizeof(query));
+	if (len < 0) {
+		h_errno = NO_RECOVERY;
+		errno = -len;
+		return -1;
+	}
+	/* The class asked, always IN in the query encoded. */
+	query[len - 2] = class >> 8;
+	query[len - 1] = class & 0xff;
+
+	return reply_h_errno(answer, answer_query(query, len, answer, anslen));
+}
+
+/*
+ * Libc hijacked symbol res_query(3).
+ */
+LIBC_RES_QUERY_DECL
+{
+	LIBC_RES_QUERY_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_query_entry, dname, type);
+	tsocks_initialize();
+	ret = tsocks_res_query(LIBC_RES_QUERY_ARGS);
+	TSOCKS_PROBE2(res_query_return, dname, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_search(3).
+ *
+ * The name is resolved as given, the search list of resolv.conf(5) is not
+ * applied since Tor only resolves fully qualified names.
+ */
+LIBC_RES_SEARCH_RET_TYPE tsocks_res_search(LIBC_RES_SEARCH_SIG)
+{
+	return tsocks_res_query(LIBC_RES_QUERY_ARGS);
+}
+
+/*
+ * Libc hijacked symbol res_search(3).
+ */
+LIBC_RES_SEARCH_DECL
+{
+	LIBC_RES_SEARCH_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_search_entry, dname, type);
+	tsocks_initialize();
+	ret = tsocks_res_search(LIBC_RES_SEARCH_ARGS);
+	TSOCKS_PROBE2(res_search_return, dname, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_querydomain(3).
+ */
+LIBC_RES_QUERYDOMAIN_RET_TYPE tsocks_res_querydomain(
+		LIBC_RES_QUERYDOMAIN_SIG)
+{
+	int ret;
+	char dname[DEFAULT_DOMAIN_NAME_SIZE + 1];
+
+	if (!name) {
+		h_errno = NETDB_INTERNAL;
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (domain) {
+		ret = snprintf(dname, sizeof(dname), "%s.%s", name, domain);
+	} else {
+		ret = snprintf(dname, sizeof(dname), "%s", name);
+	}
+	if (ret < 0 || (size_t) ret >= sizeof(dname)) {
+		h_errno = NO_RECOVERY;
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return tsocks_res_query(dname, class, type, answer, anslen);
+}
+
+/*
+ * Libc hijacked symbol res_querydomain(3).
+ */
+LIBC_RES_QUERYDOMAIN_DECL
+{
+	LIBC_RES_QUERYDOMAIN_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_querydomain_entry, name, type);
+	tsocks_initialize();
+	ret = tsocks_res_querydomain(LIBC_RES_QUERYDOMAIN_ARGS);
+	TSOCKS_PROBE2(res_querydomain_return, name, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_send(3).
+ *
+ * The reply is returned whatever its response code like the libc does.
+ */
+LIBC_RES_SEND_RET_TYPE tsocks_res_send(LIBC_RES_SEND_SIG)
+{
+	int ret;
+
+	ret = answer_query(msg, msglen, answer, anslen);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol res_send(3).
+ */
+LIBC_RES_SEND_DECL
+{
+	LIBC_RES_SEND_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_send_entry, msg, msglen);
+	tsocks_initialize();
+	ret = tsocks_res_send(LIBC_RES_SEND_ARGS);
+	TSOCKS_PROBE2(res_send_return, msg, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_nquery(3). The state is only used for its h_errno.
+ */
+LIBC_RES_NQUERY_RET_TYPE tsocks_res_nquery(LIBC_RES_NQUERY_SIG)
+{
+	int ret;
+
+	ret = tsocks_res_query(LIBC_RES_QUERY_ARGS);
+	if (statp) {
+		statp->res_h_errno = h_errno;
+	}
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol res_nquery(3).
+ */
+LIBC_RES_NQUERY_DECL
+{
+	LIBC_RES_NQUERY_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_nquery_entry, dname, type);
+	tsocks_initialize();
+	ret = tsocks_res_nquery(LIBC_RES_NQUERY_ARGS);
+	TSOCKS_PROBE2(res_nquery_return, dname, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_nsearch(3).
+ */
+LIBC_RES_NSEARCH_RET_TYPE tsocks_res_nsearch(LIBC_RES_NSEARCH_SIG)
+{
+	int ret;
+
+	ret = tsocks_res_search(LIBC_RES_SEARCH_ARGS);
+	if (statp) {
+		statp->res_h_errno = h_errno;
+	}
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol res_nsearch(3).
+ */
+LIBC_RES_NSEARCH_DECL
+{
+	LIBC_RES_NSEARCH_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_nsearch_entry, dname, type);
+	tsocks_initialize();
+	ret = tsocks_res_nsearch(LIBC_RES_NSEARCH_ARGS);
+	TSOCKS_PROBE2(res_nsearch_return, dname, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_nquerydomain(3).
+ */
+LIBC_RES_NQUERYDOMAIN_RET_TYPE tsocks_res_nquerydomain(
+		LIBC_RES_NQUERYDOMAIN_SIG)
+{
+	int ret;
+
+	ret = tsocks_res_querydomain(LIBC_RES_QUERYDOMAIN_ARGS);
+	if (statp) {
+		statp->res_h_errno = h_errno;
+	}
+	return ret;
+}
+
+/*
+ * Libc hijacked symbol res_nquerydomain(3).
+ */
+LIBC_RES_NQUERYDOMAIN_DECL
+{
+	LIBC_RES_NQUERYDOMAIN_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_nquerydomain_entry, name, type);
+	tsocks_initialize();
+	ret = tsocks_res_nquerydomain(LIBC_RES_NQUERYDOMAIN_ARGS);
+	TSOCKS_PROBE2(res_nquerydomain_return, name, ret);
+
+	return ret;
+}
+
+/*
+ * Torsocks call for res_nsend(3).
+ */
+LIBC_RES_NSEND_RET_TYPE tsocks_res_nsend(LIBC_RES_NSEND_SIG)
+{
+	return tsocks_res_send(LIBC_RES_SEND_ARGS);
+}
+
+/*
+ * Libc hijacked symbol res_nsend(3).
+ */
+LIBC_RES_NSEND_DECL
+{
+	LIBC_RES_NSEND_RET_TYPE ret;
+
+	TSOCKS_PROBE2(res_nsend_entry, msg, msglen);
+	tsocks_initialize();
+	ret = tsocks_res_nsend(LIBC_RES_NSEND_ARGS);
+	TSOCKS_PROBE2(res_nsend_return, msg, ret);
+
+	return ret;
+}
+
+/*
+ * Before glibc 2.34, resolv.h renames the resolver to those names and the
+ * binaries built against it still call them.
+ */
+#if (defined(__GLIBC__) && !defined(res_query))
+int __res_query(LIBC_RES_QUERY_SIG);
+int __res_search(LIBC_RES_SEARCH_SIG);
+int __res_querydomain(LIBC_RES_QUERYDOMAIN_SIG);
+int __res_send(LIBC_RES_SEND_SIG);
+int __res_nquery(LIBC_RES_NQUERY_SIG);
+int __res_nsearch(LIBC_RES_NSEARCH_SIG);
+int __res_nquerydomain(LIBC_RES_NQUERYDOMAIN_SIG);
+int __res_nsend(LIBC_RES_NSEND_SIG);
+
+int __res_query(LIBC_RES_QUERY_SIG)
+{
+	return LIBC_RES_QUERY_NAME(LIBC_RES_QUERY_ARGS);
+}
+
+int __res_search(LIBC_RES_SEARCH_SIG)
+{
+	return LIBC_RES_SEARCH_NAME(LIBC_RES_SEARCH_ARGS);
+}
+
+int __res_querydomain(LIBC_RES_QUERYDOMAIN_SIG)
+{
+	return LIBC_RES_QUERYDOMAIN_NAME(LIBC_RES_QUERYDOMAIN_ARGS);
+}
+
+int __res_send(LIBC_RES_SEND_SIG)
+{
+	return LIBC_RES_SEND_NAME(LIBC_RES_SEND_ARGS);
+}
+
+int __res_nquery(LIBC_RES_NQUERY_SIG)
+{
+	return LIBC_RES_NQUERY_NAME(LIBC_RES_NQUERY_ARGS);
+}
+
+int __res_nsearch(LIBC_RES_NSEARCH_SIG)
+{
+	return LIBC_RES_NSEARCH_NAME(LIBC_RES_NSEARCH_ARGS);
+}
+
+int __res_nquerydomain(LIBC_RES_NQUERYDOMAIN_SIG)
+{
+	return LIBC_RES_NQUERYDOMAIN_NAME(LIBC_RES_NQUERYDOMAIN_ARGS);
+}
+
+int __res_nsend(LIBC_RES_NSEND_SIG)
+{
+	return LIBC_RES_NSEND_NAME(LIBC_RES_NSEND_ARGS);
+}
+#endif /* __GLIBC__ && !res_query */
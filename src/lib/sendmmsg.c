@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* For struct mmsghdr. */
+#define _GNU_SOURCE
+
+#include <common/fd-table.h>
+#include <common/log.h>
+#include <common/trace.h>
+
+#include "torsocks.h"
+
+#if (defined(__linux__))
+
+/* sendmmsg(2) */
+TSOCKS_LIBC_DECL(sendmmsg, LIBC_SENDMMSG_RET_TYPE, LIBC_SENDMMSG_SIG)
+
+/*
+ * Send a batch of DNS queries of a UDP socket allowed by AllowUDPDNS, one
+ * message at a time since each is redirected to the responder with
+ * sendmsg().
+ *
+ * Return the number of messages sent or -1 if none was.
+ */
+static int send_udp_dns(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < vlen; i++) {
+		ret = tsocks_sendmsg(sockfd, &msgvec[i].msg_hdr, flags);
+		if (ret < 0) {
+			return i ? (int) i : -1;
+		}
+		msgvec[i].msg_len = ret;
+	}
+	return vlen;
+}
+
+/*
+ * Torsocks call for sendmmsg(2).
+ *
+ * The socket is checked once for the whole batch. Non stream inet sockets
+ * can't go through Tor thus the batch is denied unless it holds the DNS
+ * queries of a socket allowed by AllowUDPDNS. As for sendto(), a TCP fast
+ * open batch is turned into a connect() to the destination of the first
+ * message followed by a normal send of the batch.
+ */
+LIBC_SENDMMSG_RET_TYPE tsocks_sendmmsg(LIBC_SENDMMSG_SIG)
+{
+	int ret;
+
+	ret = udp_dns_check_socket(sockfd);
+	if (ret < 0) {
+		DBG("[sendmmsg] Non stream inet socket %d can't be handled. "
+				"Denying the batch.", sockfd);
+		errno = -ret;
+		goto error;
+	}
+	if (ret) {
+		return msgvec ? send_udp_dns(sockfd, msgvec, vlen, flags) :
+			tsocks_libc_sendmmsg(LIBC_SENDMMSG_ARGS);
+	}
+
+#ifdef MSG_FASTOPEN
+	if ((flags & MSG_FASTOPEN) && vlen > 0 && msgvec &&
+			msgvec[0].msg_hdr.msg_name) {
+		DBG("[sendmmsg] TCP fast open catched on fd %d", sockfd);
+
+		ret = connect(sockfd, msgvec[0].msg_hdr.msg_name,
+				msgvec[0].msg_hdr.msg_namelen);
+		if (ret < 0) {
+			goto error;
+		}
+		flags &= ~MSG_FASTOPEN;
+	}
+#endif /* MSG_FASTOPEN */
+
+	return tsocks_libc_sendmmsg(LIBC_SENDMMSG_ARGS);
+
+error:
+	return -1;
+}
+
+/*
+ * Libc hijacked symbol sendmmsg(2).
+ */
+LIBC_SENDMMSG_DECL
+{
+	LIBC_SENDMMSG_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(sendmmsg_entry, sockfd, vlen);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_sendmmsg(LIBC_SENDMMSG_ARGS);
+	trace_call(start, TRACE_SENDMMSG, sockfd, vlen, ret, NULL);
+	TSOCKS_PROBE2(sendmmsg_return, sockfd, ret);
+
+	return ret;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <common/log.h>
+#include <common/trace.h>
+
+#include "torsocks.h"
+
+/* sendmsg(2) */
+TSOCKS_LIBC_DECL(sendmsg, LIBC_SENDMSG_RET_TYPE, LIBC_SENDMSG_SIG)
+
+/*
+ * Torsocks call for sendmsg(2).
+ *
+ * Only the DNS queries of the UDP sockets allowed by AllowUDPDNS need
+ * anything, they are sent to the responder instead of their destination.
+ * Any other non stream inet socket is denied.
+ */
+LIBC_SENDMSG_RET_TYPE tsocks_sendmsg(LIBC_SENDMSG_SIG)
+{
+	int ret;
+	socklen_t to_len;
+	struct sockaddr_storage to;
+	struct msghdr redirected;
+
+	ret = udp_dns_check_socket(sockfd);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	if (!ret || !msg || !msg->msg_name) {
+		goto libc_sendmsg;
+	}
+
+	ret = udp_dns_redirect(sockfd, msg->msg_name, msg->msg_namelen, &to,
+			&to_len);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	redirected = *msg;
+	redirected.msg_name = &to;
+	redirected.msg_namelen = to_len;
+	return tsocks_libc_sendmsg(sockfd, &redirected, flags);
+
+libc_sendmsg:
+	return tsocks_libc_sendmsg(LIBC_SENDMSG_ARGS);
+}
+
+/*
+ * Libc hijacked symbol sendmsg(2).
+ */
+LIBC_SENDMSG_DECL
+{
+	LIBC_SENDMSG_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(sendmsg_entry, sockfd, msg);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_sendmsg(LIBC_SENDMSG_ARGS);
+	trace_call(start, TRACE_SENDMSG, sockfd, flags, ret,
+			msg ? msg->msg_name : NULL);
+	TSOCKS_PROBE2(sendmsg_return, sockfd, ret);
+
+	return ret;
+}
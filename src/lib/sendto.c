@@ -17,7 +17,9 @@
 
 #include <assert.h>
 
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/trace.h>
 #include <common/utils.h>
 
 #include "torsocks.h"
@@ -43,9 +45,28 @@ TSOCKS_LIBC_DECL(sendto, LIBC_SENDTO_RET_TYPE, LIBC_SENDTO_SIG)
  */
 LIBC_SENDTO_RET_TYPE tsocks_sendto(LIBC_SENDTO_SIG)
 {
-#ifdef MSG_FASTOPEN
 	int ret;
 
+	ret = udp_dns_check_socket(sockfd);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	if (ret && dest_addr) {
+		socklen_t to_len;
+		struct sockaddr_storage to;
+
+		/* DNS query of a UDP socket, answered by the responder. */
+		ret = udp_dns_redirect(sockfd, dest_addr, addrlen, &to, &to_len);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		return tsocks_libc_sendto(sockfd, buf, len, flags,
+				(struct sockaddr *) &to, to_len);
+	}
+
+#ifdef MSG_FASTOPEN
 	if ((flags & MSG_FASTOPEN) == 0) {
 		/* No TFO, fallback to libc sendto() */
 		goto libc_sendto;
@@ -72,11 +93,16 @@ libc_sendto:
  */
 LIBC_SENDTO_DECL
 {
-	if (!tsocks_libc_sendto) {
-		tsocks_initialize();
-		tsocks_libc_sendto = tsocks_find_libc_symbol(
-				LIBC_SENDTO_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_SENDTO_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(sendto_entry, sockfd, dest_addr);
+	tsocks_initialize();
 
-	return tsocks_sendto(LIBC_SENDTO_ARGS);
+	start = trace_begin();
+	ret = tsocks_sendto(LIBC_SENDTO_ARGS);
+	trace_call(start, TRACE_SENDTO, sockfd, flags, ret, dest_addr);
+	TSOCKS_PROBE2(sendto_return, sockfd, ret);
+
+	return ret;
 }
@@ -17,7 +17,9 @@
 
 #include <assert.h>
 
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -29,6 +31,8 @@ TSOCKS_LIBC_DECL(socket, LIBC_SOCKET_RET_TYPE, LIBC_SOCKET_SIG)
  */
 LIBC_SOCKET_RET_TYPE tsocks_socket(LIBC_SOCKET_SIG)
 {
+	int ret;
+
 	DBG("[socket] Creating socket with domain %d, type %d and protocol %d",
 			domain, type, protocol);
 
@@ -47,6 +51,16 @@ LIBC_SOCKET_RET_TYPE tsocks_socket(LIBC_SOCKET_SIG)
 			goto end;
 		}
 
+		/*
+		 * UDP sockets are allowed for DNS, anything else than a query to
+		 * port 53 is denied when sent and the queries are answered through
+		 * Tor.
+		 */
+		if (tsocks_config.allow_udp_dns && IS_SOCK_DGRAM(type) &&
+				(protocol == 0 || protocol == IPPROTO_UDP)) {
+			goto udp_dns;
+		}
+
 		/*
 		 * Print this message only in debug mode. Very often, applications uses
 		 * the libc to do DNS resolution which first tries with UDP and then
@@ -64,7 +78,25 @@ LIBC_SOCKET_RET_TYPE tsocks_socket(LIBC_SOCKET_SIG)
 
 end:
 	/* Stream socket for INET/INET6 is good so open it. */
-	return tsocks_libc_socket(domain, type, protocol);
+	ret = tsocks_libc_socket(domain, type, protocol);
+	if (ret >= 0) {
+		fd_table_set(ret, fd_table_classify(domain, type));
+	}
+
+	return ret;
+
+udp_dns:
+	ret = tsocks_libc_socket(domain, type, protocol);
+	if (ret < 0) {
+		return ret;
+	}
+	if (udp_dns_register(ret, domain) < 0) {
+		tsocks_libc_close(ret);
+		errno = EPERM;
+		return -1;
+	}
+	fd_table_set(ret, fd_table_classify(domain, type) | FD_TABLE_UDP_DNS);
+	return ret;
 }
 
 /*
@@ -72,7 +104,16 @@ end:
  */
 LIBC_SOCKET_DECL
 {
-	if (!tsocks_libc_socket)
-		tsocks_initialize();
-	return tsocks_socket(LIBC_SOCKET_ARGS);
+	LIBC_SOCKET_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(socket_entry, domain, type);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_socket(LIBC_SOCKET_ARGS);
+	trace_call(start, TRACE_SOCKET, domain, type, ret, NULL);
+	TSOCKS_PROBE2(socket_return, domain, ret);
+
+	return ret;
 }
@@ -17,7 +17,9 @@
 
 #include <assert.h>
 
+#include <common/fd-table.h>
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -29,6 +31,8 @@ TSOCKS_LIBC_DECL(socketpair, LIBC_SOCKETPAIR_RET_TYPE, LIBC_SOCKETPAIR_SIG)
  */
 LIBC_SOCKETPAIR_RET_TYPE tsocks_socketpair(LIBC_SOCKETPAIR_SIG)
 {
+	int ret;
+
 	DBG("[socketpair] Creating socket with domain %d, type %d and protocol %d",
 			domain, type, protocol);
 
@@ -39,7 +43,13 @@ LIBC_SOCKETPAIR_RET_TYPE tsocks_socketpair(LIBC_SOCKETPAIR_SIG)
 	}
 
 	/* Stream socket for INET/INET6 is good so open it. */
-	return tsocks_libc_socketpair(domain, type, protocol, sv);
+	ret = tsocks_libc_socketpair(domain, type, protocol, sv);
+	if (ret == 0) {
+		fd_table_set(sv[0], fd_table_classify(domain, type));
+		fd_table_set(sv[1], fd_table_classify(domain, type));
+	}
+
+	return ret;
 }
 
 /*
@@ -47,11 +57,16 @@ LIBC_SOCKETPAIR_RET_TYPE tsocks_socketpair(LIBC_SOCKETPAIR_SIG)
  */
 LIBC_SOCKETPAIR_DECL
 {
-	if (!tsocks_libc_socketpair) {
-		tsocks_initialize();
-		tsocks_libc_socketpair = tsocks_find_libc_symbol(
-				LIBC_SOCKETPAIR_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	LIBC_SOCKETPAIR_RET_TYPE ret;
+	uint64_t start;
+
+	TSOCKS_PROBE2(socketpair_entry, domain, type);
+	tsocks_initialize();
+
+	start = trace_begin();
+	ret = tsocks_socketpair(LIBC_SOCKETPAIR_ARGS);
+	trace_call(start, TRACE_SOCKETPAIR, domain, type, ret, NULL);
+	TSOCKS_PROBE2(socketpair_return, domain, ret);
 
-	return tsocks_socketpair(LIBC_SOCKETPAIR_ARGS);
+	return ret;
 }
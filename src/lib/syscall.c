@@ -20,6 +20,7 @@
 #include <sys/mman.h>
 
 #include <common/log.h>
+#include <common/trace.h>
 
 #include "torsocks.h"
 
@@ -231,6 +232,86 @@ static LIBC_SYSCALL_RET_TYPE handle_accept4(va_list args)
 	return tsocks_accept4(sockfd, addr, &addrlen, flags);
 }
 
+/*
+ * Handle recvmmsg(2) syscall.
+ */
+static LIBC_RECVMMSG_RET_TYPE handle_recvmmsg(va_list args)
+{
+	int sockfd, flags;
+	unsigned int vlen;
+	struct mmsghdr *msgvec;
+	struct timespec *timeout;
+
+	sockfd = va_arg(args, __typeof__(sockfd));
+	msgvec = va_arg(args, __typeof__(msgvec));
+	vlen = va_arg(args, __typeof__(vlen));
+	flags = va_arg(args, __typeof__(flags));
+	timeout = va_arg(args, __typeof__(timeout));
+
+	return tsocks_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+}
+
+/*
+ * Handle sendmmsg(2) syscall.
+ */
+static LIBC_SENDMMSG_RET_TYPE handle_sendmmsg(va_list args)
+{
+	int sockfd, flags;
+	unsigned int vlen;
+	struct mmsghdr *msgvec;
+
+	sockfd = va_arg(args, __typeof__(sockfd));
+	msgvec = va_arg(args, __typeof__(msgvec));
+	vlen = va_arg(args, __typeof__(vlen));
+	flags = va_arg(args, __typeof__(flags));
+
+	return tsocks_sendmmsg(sockfd, msgvec, vlen, flags);
+}
+
+/*
+ * Handle dup2(2) syscall so the fd table follows the new fd number.
+ */
+static LIBC_DUP2_RET_TYPE handle_dup2(va_list args)
+{
+	int oldfd, newfd;
+
+	oldfd = va_arg(args, __typeof__(oldfd));
+	newfd = va_arg(args, __typeof__(newfd));
+
+	return tsocks_dup2(oldfd, newfd);
+}
+
+/*
+ * Handle dup3(2) syscall so the fd table follows the new fd number.
+ */
+static LIBC_DUP3_RET_TYPE handle_dup3(va_list args)
+{
+	int oldfd, newfd, flags;
+
+	oldfd = va_arg(args, __typeof__(oldfd));
+	newfd = va_arg(args, __typeof__(newfd));
+	flags = va_arg(args, __typeof__(flags));
+
+	return tsocks_dup3(oldfd, newfd, flags);
+}
+
+#if (defined(HAVE_CLOSE_RANGE))
+/*
+ * Handle close_range(2) syscall so the closed fds leave the fd table.
+ */
+static LIBC_CLOSE_RANGE_RET_TYPE handle_close_range(va_list args)
+{
+	unsigned int first, last;
+	int flags;
+
+	first = va_arg(args, __typeof__(first));
+	last = va_arg(args, __typeof__(last));
+	flags = va_arg(args, __typeof__(flags));
+
+	return tsocks_close_range(first, last, flags);
+}
+#endif /* HAVE_CLOSE_RANGE */
+
 /*
  * Handle epoll_create1(2) syscall.
  */
@@ -431,6 +512,12 @@ LIBC_SYSCALL_RET_TYPE tsocks_syscall(long int number, va_list args)
 	case TSOCKS_NR_ACCEPT4:
 		ret = handle_accept4(args);
 		break;
+	case TSOCKS_NR_RECVMMSG:
+		ret = handle_recvmmsg(args);
+		break;
+	case TSOCKS_NR_SENDMMSG:
+		ret = handle_sendmmsg(args);
+		break;
 	case TSOCKS_NR_EPOLL_CREATE1:
 		ret = handle_epoll_create1(args);
 		break;
@@ -455,6 +542,28 @@ LIBC_SYSCALL_RET_TYPE tsocks_syscall(long int number, va_list args)
 	case TSOCKS_NR_INOTIFY_RM_WATCH:
 		ret = handle_inotify_rm_watch(args);
 		break;
+	case TSOCKS_NR_DUP2:
+		ret = handle_dup2(args);
+		break;
+	case TSOCKS_NR_DUP3:
+		ret = handle_dup3(args);
+		break;
+#if (defined(HAVE_CLOSE_RANGE))
+	case TSOCKS_NR_CLOSE_RANGE:
+		ret = handle_close_range(args);
+		break;
+#endif
+	case TSOCKS_NR_IO_URING_SETUP:
+		/*
+		 * Denied like any unknown number but make it explicit since it is
+		 * expected for an application to fallback when this call fails. See
+		 * io_uring.c for the reason.
+		 */
+		DBG("[syscall] io_uring_setup is not supported by torsocks. "
+				"Denying the call");
+		ret = -1;
+		errno = ENOSYS;
+		break;
 #endif /* __linux__ */
 	default:
 		/*
@@ -478,16 +587,17 @@ LIBC_SYSCALL_DECL
 {
 	LIBC_SYSCALL_RET_TYPE ret;
 	va_list args;
+	uint64_t start;
 
-	if (!tsocks_libc_syscall) {
-		tsocks_initialize();
-		tsocks_libc_syscall= tsocks_find_libc_symbol(
-				LIBC_SYSCALL_NAME_STR, TSOCKS_SYM_EXIT_NOT_FOUND);
-	}
+	TSOCKS_PROBE2(syscall_entry, number, 0);
+	tsocks_initialize();
 
+	start = trace_begin();
 	va_start(args, number);
 	ret = tsocks_syscall(number, args);
 	va_end(args);
+	trace_call(start, TRACE_SYSCALL, -1, number, ret, NULL);
+	TSOCKS_PROBE2(syscall_return, number, ret);
 
 	return ret;
 }
@@ -550,9 +660,12 @@ LIBC___SYSCALL_DECL
 	LIBC___SYSCALL_RET_TYPE ret;
 	va_list args;
 
+	TSOCKS_PROBE2(__syscall_entry, number, 0);
+
 	va_start(args, number);
 	ret = tsocks___syscall(number, args);
 	va_end(args);
+	TSOCKS_PROBE2(__syscall_return, number, ret);
 
 	return ret;
 }
@@ -21,13 +21,24 @@
 #include <dlfcn.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
 
+#include <common/addrinfo.h>
 #include <common/config-file.h>
+#include <common/config-snapshot.h>
 #include <common/connection.h>
+#include <common/control.h>
 #include <common/defaults.h>
+#include <common/dns.h>
+#include <common/flight.h>
 #include <common/log.h>
+#include <common/metrics.h>
+#include <common/macros.h>
 #include <common/onion.h>
 #include <common/socks5.h>
+#include <common/tor-control.h>
+#include <common/trace.h>
 #include <common/utils.h>
 
 #include "torsocks.h"
@@ -47,12 +58,28 @@ struct configuration tsocks_config;
  */
 struct onion_pool tsocks_onion_pool;
 
-/* Indicate if the library was initialized previously. */
-static TSOCKS_INIT_ONCE(init_once);
+/*
+ * Indicate if the library was initialized previously. Checked by every libc
+ * hijacked call through tsocks_initialize().
+ */
+TSOCKS_INIT_ONCE(tsocks_init_once);
+
+/*
+ * Indicate if the libc symbols were looked up previously. Checked by the
+ * hijacked calls that don't need the configuration through
+ * tsocks_initialize_libc().
+ */
+TSOCKS_INIT_ONCE(tsocks_libc_once);
 
 /* Indicate if the library was cleaned up previously. */
 static TSOCKS_INIT_ONCE(term_once);
 
+/*
+ * Set to 1 if the initialization is deferred to the first network related
+ * call. Set once by the constructor.
+ */
+static int lazy_init;
+
 /*
  * Set to 1 if the binary is set with suid or 0 if not. This is set once during
  * initialization so after that it can be read without any protection.
@@ -68,6 +95,80 @@ static void clean_exit(int status)
 	exit(status);
 }
 
+/*
+ * Environment variables used by the initialization. They are copied once
+ * with the libc symbols, at the latest by the constructor, so that a lazy
+ * initialization on any thread never races with the application changing its
+ * environment and still sees it as it was at startup.
+ */
+static const char *saved_env_names[] = {
+	DEFAULT_CONF_FILE_ENV,
+	DEFAULT_SHARE_CONFIG_ENV,
+	DEFAULT_CONFIG_FD_ENV,
+	DEFAULT_ALLOW_INBOUND_ENV,
+	DEFAULT_ISOLATE_PID_ENV,
+	DEFAULT_USE_IO_URING_ENV,
+	DEFAULT_PREFER_IPV6_ENV,
+	DEFAULT_ALLOW_UDP_DNS_ENV,
+	DEFAULT_SOCKS5_USER_ENV,
+	DEFAULT_SOCKS5_PASS_ENV,
+	DEFAULT_LOG_LEVEL_ENV,
+	DEFAULT_LOG_TIME_ENV,
+	DEFAULT_LOG_FILEPATH_ENV,
+	DEFAULT_LOG_ASYNC_ENV,
+	DEFAULT_LOG_FORMAT_ENV,
+	DEFAULT_FLIGHT_ENV,
+	DEFAULT_FLIGHT_DIR_ENV,
+	DEFAULT_FLIGHT_SIGNAL_ENV,
+	DEFAULT_CONTROL_DIR_ENV,
+	DEFAULT_TRACE_FILE_ENV,
+	DEFAULT_ADDRINFO_CACHE_ENV,
+};
+static char *saved_env[ARRAY_SIZE(saved_env_names)];
+
+/*
+ * Copy the environment variables used by the initialization. Nothing is
+ * copied for a SUID binary so they all look unset.
+ */
+static void save_env(void)
+{
+	unsigned int i;
+	const char *value;
+
+	if (is_suid) {
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(saved_env_names); i++) {
+		value = getenv(saved_env_names[i]);
+		if (!value) {
+			continue;
+		}
+		saved_env[i] = strdup(value);
+		if (!saved_env[i]) {
+			/* Most likely ENOMEM thus we can't continue. */
+			clean_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Return the value the given environment variable had at startup or NULL if
+ * it was unset. Only the variables of saved_env_names are known.
+ */
+static char *get_env(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(saved_env_names); i++) {
+		if (strcmp(saved_env_names[i], name) == 0) {
+			return saved_env[i];
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Read SOCKS5 username and password environment variable and if found set them
  * in the configuration. If we are setuid, return gracefully.
@@ -75,13 +176,14 @@ static void clean_exit(int status)
 static void read_env(void)
 {
 	int ret;
-	const char *username, *password, *allow_in, *isolate_pid;
+	const char *username, *password, *allow_in, *isolate_pid, *use_io_uring,
+		  *prefer_ipv6, *allow_udp_dns;
 
 	if (is_suid) {
 		goto end;
 	}
 
-	allow_in = getenv(DEFAULT_ALLOW_INBOUND_ENV);
+	allow_in = get_env(DEFAULT_ALLOW_INBOUND_ENV);
 	if (allow_in) {
 		ret = conf_file_set_allow_inbound(allow_in, &tsocks_config);
 		if (ret < 0) {
@@ -89,7 +191,7 @@ static void read_env(void)
 		}
 	}
 
-	isolate_pid = getenv(DEFAULT_ISOLATE_PID_ENV);
+	isolate_pid = get_env(DEFAULT_ISOLATE_PID_ENV);
 	if (isolate_pid) {
 		ret = conf_file_set_isolate_pid(isolate_pid, &tsocks_config);
 		if (ret < 0) {
@@ -97,8 +199,32 @@ static void read_env(void)
 		}
 	}
 
-	username = getenv(DEFAULT_SOCKS5_USER_ENV);
-	password = getenv(DEFAULT_SOCKS5_PASS_ENV);
+	use_io_uring = get_env(DEFAULT_USE_IO_URING_ENV);
+	if (use_io_uring) {
+		ret = conf_file_set_use_io_uring(use_io_uring, &tsocks_config);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	prefer_ipv6 = get_env(DEFAULT_PREFER_IPV6_ENV);
+	if (prefer_ipv6) {
+		ret = conf_file_set_prefer_ipv6(prefer_ipv6, &tsocks_config);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	allow_udp_dns = get_env(DEFAULT_ALLOW_UDP_DNS_ENV);
+	if (allow_udp_dns) {
+		ret = conf_file_set_allow_udp_dns(allow_udp_dns, &tsocks_config);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	username = get_env(DEFAULT_SOCKS5_USER_ENV);
+	password = get_env(DEFAULT_SOCKS5_PASS_ENV);
 	if (!username && !password) {
 		goto end;
 	}
@@ -133,16 +259,12 @@ error:
 }
 
 /*
- * Initialize torsocks configuration from a given conf file or the default one.
+ * Read the given conf file or the default one and set the defaults of the
+ * missing attributes.
  */
-static void init_config(void)
+static void init_config_file(const char *filename)
 {
 	int ret;
-	const char *filename = NULL;
-
-	if (!is_suid) {
-		filename = getenv("TORSOCKS_CONF_FILE");
-	}
 
 	ret  = config_file_read(filename, &tsocks_config);
 	if (ret < 0) {
@@ -186,10 +308,46 @@ static void init_config(void)
 		 */
 		clean_exit(EXIT_FAILURE);
 	}
+}
+
+/*
+ * Initialize torsocks configuration from a given conf file or the default one.
+ */
+static void init_config(void)
+{
+	int ret, share = 0;
+	uint64_t fingerprint = 0;
+	const char *filename = NULL, *share_str;
+
+	if (!is_suid) {
+		filename = get_env(DEFAULT_CONF_FILE_ENV);
+		share_str = get_env(DEFAULT_SHARE_CONFIG_ENV);
+		share = share_str && atoi(share_str) == 1;
+	}
+
+	if (share) {
+		/*
+		 * Use the configuration of our parent if it was built from the same
+		 * file and environment. This skips the file parsing entirely.
+		 */
+		fingerprint = config_snapshot_fingerprint(filename, get_env);
+		ret = config_snapshot_load(fingerprint, &tsocks_config, get_env);
+		if (ret == 0) {
+			goto apply_auth;
+		}
+	}
+
+	init_config_file(filename);
 
 	/* Handle possible env. variables. */
 	read_env();
 
+	if (share) {
+		/* Not critical, our children will simply parse the file. */
+		(void) config_snapshot_publish(&tsocks_config, fingerprint);
+	}
+
+apply_auth:
 	/* Finalize the SOCKS auth (Isolation) settings. */
 	ret = conf_apply_socks_auth(&tsocks_config);
 	if (ret < 0) {
@@ -197,11 +355,51 @@ static void init_config(void)
 	}
 }
 
+/*
+ * Every other libc symbol hijacked by torsocks. They are all looked up once
+ * at initialization so a hijacked call never has to resolve its symbol.
+ */
+static const struct libc_symbol {
+	const char *name;
+	void **ptr;
+} libc_symbols[] = {
+	{ LIBC_ACCEPT_NAME_STR, (void **) &tsocks_libc_accept },
+	{ LIBC_BIND_NAME_STR, (void **) &tsocks_libc_bind },
+	{ LIBC_DUP_NAME_STR, (void **) &tsocks_libc_dup },
+	{ LIBC_DUP2_NAME_STR, (void **) &tsocks_libc_dup2 },
+	{ LIBC_FCLOSE_NAME_STR, (void **) &tsocks_libc_fclose },
+	{ LIBC_FCNTL_NAME_STR, (void **) &tsocks_libc_fcntl },
+	{ LIBC_GETADDRINFO_NAME_STR, (void **) &tsocks_libc_getaddrinfo },
+	{ LIBC_GETPEERNAME_NAME_STR, (void **) &tsocks_libc_getpeername },
+	{ LIBC_LISTEN_NAME_STR, (void **) &tsocks_libc_listen },
+	{ LIBC_RECVFROM_NAME_STR, (void **) &tsocks_libc_recvfrom },
+	{ LIBC_RECVMSG_NAME_STR, (void **) &tsocks_libc_recvmsg },
+	{ LIBC_SENDMSG_NAME_STR, (void **) &tsocks_libc_sendmsg },
+	{ LIBC_SENDTO_NAME_STR, (void **) &tsocks_libc_sendto },
+	{ LIBC_SOCKETPAIR_NAME_STR, (void **) &tsocks_libc_socketpair },
+#if (defined(HAVE_CLOSE_RANGE))
+	{ LIBC_CLOSE_RANGE_NAME_STR, (void **) &tsocks_libc_close_range },
+#endif
+#if (defined(HAVE_CLOSEFROM))
+	{ LIBC_CLOSEFROM_NAME_STR, (void **) &tsocks_libc_closefrom },
+#endif
+#if (defined(HAVE_FCNTL64))
+	{ LIBC_FCNTL64_NAME_STR, (void **) &tsocks_libc_fcntl64 },
+#endif
+#if (defined(__linux__))
+	{ LIBC_ACCEPT4_NAME_STR, (void **) &tsocks_libc_accept4 },
+	{ LIBC_DUP3_NAME_STR, (void **) &tsocks_libc_dup3 },
+	{ LIBC_RECVMMSG_NAME_STR, (void **) &tsocks_libc_recvmmsg },
+	{ LIBC_SENDMMSG_NAME_STR, (void **) &tsocks_libc_sendmmsg },
+#endif
+};
+
 /*
  * Save all the original libc function calls that torsocks needs.
  */
 static void init_libc_symbols(void)
 {
+	unsigned int i;
 	int ret;
 	void *libc_ptr;
 
@@ -227,6 +425,15 @@ static void init_libc_symbols(void)
 	if (ret != 0) {
 		ERR("dlclose: %s", dlerror());
 	}
+
+	for (i = 0; i < ARRAY_SIZE(libc_symbols); i++) {
+		/* fclose(3) might have been resolved lazily already. */
+		if (*libc_symbols[i].ptr) {
+			continue;
+		}
+		*libc_symbols[i].ptr = tsocks_find_libc_symbol(libc_symbols[i].name,
+				TSOCKS_SYM_EXIT_NOT_FOUND);
+	}
 	return;
 
 error:
@@ -245,12 +452,14 @@ error_dlopen:
 static void init_logging(void)
 {
 	int level;
-	const char *filepath = NULL, *level_str = NULL, *time_status_str = NULL;
+	const char *filepath = NULL, *level_str = NULL, *time_status_str = NULL,
+		  *async_str = NULL, *format_str = NULL;
 	enum log_time_status t_status;
+	enum log_format format = LOG_FORMAT_TEXT;
 
 	/* Get log level from user or use default. */
 	if (!is_suid) {
-		level_str = getenv(DEFAULT_LOG_LEVEL_ENV);
+		level_str = get_env(DEFAULT_LOG_LEVEL_ENV);
 	}
 	if (level_str) {
 		level = atoi(level_str);
@@ -261,7 +470,7 @@ static void init_logging(void)
 
 	/* Get time status from user or use default. */
 	if (!is_suid) {
-		time_status_str = getenv(DEFAULT_LOG_TIME_ENV);
+		time_status_str = get_env(DEFAULT_LOG_TIME_ENV);
 	}
 	if (time_status_str) {
 		t_status = atoi(time_status_str);
@@ -271,7 +480,7 @@ static void init_logging(void)
 
 	/* NULL value is valid which will set the output to stderr. */
 	if (!is_suid) {
-		filepath = getenv(DEFAULT_LOG_FILEPATH_ENV);
+		filepath = get_env(DEFAULT_LOG_FILEPATH_ENV);
 	}
 
 	/*
@@ -280,6 +489,21 @@ static void init_logging(void)
 	 */
 	(void) log_init(level, filepath, t_status);
 
+	/*
+	 * Asynchronous logging for when a lot is logged. The binary format is
+	 * only written by the asynchronous logger.
+	 */
+	if (!is_suid) {
+		async_str = get_env(DEFAULT_LOG_ASYNC_ENV);
+		format_str = get_env(DEFAULT_LOG_FORMAT_ENV);
+	}
+	if (format_str && strcmp(format_str, "binary") == 0) {
+		format = LOG_FORMAT_BINARY;
+	}
+	if ((async_str && atoi(async_str) == 1) || format == LOG_FORMAT_BINARY) {
+		(void) log_init_async(format);
+	}
+
 	/* After this, it is safe to call any logging macros. */
 
 	DBG("Logging subsytem initialized. Level %d, file %s, time %d",
@@ -287,23 +511,205 @@ static void init_logging(void)
 }
 
 /*
- * Lib constructor. Initialize torsocks here before the main execution of the
- * binary we are preloading.
+ * Setup the flight recorder and the control socket from the environment
+ * variables. Recording is on unless disabled but dumps need a directory.
  */
-static void tsocks_init(void)
+static void init_flight(void)
 {
 	int ret;
+	const char *enabled_str, *dir, *signal_str, *control_dir;
+
+	if (is_suid) {
+		return;
+	}
+
+	enabled_str = get_env(DEFAULT_FLIGHT_ENV);
+	if (enabled_str && atoi(enabled_str) == 0) {
+		flight_set_enabled(0);
+	}
 
+	dir = get_env(DEFAULT_FLIGHT_DIR_ENV);
+	if (dir) {
+		ret = flight_set_dump_dir(dir);
+		if (ret < 0) {
+			ERR("Flight recorder directory %s is too long", dir);
+			dir = NULL;
+		} else {
+			flight_install_crash_handlers();
+		}
+	}
+
+	signal_str = get_env(DEFAULT_FLIGHT_SIGNAL_ENV);
+	if (signal_str && dir) {
+		ret = flight_install_signal(atoi(signal_str));
+		if (ret < 0) {
+			ERR("Unable to dump the flight recorder on signal %s", signal_str);
+		}
+	}
+
+	control_dir = get_env(DEFAULT_CONTROL_DIR_ENV);
+	if (control_dir) {
+		(void) control_init(control_dir);
+	}
+}
+
+/*
+ * Start recording every hijacked call if a trace file is given.
+ */
+static void init_trace(void)
+{
+	int ret;
+	const char *path;
+
+	if (is_suid) {
+		return;
+	}
+
+	path = get_env(DEFAULT_TRACE_FILE_ENV);
+	if (!path) {
+		return;
+	}
+	ret = trace_open(path);
+	if (ret < 0) {
+		ERR("Unable to open trace file %s: %s", path, strerror(-ret));
+	}
+}
+
+/*
+ * Enable the getaddrinfo(3) result cache with the TTL of the environment, if
+ * any.
+ */
+static void init_addrinfo_cache(void)
+{
+	unsigned int ttl = DEFAULT_ADDRINFO_CACHE_TTL;
+	const char *ttl_str;
+
+	if (!is_suid) {
+		ttl_str = get_env(DEFAULT_ADDRINFO_CACHE_ENV);
+		if (ttl_str) {
+			ttl = atoi(ttl_str);
+		}
+	}
+	addrinfo_cache_init(ttl);
+}
+
+/*
+ * Point the DNS resolver to the DNSPort of Tor, if any, on the address of its
+ * SOCKS port.
+ */
+static void init_dns_resolver(void)
+{
+	struct connection_addr addr;
+
+	if (!tsocks_config.conf_file.tor_dns_port) {
+		return;
+	}
+
+	memcpy(&addr, &tsocks_config.socks5_addr, sizeof(addr));
+	if (addr.domain == CONNECTION_DOMAIN_INET6) {
+		addr.u.sin6.sin6_port = htons(tsocks_config.conf_file.tor_dns_port);
+		dns_resolver_init((const struct sockaddr *) &addr.u.sin6,
+				sizeof(addr.u.sin6));
+	} else {
+		addr.u.sin.sin_port = htons(tsocks_config.conf_file.tor_dns_port);
+		dns_resolver_init((const struct sockaddr *) &addr.u.sin,
+				sizeof(addr.u.sin));
+	}
+}
+
+/*
+ * Return 1 if resolutions may go through the ControlPort of Tor.
+ */
+static int control_configured(void)
+{
+	return tsocks_config.conf_file.tor_control_port ||
+		tsocks_config.conf_file.tor_control_socket[0] != '\0';
+}
+
+/*
+ * Point the ControlPort resolver to the control socket of Tor, if any, or to
+ * its ControlPort on the address of its SOCKS port.
+ */
+static void init_tor_control(void)
+{
+	size_t len;
+	struct config_file *conf = &tsocks_config.conf_file;
+	struct connection_addr addr;
+	struct sockaddr_un sun;
+	const char *password, *cookie_file;
+
+	if (!control_configured()) {
+		return;
+	}
+
+	password = conf->tor_control_password[0] ? conf->tor_control_password :
+		NULL;
+	cookie_file = conf->tor_control_cookie_file[0] ?
+		conf->tor_control_cookie_file : NULL;
+
+	if (conf->tor_control_socket[0]) {
+		/* Rejected when parsed, a truncated path would be another socket. */
+		len = strlen(conf->tor_control_socket);
+		if (len >= sizeof(sun.sun_path)) {
+			ERR("Tor control socket path %s is too long",
+					conf->tor_control_socket);
+			return;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		memcpy(sun.sun_path, conf->tor_control_socket, len + 1);
+		tor_control_init((const struct sockaddr *) &sun, sizeof(sun),
+				password, cookie_file);
+		return;
+	}
+
+	memcpy(&addr, &tsocks_config.socks5_addr, sizeof(addr));
+	if (addr.domain == CONNECTION_DOMAIN_INET6) {
+		addr.u.sin6.sin6_port = htons(conf->tor_control_port);
+		tor_control_init((const struct sockaddr *) &addr.u.sin6,
+				sizeof(addr.u.sin6), password, cookie_file);
+	} else {
+		addr.u.sin.sin_port = htons(conf->tor_control_port);
+		tor_control_init((const struct sockaddr *) &addr.u.sin,
+				sizeof(addr.u.sin), password, cookie_file);
+	}
+}
+
+/*
+ * Look up the libc symbols. This is the only thing done by the constructor in
+ * lazy mode since it is all that the calls not touching the network need.
+ */
+void tsocks_init_libc(void)
+{
 	/* UID and effective UID MUST be the same or else we are SUID. */
 	is_suid = (getuid() != geteuid());
+	save_env();
 
-	init_logging();
+	/* In lazy mode, logging is set up with the rest of the library. */
+	if (!lazy_init) {
+		init_logging();
+	}
 
 	/*
 	 * We need to save libc symbols *before* we override them so torsocks can
 	 * use the original libc calls.
 	 */
 	init_libc_symbols();
+}
+
+/*
+ * Initialize torsocks. Called once by the library constructor or, in lazy
+ * mode, by the first network related hijacked call.
+ */
+void tsocks_init(void)
+{
+	int ret;
+
+	tsocks_initialize_libc();
+
+	if (lazy_init) {
+		init_logging();
+	}
 
 	/*
 	 * Read configuration file and set the global config.
@@ -320,6 +726,12 @@ static void tsocks_init(void)
 	if (ret < 0) {
 		clean_exit(EXIT_FAILURE);
 	}
+
+	init_flight();
+	init_trace();
+	init_addrinfo_cache();
+	init_dns_resolver();
+	init_tor_control();
 }
 
 /*
@@ -327,33 +739,51 @@ static void tsocks_init(void)
  */
 static void tsocks_exit(void)
 {
+	/* Nothing was set up if no network call was made in lazy mode. */
+	if (__atomic_load_n(&tsocks_init_once.once, __ATOMIC_ACQUIRE)) {
+		goto end;
+	}
+
+	control_destroy();
+	trace_destroy();
+	addrinfo_cache_destroy();
+	dns_resolver_destroy();
+	tor_control_destroy();
 	/* Cleanup every entries in the onion pool. */
 	onion_pool_destroy(&tsocks_onion_pool);
 	/* Cleanup allocated memory in the config file. */
 	config_file_destroy(&tsocks_config.conf_file);
+
+end:
 	/* Clean up logging. */
 	log_destroy();
 }
 
 /*
- * Setup a Tor connection meaning initiating the initial SOCKS5 handshake.
+ * Setup a Tor connection meaning initiating the initial SOCKS5 handshake. The
+ * connection is made to the given Tor SOCKS port or the configured one if 0.
  *
  * Return 0 on success else a negative value.
  */
 static int setup_tor_connection(struct connection *conn,
-		uint8_t socks5_method)
+		uint8_t socks5_method, in_port_t port)
 {
 	int ret;
+	uint64_t start;
 
 	assert(conn);
 
 	DBG("Setting up a connection to the Tor network on fd %d", conn->fd);
 
-	ret = socks5_connect(conn);
+	start = metrics_now();
+	ret = socks5_connect_port(conn, port);
 	if (ret < 0) {
 		goto error;
 	}
+	flight_record(conn->fd, FLIGHT_TOR_CONNECTED, FLIGHT_BACKEND_SOCKET, 0, 0);
+	metrics_observe(METRICS_PHASE_CONNECT, metrics_now() - start);
 
+	start = metrics_now();
 	ret = socks5_send_method(conn, socks5_method);
 	if (ret < 0) {
 		goto error;
@@ -363,6 +793,8 @@ static int setup_tor_connection(struct connection *conn,
 	if (ret < 0) {
 		goto error;
 	}
+	flight_record(conn->fd, FLIGHT_METHOD, FLIGHT_BACKEND_SOCKET, 0, 0);
+	metrics_observe(METRICS_PHASE_METHOD, metrics_now() - start);
 
 error:
 	return ret;
@@ -417,9 +849,11 @@ static int
 auth_socks5(struct connection *conn)
 {
 	int ret;
+	uint64_t start;
 
 	assert(conn);
 
+	start = metrics_now();
 	ret = socks5_send_user_pass_request(conn,
 			tsocks_config.conf_file.socks5_username,
 			tsocks_config.conf_file.socks5_password);
@@ -431,6 +865,8 @@ auth_socks5(struct connection *conn)
 	if (ret < 0) {
 		goto error;
 	}
+	flight_record(conn->fd, FLIGHT_AUTH, FLIGHT_BACKEND_SOCKET, 0, 0);
+	metrics_observe(METRICS_PHASE_AUTH, metrics_now() - start);
 
 error:
 	return ret;
@@ -449,11 +885,21 @@ int tsocks_connect_to_tor(struct connection *conn)
 {
 	int ret;
 	uint8_t socks5_method;
+	uint64_t start, step;
+	enum flight_backend backend = FLIGHT_BACKEND_SOCKET;
 
 	assert(conn);
 
 	DBG("Connecting to the Tor network on fd %d", conn->fd);
 
+	/* A forked child needs its own control socket. */
+	control_check_fork();
+	metrics_inc(METRICS_HANDSHAKE_STARTED);
+	start = metrics_now();
+	flight_record(conn->fd, FLIGHT_CONNECT_START, backend, 0, 0);
+	TSOCKS_PROBE3(handshake_start, conn->fd, &conn->dest_addr.u,
+			conn->dest_addr.hostname.addr);
+
 	/* Is this configuration is set to use SOCKS5 authentication. */
 	if (tsocks_config.socks5_use_auth) {
 		socks5_method = SOCKS5_USER_PASS_METHOD;
@@ -461,7 +907,20 @@ int tsocks_connect_to_tor(struct connection *conn)
 		socks5_method = SOCKS5_NO_AUTH_METHOD;
 	}
 
-	ret = setup_tor_connection(conn, socks5_method);
+#ifdef HAVE_IO_URING
+	if (tsocks_config.use_io_uring) {
+		ret = socks5_uring_handshake(conn, socks5_method,
+				tsocks_config.conf_file.socks5_username,
+				tsocks_config.conf_file.socks5_password);
+		if (ret != -ENOSYS) {
+			backend = FLIGHT_BACKEND_URING;
+			goto error;
+		}
+		/* io_uring is not usable, nothing was done so use the normal path. */
+	}
+#endif
+
+	ret = setup_tor_connection(conn, socks5_method, 0);
 	if (ret < 0) {
 		goto error;
 	}
@@ -474,20 +933,236 @@ int tsocks_connect_to_tor(struct connection *conn)
 		}
 	}
 
+	step = metrics_now();
 	ret = socks5_send_connect_request(conn);
 	if (ret < 0) {
 		goto error;
 	}
+	flight_record(conn->fd, FLIGHT_REQUEST, backend, 0, 0);
+	metrics_observe(METRICS_PHASE_REQUEST, metrics_now() - step);
 
+	step = metrics_now();
 	ret = socks5_recv_connect_reply(conn);
 	if (ret < 0) {
 		goto error;
 	}
+	metrics_observe(METRICS_PHASE_REPLY, metrics_now() - step);
+
+error:
+	flight_record(conn->fd, FLIGHT_CONNECT_END, backend, 0, ret);
+	metrics_observe(METRICS_HANDSHAKE, metrics_now() - start);
+	metrics_inc(METRICS_HANDSHAKE_DONE);
+	TSOCKS_PROBE2(handshake_end, conn->fd, ret);
+	return ret;
+}
+
+/* Where a resolve request is sent. */
+enum resolve_backend {
+	RESOLVE_SOCKS,
+	RESOLVE_DNS,
+	RESOLVE_CONTROL,
+};
+
+/*
+ * A resolve request sent to Tor and, once received, its reply. It goes to the
+ * DNSPort if one is configured, else to the ControlPort for IPv4 if one is
+ * configured, else on a SOCKS connection.
+ */
+struct tor_resolve {
+	struct connection conn;
+	enum resolve_backend backend;
+	union {
+		struct dns_query dns;
+		struct tor_control_query control;
+	} query;
+	/* Family of the request, AF_UNSPEC accepting any reply. */
+	int af;
+	/* Error of the request, 0 once replied. */
+	int ret;
+	uint64_t start;
+	struct addrinfo_addr addr;
+};
+
+/*
+ * Send a resolve request for hostname to the given Tor SOCKS port or the
+ * configured one if 0. The reply is received by resolve_recv() so many
+ * requests can be sent before waiting for the first reply.
+ *
+ * Return 0 on success else a negative value that is also set in the request.
+ */
+static int resolve_send(struct tor_resolve *req, const char *hostname,
+		in_port_t port)
+{
+	int ret;
+	uint8_t socks5_method;
+
+	req->backend = RESOLVE_SOCKS;
+	req->start = metrics_now();
+	req->conn.fd = -1;
+	if (tsocks_config.conf_file.tor_dns_port && req->af != AF_UNSPEC) {
+		ret = dns_query_send(hostname,
+				req->af == AF_INET6 ? DNS_TYPE_AAAA : DNS_TYPE_A,
+				&req->query.dns);
+		if (ret == 0) {
+			req->backend = RESOLVE_DNS;
+			flight_record(-1, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_DNS, 0, 0);
+			TSOCKS_PROBE2(resolve_start, -1, hostname);
+			goto error;
+		}
+		if (ret != -EAGAIN) {
+			metrics_inc(METRICS_RESOLVE_ERROR);
+			goto error;
+		}
+		/* Too many queries in flight, this one goes on a SOCKS connection. */
+		DBG("[dns] No query slot left, resolving %s with SOCKS", hostname);
+	} else if (control_configured() && req->af != AF_INET6) {
+		/* The RESOLVE command of Tor gives IPv4 addresses. */
+		ret = tor_control_resolve_send(hostname, 0, &req->query.control);
+		if (ret == 0) {
+			req->backend = RESOLVE_CONTROL;
+			flight_record(-1, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_CONTROL, 0,
+					0);
+			TSOCKS_PROBE2(resolve_start, -1, hostname);
+			goto error;
+		}
+		/*
+		 * No slot left, a name the control protocol can't carry or no
+		 * connection to the ControlPort: SOCKS can still do it.
+		 */
+		DBG("[tor-control] Resolving %s with SOCKS: %d", hostname, ret);
+	}
+
+	/* The family of the socket is the one of Tor, not the resolved one. */
+	req->conn.dest_addr.domain = tsocks_config.socks5_addr.domain;
+	req->conn.fd = tsocks_libc_socket(
+			req->conn.dest_addr.domain == CONNECTION_DOMAIN_INET6 ?
+			AF_INET6 : AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (req->conn.fd < 0) {
+		PERROR("socket");
+		ret = -errno;
+		metrics_inc(METRICS_RESOLVE_ERROR);
+		goto error;
+	}
+	flight_record(req->conn.fd, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_SOCKET,
+			0, 0);
+	TSOCKS_PROBE2(resolve_start, req->conn.fd, hostname);
+
+	/* Is this configuration is set to use SOCKS5 authentication. */
+	if (tsocks_config.socks5_use_auth) {
+		socks5_method = SOCKS5_USER_PASS_METHOD;
+	} else {
+		socks5_method = SOCKS5_NO_AUTH_METHOD;
+	}
+
+	ret = setup_tor_connection(&req->conn, socks5_method, port);
+	if (ret < 0) {
+		goto error;
+	}
+
+	/* For the user/pass method, send the request before resolve. */
+	if (socks5_method == SOCKS5_USER_PASS_METHOD) {
+		ret = auth_socks5(&req->conn);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	ret = socks5_send_resolve_request(hostname, &req->conn);
 
 error:
+	req->ret = ret;
+	return ret;
+}
+
+/*
+ * Receive the reply of a request sent by resolve_send() and close its
+ * connection. A reply of another family than the one of the request is an
+ * error.
+ *
+ * Return 0 on success else a negative value that is also set in the request.
+ */
+static int resolve_recv(struct tor_resolve *req)
+{
+	int ret = req->ret;
+	enum flight_backend backend;
+	struct dns_answer dns_answer;
+	struct tor_control_answer control_answer;
+
+	if (req->backend == RESOLVE_SOCKS && req->conn.fd < 0) {
+		/* Nothing was sent. */
+		goto end;
+	}
+
+	switch (req->backend) {
+	case RESOLVE_DNS:
+		backend = FLIGHT_BACKEND_DNS;
+		ret = dns_query_wait(&req->query.dns, &dns_answer);
+		if (ret == 0) {
+			req->addr.af = req->af;
+			if (req->af == AF_INET6) {
+				req->addr.u.v6 = dns_answer.u.v6;
+			} else {
+				req->addr.u.v4 = dns_answer.u.v4;
+			}
+		} else if (ret == -ENODATA) {
+			/* The name exists but has no address of that family. */
+			ret = -EAFNOSUPPORT;
+		}
+		break;
+	case RESOLVE_CONTROL:
+		backend = FLIGHT_BACKEND_CONTROL;
+		ret = tor_control_resolve_wait(&req->query.control, &control_answer);
+		if (ret == 0) {
+			req->addr.af = control_answer.af;
+			if (control_answer.af == AF_INET6) {
+				req->addr.u.v6 = control_answer.u.v6;
+			} else {
+				req->addr.u.v4 = control_answer.u.v4;
+			}
+		}
+		break;
+	case RESOLVE_SOCKS:
+	default:
+		backend = FLIGHT_BACKEND_SOCKET;
+		if (ret == 0) {
+			ret = socks5_recv_resolve_reply(&req->conn, &req->addr.u,
+					sizeof(req->addr.u), &req->addr.af);
+		}
+		break;
+	}
+	if (ret == 0 && req->af != AF_UNSPEC && req->addr.af != req->af) {
+		DBG("Resolve reply of family %d instead of %d", req->addr.af, req->af);
+		ret = -EAFNOSUPPORT;
+	}
+
+	flight_record(req->conn.fd, FLIGHT_RESOLVE_END, backend, 0, ret);
+	TSOCKS_PROBE2(resolve_end, req->conn.fd, ret);
+	metrics_observe(METRICS_RESOLVE, metrics_now() - req->start);
+	metrics_inc(ret < 0 ? METRICS_RESOLVE_ERROR : METRICS_RESOLVE_MISS);
+	if (req->conn.fd >= 0 && tsocks_libc_close(req->conn.fd) < 0) {
+		PERROR("close");
+	}
+	req->conn.fd = -1;
+	req->backend = RESOLVE_SOCKS;
+
+end:
+	req->ret = ret;
 	return ret;
 }
 
+/*
+ * Return the Tor SOCKS port to send the resolve requests of the given family
+ * to, 0 being the configured one.
+ *
+ * Tor answers a resolve request with an IPv6 address only if its SocksPort
+ * has the IPv6Traffic and PreferIPv6 flags, so IPv6 requests go to the port
+ * set up for them if any.
+ */
+static in_port_t resolve_port(int af)
+{
+	return af == AF_INET6 ? tsocks_config.conf_file.tor_ipv6_port : 0;
+}
+
 /*
  * Resolve a hostname through Tor and set the ip address in the given pointer.
  *
@@ -497,21 +1172,15 @@ int tsocks_tor_resolve(int af, const char *hostname, void *ip_addr)
 {
 	int ret;
 	size_t addr_len;
-	struct connection conn;
-	uint8_t socks5_method;
+	struct tor_resolve req;
 
 	assert(hostname);
 	assert(ip_addr);
 
 	if (af == AF_INET) {
-		addr_len = sizeof(uint32_t);
-		conn.dest_addr.domain = CONNECTION_DOMAIN_INET;
+		addr_len = sizeof(struct in_addr);
 	} else if (af == AF_INET6) {
-		addr_len = 16;
-		conn.dest_addr.domain = CONNECTION_DOMAIN_INET6;
-		/* Tor daemon does not support IPv6 DNS resolution yet. */
-		ret = -ENOSYS;
-		goto error;
+		addr_len = sizeof(struct in6_addr);
 	} else {
 		ret = -EINVAL;
 		goto error;
@@ -520,6 +1189,7 @@ int tsocks_tor_resolve(int af, const char *hostname, void *ip_addr)
 	ret = utils_localhost_resolve(hostname, af, ip_addr, addr_len);
 	if (ret) {
 		/* Found to be a localhost name. */
+		metrics_inc(METRICS_RESOLVE_HIT);
 		ret = 0;
 		goto end;
 	}
@@ -534,58 +1204,209 @@ int tsocks_tor_resolve(int af, const char *hostname, void *ip_addr)
 	if (utils_strcasecmpend(hostname, ".onion") == 0) {
 		struct onion_entry *entry;
 
+		/* The cookies are IPv4 addresses. */
+		if (af != AF_INET) {
+			ret = -EAFNOSUPPORT;
+			goto error;
+		}
+
 		entry = get_onion_entry(hostname, &tsocks_onion_pool);
 		if (entry) {
 			memcpy(ip_addr, &entry->ip, sizeof(entry->ip));
+			metrics_inc(METRICS_RESOLVE_HIT);
 			ret = 0;
 			goto end;
 		}
 	}
 
-	conn.fd = tsocks_libc_socket(af, SOCK_STREAM, IPPROTO_TCP);
-	if (conn.fd < 0) {
-		PERROR("socket");
-		ret = -errno;
-		goto error;
+	req.af = af;
+	(void) resolve_send(&req, hostname, resolve_port(af));
+	ret = resolve_recv(&req);
+	if (ret < 0) {
+		goto end;
 	}
 
-	/* Is this configuration is set to use SOCKS5 authentication. */
-	if (tsocks_config.socks5_use_auth) {
-		socks5_method = SOCKS5_USER_PASS_METHOD;
-	} else {
-		socks5_method = SOCKS5_NO_AUTH_METHOD;
+	memcpy(ip_addr, &req.addr.u, addr_len);
+
+end:
+	return ret;
+
+error:
+	metrics_inc(METRICS_RESOLVE_ERROR);
+	return ret;
+}
+
+/*
+ * Resolve a hostname through Tor for any address family. Its addresses, at
+ * most one per family, are set in addrs with the IPv6 one first only if it
+ * is preferred.
+ *
+ * If a Tor DNSPort or a Tor SOCKS port for IPv6 is set up, the IPv4 and IPv6
+ * requests are both sent before waiting for a reply so Tor resolves them at
+ * the same time. Else the address is the one Tor answers on its ControlPort
+ * or SOCKS port.
+ *
+ * Return the number of addresses on success else a negative value.
+ */
+int tsocks_tor_resolve_all(const char *hostname, struct addrinfo_addr *addrs)
+{
+	int ret;
+	unsigned int i, nb = 0;
+	struct tor_resolve reqs[2];
+	const int families[2] = {
+		tsocks_config.prefer_ipv6 ? AF_INET6 : AF_INET,
+		tsocks_config.prefer_ipv6 ? AF_INET : AF_INET6,
+	};
+
+	assert(hostname);
+	assert(addrs);
+
+	for (i = 0; i < ARRAY_SIZE(families); i++) {
+		if (utils_localhost_resolve(hostname, families[i], &addrs[nb].u,
+					sizeof(addrs[nb].u))) {
+			addrs[nb++].af = families[i];
+		}
+	}
+	if (nb) {
+		/* Found to be a localhost name. */
+		metrics_inc(METRICS_RESOLVE_HIT);
+		ret = nb;
+		goto end;
 	}
 
-	ret = setup_tor_connection(&conn, socks5_method);
-	if (ret < 0) {
-		goto end_close;
+	/* The cookies of the onion addresses are IPv4 only. */
+	if (utils_strcasecmpend(hostname, ".onion") == 0) {
+		ret = tsocks_tor_resolve(AF_INET, hostname, &addrs[0].u.v4);
+		if (ret < 0) {
+			goto end;
+		}
+		addrs[0].af = AF_INET;
+		ret = 1;
+		goto end;
 	}
 
-	/* For the user/pass method, send the request before resolve. */
-	if (socks5_method == SOCKS5_USER_PASS_METHOD) {
-		ret = auth_socks5(&conn);
+	DBG("Resolving %s for any family on the Tor network", hostname);
+
+	if (!tsocks_config.conf_file.tor_ipv6_port &&
+			!tsocks_config.conf_file.tor_dns_port) {
+		reqs[0].af = AF_UNSPEC;
+		(void) resolve_send(&reqs[0], hostname, 0);
+		ret = resolve_recv(&reqs[0]);
 		if (ret < 0) {
-			goto end_close;
+			goto end;
+		}
+		addrs[0] = reqs[0].addr;
+		ret = 1;
+		goto end;
+	}
+
+	/* Every request is in flight before waiting for the first reply. */
+	for (i = 0; i < ARRAY_SIZE(reqs); i++) {
+		reqs[i].af = families[i];
+		(void) resolve_send(&reqs[i], hostname, resolve_port(families[i]));
+	}
+	for (i = 0; i < ARRAY_SIZE(reqs); i++) {
+		if (resolve_recv(&reqs[i]) == 0) {
+			addrs[nb++] = reqs[i].addr;
 		}
 	}
 
-	ret = socks5_send_resolve_request(hostname, &conn);
+	/* The error of the first family is the one reported. */
+	ret = nb ? (int) nb : reqs[0].ret;
+
+end:
+	return ret;
+}
+
+/*
+ * Resolve an address to its name with a PTR query to the DNSPort of Tor. The
+ * name is allocated in *ip.
+ *
+ * Return 0 on success, -EAGAIN if too many queries are in flight or else a
+ * negative value.
+ */
+static int resolve_ptr_dns(const void *addr, char **ip, int af)
+{
+	int ret;
+	uint64_t start;
+	struct dns_query query;
+	struct dns_answer answer;
+	char name[DNS_PTR_NAME_MAX];
+
+	ret = dns_ptr_name(af, addr, name, sizeof(name));
 	if (ret < 0) {
-		goto end_close;
+		goto end;
 	}
 
-	/* Force IPv4 resolution for now. */
-	ret = socks5_recv_resolve_reply(&conn, ip_addr, addr_len);
+	start = metrics_now();
+	ret = dns_query_send(name, DNS_TYPE_PTR, &query);
 	if (ret < 0) {
-		goto end_close;
+		goto end;
+	}
+	flight_record(-1, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_DNS, 0, 0);
+	TSOCKS_PROBE2(resolve_start, -1, (const char *) name);
+
+	ret = dns_query_wait(&query, &answer);
+	if (ret == 0) {
+		*ip = strdup(answer.u.name);
+		if (!*ip) {
+			ret = -ENOMEM;
+		}
 	}
 
-end_close:
-	if (tsocks_libc_close(conn.fd) < 0) {
-		PERROR("close");
+	flight_record(-1, FLIGHT_RESOLVE_END, FLIGHT_BACKEND_DNS, 0, ret);
+	TSOCKS_PROBE2(resolve_end, -1, ret);
+	metrics_observe(METRICS_RESOLVE, metrics_now() - start);
+	metrics_inc(ret < 0 ? METRICS_RESOLVE_ERROR : METRICS_RESOLVE_MISS);
+
+end:
+	return ret;
+}
+
+/*
+ * Resolve an address to its name with a reverse RESOLVE command to the
+ * ControlPort of Tor. The name is allocated in *ip.
+ *
+ * Return 0 on success, -EAGAIN if the command could not be sent or else a
+ * negative value.
+ */
+static int resolve_ptr_control(const void *addr, char **ip, int af)
+{
+	int ret;
+	uint64_t start;
+	struct tor_control_query query;
+	struct tor_control_answer answer;
+	char text[INET6_ADDRSTRLEN];
+
+	if (!inet_ntop(af, addr, text, sizeof(text))) {
+		ret = -errno;
+		goto end;
 	}
+
+	start = metrics_now();
+	ret = tor_control_resolve_send(text, 1, &query);
+	if (ret < 0) {
+		DBG("[tor-control] Resolving %s with SOCKS: %d", text, ret);
+		ret = -EAGAIN;
+		goto end;
+	}
+	flight_record(-1, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_CONTROL, 0, 0);
+	TSOCKS_PROBE2(resolve_start, -1, (const char *) text);
+
+	ret = tor_control_resolve_wait(&query, &answer);
+	if (ret == 0) {
+		*ip = strdup(answer.u.name);
+		if (!*ip) {
+			ret = -ENOMEM;
+		}
+	}
+
+	flight_record(-1, FLIGHT_RESOLVE_END, FLIGHT_BACKEND_CONTROL, 0, ret);
+	TSOCKS_PROBE2(resolve_end, -1, ret);
+	metrics_observe(METRICS_RESOLVE, metrics_now() - start);
+	metrics_inc(ret < 0 ? METRICS_RESOLVE_ERROR : METRICS_RESOLVE_MISS);
+
 end:
-error:
 	return ret;
 }
 
@@ -597,6 +1418,7 @@ error:
 int tsocks_tor_resolve_ptr(const char *addr, char **ip, int af)
 {
 	int ret;
+	uint64_t start;
 	struct connection conn;
 	uint8_t socks5_method;
 
@@ -605,12 +1427,28 @@ int tsocks_tor_resolve_ptr(const char *addr, char **ip, int af)
 
 	DBG("Resolving %" PRIu32 " on the Tor network", addr);
 
+	if (tsocks_config.conf_file.tor_dns_port) {
+		ret = resolve_ptr_dns(addr, ip, af);
+		if (ret != -EAGAIN) {
+			return ret;
+		}
+		/* Too many queries in flight, this one goes on a SOCKS connection. */
+	} else if (control_configured()) {
+		ret = resolve_ptr_control(addr, ip, af);
+		if (ret != -EAGAIN) {
+			return ret;
+		}
+	}
+
+	start = metrics_now();
 	conn.fd = tsocks_libc_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (conn.fd < 0) {
 		PERROR("socket");
 		ret = -errno;
 		goto error;
 	}
+	flight_record(conn.fd, FLIGHT_RESOLVE_START, FLIGHT_BACKEND_SOCKET, 0, 0);
+	TSOCKS_PROBE2(resolve_start, conn.fd, addr);
 	conn.dest_addr.domain = CONNECTION_DOMAIN_INET;
 
 	/* Is this configuration is set to use SOCKS5 authentication. */
@@ -620,7 +1458,7 @@ int tsocks_tor_resolve_ptr(const char *addr, char **ip, int af)
 		socks5_method = SOCKS5_NO_AUTH_METHOD;
 	}
 
-	ret = setup_tor_connection(&conn, socks5_method);
+	ret = setup_tor_connection(&conn, socks5_method, 0);
 	if (ret < 0) {
 		goto end_close;
 	}
@@ -645,11 +1483,17 @@ int tsocks_tor_resolve_ptr(const char *addr, char **ip, int af)
 	}
 
 end_close:
+	flight_record(conn.fd, FLIGHT_RESOLVE_END, FLIGHT_BACKEND_SOCKET, 0, ret);
+	TSOCKS_PROBE2(resolve_end, conn.fd, ret);
+	metrics_observe(METRICS_RESOLVE, metrics_now() - start);
+	metrics_inc(ret < 0 ? METRICS_RESOLVE_ERROR : METRICS_RESOLVE_MISS);
 	if (tsocks_libc_close(conn.fd) < 0) {
 		PERROR("close");
 	}
+	return ret;
 
 error:
+	metrics_inc(METRICS_RESOLVE_ERROR);
 	return ret;
 }
 
@@ -678,11 +1522,27 @@ void *tsocks_find_libc_symbol(const char *symbol,
 }
 
 /*
- * Initialize torsocks library.
+ * Lib constructor. Initialize torsocks here before the main execution of the
+ * binary we are preloading.
  */
-void __attribute__((constructor)) tsocks_initialize(void)
+static void __attribute__((constructor)) tsocks_constructor(void)
 {
-	tsocks_once(&init_once, &tsocks_init);
+	const char *lazy = NULL;
+
+	/* Never trust the environment of a SUID binary. */
+	if (getuid() == geteuid()) {
+		lazy = getenv(DEFAULT_LAZY_INIT_ENV);
+	}
+	if (lazy && atoi(lazy) == 1) {
+		/*
+		 * Most processes never use the network so only look up the libc
+		 * symbols. The rest is done by the first network related call.
+		 */
+		lazy_init = 1;
+		tsocks_initialize_libc();
+	} else {
+		tsocks_initialize();
+	}
 }
 
 /*
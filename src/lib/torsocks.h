@@ -22,6 +22,7 @@
 
 #include <common/compat.h>
 #include <common/config-file.h>
+#include <common/probes.h>
 
 /*
  * This defines a function pointer to the original libc call of "name" so the
@@ -86,17 +87,6 @@
 /* gethostbyname(3) - DEPRECATED in glibc. */
 #include <netdb.h>
 
-/*
- * The man page specifies that this call can return a pointers to static data
- * meaning that the caller needs to copy the returned data and not forced to
- * use free(). So, we use static memory here to mimic the libc call and avoid
- * memory leaks. This also void the need of hijacking freehostent(3).
- */
-extern struct hostent tsocks_he;
-extern char *tsocks_he_addr_list[2];
-extern char tsocks_he_addr[INET_ADDRSTRLEN];
-extern char tsocks_he_name[255];
-
 #define LIBC_GETHOSTBYNAME_NAME gethostbyname
 #define LIBC_GETHOSTBYNAME_NAME_STR XSTR(LIBC_GETHOSTBYNAME_NAME)
 #define LIBC_GETHOSTBYNAME_RET_TYPE struct hostent *
@@ -160,6 +150,105 @@ struct hostent **result, int *h_errnop
 	struct addrinfo **res
 #define LIBC_GETADDRINFO_ARGS  node, service, hints, res
 
+/*
+ * The asynchronous getaddrinfo(3) of glibc, in libanl before 2.34. Those are
+ * never looked up, torsocks runs the requests itself.
+ */
+#if (defined(__GLIBC__))
+struct gaicb;
+struct sigevent;
+
+/* getaddrinfo_a(3) */
+#define LIBC_GETADDRINFO_A_NAME getaddrinfo_a
+#define LIBC_GETADDRINFO_A_RET_TYPE int
+#define LIBC_GETADDRINFO_A_SIG \
+	int mode, struct gaicb *list[], int nitems, struct sigevent *sevp
+#define LIBC_GETADDRINFO_A_ARGS mode, list, nitems, sevp
+
+/* gai_suspend(3) */
+#define LIBC_GAI_SUSPEND_NAME gai_suspend
+#define LIBC_GAI_SUSPEND_RET_TYPE int
+#define LIBC_GAI_SUSPEND_SIG \
+	const struct gaicb *const list[], int nitems, \
+	const struct timespec *timeout
+#define LIBC_GAI_SUSPEND_ARGS list, nitems, timeout
+
+/* gai_error(3) */
+#define LIBC_GAI_ERROR_NAME gai_error
+#define LIBC_GAI_ERROR_RET_TYPE int
+#define LIBC_GAI_ERROR_SIG struct gaicb *req
+#define LIBC_GAI_ERROR_ARGS req
+
+/* gai_cancel(3) */
+#define LIBC_GAI_CANCEL_NAME gai_cancel
+#define LIBC_GAI_CANCEL_RET_TYPE int
+#define LIBC_GAI_CANCEL_SIG struct gaicb *req
+#define LIBC_GAI_CANCEL_ARGS req
+#endif /* __GLIBC__ */
+
+/*
+ * The resolver of resolv.h, in libresolv before glibc 2.34. Those are never
+ * looked up, torsocks answers the queries itself.
+ */
+struct __res_state;
+
+/* res_query(3) */
+#define LIBC_RES_QUERY_NAME res_query
+#define LIBC_RES_QUERY_RET_TYPE int
+#define LIBC_RES_QUERY_SIG \
+	const char *dname, int class, int type, unsigned char *answer, int anslen
+#define LIBC_RES_QUERY_ARGS dname, class, type, answer, anslen
+
+/* res_search(3) */
+#define LIBC_RES_SEARCH_NAME res_search
+#define LIBC_RES_SEARCH_RET_TYPE int
+#define LIBC_RES_SEARCH_SIG \
+	const char *dname, int class, int type, unsigned char *answer, int anslen
+#define LIBC_RES_SEARCH_ARGS dname, class, type, answer, anslen
+
+/* res_querydomain(3) */
+#define LIBC_RES_QUERYDOMAIN_NAME res_querydomain
+#define LIBC_RES_QUERYDOMAIN_RET_TYPE int
+#define LIBC_RES_QUERYDOMAIN_SIG \
+	const char *name, const char *domain, int class, int type, \
+	unsigned char *answer, int anslen
+#define LIBC_RES_QUERYDOMAIN_ARGS name, domain, class, type, answer, anslen
+
+/* res_send(3) */
+#define LIBC_RES_SEND_NAME res_send
+#define LIBC_RES_SEND_RET_TYPE int
+#define LIBC_RES_SEND_SIG \
+	const unsigned char *msg, int msglen, unsigned char *answer, int anslen
+#define LIBC_RES_SEND_ARGS msg, msglen, answer, anslen
+
+/* res_nquery(3) */
+#define LIBC_RES_NQUERY_NAME res_nquery
+#define LIBC_RES_NQUERY_RET_TYPE int
+#define LIBC_RES_NQUERY_SIG \
+	struct __res_state *statp, LIBC_RES_QUERY_SIG
+#define LIBC_RES_NQUERY_ARGS statp, LIBC_RES_QUERY_ARGS
+
+/* res_nsearch(3) */
+#define LIBC_RES_NSEARCH_NAME res_nsearch
+#define LIBC_RES_NSEARCH_RET_TYPE int
+#define LIBC_RES_NSEARCH_SIG \
+	struct __res_state *statp, LIBC_RES_SEARCH_SIG
+#define LIBC_RES_NSEARCH_ARGS statp, LIBC_RES_SEARCH_ARGS
+
+/* res_nquerydomain(3) */
+#define LIBC_RES_NQUERYDOMAIN_NAME res_nquerydomain
+#define LIBC_RES_NQUERYDOMAIN_RET_TYPE int
+#define LIBC_RES_NQUERYDOMAIN_SIG \
+	struct __res_state *statp, LIBC_RES_QUERYDOMAIN_SIG
+#define LIBC_RES_NQUERYDOMAIN_ARGS statp, LIBC_RES_QUERYDOMAIN_ARGS
+
+/* res_nsend(3) */
+#define LIBC_RES_NSEND_NAME res_nsend
+#define LIBC_RES_NSEND_RET_TYPE int
+#define LIBC_RES_NSEND_SIG \
+	struct __res_state *statp, LIBC_RES_SEND_SIG
+#define LIBC_RES_NSEND_ARGS statp, LIBC_RES_SEND_ARGS
+
 /* getpeername(2) */
 #include <sys/socket.h>
 
@@ -179,6 +268,25 @@ struct hostent **result, int *h_errnop
 #define LIBC_RECVMSG_ARGS \
 	sockfd, msg, flags
 
+/* recvfrom(2) */
+#define LIBC_RECVFROM_NAME recvfrom
+#define LIBC_RECVFROM_NAME_STR XSTR(LIBC_RECVFROM_NAME)
+#define LIBC_RECVFROM_RET_TYPE ssize_t
+#define LIBC_RECVFROM_SIG \
+	int sockfd, void *buf, size_t len, int flags,\
+	struct sockaddr *src_addr, socklen_t *addrlen
+#define LIBC_RECVFROM_ARGS \
+	sockfd, buf, len, flags, src_addr, addrlen
+
+/* sendmsg(2) */
+#define LIBC_SENDMSG_NAME sendmsg
+#define LIBC_SENDMSG_NAME_STR XSTR(LIBC_SENDMSG_NAME)
+#define LIBC_SENDMSG_RET_TYPE ssize_t
+#define LIBC_SENDMSG_SIG \
+	int sockfd, const struct msghdr *msg, int flags
+#define LIBC_SENDMSG_ARGS \
+	sockfd, msg, flags
+
 /* sendto(2) */
 #define LIBC_SENDTO_NAME sendto
 #define LIBC_SENDTO_NAME_STR XSTR(LIBC_SENDTO_NAME)
@@ -205,6 +313,56 @@ struct hostent **result, int *h_errnop
 	int sockfd, int backlog
 #define LIBC_LISTEN_ARGS sockfd, backlog
 
+/* bind(2) */
+#define LIBC_BIND_NAME bind
+#define LIBC_BIND_NAME_STR XSTR(LIBC_BIND_NAME)
+#define LIBC_BIND_RET_TYPE int
+#define LIBC_BIND_SIG \
+	int sockfd, const struct sockaddr *addr, socklen_t addrlen
+#define LIBC_BIND_ARGS sockfd, addr, addrlen
+
+/* dup(2) */
+#define LIBC_DUP_NAME dup
+#define LIBC_DUP_NAME_STR XSTR(LIBC_DUP_NAME)
+#define LIBC_DUP_RET_TYPE int
+#define LIBC_DUP_SIG int oldfd
+#define LIBC_DUP_ARGS oldfd
+
+/* dup2(2) */
+#define LIBC_DUP2_NAME dup2
+#define LIBC_DUP2_NAME_STR XSTR(LIBC_DUP2_NAME)
+#define LIBC_DUP2_RET_TYPE int
+#define LIBC_DUP2_SIG int oldfd, int newfd
+#define LIBC_DUP2_ARGS oldfd, newfd
+
+/* fcntl(2), its argument is passed along as a pointer like the libc does. */
+#define LIBC_FCNTL_NAME fcntl
+#define LIBC_FCNTL_NAME_STR XSTR(LIBC_FCNTL_NAME)
+#define LIBC_FCNTL_RET_TYPE int
+#define LIBC_FCNTL_SIG int fd, int cmd, ...
+#define LIBC_FCNTL_ARGS fd, cmd, arg
+
+/* fcntl64(2) of glibc, fcntl(2) with a 64 bit off_t. */
+#define LIBC_FCNTL64_NAME fcntl64
+#define LIBC_FCNTL64_NAME_STR XSTR(LIBC_FCNTL64_NAME)
+#define LIBC_FCNTL64_RET_TYPE int
+#define LIBC_FCNTL64_SIG int fd, int cmd, ...
+#define LIBC_FCNTL64_ARGS fd, cmd, arg
+
+/* close_range(2) */
+#define LIBC_CLOSE_RANGE_NAME close_range
+#define LIBC_CLOSE_RANGE_NAME_STR XSTR(LIBC_CLOSE_RANGE_NAME)
+#define LIBC_CLOSE_RANGE_RET_TYPE int
+#define LIBC_CLOSE_RANGE_SIG unsigned int first, unsigned int last, int flags
+#define LIBC_CLOSE_RANGE_ARGS first, last, flags
+
+/* closefrom(3) */
+#define LIBC_CLOSEFROM_NAME closefrom
+#define LIBC_CLOSEFROM_NAME_STR XSTR(LIBC_CLOSEFROM_NAME)
+#define LIBC_CLOSEFROM_RET_TYPE void
+#define LIBC_CLOSEFROM_SIG int lowfd
+#define LIBC_CLOSEFROM_ARGS lowfd
+
 #else
 #error "OS not supported."
 #endif /* __GLIBC__ , __FreeBSD__, __darwin__, __NetBSD__ */
@@ -228,6 +386,70 @@ struct hostent **result, int *h_errnop
 	int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags
 #define LIBC_ACCEPT4_ARGS sockfd, addr, addrlen, flags
 
+/* recvmmsg(2) */
+struct mmsghdr;
+struct timespec;
+#define LIBC_RECVMMSG_NAME recvmmsg
+#define LIBC_RECVMMSG_NAME_STR XSTR(LIBC_RECVMMSG_NAME)
+#define LIBC_RECVMMSG_RET_TYPE int
+#define LIBC_RECVMMSG_SIG \
+	int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, \
+	struct timespec *timeout
+#define LIBC_RECVMMSG_ARGS \
+	sockfd, msgvec, vlen, flags, timeout
+
+/* sendmmsg(2) */
+#define LIBC_SENDMMSG_NAME sendmmsg
+#define LIBC_SENDMMSG_NAME_STR XSTR(LIBC_SENDMMSG_NAME)
+#define LIBC_SENDMMSG_RET_TYPE int
+#define LIBC_SENDMMSG_SIG \
+	int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags
+#define LIBC_SENDMMSG_ARGS \
+	sockfd, msgvec, vlen, flags
+
+/* dup3(2) */
+#define LIBC_DUP3_NAME dup3
+#define LIBC_DUP3_NAME_STR XSTR(LIBC_DUP3_NAME)
+#define LIBC_DUP3_RET_TYPE int
+#define LIBC_DUP3_SIG int oldfd, int newfd, int flags
+#define LIBC_DUP3_ARGS oldfd, newfd, flags
+
+/*
+ * The liburing entry points creating a ring. Those are not libc symbols thus
+ * they are never looked up, torsocks does not call them.
+ */
+struct io_uring;
+struct io_uring_params;
+
+/* io_uring_setup(2) wrapper of liburing. */
+#define LIBC_IO_URING_SETUP_NAME io_uring_setup
+#define LIBC_IO_URING_SETUP_RET_TYPE int
+#define LIBC_IO_URING_SETUP_SIG \
+	unsigned int entries, struct io_uring_params *p
+#define LIBC_IO_URING_SETUP_ARGS entries, p
+
+/* io_uring_queue_init(3) */
+#define LIBC_IO_URING_QUEUE_INIT_NAME io_uring_queue_init
+#define LIBC_IO_URING_QUEUE_INIT_RET_TYPE int
+#define LIBC_IO_URING_QUEUE_INIT_SIG \
+	unsigned int entries, struct io_uring *ring, unsigned int flags
+#define LIBC_IO_URING_QUEUE_INIT_ARGS entries, ring, flags
+
+/* io_uring_queue_init_params(3) */
+#define LIBC_IO_URING_QUEUE_INIT_PARAMS_NAME io_uring_queue_init_params
+#define LIBC_IO_URING_QUEUE_INIT_PARAMS_RET_TYPE int
+#define LIBC_IO_URING_QUEUE_INIT_PARAMS_SIG \
+	unsigned int entries, struct io_uring *ring, struct io_uring_params *p
+#define LIBC_IO_URING_QUEUE_INIT_PARAMS_ARGS entries, ring, p
+
+/* io_uring_queue_init_mem(3) */
+#define LIBC_IO_URING_QUEUE_INIT_MEM_NAME io_uring_queue_init_mem
+#define LIBC_IO_URING_QUEUE_INIT_MEM_RET_TYPE int
+#define LIBC_IO_URING_QUEUE_INIT_MEM_SIG \
+	unsigned int entries, struct io_uring *ring, struct io_uring_params *p, \
+	void *buf, size_t buf_size
+#define LIBC_IO_URING_QUEUE_INIT_MEM_ARGS entries, ring, p, buf, buf_size
+
 #endif /* __linux__ */
 
 #if (defined(__FreeBSD__) || defined(__darwin__) || defined(__NetBSD__))
@@ -288,6 +510,31 @@ TSOCKS_DECL(recvmsg, LIBC_RECVMSG_RET_TYPE, LIBC_RECVMSG_SIG)
 #define LIBC_RECVMSG_DECL \
 		LIBC_RECVMSG_RET_TYPE LIBC_RECVMSG_NAME(LIBC_RECVMSG_SIG)
 
+/* recvfrom(2) */
+extern TSOCKS_LIBC_DECL(recvfrom, LIBC_RECVFROM_RET_TYPE, LIBC_RECVFROM_SIG)
+TSOCKS_DECL(recvfrom, LIBC_RECVFROM_RET_TYPE, LIBC_RECVFROM_SIG)
+#define LIBC_RECVFROM_DECL \
+		LIBC_RECVFROM_RET_TYPE LIBC_RECVFROM_NAME(LIBC_RECVFROM_SIG)
+
+/* recvmmsg(2) and sendmmsg(2) */
+#if (defined(__linux__))
+extern TSOCKS_LIBC_DECL(recvmmsg, LIBC_RECVMMSG_RET_TYPE, LIBC_RECVMMSG_SIG)
+TSOCKS_DECL(recvmmsg, LIBC_RECVMMSG_RET_TYPE, LIBC_RECVMMSG_SIG)
+#define LIBC_RECVMMSG_DECL \
+		LIBC_RECVMMSG_RET_TYPE LIBC_RECVMMSG_NAME(LIBC_RECVMMSG_SIG)
+
+extern TSOCKS_LIBC_DECL(sendmmsg, LIBC_SENDMMSG_RET_TYPE, LIBC_SENDMMSG_SIG)
+TSOCKS_DECL(sendmmsg, LIBC_SENDMMSG_RET_TYPE, LIBC_SENDMMSG_SIG)
+#define LIBC_SENDMMSG_DECL \
+		LIBC_SENDMMSG_RET_TYPE LIBC_SENDMMSG_NAME(LIBC_SENDMMSG_SIG)
+#endif
+
+/* sendmsg(2) */
+extern TSOCKS_LIBC_DECL(sendmsg, LIBC_SENDMSG_RET_TYPE, LIBC_SENDMSG_SIG)
+TSOCKS_DECL(sendmsg, LIBC_SENDMSG_RET_TYPE, LIBC_SENDMSG_SIG)
+#define LIBC_SENDMSG_DECL \
+		LIBC_SENDMSG_RET_TYPE LIBC_SENDMSG_NAME(LIBC_SENDMSG_SIG)
+
 /* sendto(2) */
 extern TSOCKS_LIBC_DECL(sendto, LIBC_SENDTO_RET_TYPE, LIBC_SENDTO_SIG)
 TSOCKS_DECL(sendto, LIBC_SENDTO_RET_TYPE, LIBC_SENDTO_SIG)
@@ -333,45 +580,94 @@ TSOCKS_DECL(fclose, LIBC_FCLOSE_RET_TYPE, LIBC_FCLOSE_SIG)
 /* gethostbyname(3) */
 extern TSOCKS_LIBC_DECL(gethostbyname, LIBC_GETHOSTBYNAME_RET_TYPE,
 		LIBC_GETHOSTBYNAME_SIG)
+TSOCKS_DECL(gethostbyname, LIBC_GETHOSTBYNAME_RET_TYPE, LIBC_GETHOSTBYNAME_SIG)
 #define LIBC_GETHOSTBYNAME_DECL LIBC_GETHOSTBYNAME_RET_TYPE \
 		LIBC_GETHOSTBYNAME_NAME(LIBC_GETHOSTBYNAME_SIG)
 
 /* gethostbyname_r(3) */
 extern TSOCKS_LIBC_DECL(gethostbyname_r, LIBC_GETHOSTBYNAME_R_RET_TYPE,
 		LIBC_GETHOSTBYNAME_R_SIG)
+TSOCKS_DECL(gethostbyname_r, LIBC_GETHOSTBYNAME_R_RET_TYPE, LIBC_GETHOSTBYNAME_R_SIG)
 #define LIBC_GETHOSTBYNAME_R_DECL LIBC_GETHOSTBYNAME_R_RET_TYPE \
 		LIBC_GETHOSTBYNAME_R_NAME(LIBC_GETHOSTBYNAME_R_SIG)
 
 /* gethostbyname2(3) */
 extern TSOCKS_LIBC_DECL(gethostbyname2, LIBC_GETHOSTBYNAME2_RET_TYPE,
 		LIBC_GETHOSTBYNAME2_SIG)
+TSOCKS_DECL(gethostbyname2, LIBC_GETHOSTBYNAME2_RET_TYPE, LIBC_GETHOSTBYNAME2_SIG)
 #define LIBC_GETHOSTBYNAME2_DECL LIBC_GETHOSTBYNAME2_RET_TYPE \
 		LIBC_GETHOSTBYNAME2_NAME(LIBC_GETHOSTBYNAME2_SIG)
 
 /* gethostbyname2_r(3) */
 extern TSOCKS_LIBC_DECL(gethostbyname2_r, LIBC_GETHOSTBYNAME2_R_RET_TYPE,
 		LIBC_GETHOSTBYNAME2_R_SIG)
+TSOCKS_DECL(gethostbyname2_r, LIBC_GETHOSTBYNAME2_R_RET_TYPE, LIBC_GETHOSTBYNAME2_R_SIG)
 #define LIBC_GETHOSTBYNAME2_R_DECL LIBC_GETHOSTBYNAME2_R_RET_TYPE \
 		LIBC_GETHOSTBYNAME2_R_NAME(LIBC_GETHOSTBYNAME2_R_SIG)
 
 /* gethostbyaddr(3) */
 extern TSOCKS_LIBC_DECL(gethostbyaddr, LIBC_GETHOSTBYADDR_RET_TYPE,
 		LIBC_GETHOSTBYADDR_SIG)
+TSOCKS_DECL(gethostbyaddr, LIBC_GETHOSTBYADDR_RET_TYPE, LIBC_GETHOSTBYADDR_SIG)
 #define LIBC_GETHOSTBYADDR_DECL LIBC_GETHOSTBYADDR_RET_TYPE \
 		LIBC_GETHOSTBYADDR_NAME(LIBC_GETHOSTBYADDR_SIG)
 
 /* gethostbyaddr_r(3) */
 extern TSOCKS_LIBC_DECL(gethostbyaddr_r, LIBC_GETHOSTBYADDR_R_RET_TYPE,
 		LIBC_GETHOSTBYADDR_R_SIG)
+TSOCKS_DECL(gethostbyaddr_r, LIBC_GETHOSTBYADDR_R_RET_TYPE, LIBC_GETHOSTBYADDR_R_SIG)
 #define LIBC_GETHOSTBYADDR_R_DECL LIBC_GETHOSTBYADDR_R_RET_TYPE \
 		LIBC_GETHOSTBYADDR_R_NAME(LIBC_GETHOSTBYADDR_R_SIG)
 
 /* getaddrinfo(3) */
 extern TSOCKS_LIBC_DECL(getaddrinfo, LIBC_GETADDRINFO_RET_TYPE,
 		LIBC_GETADDRINFO_SIG)
+TSOCKS_DECL(getaddrinfo, LIBC_GETADDRINFO_RET_TYPE, LIBC_GETADDRINFO_SIG)
 #define LIBC_GETADDRINFO_DECL LIBC_GETADDRINFO_RET_TYPE \
 		LIBC_GETADDRINFO_NAME(LIBC_GETADDRINFO_SIG)
 
+/* getaddrinfo_a(3), gai_suspend(3), gai_error(3) and gai_cancel(3) */
+#if (defined(__GLIBC__))
+TSOCKS_DECL(getaddrinfo_a, LIBC_GETADDRINFO_A_RET_TYPE, LIBC_GETADDRINFO_A_SIG)
+#define LIBC_GETADDRINFO_A_DECL LIBC_GETADDRINFO_A_RET_TYPE \
+		LIBC_GETADDRINFO_A_NAME(LIBC_GETADDRINFO_A_SIG)
+TSOCKS_DECL(gai_suspend, LIBC_GAI_SUSPEND_RET_TYPE, LIBC_GAI_SUSPEND_SIG)
+#define LIBC_GAI_SUSPEND_DECL LIBC_GAI_SUSPEND_RET_TYPE \
+		LIBC_GAI_SUSPEND_NAME(LIBC_GAI_SUSPEND_SIG)
+TSOCKS_DECL(gai_error, LIBC_GAI_ERROR_RET_TYPE, LIBC_GAI_ERROR_SIG)
+#define LIBC_GAI_ERROR_DECL LIBC_GAI_ERROR_RET_TYPE \
+		LIBC_GAI_ERROR_NAME(LIBC_GAI_ERROR_SIG)
+TSOCKS_DECL(gai_cancel, LIBC_GAI_CANCEL_RET_TYPE, LIBC_GAI_CANCEL_SIG)
+#define LIBC_GAI_CANCEL_DECL LIBC_GAI_CANCEL_RET_TYPE \
+		LIBC_GAI_CANCEL_NAME(LIBC_GAI_CANCEL_SIG)
+#endif /* __GLIBC__ */
+
+/* res_query(3) and the rest of the resolver of resolv.h */
+TSOCKS_DECL(res_query, LIBC_RES_QUERY_RET_TYPE, LIBC_RES_QUERY_SIG)
+#define LIBC_RES_QUERY_DECL LIBC_RES_QUERY_RET_TYPE \
+		LIBC_RES_QUERY_NAME(LIBC_RES_QUERY_SIG)
+TSOCKS_DECL(res_search, LIBC_RES_SEARCH_RET_TYPE, LIBC_RES_SEARCH_SIG)
+#define LIBC_RES_SEARCH_DECL LIBC_RES_SEARCH_RET_TYPE \
+		LIBC_RES_SEARCH_NAME(LIBC_RES_SEARCH_SIG)
+TSOCKS_DECL(res_querydomain, LIBC_RES_QUERYDOMAIN_RET_TYPE, LIBC_RES_QUERYDOMAIN_SIG)
+#define LIBC_RES_QUERYDOMAIN_DECL LIBC_RES_QUERYDOMAIN_RET_TYPE \
+		LIBC_RES_QUERYDOMAIN_NAME(LIBC_RES_QUERYDOMAIN_SIG)
+TSOCKS_DECL(res_send, LIBC_RES_SEND_RET_TYPE, LIBC_RES_SEND_SIG)
+#define LIBC_RES_SEND_DECL LIBC_RES_SEND_RET_TYPE \
+		LIBC_RES_SEND_NAME(LIBC_RES_SEND_SIG)
+TSOCKS_DECL(res_nquery, LIBC_RES_NQUERY_RET_TYPE, LIBC_RES_NQUERY_SIG)
+#define LIBC_RES_NQUERY_DECL LIBC_RES_NQUERY_RET_TYPE \
+		LIBC_RES_NQUERY_NAME(LIBC_RES_NQUERY_SIG)
+TSOCKS_DECL(res_nsearch, LIBC_RES_NSEARCH_RET_TYPE, LIBC_RES_NSEARCH_SIG)
+#define LIBC_RES_NSEARCH_DECL LIBC_RES_NSEARCH_RET_TYPE \
+		LIBC_RES_NSEARCH_NAME(LIBC_RES_NSEARCH_SIG)
+TSOCKS_DECL(res_nquerydomain, LIBC_RES_NQUERYDOMAIN_RET_TYPE, LIBC_RES_NQUERYDOMAIN_SIG)
+#define LIBC_RES_NQUERYDOMAIN_DECL LIBC_RES_NQUERYDOMAIN_RET_TYPE \
+		LIBC_RES_NQUERYDOMAIN_NAME(LIBC_RES_NQUERYDOMAIN_SIG)
+TSOCKS_DECL(res_nsend, LIBC_RES_NSEND_RET_TYPE, LIBC_RES_NSEND_SIG)
+#define LIBC_RES_NSEND_DECL LIBC_RES_NSEND_RET_TYPE \
+		LIBC_RES_NSEND_NAME(LIBC_RES_NSEND_SIG)
+
 /* getpeername(2) */
 extern TSOCKS_LIBC_DECL(getpeername, LIBC_GETPEERNAME_RET_TYPE,
 		LIBC_GETPEERNAME_SIG)
@@ -393,12 +689,91 @@ TSOCKS_DECL(accept4, LIBC_ACCEPT4_RET_TYPE, LIBC_ACCEPT4_SIG)
 		LIBC_ACCEPT4_NAME(LIBC_ACCEPT4_SIG)
 #endif
 
+/* liburing ring creation. */
+#if (defined(__linux__))
+TSOCKS_DECL(io_uring_setup, LIBC_IO_URING_SETUP_RET_TYPE,
+		LIBC_IO_URING_SETUP_SIG)
+#define LIBC_IO_URING_SETUP_DECL LIBC_IO_URING_SETUP_RET_TYPE \
+		LIBC_IO_URING_SETUP_NAME(LIBC_IO_URING_SETUP_SIG)
+TSOCKS_DECL(io_uring_queue_init, LIBC_IO_URING_QUEUE_INIT_RET_TYPE,
+		LIBC_IO_URING_QUEUE_INIT_SIG)
+#define LIBC_IO_URING_QUEUE_INIT_DECL LIBC_IO_URING_QUEUE_INIT_RET_TYPE \
+		LIBC_IO_URING_QUEUE_INIT_NAME(LIBC_IO_URING_QUEUE_INIT_SIG)
+TSOCKS_DECL(io_uring_queue_init_params,
+		LIBC_IO_URING_QUEUE_INIT_PARAMS_RET_TYPE,
+		LIBC_IO_URING_QUEUE_INIT_PARAMS_SIG)
+#define LIBC_IO_URING_QUEUE_INIT_PARAMS_DECL \
+		LIBC_IO_URING_QUEUE_INIT_PARAMS_RET_TYPE \
+		LIBC_IO_URING_QUEUE_INIT_PARAMS_NAME(LIBC_IO_URING_QUEUE_INIT_PARAMS_SIG)
+TSOCKS_DECL(io_uring_queue_init_mem, LIBC_IO_URING_QUEUE_INIT_MEM_RET_TYPE,
+		LIBC_IO_URING_QUEUE_INIT_MEM_SIG)
+#define LIBC_IO_URING_QUEUE_INIT_MEM_DECL \
+		LIBC_IO_URING_QUEUE_INIT_MEM_RET_TYPE \
+		LIBC_IO_URING_QUEUE_INIT_MEM_NAME(LIBC_IO_URING_QUEUE_INIT_MEM_SIG)
+#endif /* __linux__ */
+
 /* listen(2) */
 extern TSOCKS_LIBC_DECL(listen, LIBC_LISTEN_RET_TYPE, LIBC_LISTEN_SIG)
 TSOCKS_DECL(listen, LIBC_LISTEN_RET_TYPE, LIBC_LISTEN_SIG)
 #define LIBC_LISTEN_DECL LIBC_LISTEN_RET_TYPE \
 		LIBC_LISTEN_NAME(LIBC_LISTEN_SIG)
 
+/* bind(2) */
+extern TSOCKS_LIBC_DECL(bind, LIBC_BIND_RET_TYPE, LIBC_BIND_SIG)
+TSOCKS_DECL(bind, LIBC_BIND_RET_TYPE, LIBC_BIND_SIG)
+#define LIBC_BIND_DECL LIBC_BIND_RET_TYPE \
+		LIBC_BIND_NAME(LIBC_BIND_SIG)
+
+/* dup(2) */
+extern TSOCKS_LIBC_DECL(dup, LIBC_DUP_RET_TYPE, LIBC_DUP_SIG)
+TSOCKS_DECL(dup, LIBC_DUP_RET_TYPE, LIBC_DUP_SIG)
+#define LIBC_DUP_DECL LIBC_DUP_RET_TYPE \
+		LIBC_DUP_NAME(LIBC_DUP_SIG)
+
+/* dup2(2) */
+extern TSOCKS_LIBC_DECL(dup2, LIBC_DUP2_RET_TYPE, LIBC_DUP2_SIG)
+TSOCKS_DECL(dup2, LIBC_DUP2_RET_TYPE, LIBC_DUP2_SIG)
+#define LIBC_DUP2_DECL LIBC_DUP2_RET_TYPE \
+		LIBC_DUP2_NAME(LIBC_DUP2_SIG)
+
+/* dup3(2) */
+#if (defined(__linux__))
+extern TSOCKS_LIBC_DECL(dup3, LIBC_DUP3_RET_TYPE, LIBC_DUP3_SIG)
+TSOCKS_DECL(dup3, LIBC_DUP3_RET_TYPE, LIBC_DUP3_SIG)
+#define LIBC_DUP3_DECL LIBC_DUP3_RET_TYPE \
+		LIBC_DUP3_NAME(LIBC_DUP3_SIG)
+#endif
+
+/* fcntl(2) */
+extern TSOCKS_LIBC_DECL(fcntl, LIBC_FCNTL_RET_TYPE, LIBC_FCNTL_SIG)
+extern LIBC_FCNTL_RET_TYPE tsocks_fcntl(int fd, int cmd, void *arg);
+#define LIBC_FCNTL_DECL LIBC_FCNTL_RET_TYPE \
+		LIBC_FCNTL_NAME(LIBC_FCNTL_SIG)
+
+/* fcntl64(2) */
+#if (defined(HAVE_FCNTL64))
+extern TSOCKS_LIBC_DECL(fcntl64, LIBC_FCNTL64_RET_TYPE, LIBC_FCNTL64_SIG)
+#define LIBC_FCNTL64_DECL LIBC_FCNTL64_RET_TYPE \
+		LIBC_FCNTL64_NAME(LIBC_FCNTL64_SIG)
+#endif
+
+/* close_range(2) */
+#if (defined(HAVE_CLOSE_RANGE))
+extern TSOCKS_LIBC_DECL(close_range, LIBC_CLOSE_RANGE_RET_TYPE,
+		LIBC_CLOSE_RANGE_SIG)
+TSOCKS_DECL(close_range, LIBC_CLOSE_RANGE_RET_TYPE, LIBC_CLOSE_RANGE_SIG)
+#define LIBC_CLOSE_RANGE_DECL LIBC_CLOSE_RANGE_RET_TYPE \
+		LIBC_CLOSE_RANGE_NAME(LIBC_CLOSE_RANGE_SIG)
+#endif
+
+/* closefrom(3) */
+#if (defined(HAVE_CLOSEFROM))
+extern TSOCKS_LIBC_DECL(closefrom, LIBC_CLOSEFROM_RET_TYPE, LIBC_CLOSEFROM_SIG)
+TSOCKS_DECL(closefrom, LIBC_CLOSEFROM_RET_TYPE, LIBC_CLOSEFROM_SIG)
+#define LIBC_CLOSEFROM_DECL LIBC_CLOSEFROM_RET_TYPE \
+		LIBC_CLOSEFROM_NAME(LIBC_CLOSEFROM_SIG)
+#endif
+
 /*
  * Those are actions to do during the lookup process of libc symbols. For
  * instance the connect(2) syscall is essential to Torsocks so the function
@@ -420,9 +795,48 @@ extern unsigned int tsocks_cleaned_up;
 int tsocks_connect_to_tor(struct connection *conn);
 void *tsocks_find_libc_symbol(const char *symbol,
 		enum tsocks_sym_action action);
+struct addrinfo_addr;
 int tsocks_tor_resolve(int af, const char *hostname, void *ip_addr);
+int tsocks_tor_resolve_all(const char *hostname, struct addrinfo_addr *addrs);
 int tsocks_tor_resolve_ptr(const char *addr, char **ip, int af);
-void tsocks_initialize(void);
+void tsocks_init(void);
+void tsocks_init_libc(void);
+
+/* UDP sockets of the DNS responder, see udp-dns.c. */
+int udp_dns_register(int fd, int domain);
+int udp_dns_check_socket(int fd);
+void udp_dns_unregister(int fd);
+void udp_dns_dup(int oldfd, int newfd);
+int udp_dns_redirect(int fd, const struct sockaddr *dest, socklen_t dest_len,
+		struct sockaddr_storage *to, socklen_t *to_len);
+void udp_dns_set_connected(int fd, int connected);
+void udp_dns_set_source(int fd, struct sockaddr *addr, socklen_t len,
+		socklen_t *addr_len);
+int udp_dns_getpeername(int fd, struct sockaddr *addr, socklen_t *addr_len);
 void tsocks_cleanup(void);
 
+/* Indicate if the library was initialized previously. */
+extern tsocks_once_t tsocks_init_once;
+/* Indicate if the libc symbols were looked up previously. */
+extern tsocks_once_t tsocks_libc_once;
+
+/*
+ * Initialize torsocks library if not done already. Every hijacked libc call
+ * goes through this so once initialized it is only one predictable branch.
+ */
+static inline void tsocks_initialize(void)
+{
+	tsocks_once(&tsocks_init_once, &tsocks_init);
+}
+
+/*
+ * Look up the libc symbols if not done already. Used by the hijacked calls
+ * that never touch the network and thus don't need the configuration, so they
+ * don't trigger the whole initialization in lazy mode.
+ */
+static inline void tsocks_initialize_libc(void)
+{
+	tsocks_once(&tsocks_libc_once, &tsocks_init_libc);
+}
+
 #endif /* TORSOCKS_H */
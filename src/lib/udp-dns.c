@@ -0,0 +1,872 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/compat.h>
+#include <common/dns.h>
+#include <common/fd-table.h>
+#include <common/log.h>
+#include <common/macros.h>
+#include <common/utils.h>
+
+#include "torsocks.h"
+
+/*
+ * UDP sockets allowed by the AllowUDPDNS option. Their datagrams to port 53
+ * are sent to a responder bound on the loopback instead, which answers them
+ * with the torsocks res_send(3) thus through Tor. The replies are real
+ * datagrams queued on the socket so poll(2) and friends see them and their
+ * source is rewritten to the DNS server the application sent the query to
+ * when received. Any other destination is denied.
+ */
+
+/* Sockets in use at most, socket() fails with EPERM beyond. */
+#define UDP_DNS_MAX_SOCKETS		64
+/* Worker threads at most, each answers one query at a time. */
+#define UDP_DNS_MAX_WORKERS		16
+/* Queries waiting for a worker at most, the next ones are dropped. */
+#define UDP_DNS_MAX_QUEUED		256
+
+struct udp_dns_socket {
+	int fd;
+	int domain;
+	/* Local port once bound, network byte order. */
+	in_port_t port;
+	/* Last DNS server a query was sent to. */
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	unsigned int used:1;
+	unsigned int connected:1;
+};
+
+/* A query received by the responder. */
+struct udp_dns_query {
+	int sock;
+	struct sockaddr_storage src;
+	socklen_t src_len;
+	size_t len;
+	unsigned char buf[DNS_MSG_MAX];
+	struct udp_dns_query *next;
+};
+
+static struct {
+	tsocks_mutex_t lock;
+	struct udp_dns_socket sockets[UDP_DNS_MAX_SOCKETS];
+	unsigned int nb_sockets;
+	/* Responder sockets, -1 if not created. */
+	int sock4;
+	int sock6;
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 addr6;
+	unsigned int started:1;
+	struct udp_dns_query *queue;
+	struct udp_dns_query *queue_tail;
+	unsigned int queued;
+	unsigned int workers;
+} udp_dns = {
+	.lock = TSOCKS_MUTEX_INIT,
+	.sock4 = -1,
+	.sock6 = -1,
+};
+
+static TSOCKS_INIT_ONCE(udp_dns_atfork_once);
+
+/*
+ * Return the socket of the given fd or NULL. MUST be called with the lock
+ * held.
+ */
+static struct udp_dns_socket *find_socket(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(udp_dns.sockets); i++) {
+		if (udp_dns.sockets[i].used && udp_dns.sockets[i].fd == fd) {
+			return &udp_dns.sockets[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return the socket bound on the given port, the source port of a query, or
+ * NULL. MUST be called with the lock held.
+ */
+static struct udp_dns_socket *find_socket_by_port(in_port_t port)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(udp_dns.sockets); i++) {
+		if (udp_dns.sockets[i].used && udp_dns.sockets[i].port &&
+				udp_dns.sockets[i].port == port) {
+			return &udp_dns.sockets[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a free slot for the given fd. MUST be called with the lock held.
+ *
+ * Return the slot or NULL if they are all used.
+ */
+static struct udp_dns_socket *add_socket(int fd)
+{
+	unsigned int i;
+	struct udp_dns_socket *s;
+
+	if (udp_dns.nb_sockets == ARRAY_SIZE(udp_dns.sockets)) {
+		return NULL;
+	}
+	for (i = 0; i < ARRAY_SIZE(udp_dns.sockets); i++) {
+		s = &udp_dns.sockets[i];
+		if (!s->used) {
+			memset(s, 0, sizeof(*s));
+			s->fd = fd;
+			s->used = 1;
+			udp_dns.nb_sockets++;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static void remove_socket(struct udp_dns_socket *s)
+{
+	s->used = 0;
+	udp_dns.nb_sockets--;
+}
+
+/*
+ * Return the port of an inet address in network byte order or 0.
+ */
+static in_port_t addr_port(const struct sockaddr *addr, socklen_t len)
+{
+	switch (addr->sa_family) {
+	case AF_INET:
+		if (len < sizeof(struct sockaddr_in)) {
+			return 0;
+		}
+		return ((const struct sockaddr_in *) addr)->sin_port;
+	case AF_INET6:
+		if (len < sizeof(struct sockaddr_in6)) {
+			return 0;
+		}
+		return ((const struct sockaddr_in6 *) addr)->sin6_port;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Return 1 if the given source address is the one of the responder. MUST be
+ * called with the lock held.
+ */
+static int from_responder(const struct sockaddr *addr, socklen_t len)
+{
+	const struct sockaddr_in6 *sin6;
+
+	if (!udp_dns.started) {
+		return 0;
+	}
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		return len >= sizeof(struct sockaddr_in) &&
+			memcmp(addr, &udp_dns.addr4, sizeof(struct sockaddr_in)) == 0;
+	case AF_INET6:
+		if (len < sizeof(*sin6)) {
+			return 0;
+		}
+		sin6 = (const struct sockaddr_in6 *) addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			return sin6->sin6_port == udp_dns.addr4.sin_port &&
+				memcmp(&sin6->sin6_addr.s6_addr[12],
+						&udp_dns.addr4.sin_addr, 4) == 0;
+		}
+		return udp_dns.sock6 >= 0 &&
+			sin6->sin6_port == udp_dns.addr6.sin6_port &&
+			IN6_ARE_ADDR_EQUAL(&sin6->sin6_addr, &udp_dns.addr6.sin6_addr);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Set the address of the responder reachable from a socket of the given
+ * domain. An IPv6 socket uses the IPv4 mapped address of the IPv4 responder
+ * if there is no IPv6 loopback. MUST be called with the lock held.
+ */
+static void responder_addr(int domain, struct sockaddr_storage *addr,
+		socklen_t *len)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+
+	memset(addr, 0, sizeof(*addr));
+	if (domain == AF_INET) {
+		memcpy(addr, &udp_dns.addr4, sizeof(udp_dns.addr4));
+		*len = sizeof(udp_dns.addr4);
+	} else if (udp_dns.sock6 >= 0) {
+		memcpy(addr, &udp_dns.addr6, sizeof(udp_dns.addr6));
+		*len = sizeof(udp_dns.addr6);
+	} else {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = udp_dns.addr4.sin_port;
+		sin6->sin6_addr.s6_addr[10] = 0xff;
+		sin6->sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&sin6->sin6_addr.s6_addr[12], &udp_dns.addr4.sin_addr, 4);
+		*len = sizeof(*sin6);
+	}
+}
+
+/*
+ * Answer a query through Tor and send the reply back to its source.
+ */
+static void answer_query(struct udp_dns_query *query)
+{
+	int len;
+	unsigned char answer[DNS_MSG_MAX];
+
+	len = tsocks_res_send(query->buf, query->len, answer, sizeof(answer));
+	if (len < 0) {
+		DBG("[udp-dns] No reply to the query on port %u",
+				ntohs(addr_port((struct sockaddr *) &query->src,
+						query->src_len)));
+		return;
+	}
+
+	if (tsocks_libc_sendto(query->sock, answer, len, 0,
+				(struct sockaddr *) &query->src, query->src_len) < 0) {
+		DBG("[udp-dns] Unable to send the reply: %s", strerror(errno));
+	}
+}
+
+/*
+ * Answer the queued queries until there is none left.
+ */
+static void *worker_thread(void *data)
+{
+	struct udp_dns_query *query;
+
+	for (;;) {
+		tsocks_mutex_lock(&udp_dns.lock);
+		query = udp_dns.queue;
+		if (!query) {
+			udp_dns.workers--;
+			tsocks_mutex_unlock(&udp_dns.lock);
+			break;
+		}
+		udp_dns.queue = query->next;
+		if (!udp_dns.queue) {
+			udp_dns.queue_tail = NULL;
+		}
+		udp_dns.queued--;
+		tsocks_mutex_unlock(&udp_dns.lock);
+
+		answer_query(query);
+		free(query);
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue a query and start a worker for it if possible. MUST be called with
+ * the lock held.
+ */
+static void queue_query(struct udp_dns_query *query)
+{
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	query->next = NULL;
+	if (udp_dns.queue_tail) {
+		udp_dns.queue_tail->next = query;
+	} else {
+		udp_dns.queue = query;
+	}
+	udp_dns.queue_tail = query;
+	udp_dns.queued++;
+
+	if (udp_dns.workers >= UDP_DNS_MAX_WORKERS) {
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, worker_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		/* The query waits for a running worker, if any. */
+		ERR("[udp-dns] Unable to create a worker: %s", strerror(ret));
+		return;
+	}
+	udp_dns.workers++;
+}
+
+/*
+ * Receive a query on a responder socket. It is queued only if it comes from
+ * one of the sockets thus no other process can use the responder.
+ */
+static void receive_query(int sock)
+{
+	ssize_t ret;
+	struct udp_dns_query *query;
+
+	query = zmalloc(sizeof(*query));
+	if (!query) {
+		/* Drop the datagram, the application will retry. */
+		(void) tsocks_libc_recvfrom(sock, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return;
+	}
+
+	query->src_len = sizeof(query->src);
+	ret = tsocks_libc_recvfrom(sock, query->buf, sizeof(query->buf),
+			MSG_DONTWAIT, (struct sockaddr *) &query->src, &query->src_len);
+	if (ret < 0) {
+		free(query);
+		return;
+	}
+	query->sock = sock;
+	query->len = ret;
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	if (!find_socket_by_port(addr_port((struct sockaddr *) &query->src,
+					query->src_len))) {
+		DBG("[udp-dns] Query from an unknown socket dropped");
+		goto drop;
+	}
+	if (udp_dns.queued >= UDP_DNS_MAX_QUEUED) {
+		DBG("[udp-dns] Too many queries waiting. Dropping one.");
+		goto drop;
+	}
+	queue_query(query);
+	tsocks_mutex_unlock(&udp_dns.lock);
+	return;
+
+drop:
+	tsocks_mutex_unlock(&udp_dns.lock);
+	free(query);
+}
+
+/*
+ * Wait for the queries sent to the responder sockets.
+ */
+static void *responder_thread(void *data)
+{
+	int ret;
+	nfds_t i, nfds = 0;
+	sigset_t set;
+	struct pollfd fds[2];
+
+	/* Signals are for the application threads. */
+	sigfillset(&set);
+	(void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/* Set before the thread is created and only changed in a child. */
+	fds[nfds].fd = udp_dns.sock4;
+	fds[nfds++].events = POLLIN;
+	if (udp_dns.sock6 >= 0) {
+		fds[nfds].fd = udp_dns.sock6;
+		fds[nfds++].events = POLLIN;
+	}
+
+	for (;;) {
+		ret = poll(fds, nfds, -1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR("[udp-dns] Responder stopped: %s", strerror(errno));
+			break;
+		}
+		for (i = 0; i < nfds; i++) {
+			if (fds[i].revents & POLLIN) {
+				receive_query(fds[i].fd);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Create a responder socket bound on the given loopback address. The address
+ * is updated with the port given by the kernel.
+ *
+ * Return the socket or a negative errno.
+ */
+static int open_responder(struct sockaddr *addr, socklen_t len)
+{
+	int ret, sock;
+
+	sock = tsocks_libc_socket(addr->sa_family, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		return -errno;
+	}
+	if (fcntl(sock, F_SETFD, FD_CLOEXEC) < 0 ||
+			tsocks_libc_bind(sock, addr, len) < 0 ||
+			getsockname(sock, addr, &len) < 0) {
+		ret = -errno;
+		tsocks_libc_close(sock);
+		return ret;
+	}
+	return sock;
+}
+
+/*
+ * Start the responder if not done already. MUST be called with the lock
+ * held.
+ *
+ * Return 0 on success or a negative errno.
+ */
+static int start_responder(void)
+{
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (udp_dns.started) {
+		return 0;
+	}
+
+	memset(&udp_dns.addr4, 0, sizeof(udp_dns.addr4));
+	udp_dns.addr4.sin_family = AF_INET;
+	udp_dns.addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ret = open_responder((struct sockaddr *) &udp_dns.addr4,
+			sizeof(udp_dns.addr4));
+	if (ret < 0) {
+		ERR("[udp-dns] Unable to create the responder: %s", strerror(-ret));
+		return ret;
+	}
+	udp_dns.sock4 = ret;
+
+	/* Without an IPv6 loopback, IPv6 sockets use the IPv4 responder. */
+	memset(&udp_dns.addr6, 0, sizeof(udp_dns.addr6));
+	udp_dns.addr6.sin6_family = AF_INET6;
+	udp_dns.addr6.sin6_addr = in6addr_loopback;
+	udp_dns.sock6 = open_responder((struct sockaddr *) &udp_dns.addr6,
+			sizeof(udp_dns.addr6));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, responder_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		ERR("[udp-dns] Unable to create the responder thread: %s",
+				strerror(ret));
+		tsocks_libc_close(udp_dns.sock4);
+		udp_dns.sock4 = -1;
+		if (udp_dns.sock6 >= 0) {
+			tsocks_libc_close(udp_dns.sock6);
+			udp_dns.sock6 = -1;
+		}
+		return -ret;
+	}
+
+	DBG("[udp-dns] Responder started on port %u", ntohs(udp_dns.addr4.sin_port));
+	udp_dns.started = 1;
+	return 0;
+}
+
+/*
+ * Bind the socket on the loopback if the application did not so its queries
+ * can be told from the ones of other processes. MUST be called with the lock
+ * held.
+ *
+ * Return 0 on success or a negative errno.
+ */
+static int bind_socket(struct udp_dns_socket *s)
+{
+	socklen_t len;
+	struct sockaddr_storage addr;
+
+	if (s->port) {
+		return 0;
+	}
+
+	len = sizeof(addr);
+	if (getsockname(s->fd, (struct sockaddr *) &addr, &len) < 0) {
+		return -errno;
+	}
+	s->port = addr_port((struct sockaddr *) &addr, len);
+	if (s->port) {
+		return 0;
+	}
+
+	/* The loopback of the responder this socket sends to. */
+	responder_addr(s->domain, &addr, &len);
+	if (s->domain == AF_INET) {
+		((struct sockaddr_in *) &addr)->sin_port = 0;
+	} else {
+		((struct sockaddr_in6 *) &addr)->sin6_port = 0;
+	}
+	if (tsocks_libc_bind(s->fd, (struct sockaddr *) &addr, len) < 0) {
+		return -errno;
+	}
+
+	len = sizeof(addr);
+	if (getsockname(s->fd, (struct sockaddr *) &addr, &len) < 0) {
+		return -errno;
+	}
+	s->port = addr_port((struct sockaddr *) &addr, len);
+	return 0;
+}
+
+static void udp_dns_atfork_prepare(void)
+{
+	tsocks_mutex_lock(&udp_dns.lock);
+}
+
+static void udp_dns_atfork_parent(void)
+{
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+/*
+ * The responder threads are gone in the child thus it starts its own with
+ * new sockets on the next query. The queued queries are the parent's.
+ */
+static void udp_dns_atfork_child(void)
+{
+	struct udp_dns_query *query;
+
+	if (udp_dns.sock4 >= 0) {
+		tsocks_libc_close(udp_dns.sock4);
+		udp_dns.sock4 = -1;
+	}
+	if (udp_dns.sock6 >= 0) {
+		tsocks_libc_close(udp_dns.sock6);
+		udp_dns.sock6 = -1;
+	}
+	while ((query = udp_dns.queue)) {
+		udp_dns.queue = query->next;
+		free(query);
+	}
+	udp_dns.queue_tail = NULL;
+	udp_dns.queued = 0;
+	udp_dns.workers = 0;
+	udp_dns.started = 0;
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+static void udp_dns_atfork_init(void)
+{
+	(void) pthread_atfork(udp_dns_atfork_prepare, udp_dns_atfork_parent,
+			udp_dns_atfork_child);
+}
+
+/*
+ * Add a new UDP socket of the given domain. Its fd MUST be in the fd table
+ * since every hijacked call looks for it there.
+ *
+ * Return 0 on success or -EPERM if the socket can't be handled.
+ */
+ATTR_HIDDEN
+int udp_dns_register(int fd, int domain)
+{
+	int ret = 0;
+	struct udp_dns_socket *s;
+
+	if (fd < 0 || fd >= FD_TABLE_SIZE) {
+		return -EPERM;
+	}
+
+	tsocks_once(&udp_dns_atfork_once, &udp_dns_atfork_init);
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	s = find_socket(fd);
+	if (!s) {
+		s = add_socket(fd);
+	}
+	if (!s) {
+		DBG("[udp-dns] Too many UDP sockets. Denying fd %d", fd);
+		ret = -EPERM;
+		goto end;
+	}
+	s->domain = domain;
+	s->port = 0;
+	s->peer_len = 0;
+	s->connected = 0;
+
+end:
+	tsocks_mutex_unlock(&udp_dns.lock);
+	return ret;
+}
+
+/*
+ * Check a socket sending to an inet destination. A socket not created by our
+ * socket(), inherited across exec or copied with a call we don't see, is
+ * unknown to the fd table thus the kernel is asked. An inet datagram socket
+ * is added as a UDP DNS socket if allowed else denied like in socket().
+ *
+ * Return 1 for a UDP DNS socket, 0 if the libc can handle it or a negative
+ * errno if it must be denied.
+ */
+ATTR_HIDDEN
+int udp_dns_check_socket(int fd)
+{
+	int ret, sock_type, protocol = 0;
+	uint8_t fd_flags;
+	socklen_t len;
+	struct sockaddr_storage addr;
+
+	fd_flags = fd_table_get(fd);
+	if (fd_flags & FD_TABLE_UDP_DNS) {
+		return 1;
+	}
+	if (fd_flags & (FD_TABLE_UNIX | FD_TABLE_STREAM)) {
+		return 0;
+	}
+
+	len = sizeof(sock_type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &len) < 0) {
+		/* Not a socket, let the libc report the error. */
+		return 0;
+	}
+	len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+		return 0;
+	}
+	if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6) {
+		if (addr.ss_family == AF_UNIX) {
+			fd_table_add(fd, FD_TABLE_UNIX);
+		}
+		return 0;
+	}
+	if (IS_SOCK_STREAM(sock_type)) {
+		fd_table_add(fd, FD_TABLE_INET | FD_TABLE_STREAM);
+		return 0;
+	}
+
+#ifdef SO_PROTOCOL
+	len = sizeof(protocol);
+	if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) < 0) {
+		return -EPERM;
+	}
+#endif
+	if (!tsocks_config.allow_udp_dns || sock_type != SOCK_DGRAM ||
+			(protocol != 0 && protocol != IPPROTO_UDP)) {
+		DBG("[udp-dns] Unknown non stream inet socket %d denied", fd);
+		return -EPERM;
+	}
+
+	/* Already associated to a destination that can't be redirected. */
+	len = sizeof(addr);
+	if (tsocks_libc_getpeername(fd, (struct sockaddr *) &addr, &len) == 0) {
+		DBG("[udp-dns] Unknown connected UDP socket %d denied", fd);
+		return -EPERM;
+	}
+
+	ret = udp_dns_register(fd, addr.ss_family);
+	if (ret < 0) {
+		return ret;
+	}
+	fd_table_add(fd, FD_TABLE_INET | FD_TABLE_UDP_DNS);
+	return 1;
+}
+
+/*
+ * Forget the given fd, closed by the application.
+ */
+ATTR_HIDDEN
+void udp_dns_unregister(int fd)
+{
+	struct udp_dns_socket *s;
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	s = find_socket(fd);
+	if (s) {
+		remove_socket(s);
+	}
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+/*
+ * The new fd refers to the same socket as the old one. Whatever newfd was
+ * before is forgotten.
+ */
+ATTR_HIDDEN
+void udp_dns_dup(int oldfd, int newfd)
+{
+	struct udp_dns_socket *s, *new_s;
+
+	if (oldfd == newfd) {
+		return;
+	}
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	new_s = find_socket(newfd);
+	if (new_s) {
+		remove_socket(new_s);
+	}
+	s = find_socket(oldfd);
+	if (!s || newfd >= FD_TABLE_SIZE) {
+		goto end;
+	}
+	new_s = add_socket(newfd);
+	if (!new_s) {
+		/* Still in the fd table thus denied by udp_dns_redirect(). */
+		DBG("[udp-dns] Too many UDP sockets for the copy fd %d", newfd);
+		goto end;
+	}
+	*new_s = *s;
+	new_s->fd = newfd;
+
+end:
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+/*
+ * Check the destination of a datagram or connect() of the given socket. Only
+ * a DNS server is allowed and the address of the responder to use instead is
+ * set in to. The destination is kept as the peer of the socket.
+ *
+ * Return 0 on success or a negative errno, -EPERM for any other destination.
+ */
+ATTR_HIDDEN
+int udp_dns_redirect(int fd, const struct sockaddr *dest, socklen_t dest_len,
+		struct sockaddr_storage *to, socklen_t *to_len)
+{
+	int ret;
+	in_port_t port;
+	struct udp_dns_socket *s;
+
+	assert(dest);
+	assert(to);
+	assert(to_len);
+
+	if (dest->sa_family != AF_INET && dest->sa_family != AF_INET6) {
+		return -EAFNOSUPPORT;
+	}
+	port = addr_port(dest, dest_len);
+	if (!port) {
+		return -EINVAL;
+	}
+	if (port != htons(DNS_PORT)) {
+		DBG("[udp-dns] Datagram to port %u denied on fd %d", ntohs(port), fd);
+		return -EPERM;
+	}
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	s = find_socket(fd);
+	if (!s) {
+		ret = -EPERM;
+		goto end;
+	}
+	ret = start_responder();
+	if (ret < 0) {
+		goto end;
+	}
+	ret = bind_socket(s);
+	if (ret < 0) {
+		goto end;
+	}
+
+	s->peer_len = min(dest_len, sizeof(s->peer));
+	memcpy(&s->peer, dest, s->peer_len);
+	responder_addr(s->domain, to, to_len);
+
+end:
+	tsocks_mutex_unlock(&udp_dns.lock);
+	return ret;
+}
+
+/*
+ * Mark the socket as connected to its peer or not, once connect() returned.
+ */
+ATTR_HIDDEN
+void udp_dns_set_connected(int fd, int connected)
+{
+	struct udp_dns_socket *s;
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	s = find_socket(fd);
+	if (s) {
+		s->connected = !!connected;
+	}
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+/*
+ * Replace the source address of a datagram received on the given socket by
+ * its peer if it comes from the responder. The address buffer was len bytes
+ * long and addr_len is set as by the kernel.
+ */
+ATTR_HIDDEN
+void udp_dns_set_source(int fd, struct sockaddr *addr, socklen_t len,
+		socklen_t *addr_len)
+{
+	struct udp_dns_socket *s;
+
+	if (!addr || !addr_len) {
+		return;
+	}
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	if (!from_responder(addr, min(len, *addr_len))) {
+		goto end;
+	}
+	s = find_socket(fd);
+	if (!s || !s->peer_len) {
+		goto end;
+	}
+	memcpy(addr, &s->peer, min(len, s->peer_len));
+	*addr_len = s->peer_len;
+
+end:
+	tsocks_mutex_unlock(&udp_dns.lock);
+}
+
+/*
+ * Set the DNS server the socket is connected to as for getpeername(2).
+ *
+ * Return 0 on success or a negative errno.
+ */
+ATTR_HIDDEN
+int udp_dns_getpeername(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	int ret = 0;
+	struct udp_dns_socket *s;
+
+	if (!addr || !addr_len) {
+		return -EFAULT;
+	}
+
+	tsocks_mutex_lock(&udp_dns.lock);
+	s = find_socket(fd);
+	if (!s || !s->connected) {
+		ret = -ENOTCONN;
+		goto end;
+	}
+	memcpy(addr, &s->peer, min(*addr_len, s->peer_len));
+	*addr_len = s->peer_len;
+
+end:
+	tsocks_mutex_unlock(&udp_dns.lock);
+	return ret;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Load generator of the benchmark. Threads connect and close in a loop for a
+ * duration then resolve a name in a loop, timing every call. The result is a
+ * JSON object on stdout. It is run with and without torsocks preloaded by
+ * bench.sh, the code is the same in both cases.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS	1024
+
+/* Latencies in nanoseconds of one kind of call. */
+struct samples {
+	uint64_t *values;
+	size_t nb;
+	size_t size;
+	uint64_t errors;
+};
+
+struct worker {
+	pthread_t thread;
+	struct samples connect;
+	struct samples close;
+	struct samples resolve;
+	/* First failure of the echo check, 0 if the path works. */
+	int echo_err;
+};
+
+static struct {
+	struct sockaddr_in target;
+	const char *name;
+	double duration;
+	unsigned int nb_threads;
+	pthread_barrier_t barrier;
+} bench = {
+	.duration = 2.0,
+	.nb_threads = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void samples_add(struct samples *s, uint64_t value)
+{
+	uint64_t *tmp;
+
+	if (s->nb == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		tmp = realloc(s->values, s->size * sizeof(*s->values));
+		if (!tmp) {
+			s->errors++;
+			return;
+		}
+		s->values = tmp;
+	}
+	s->values[s->nb++] = value;
+}
+
+/* Move the samples of src at the end of dst. */
+static void samples_merge(struct samples *dst, struct samples *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->nb; i++) {
+		samples_add(dst, src->values[i]);
+	}
+	dst->errors += src->errors;
+	free(src->values);
+	memset(src, 0, sizeof(*src));
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *) a, ub = *(const uint64_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static double percentile(const struct samples *s, double p)
+{
+	size_t idx;
+
+	if (!s->nb) {
+		return 0;
+	}
+	idx = (size_t) (p / 100.0 * (s->nb - 1) + 0.5);
+	return s->values[idx] / 1000.0;
+}
+
+/*
+ * Send a byte and wait for the echo to check that the relay works.
+ *
+ * Return 0 on success else an errno value.
+ */
+static int check_echo(int fd)
+{
+	char c = 'x';
+
+	if (send(fd, &c, 1, 0) != 1 || recv(fd, &c, 1, MSG_WAITALL) != 1) {
+		return errno ? errno : EPIPE;
+	}
+	return c == 'x' ? 0 : EBADMSG;
+}
+
+static void run_connects(struct worker *w)
+{
+	int fd, ret, first = 1;
+	uint64_t start, end, deadline;
+	/*
+	 * Reset on close so thousands of connections per second do not exhaust
+	 * the local ports in TIME_WAIT, with and without torsocks alike.
+	 */
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	deadline = now_ns() + bench.duration * 1e9;
+	do {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			w->connect.errors++;
+			end = now_ns();
+			continue;
+		}
+		(void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+		start = now_ns();
+		ret = connect(fd, (struct sockaddr *) &bench.target,
+				sizeof(bench.target));
+		end = now_ns();
+		if (ret < 0) {
+			w->connect.errors++;
+		} else {
+			samples_add(&w->connect, end - start);
+			if (first) {
+				w->echo_err = check_echo(fd);
+				first = 0;
+			}
+		}
+
+		start = now_ns();
+		ret = close(fd);
+		end = now_ns();
+		if (ret < 0) {
+			w->close.errors++;
+		} else {
+			samples_add(&w->close, end - start);
+		}
+	} while (end < deadline);
+}
+
+static void run_resolves(struct worker *w)
+{
+	int ret;
+	uint64_t start, end, deadline;
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	deadline = now_ns() + bench.duration * 1e9;
+	do {
+		start = now_ns();
+		ret = getaddrinfo(bench.name, NULL, &hints, &res);
+		end = now_ns();
+		if (ret) {
+			w->resolve.errors++;
+			continue;
+		}
+		samples_add(&w->resolve, end - start);
+		freeaddrinfo(res);
+	} while (end < deadline);
+}
+
+static void *worker_thread(void *data)
+{
+	struct worker *w = data;
+
+	/* Every thread starts each phase at the same time. */
+	pthread_barrier_wait(&bench.barrier);
+	run_connects(w);
+	if (bench.name) {
+		pthread_barrier_wait(&bench.barrier);
+		run_resolves(w);
+	}
+	return NULL;
+}
+
+static void print_latency(const char *name, struct samples *s)
+{
+	size_t i;
+	double sum = 0;
+
+	qsort(s->values, s->nb, sizeof(*s->values), compare_u64);
+	for (i = 0; i < s->nb; i++) {
+		sum += s->values[i];
+	}
+
+	printf("\"%s\":{\"count\":%zu,\"errors\":%" PRIu64 ",\"per_sec\":%.1f,"
+			"\"latency_us\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+			"\"p99\":%.3f,\"max\":%.3f}}", name, s->nb, s->errors,
+			s->nb / bench.duration, s->nb ? sum / s->nb / 1000.0 : 0,
+			percentile(s, 50), percentile(s, 90), percentile(s, 99),
+			percentile(s, 100));
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t THREADS] [-d SECONDS] [-r NAME] "
+			"ADDR PORT\n"
+			"Connect to ADDR:PORT and close in a loop, then resolve NAME.\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, echo_err = 0;
+	unsigned int i;
+	struct worker *workers;
+	struct samples connects = { 0 }, closes = { 0 }, resolves = { 0 };
+
+	while ((opt = getopt(argc, argv, "t:d:r:h")) != -1) {
+		switch (opt) {
+		case 't':
+			bench.nb_threads = atoi(optarg);
+			break;
+		case 'd':
+			bench.duration = atof(optarg);
+			break;
+		case 'r':
+			bench.name = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2 || bench.nb_threads < 1 ||
+			bench.nb_threads > MAX_THREADS || bench.duration <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench.target.sin_family = AF_INET;
+	bench.target.sin_port = htons(atoi(argv[optind + 1]));
+	if (inet_pton(AF_INET, argv[optind], &bench.target.sin_addr) != 1) {
+		fprintf(stderr, "%s: invalid IPv4 address\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	workers = calloc(bench.nb_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	pthread_barrier_init(&bench.barrier, NULL, bench.nb_threads);
+
+	for (i = 0; i < bench.nb_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+					&workers[i])) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < bench.nb_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		samples_merge(&connects, &workers[i].connect);
+		samples_merge(&closes, &workers[i].close);
+		samples_merge(&resolves, &workers[i].resolve);
+		if (workers[i].echo_err && !echo_err) {
+			echo_err = workers[i].echo_err;
+		}
+	}
+
+	if (echo_err) {
+		fprintf(stderr, "Echo through the connection failed: %s\n",
+				strerror(echo_err));
+	}
+
+	printf("{\"threads\":%u,\"duration_s\":%.3f,", bench.nb_threads,
+			bench.duration);
+	print_latency("connect", &connects);
+	printf(",");
+	print_latency("close", &closes);
+	if (bench.name) {
+		printf(",");
+		print_latency("resolve", &resolves);
+	}
+	printf("}\n");
+
+	free(connects.values);
+	free(closes.values);
+	free(resolves.values);
+	free(workers);
+	return echo_err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License, version 2 only, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# Run the benchmark against the mock Tor server with and without torsocks at
+# every thread count and write the results as one JSON document.
+#
+# Usage: bench.sh MOCK_TOR BENCH_CLIENT LIBTORSOCKS [VERSION]
+#
+# Environment:
+#   BENCH_THREADS   thread counts, default "1 2 4 ... nproc"
+#   BENCH_DURATION  seconds of each phase of a run, default 2
+#   BENCH_MOCK_ARGS options of mock-tor such as "-l all=exp:200"
+#   BENCH_DNS       1 to resolve through the DNS port of the mock
+#   BENCH_CONTROL   1 to resolve through the control port of the mock
+#   BENCH_OUTPUT    file of the results, default bench.json
+
+MOCK_TOR=$1
+BENCH_CLIENT=$2
+LIBTORSOCKS=$3
+VERSION=$4
+
+# Never used since every CONNECT goes to the sink of the mock.
+TARGET_ADDR=198.51.100.1
+TARGET_PORT=80
+RESOLVE_NAME=bench.example
+
+if [ ! -x "$MOCK_TOR" ] || [ ! -x "$BENCH_CLIENT" ] || [ ! -f "$LIBTORSOCKS" ]; then
+	echo "Usage: $0 MOCK_TOR BENCH_CLIENT LIBTORSOCKS [VERSION]" >&2
+	exit 1
+fi
+
+DURATION=${BENCH_DURATION:-2}
+OUTPUT=${BENCH_OUTPUT:-bench.json}
+
+. `dirname "$0"`/mock.sh
+mock_start "$MOCK_TOR"
+
+runs=
+for threads in $BENCH_THREADS; do
+	# Without torsocks, straight to the sink the mock relays to.
+	result=`"$BENCH_CLIENT" -t $threads -d $DURATION 127.0.0.1 $sink_port` || exit 1
+	runs="$runs${runs:+,}
+    {\"preload\":false,\"result\":$result}"
+	echo "$threads threads without torsocks done" >&2
+
+	result=`TORSOCKS_CONF_FILE="$tmpdir/torsocks.conf" LD_PRELOAD="$LIBTORSOCKS" \
+		"$BENCH_CLIENT" -t $threads -d $DURATION -r $RESOLVE_NAME \
+		$TARGET_ADDR $TARGET_PORT` || exit 1
+	runs="$runs,
+    {\"preload\":true,\"result\":$result}"
+	echo "$threads threads with torsocks done" >&2
+done
+
+cat > "$OUTPUT" <<EOF
+{
+  "torsocks": "$VERSION",
+  "date": "`date -u +%Y-%m-%dT%H:%M:%SZ`",
+  "host": "`uname -srm`",
+  "mock_args": "$BENCH_MOCK_ARGS",
+  "dns": ${BENCH_DNS:-0},
+  "control": ${BENCH_CONTROL:-0},
+  "runs": [$runs
+  ]
+}
+EOF
+cat "$OUTPUT"
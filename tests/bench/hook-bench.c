@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Cost added by each hook on the calls that never go to Tor. Every call is
+ * timed alone, once through the tsocks_*() function and once straight to the
+ * libc, after a warmup and on threads pinned to a CPU. The overhead is the
+ * difference of the medians. The arguments of a call are prepared outside of
+ * the timed region with the libc functions.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <lib/torsocks.h>
+
+#define MAX_THREADS		256
+#define DEFAULT_ITERS	20000
+
+/* Resources of a thread shared by its calls. */
+struct bench_ctx {
+	int inet_listen;
+	struct sockaddr_in inet_addr;
+	int unix_listen;
+	struct sockaddr_un unix_addr;
+	socklen_t unix_addr_len;
+	/* AF_UNIX pair for recvmsg(). */
+	int pair[2];
+	/* Connected TCP socket for getpeername() and its server side. */
+	int peer_fd;
+	int server_fd;
+};
+
+/* Arguments and leftovers of one call. */
+struct call {
+	int fd;
+	int other_fd;
+	FILE *fp;
+};
+
+struct hook_case {
+	const char *name;
+	/* Untimed. Return 0 on success. */
+	int (*prepare)(struct bench_ctx *ctx, struct call *call);
+	/* Timed. Either the hook or the libc. */
+	int (*run)(struct bench_ctx *ctx, struct call *call, int hooked);
+	/* Untimed. */
+	void (*cleanup)(struct bench_ctx *ctx, struct call *call);
+};
+
+struct result {
+	/* Medians in cycles of the timer. */
+	double libc;
+	double hooked;
+	int error;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int cpu;
+	const struct hook_case *hook;
+	struct result result;
+};
+
+static unsigned int nb_iters = DEFAULT_ITERS;
+static unsigned int nb_warmup;
+/* Timer cycles per nanosecond. */
+static double cycles_per_ns = 1.0;
+/* Median cost of an empty timed region. */
+static double timer_overhead;
+static pthread_barrier_t barrier;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t timer_start(void)
+{
+	_mm_lfence();
+	return __rdtsc();
+}
+
+static inline uint64_t timer_end(void)
+{
+	unsigned int aux;
+	uint64_t t = __rdtscp(&aux);
+
+	_mm_lfence();
+	return t;
+}
+#else
+static inline uint64_t timer_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t timer_end(void)
+{
+	return timer_start();
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *) a, ub = *(const uint64_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static double median(uint64_t *samples, size_t nb)
+{
+	qsort(samples, nb, sizeof(*samples), compare_u64);
+	return samples[nb / 2];
+}
+
+/*
+ * Measure the frequency of the timer against the monotonic clock and the
+ * cost of an empty timed region.
+ */
+static void calibrate(void)
+{
+	unsigned int i;
+	uint64_t c0, c1, t0, t1;
+	uint64_t samples[1000];
+
+	t0 = now_ns();
+	c0 = timer_start();
+	while (now_ns() - t0 < 50000000ULL) {
+		continue;
+	}
+	c1 = timer_end();
+	t1 = now_ns();
+	cycles_per_ns = (double) (c1 - c0) / (t1 - t0);
+
+	for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		c0 = timer_start();
+		c1 = timer_end();
+		samples[i] = c1 - c0;
+	}
+	timer_overhead = median(samples, i);
+}
+
+static void close_linger(int fd)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	/* Thousands of connections would exhaust the ports in TIME_WAIT. */
+	(void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	tsocks_libc_close(fd);
+}
+
+/* close() of an inet socket. */
+static int prepare_socket_fd(struct bench_ctx *ctx, struct call *call)
+{
+	call->fd = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	return call->fd < 0 ? -1 : 0;
+}
+
+static int run_close(struct bench_ctx *ctx, struct call *call, int hooked)
+{
+	return hooked ? tsocks_close(call->fd) : tsocks_libc_close(call->fd);
+}
+
+/* fclose() of a stream on an inet socket. */
+static int prepare_fclose(struct bench_ctx *ctx, struct call *call)
+{
+	if (prepare_socket_fd(ctx, call) < 0) {
+		return -1;
+	}
+	call->fp = fdopen(call->fd, "r");
+	if (!call->fp) {
+		tsocks_libc_close(call->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_fclose(struct bench_ctx *ctx, struct call *call, int hooked)
+{
+	return hooked ? tsocks_fclose(call->fp) : tsocks_libc_fclose(call->fp);
+}
+
+/* socket() of an inet TCP socket. */
+static int run_socket(struct bench_ctx *ctx, struct call *call, int hooked)
+{
+	call->fd = hooked ? tsocks_socket(AF_INET, SOCK_STREAM, 0) :
+		tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	return call->fd;
+}
+
+static void cleanup_fd(struct bench_ctx *ctx, struct call *call)
+{
+	if (call->fd >= 0) {
+		tsocks_libc_close(call->fd);
+	}
+}
+
+/* recvmsg() of one byte on an AF_UNIX socket. */
+static int prepare_recvmsg(struct bench_ctx *ctx, struct call *call)
+{
+	char c = 'x';
+
+	return send(ctx->pair[1], &c, 1, 0) == 1 ? 0 : -1;
+}
+
+static int run_recvmsg(struct bench_ctx *ctx, struct call *call, int hooked)
+{
+	char c;
+	struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	return hooked ? tsocks_recvmsg(ctx->pair[0], &msg, 0) :
+		tsocks_libc_recvmsg(ctx->pair[0], &msg, 0);
+}
+
+/* accept() of a connection on a localhost listener. */
+static int prepare_accept(struct bench_ctx *ctx, struct call *call)
+{
+	call->other_fd = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	if (call->other_fd < 0) {
+		return -1;
+	}
+	if (tsocks_libc_connect(call->other_fd,
+				(struct sockaddr *) &ctx->inet_addr, sizeof(ctx->inet_addr)) < 0) {
+		tsocks_libc_close(call->other_fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_accept(struct bench_ctx *ctx, struct call *call, int hooked)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	call->fd = hooked ?
+		tsocks_accept(ctx->inet_listen, (struct sockaddr *) &sin, &len) :
+		tsocks_libc_accept(ctx->inet_listen, (struct sockaddr *) &sin, &len);
+	return call->fd;
+}
+
+static void cleanup_accept(struct bench_ctx *ctx, struct call *call)
+{
+	if (call->fd >= 0) {
+		close_linger(call->fd);
+	}
+	close_linger(call->other_fd);
+}
+
+/* getpeername() of a connected inet socket. */
+static int run_getpeername(struct bench_ctx *ctx, struct call *call,
+		int hooked)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	return hooked ?
+		tsocks_getpeername(ctx->peer_fd, (struct sockaddr *) &sin, &len) :
+		tsocks_libc_getpeername(ctx->peer_fd, (struct sockaddr *) &sin, &len);
+}
+
+/* connect() to an AF_UNIX listener. */
+static int prepare_connect_unix(struct bench_ctx *ctx, struct call *call)
+{
+	call->fd = tsocks_libc_socket(AF_UNIX, SOCK_STREAM, 0);
+	return call->fd < 0 ? -1 : 0;
+}
+
+static int run_connect_unix(struct bench_ctx *ctx, struct call *call,
+		int hooked)
+{
+	return hooked ?
+		tsocks_connect(call->fd, (struct sockaddr *) &ctx->unix_addr,
+				ctx->unix_addr_len) :
+		tsocks_libc_connect(call->fd, (struct sockaddr *) &ctx->unix_addr,
+				ctx->unix_addr_len);
+}
+
+static void cleanup_connect_unix(struct bench_ctx *ctx, struct call *call)
+{
+	int fd;
+
+	tsocks_libc_close(call->fd);
+	fd = tsocks_libc_accept(ctx->unix_listen, NULL, NULL);
+	if (fd >= 0) {
+		tsocks_libc_close(fd);
+	}
+}
+
+static const struct hook_case hook_cases[] = {
+	{ "close", prepare_socket_fd, run_close, NULL },
+	{ "fclose", prepare_fclose, run_fclose, NULL },
+	{ "socket", NULL, run_socket, cleanup_fd },
+	{ "recvmsg_unix", prepare_recvmsg, run_recvmsg, NULL },
+	{ "accept_localhost", prepare_accept, run_accept, cleanup_accept },
+	{ "getpeername", NULL, run_getpeername, NULL },
+	{ "connect_unix", prepare_connect_unix, run_connect_unix,
+		cleanup_connect_unix },
+};
+
+static int ctx_init(struct bench_ctx *ctx)
+{
+	socklen_t len = sizeof(ctx->inet_addr);
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->inet_listen = ctx->unix_listen = ctx->peer_fd = ctx->server_fd = -1;
+	ctx->pair[0] = ctx->pair[1] = -1;
+
+	ctx->inet_listen = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	ctx->inet_addr.sin_family = AF_INET;
+	ctx->inet_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (ctx->inet_listen < 0 ||
+			tsocks_libc_bind(ctx->inet_listen,
+				(struct sockaddr *) &ctx->inet_addr, len) < 0 ||
+			getsockname(ctx->inet_listen,
+				(struct sockaddr *) &ctx->inet_addr, &len) < 0 ||
+			tsocks_libc_listen(ctx->inet_listen, 128) < 0) {
+		return -1;
+	}
+
+	/* Abstract name so nothing is left on the filesystem. */
+	ctx->unix_listen = tsocks_libc_socket(AF_UNIX, SOCK_STREAM, 0);
+	ctx->unix_addr.sun_family = AF_UNIX;
+	snprintf(ctx->unix_addr.sun_path + 1, sizeof(ctx->unix_addr.sun_path) - 1,
+			"torsocks-hook-bench-%d-%p", (int) getpid(), (void *) ctx);
+	ctx->unix_addr_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+		strlen(ctx->unix_addr.sun_path + 1);
+	if (ctx->unix_listen < 0 ||
+			tsocks_libc_bind(ctx->unix_listen,
+				(struct sockaddr *) &ctx->unix_addr, ctx->unix_addr_len) < 0 ||
+			tsocks_libc_listen(ctx->unix_listen, 128) < 0) {
+		return -1;
+	}
+
+	if (tsocks_libc_socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->pair) < 0) {
+		return -1;
+	}
+
+	ctx->peer_fd = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	if (ctx->peer_fd < 0 ||
+			tsocks_libc_connect(ctx->peer_fd,
+				(struct sockaddr *) &ctx->inet_addr,
+				sizeof(ctx->inet_addr)) < 0) {
+		return -1;
+	}
+	ctx->server_fd = tsocks_libc_accept(ctx->inet_listen, NULL, NULL);
+	return ctx->server_fd < 0 ? -1 : 0;
+}
+
+static void ctx_fini(struct bench_ctx *ctx)
+{
+	int i;
+	int fds[] = { ctx->inet_listen, ctx->unix_listen, ctx->pair[0],
+		ctx->pair[1], ctx->server_fd };
+
+	for (i = 0; i < (int) (sizeof(fds) / sizeof(fds[0])); i++) {
+		if (fds[i] >= 0) {
+			tsocks_libc_close(fds[i]);
+		}
+	}
+	if (ctx->peer_fd >= 0) {
+		close_linger(ctx->peer_fd);
+	}
+}
+
+/*
+ * Time nb_iters calls after nb_warmup untimed ones.
+ *
+ * Return the median in timer cycles or a negative value on error.
+ */
+static double time_calls(struct bench_ctx *ctx, const struct hook_case *hook,
+		int hooked, uint64_t *samples)
+{
+	unsigned int i;
+	uint64_t t0, t1;
+	struct call call;
+
+	for (i = 0; i < nb_warmup + nb_iters; i++) {
+		memset(&call, 0, sizeof(call));
+		call.fd = -1;
+		if (hook->prepare && hook->prepare(ctx, &call) < 0) {
+			return -1;
+		}
+
+		t0 = timer_start();
+		hook->run(ctx, &call, hooked);
+		t1 = timer_end();
+
+		if (hook->cleanup) {
+			hook->cleanup(ctx, &call);
+		}
+		if (i >= nb_warmup) {
+			samples[i - nb_warmup] = t1 - t0;
+		}
+	}
+
+	return median(samples, nb_iters);
+}
+
+static void *worker_thread(void *data)
+{
+	struct worker *w = data;
+	struct bench_ctx ctx;
+	uint64_t *samples;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	(void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	if (ctx_init(&ctx) < 0) {
+		w->result.error = errno;
+	}
+	samples = calloc(nb_iters, sizeof(*samples));
+	if (!samples && !w->result.error) {
+		w->result.error = ENOMEM;
+	}
+	errno = 0;
+
+	/* Every thread runs the same case at the same time. */
+	pthread_barrier_wait(&barrier);
+	if (!w->result.error) {
+		w->result.libc = time_calls(&ctx, w->hook, 0, samples);
+		pthread_barrier_wait(&barrier);
+		w->result.hooked = time_calls(&ctx, w->hook, 1, samples);
+		if (w->result.libc < 0 || w->result.hooked < 0) {
+			w->result.error = errno ? errno : EINVAL;
+		}
+	} else {
+		pthread_barrier_wait(&barrier);
+	}
+
+	ctx_fini(&ctx);
+	free(samples);
+	return NULL;
+}
+
+static double to_ns(double cycles)
+{
+	cycles -= timer_overhead;
+	return (cycles > 0 ? cycles : 0) / cycles_per_ns;
+}
+
+/*
+ * Run a case on the given number of threads, print its line and set the
+ * overhead in ns.
+ *
+ * Return 0 on success else -1.
+ */
+static int run_case(const struct hook_case *hook, unsigned int nb_threads,
+		int json, int first, double *overhead)
+{
+	unsigned int i, nb_cpus;
+	double libc = 0, hooked = 0;
+	struct worker *workers;
+
+	workers = calloc(nb_threads, sizeof(*workers));
+	if (!workers) {
+		return -1;
+	}
+	nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_barrier_init(&barrier, NULL, nb_threads);
+
+	for (i = 0; i < nb_threads; i++) {
+		workers[i].hook = hook;
+		workers[i].cpu = i % nb_cpus;
+		pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].result.error) {
+			fprintf(stderr, "%s: %s\n", hook->name,
+					strerror(workers[i].result.error));
+			free(workers);
+			pthread_barrier_destroy(&barrier);
+			return -1;
+		}
+		libc += to_ns(workers[i].result.libc);
+		hooked += to_ns(workers[i].result.hooked);
+	}
+	pthread_barrier_destroy(&barrier);
+	free(workers);
+
+	/* Mean of the median of every thread. */
+	libc /= nb_threads;
+	hooked /= nb_threads;
+	*overhead = hooked - libc;
+
+	if (json) {
+		printf("%s\n    {\"hook\":\"%s\",\"threads\":%u,\"libc_ns\":%.1f,"
+				"\"hooked_ns\":%.1f,\"overhead_ns\":%.1f,"
+				"\"overhead_cycles\":%.0f}", first ? "" : ",", hook->name,
+				nb_threads, libc, hooked, *overhead,
+				*overhead * cycles_per_ns);
+	} else {
+		printf("%-18s %7u %10.1f %10.1f %12.1f %16.0f\n", hook->name,
+				nb_threads, libc, hooked, *overhead, *overhead * cycles_per_ns);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-j] [-n ITERS] [-t THREADS,...] "
+			"[-x MAX_NS] [HOOK...]\n"
+			"Time each hook against the libc call it wraps.\n\n"
+			"  -j          print JSON\n"
+			"  -n ITERS    timed calls per thread, default %u\n"
+			"  -t THREADS  comma separated thread counts, default 1\n"
+			"  -x MAX_NS   fail if an overhead is above MAX_NS\n\n"
+			"Hooks:", name, DEFAULT_ITERS);
+	for (i = 0; i < sizeof(hook_cases) / sizeof(hook_cases[0]); i++) {
+		fprintf(stderr, " %s", hook_cases[i].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, json = 0, first = 1, ret = EXIT_SUCCESS, selected;
+	unsigned int i, j, nb_counts = 0, counts[32];
+	double overhead, max_ns = -1;
+	char *str, *tok, *save = NULL;
+
+	while ((opt = getopt(argc, argv, "jn:t:x:h")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		case 'n':
+			nb_iters = atoi(optarg);
+			break;
+		case 't':
+			str = optarg;
+			while ((tok = strtok_r(str, ",", &save)) &&
+					nb_counts < sizeof(counts) / sizeof(counts[0])) {
+				counts[nb_counts] = atoi(tok);
+				if (counts[nb_counts] < 1 || counts[nb_counts] > MAX_THREADS) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				nb_counts++;
+				str = NULL;
+			}
+			break;
+		case 'x':
+			max_ns = atof(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (nb_iters < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!nb_counts) {
+		counts[nb_counts++] = 1;
+	}
+	nb_warmup = nb_iters / 10;
+
+	/* Resolve the libc symbols before anything is timed. */
+	tsocks_initialize();
+	calibrate();
+
+	if (json) {
+		printf("{\n  \"cycles_per_ns\": %.3f,\n  \"timer_overhead_cycles\": "
+				"%.0f,\n  \"iterations\": %u,\n  \"results\": [",
+				cycles_per_ns, timer_overhead, nb_iters);
+	} else {
+		printf("%.3f timer cycles/ns, %u calls per thread\n\n", cycles_per_ns,
+				nb_iters);
+		printf("%-18s %7s %10s %10s %12s %16s\n", "hook", "threads", "libc_ns",
+				"hooked_ns", "overhead_ns", "overhead_cycles");
+	}
+
+	for (i = 0; i < sizeof(hook_cases) / sizeof(hook_cases[0]); i++) {
+		selected = optind == argc;
+		for (j = optind; j < (unsigned int) argc; j++) {
+			if (strcmp(argv[j], hook_cases[i].name) == 0) {
+				selected = 1;
+			}
+		}
+		if (!selected) {
+			continue;
+		}
+
+		for (j = 0; j < nb_counts; j++) {
+			if (run_case(&hook_cases[i], counts[j], json, first,
+						&overhead) < 0) {
+				ret = EXIT_FAILURE;
+				continue;
+			}
+			first = 0;
+			if (max_ns >= 0 && overhead > max_ns) {
+				fprintf(stderr, "%s: overhead of %.1f ns above %.1f ns\n",
+						hook_cases[i].name, overhead, max_ns);
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (json) {
+		printf("\n  ]\n}\n");
+	}
+	return ret;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Contention stress of the connection registry and the onion pool. Threads
+ * resolve one of a few .onion names then connect to its cookie address and
+ * to a regular address, calling getpeername() and close() on both, for a
+ * duration. Linked with the library so every call goes through it. At the
+ * end, the mutex statistics of a library built with --enable-lock-stats are
+ * read from the control socket. The result is a JSON object on stdout.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS		1024
+#define MAX_LOCKS		8
+#define MAX_LOCK_FIELDS	8
+
+enum op {
+	OP_RESOLVE		= 0,
+	OP_CONNECT		= 1,
+	OP_GETPEERNAME	= 2,
+	OP_CLOSE		= 3,
+
+	OP_MAX,
+};
+
+static const char *op_names[OP_MAX] = {
+	"resolve", "connect", "getpeername", "close",
+};
+
+struct worker {
+	pthread_t thread;
+	uint64_t ops[OP_MAX];
+	uint64_t errors[OP_MAX];
+	uint32_t seed;
+};
+
+/* Metrics of one mutex read from the control socket. */
+struct lock_stats {
+	char name[64];
+	unsigned int nb_fields;
+	struct {
+		char name[64];
+		double value;
+	} fields[MAX_LOCK_FIELDS];
+};
+
+static struct {
+	struct sockaddr_in target;
+	unsigned int nb_names;
+	double duration;
+	unsigned int nb_threads;
+	pthread_barrier_t barrier;
+} bench = {
+	.nb_names = 32,
+	.duration = 2.0,
+	.nb_threads = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*
+ * Connect to the given address, ask for the peer and close, counting each
+ * call. A failed connect still closes the socket.
+ */
+static void connect_close(struct worker *w, const struct sockaddr *addr,
+		socklen_t addrlen)
+{
+	int fd;
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	/* No TIME_WAIT so thousands of connections do not exhaust the ports. */
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		w->errors[OP_CONNECT]++;
+		return;
+	}
+	(void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+	if (connect(fd, addr, addrlen) < 0) {
+		w->errors[OP_CONNECT]++;
+	} else {
+		w->ops[OP_CONNECT]++;
+		if (getpeername(fd, (struct sockaddr *) &peer, &len) < 0) {
+			w->errors[OP_GETPEERNAME]++;
+		} else {
+			w->ops[OP_GETPEERNAME]++;
+		}
+	}
+
+	if (close(fd) < 0) {
+		w->errors[OP_CLOSE]++;
+	} else {
+		w->ops[OP_CLOSE]++;
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	int ret;
+	char name[64];
+	uint64_t deadline;
+	struct addrinfo hints, *res;
+	struct worker *w = data;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pthread_barrier_wait(&bench.barrier);
+	deadline = now_ns() + bench.duration * 1e9;
+
+	while (now_ns() < deadline) {
+		snprintf(name, sizeof(name), "lockbench%u.onion",
+				xorshift32(&w->seed) % bench.nb_names);
+		ret = getaddrinfo(name, "80", &hints, &res);
+		if (ret) {
+			w->errors[OP_RESOLVE]++;
+		} else {
+			w->ops[OP_RESOLVE]++;
+			/* Looked up in the onion pool by cookie address. */
+			connect_close(w, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
+		}
+
+		connect_close(w, (struct sockaddr *) &bench.target,
+				sizeof(bench.target));
+	}
+
+	return NULL;
+}
+
+/*
+ * Ask the control socket of this process for its metrics and keep the
+ * torsocks_lock_* ones.
+ *
+ * Return the number of locks found.
+ */
+static unsigned int read_lock_stats(struct lock_stats *locks)
+{
+	int fd;
+	ssize_t ret;
+	size_t len = 0;
+	unsigned int i, nb_locks = 0;
+	char *buf = NULL, *tmp, *line, *save = NULL, field[64], lock[64];
+	const char *dir;
+	double value;
+	struct sockaddr_un addr;
+	static const char cmd[] = "stats\n";
+
+	dir = getenv("TORSOCKS_CONTROL_DIR");
+	if (!dir) {
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/torsocks-%d.sock",
+			dir, (int) getpid());
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return 0;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) {
+		fprintf(stderr, "%s: %s\n", addr.sun_path, strerror(errno));
+		goto end;
+	}
+
+	for (;;) {
+		tmp = realloc(buf, len + 4096 + 1);
+		if (!tmp) {
+			goto end;
+		}
+		buf = tmp;
+		ret = read(fd, buf + len, 4096);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+		len += ret;
+	}
+	if (!buf) {
+		goto end;
+	}
+	buf[len] = '\0';
+
+	for (line = strtok_r(buf, "\n", &save); line;
+			line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "torsocks_lock_%63[a-z_]{lock=\"%63[^\"]\"} %lf",
+					field, lock, &value) != 3) {
+			continue;
+		}
+		for (i = 0; i < nb_locks; i++) {
+			if (strcmp(locks[i].name, lock) == 0) {
+				break;
+			}
+		}
+		if (i == nb_locks) {
+			if (nb_locks == MAX_LOCKS) {
+				continue;
+			}
+			memset(&locks[i], 0, sizeof(locks[i]));
+			strcpy(locks[i].name, lock);
+			nb_locks++;
+		}
+		if (locks[i].nb_fields < MAX_LOCK_FIELDS) {
+			strcpy(locks[i].fields[locks[i].nb_fields].name, field);
+			locks[i].fields[locks[i].nb_fields].value = value;
+			locks[i].nb_fields++;
+		}
+	}
+
+end:
+	free(buf);
+	close(fd);
+	return nb_locks;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t THREADS] [-d SECONDS] [-n NAMES] "
+			"ADDR PORT\n"
+			"Resolve one of NAMES .onion addresses, connect to it and to "
+			"ADDR:PORT,\ncall getpeername() and close() in a loop.\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	unsigned int i, j, nb_locks;
+	uint64_t ops[OP_MAX] = { 0 }, errors[OP_MAX] = { 0 }, total = 0;
+	struct worker *workers;
+	struct lock_stats locks[MAX_LOCKS];
+
+	while ((opt = getopt(argc, argv, "t:d:n:h")) != -1) {
+		switch (opt) {
+		case 't':
+			bench.nb_threads = atoi(optarg);
+			break;
+		case 'd':
+			bench.duration = atof(optarg);
+			break;
+		case 'n':
+			bench.nb_names = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2 || bench.nb_threads < 1 ||
+			bench.nb_threads > MAX_THREADS || bench.duration <= 0 ||
+			bench.nb_names < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench.target.sin_family = AF_INET;
+	bench.target.sin_port = htons(atoi(argv[optind + 1]));
+	if (inet_pton(AF_INET, argv[optind], &bench.target.sin_addr) != 1) {
+		fprintf(stderr, "%s: invalid IPv4 address\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	workers = calloc(bench.nb_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	pthread_barrier_init(&bench.barrier, NULL, bench.nb_threads);
+
+	for (i = 0; i < bench.nb_threads; i++) {
+		workers[i].seed = 2463534242U + i * 7919;
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+					&workers[i])) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < bench.nb_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (j = 0; j < OP_MAX; j++) {
+			ops[j] += workers[i].ops[j];
+			errors[j] += workers[i].errors[j];
+		}
+	}
+	for (j = 0; j < OP_MAX; j++) {
+		total += ops[j];
+	}
+
+	printf("{\"threads\":%u,\"duration_s\":%.3f,\"ops_per_sec\":%.1f,"
+			"\"ops\":{", bench.nb_threads, bench.duration,
+			total / bench.duration);
+	for (j = 0; j < OP_MAX; j++) {
+		printf("%s\"%s\":{\"count\":%" PRIu64 ",\"errors\":%" PRIu64
+				",\"per_sec\":%.1f}", j ? "," : "", op_names[j], ops[j],
+				errors[j], ops[j] / bench.duration);
+	}
+	printf("},\"locks\":");
+
+	nb_locks = read_lock_stats(locks);
+	if (!nb_locks) {
+		fprintf(stderr, "No lock statistics, set TORSOCKS_CONTROL_DIR and "
+				"configure with --enable-lock-stats\n");
+		printf("null");
+	} else {
+		printf("{");
+		for (i = 0; i < nb_locks; i++) {
+			printf("%s\"%s\":{", i ? "," : "", locks[i].name);
+			for (j = 0; j < locks[i].nb_fields; j++) {
+				printf("%s\"%s\":%.9g", j ? "," : "", locks[i].fields[j].name,
+						locks[i].fields[j].value);
+			}
+			printf("}");
+		}
+		printf("}");
+	}
+	printf("}\n");
+
+	free(workers);
+	return EXIT_SUCCESS;
+}
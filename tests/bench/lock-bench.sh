@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License, version 2 only, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# Run the lock contention stress against the mock Tor server at every thread
+# count and write the throughput and the mutex statistics as one JSON
+# document. The statistics need a library configured with --enable-lock-stats.
+#
+# Usage: lock-bench.sh MOCK_TOR LOCK_BENCH [VERSION]
+#
+# Environment:
+#   BENCH_THREADS   thread counts, default "1 2 4 ... nproc"
+#   BENCH_DURATION  seconds of each run, default 2
+#   BENCH_NAMES     distinct .onion names resolved, default 32
+#   BENCH_MOCK_ARGS options of mock-tor such as "-l all=exp:200"
+#   BENCH_OUTPUT    file of the results, default bench-locks.json
+
+MOCK_TOR=$1
+LOCK_BENCH=$2
+VERSION=$3
+
+# Never used since every CONNECT goes to the sink of the mock.
+TARGET_ADDR=198.51.100.1
+TARGET_PORT=80
+
+if [ ! -x "$MOCK_TOR" ] || [ ! -x "$LOCK_BENCH" ]; then
+	echo "Usage: $0 MOCK_TOR LOCK_BENCH [VERSION]" >&2
+	exit 1
+fi
+
+DURATION=${BENCH_DURATION:-2}
+NAMES=${BENCH_NAMES:-32}
+OUTPUT=${BENCH_OUTPUT:-bench-locks.json}
+
+. `dirname "$0"`/mock.sh
+mock_start "$MOCK_TOR"
+
+runs=
+for threads in $BENCH_THREADS; do
+	# The statistics are read from the control socket of the process.
+	result=`TORSOCKS_CONF_FILE="$tmpdir/torsocks.conf" \
+		TORSOCKS_CONTROL_DIR="$tmpdir" \
+		"$LOCK_BENCH" -t $threads -d $DURATION -n $NAMES \
+		$TARGET_ADDR $TARGET_PORT` || exit 1
+	runs="$runs${runs:+,}
+    $result"
+	echo "$threads threads done" >&2
+done
+
+cat > "$OUTPUT" <<EOF2
+{
+  "torsocks": "$VERSION",
+  "date": "`date -u +%Y-%m-%dT%H:%M:%SZ`",
+  "host": "`uname -srm`",
+  "mock_args": "$BENCH_MOCK_ARGS",
+  "runs": [$runs
+  ]
+}
+EOF2
+cat "$OUTPUT"
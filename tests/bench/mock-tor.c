@@ -0,0 +1,1636 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Mock of the Tor SocksPort so torsocks can be tested and measured without a
+ * Tor daemon. It speaks the SOCKS5 method negotiation, the rfc1929
+ * authentication, CONNECT and the Tor RESOLVE and RESOLVE_PTR extensions.
+ *
+ * Every CONNECT is relayed to a local sink, by default an echo server in this
+ * same process, whatever the requested destination. Resolutions return an
+ * address in 10.0.0.0/8, or in 2001:db8::/32 like a SocksPort with the
+ * PreferIPv6 flag, derived from the name and names ending in ".invalid"
+ * fail. The replies can be delayed by a latency distribution and fail at a
+ * given rate, both per step.
+ *
+ * A DNSPort is also mocked on UDP. It answers A, AAAA and PTR queries with the
+ * same addresses and names as the SOCKS resolutions. A failed resolve step
+ * drops the query like a lost datagram.
+ *
+ * A ControlPort is mocked as well. It speaks AUTHENTICATE, with a password or
+ * a cookie if required, SETEVENTS and RESOLVE whose result is sent as an
+ * ADDRMAP event like Tor does, an IPv4 address or the name of a reverse
+ * lookup. A failed resolve step answers an error.
+ *
+ * Once listening, "socks PORT sink PORT dns PORT control PORT" is printed on
+ * stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/socks5.h>
+
+#define MAX_EVENTS		64
+#define RELAY_BUF_SIZE	16384
+#define DNS_MSG_SIZE	512
+#define COOKIE_LEN		32
+
+/* Steps that can be delayed or fail. */
+enum step {
+	STEP_METHOD		= 0,
+	STEP_AUTH		= 1,
+	STEP_CONNECT	= 2,
+	STEP_RESOLVE	= 3,
+
+	STEP_MAX,
+};
+
+static const char *step_names[] = {
+	[STEP_METHOD] = "method",
+	[STEP_AUTH] = "auth",
+	[STEP_CONNECT] = "connect",
+	[STEP_RESOLVE] = "resolve",
+};
+
+enum dist_type {
+	DIST_NONE,
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+};
+
+/* Latency distribution in microseconds. */
+struct dist {
+	enum dist_type type;
+	double a;
+	double b;
+};
+
+enum client_state {
+	/* SOCKS5 client waiting for its method, auth or request reply. */
+	STATE_METHOD,
+	STATE_AUTH,
+	STATE_REQUEST,
+	/* Reply delayed until reply_at. */
+	STATE_DELAYED,
+	/* Connecting to the sink before the CONNECT reply. */
+	STATE_SINK_CONNECT,
+	/* Relaying data with the peer. */
+	STATE_RELAY,
+	/* Client of the embedded echo sink. */
+	STATE_ECHO,
+	/* Client of the ControlPort. */
+	STATE_CONTROL,
+};
+
+struct client {
+	int fd;
+	enum client_state state;
+	/* State once the reply is sent, only used while delayed. */
+	enum client_state next_state;
+	/* Reply is followed by a close. */
+	int close_after;
+	/* Control client authenticated and asking for the ADDRMAP events. */
+	int authenticated;
+	int addrmap_events;
+
+	/* Handshake input. */
+	unsigned char in[512];
+	size_t in_len;
+
+	/* Reply pending to be written. */
+	unsigned char out[512];
+	size_t out_len;
+	size_t out_pos;
+
+	/* Monotonic time in usec at which the delayed reply is sent. */
+	uint64_t reply_at;
+	struct client *next_delayed;
+
+	/* Other side of a relay. Data read from fd waits in buf for it. */
+	struct client *peer;
+	unsigned char *buf;
+	size_t buf_len;
+	size_t buf_pos;
+	int eof;
+
+	/* Freed once the events already returned by epoll are handled. */
+	int dead;
+	struct client *next_dead;
+};
+
+/* DNS reply delayed until reply_at. */
+struct dns_reply {
+	uint64_t reply_at;
+	struct sockaddr_in peer;
+	unsigned char msg[DNS_MSG_SIZE];
+	size_t len;
+	struct dns_reply *next;
+};
+
+/* ADDRMAP event to a control client delayed until reply_at. */
+struct control_event {
+	uint64_t reply_at;
+	struct client *c;
+	char line[2 * (UINT8_MAX + 1) + 64];
+	struct control_event *next;
+};
+
+static struct {
+	int epoll_fd;
+	int socks_fd;
+	int sink_fd;
+	int dns_fd;
+	int control_fd;
+	/* Armed at the earliest delayed reply, epoll_wait() is too coarse. */
+	int timer_fd;
+	/* Where CONNECT is relayed. */
+	struct sockaddr_in sink_addr;
+	/* Required credentials if any. */
+	const char *user;
+	const char *pass;
+	/* Required control password and cookie, in hex, if any. */
+	const char *control_pass;
+	char cookie_hex[2 * COOKIE_LEN + 1];
+	/* Answer resolutions with an IPv6 address. */
+	int ipv6;
+	struct dist latency[STEP_MAX];
+	double failure[STEP_MAX];
+	uint64_t rand_state;
+	struct client *delayed;
+	struct dns_reply *dns_delayed;
+	struct control_event *control_delayed;
+	struct client *dead;
+	volatile sig_atomic_t quit;
+} mock;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Uniform random number in [0, 1). xorshift64* so a seed gives the same run.
+ */
+static double rand_unit(void)
+{
+	mock.rand_state ^= mock.rand_state >> 12;
+	mock.rand_state ^= mock.rand_state << 25;
+	mock.rand_state ^= mock.rand_state >> 27;
+	return ((mock.rand_state * 2685821657736338717ULL) >> 11) *
+		(1.0 / 9007199254740992.0);
+}
+
+static uint64_t dist_sample(const struct dist *d)
+{
+	switch (d->type) {
+	case DIST_FIXED:
+		return d->a;
+	case DIST_UNIFORM:
+		return d->a + (d->b - d->a) * rand_unit();
+	case DIST_EXP:
+		return -d->a * log(1.0 - rand_unit());
+	case DIST_NONE:
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Parse "fixed:US", "uniform:MIN:MAX" or "exp:MEAN".
+ *
+ * Return 0 on success else -1.
+ */
+static int dist_parse(const char *str, struct dist *d)
+{
+	if (sscanf(str, "fixed:%lf", &d->a) == 1) {
+		d->type = DIST_FIXED;
+	} else if (sscanf(str, "uniform:%lf:%lf", &d->a, &d->b) == 2 &&
+			d->a <= d->b) {
+		d->type = DIST_UNIFORM;
+	} else if (sscanf(str, "exp:%lf", &d->a) == 1) {
+		d->type = DIST_EXP;
+	} else {
+		return -1;
+	}
+	return d->a >= 0 ? 0 : -1;
+}
+
+/*
+ * Parse "STEP=VALUE" for the given step names, "all" sets every step.
+ *
+ * Return a mask of the steps or 0 on error and value points after the '='.
+ */
+static unsigned int step_parse(const char *str, const char **value)
+{
+	size_t len;
+	unsigned int i;
+	const char *eq = strchr(str, '=');
+
+	if (!eq) {
+		return 0;
+	}
+	*value = eq + 1;
+	len = eq - str;
+
+	if (len == 3 && strncmp(str, "all", 3) == 0) {
+		return (1U << STEP_MAX) - 1;
+	}
+	for (i = 0; i < STEP_MAX; i++) {
+		if (strlen(step_names[i]) == len && strncmp(str, step_names[i], len) == 0) {
+			return 1U << i;
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n"
+			"Mock Tor SocksPort for tests and benchmarks.\n\n"
+			"  -p PORT         SOCKS port, 0 for any (default)\n"
+			"  -e PORT         port of the echo sink, 0 for any (default)\n"
+			"  -d PORT         DNS port, 0 for any (default)\n"
+			"  -c PORT         control port, 0 for any (default)\n"
+			"  -P PASSWORD     require this control password\n"
+			"  -C FILE         write a control cookie there and require it\n"
+			"  -s ADDR:PORT    relay CONNECT to this IPv4 sink instead\n"
+			"  -a USER:PASS    require this rfc1929 authentication\n"
+			"  -6              resolve names to IPv6 addresses\n"
+			"  -l STEP=DIST    delay the replies of a step\n"
+			"  -f STEP=RATE    fail this fraction of a step\n"
+			"  -S SEED         seed of the random delays and failures\n\n"
+			"STEP is method, auth, connect, resolve or all.\n"
+			"DIST is fixed:US, uniform:MIN:MAX or exp:MEAN in microseconds.\n",
+			name);
+}
+
+static int listen_on(int type, uint16_t port, uint16_t *bound_port)
+{
+	int fd, on = 1;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+			(type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0) ||
+			getsockname(fd, (struct sockaddr *) &sin, &len) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	*bound_port = ntohs(sin.sin_port);
+	return fd;
+}
+
+/*
+ * Set the epoll events of a client from its state.
+ */
+static void client_update(struct client *c)
+{
+	struct epoll_event ev = { .data.ptr = c };
+
+	switch (c->state) {
+	case STATE_DELAYED:
+		ev.events = 0;
+		break;
+	case STATE_SINK_CONNECT:
+		ev.events = EPOLLOUT;
+		break;
+	case STATE_RELAY:
+	case STATE_ECHO:
+		/* Read only once the previous data is written. */
+		if (c->buf_pos == c->buf_len && !c->eof) {
+			ev.events |= EPOLLIN;
+		}
+		/* Echo writes its own data, a relay the data of its peer. */
+		if ((c->state == STATE_ECHO && c->buf_pos < c->buf_len) ||
+				(c->peer && c->peer->buf_pos < c->peer->buf_len) ||
+				c->out_pos < c->out_len) {
+			ev.events |= EPOLLOUT;
+		}
+		break;
+	case STATE_CONTROL:
+		ev.events = EPOLLIN;
+		if (c->buf_pos < c->buf_len) {
+			ev.events |= EPOLLOUT;
+		}
+		break;
+	default:
+		ev.events = c->out_pos < c->out_len ? EPOLLOUT : EPOLLIN;
+		break;
+	}
+
+	(void) epoll_ctl(mock.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static struct client *client_new(int fd, enum client_state state)
+{
+	struct client *c;
+	struct epoll_event ev;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+	c->fd = fd;
+	c->state = state;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		close(fd);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void delayed_remove(struct client *c)
+{
+	struct client **p;
+
+	for (p = &mock.delayed; *p; p = &(*p)->next_delayed) {
+		if (*p == c) {
+			*p = c->next_delayed;
+			break;
+		}
+	}
+}
+
+static void control_events_remove(struct client *c)
+{
+	struct control_event *e, **p = &mock.control_delayed;
+
+	while ((e = *p)) {
+		if (e->c == c) {
+			*p = e->next;
+			free(e);
+		} else {
+			p = &e->next;
+		}
+	}
+}
+
+/*
+ * Close a client and the other side of its relay. The memory is released by
+ * free_dead() since an event of the batch can still point to it.
+ */
+static void client_free(struct client *c)
+{
+	struct client *peer = c->peer;
+
+	if (c->dead) {
+		return;
+	}
+	if (c->state == STATE_DELAYED) {
+		delayed_remove(c);
+	}
+	if (c->state == STATE_CONTROL) {
+		control_events_remove(c);
+	}
+	close(c->fd);
+	c->dead = 1;
+	c->next_dead = mock.dead;
+	mock.dead = c;
+
+	if (peer) {
+		peer->peer = NULL;
+		client_free(peer);
+	}
+}
+
+static void free_dead(void)
+{
+	struct client *c;
+
+	while ((c = mock.dead)) {
+		mock.dead = c->next_dead;
+		free(c->buf);
+		free(c);
+	}
+}
+
+/*
+ * Queue a reply sent after the latency of the step.
+ */
+static void client_reply(struct client *c, enum step step, const void *data,
+		size_t len, enum client_state next, int close_after)
+{
+	uint64_t delay;
+
+	memcpy(c->out, data, len);
+	c->out_len = len;
+	c->out_pos = 0;
+	c->in_len = 0;
+	c->next_state = next;
+	c->close_after = close_after;
+
+	delay = dist_sample(&mock.latency[step]);
+	if (delay) {
+		c->reply_at = now_us() + delay;
+		c->state = STATE_DELAYED;
+		c->next_delayed = mock.delayed;
+		mock.delayed = c;
+	} else {
+		c->state = next;
+	}
+	client_update(c);
+}
+
+/*
+ * Write the pending reply.
+ *
+ * Return 0 when all is written, 1 if the rest must wait and -1 on error.
+ */
+static int client_flush_out(struct client *c)
+{
+	ssize_t ret;
+
+	while (c->out_pos < c->out_len) {
+		ret = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+				MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? 1 : -1;
+		}
+		c->out_pos += ret;
+	}
+	return 0;
+}
+
+/*
+ * FNV-1a of a name, from which the addresses in 10.0.0.0/8 and 2001:db8::/32
+ * are derived.
+ */
+static uint32_t name_hash(const void *name, size_t len)
+{
+	size_t i;
+	uint32_t hash = 2166136261U;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ ((const unsigned char *) name)[i]) * 16777619U;
+	}
+	return hash;
+}
+
+static int fails(enum step step)
+{
+	return mock.failure[step] > 0 && rand_unit() < mock.failure[step];
+}
+
+static void handle_method(struct client *c)
+{
+	unsigned int i;
+	uint8_t reply[2] = { SOCKS5_VERSION, SOCKS5_NO_ACCPT_METHOD };
+	uint8_t wanted = mock.user ? SOCKS5_USER_PASS_METHOD :
+		SOCKS5_NO_AUTH_METHOD;
+
+	if (c->in_len < 2 || c->in_len < 2U + c->in[1]) {
+		return;
+	}
+
+	for (i = 0; i < c->in[1]; i++) {
+		if (c->in[2 + i] == wanted) {
+			reply[1] = wanted;
+			break;
+		}
+		/* Credentials are accepted even if not required, as Tor does. */
+		if (!mock.user && c->in[2 + i] == SOCKS5_USER_PASS_METHOD) {
+			reply[1] = SOCKS5_USER_PASS_METHOD;
+		}
+	}
+
+	if (c->in[0] != SOCKS5_VERSION || reply[1] == SOCKS5_NO_ACCPT_METHOD) {
+		client_reply(c, STEP_METHOD, reply, sizeof(reply), STATE_METHOD, 1);
+		return;
+	}
+	client_reply(c, STEP_METHOD, reply, sizeof(reply),
+			reply[1] == SOCKS5_USER_PASS_METHOD ? STATE_AUTH : STATE_REQUEST, 0);
+}
+
+static void handle_auth(struct client *c)
+{
+	size_t ulen, plen;
+	uint8_t reply[2] = { SOCKS5_USER_PASS_VER, 0 };
+
+	if (c->in_len < 2 || c->in_len < 3 + (ulen = c->in[1]) ||
+			c->in_len < 3 + ulen + (plen = c->in[2 + ulen])) {
+		return;
+	}
+
+	if (mock.user && (ulen != strlen(mock.user) ||
+				plen != strlen(mock.pass) ||
+				memcmp(c->in + 2, mock.user, ulen) ||
+				memcmp(c->in + 3 + ulen, mock.pass, plen))) {
+		reply[1] = 1;
+	}
+	if (fails(STEP_AUTH)) {
+		reply[1] = 1;
+	}
+	client_reply(c, STEP_AUTH, reply, sizeof(reply), STATE_REQUEST,
+			reply[1] != 0);
+}
+
+/*
+ * Start the connection to the sink, the reply is sent once it is connected.
+ */
+static void start_sink(struct client *c)
+{
+	int fd;
+	struct client *sink;
+	/* The sink side is closed first, keep its ports out of TIME_WAIT. */
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	c->buf = malloc(RELAY_BUF_SIZE);
+	if (!c->buf) {
+		goto error;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		goto error;
+	}
+	(void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	if (connect(fd, (struct sockaddr *) &mock.sink_addr,
+				sizeof(mock.sink_addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		goto error;
+	}
+
+	sink = client_new(fd, STATE_SINK_CONNECT);
+	if (!sink) {
+		goto error;
+	}
+	sink->buf = malloc(RELAY_BUF_SIZE);
+	if (!sink->buf) {
+		client_free(sink);
+		goto error;
+	}
+	sink->peer = c;
+	c->peer = sink;
+	/* The client waits for the sink. */
+	c->state = STATE_DELAYED;
+	c->reply_at = UINT64_MAX;
+	c->next_delayed = mock.delayed;
+	mock.delayed = c;
+	client_update(c);
+	client_update(sink);
+	return;
+
+error:
+	/* Send the reply as a failure and close. */
+	c->out[1] = SOCKS5_REPLY_FAIL;
+	c->close_after = 1;
+	c->state = STATE_REQUEST;
+	client_update(c);
+}
+
+/*
+ * The client is delayed until its sink is connected.
+ */
+static void sink_connected(struct client *sink)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	struct client *c = sink->peer;
+
+	if (!c) {
+		client_free(sink);
+		return;
+	}
+
+	(void) getsockopt(sink->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+	delayed_remove(c);
+	c->state = STATE_RELAY;
+	if (err) {
+		c->out[1] = SOCKS5_REPLY_REFUSED;
+		c->close_after = 1;
+		c->peer = NULL;
+		sink->peer = NULL;
+		client_free(sink);
+	} else {
+		sink->state = STATE_RELAY;
+		client_update(sink);
+	}
+	client_update(c);
+}
+
+static void handle_request(struct client *c)
+{
+	size_t addr_len, need, name_len = 0;
+	uint32_t hash;
+	unsigned char reply[4 + 1 + UINT8_MAX + 2];
+	size_t reply_len;
+	enum step step;
+
+	if (c->in_len < 5) {
+		return;
+	}
+	switch (c->in[3]) {
+	case SOCKS5_ATYP_IPV4:
+		addr_len = 4;
+		break;
+	case SOCKS5_ATYP_IPV6:
+		addr_len = 16;
+		break;
+	case SOCKS5_ATYP_DOMAIN:
+		name_len = c->in[4];
+		addr_len = 1 + name_len;
+		break;
+	default:
+		addr_len = 0;
+		break;
+	}
+	need = 4 + addr_len + 2;
+	if (addr_len && c->in_len < need) {
+		return;
+	}
+
+	memset(reply, 0, sizeof(reply));
+	reply[0] = SOCKS5_VERSION;
+	reply[3] = SOCKS5_ATYP_IPV4;
+	reply_len = 4 + 4 + 2;
+
+	switch (c->in[1]) {
+	case SOCKS5_CMD_CONNECT:
+		step = STEP_CONNECT;
+		if (c->in[3] == SOCKS5_ATYP_IPV6) {
+			reply[3] = SOCKS5_ATYP_IPV6;
+			reply_len = 4 + 16 + 2;
+		}
+		break;
+	case SOCKS5_CMD_RESOLVE:
+		step = STEP_RESOLVE;
+		if (c->in[3] != SOCKS5_ATYP_DOMAIN) {
+			reply[1] = SOCKS5_REPLY_ADR_NOTSUP;
+			break;
+		}
+		if (name_len >= 8 &&
+				strncasecmp((char *) c->in + 5 + name_len - 8, ".invalid", 8) == 0) {
+			reply[1] = SOCKS5_REPLY_NO_HOST;
+			break;
+		}
+		hash = name_hash(c->in + 5, name_len);
+		if (mock.ipv6) {
+			reply[3] = SOCKS5_ATYP_IPV6;
+			reply_len = 4 + 16 + 2;
+			reply[4] = 0x20;
+			reply[5] = 0x01;
+			reply[6] = 0x0d;
+			reply[7] = 0xb8;
+			reply[17] = hash >> 16;
+			reply[18] = hash >> 8;
+			reply[19] = hash | 1;
+			break;
+		}
+		reply[4] = 10;
+		reply[5] = hash >> 16;
+		reply[6] = hash >> 8;
+		reply[7] = hash | 1;
+		break;
+	case SOCKS5_CMD_RESOLVE_PTR:
+		step = STEP_RESOLVE;
+		if (c->in[3] != SOCKS5_ATYP_IPV4) {
+			reply[1] = SOCKS5_REPLY_ADR_NOTSUP;
+			break;
+		}
+		reply[3] = SOCKS5_ATYP_DOMAIN;
+		reply[4] = snprintf((char *) reply + 5, UINT8_MAX,
+				"mock-%u-%u-%u-%u.example", c->in[4], c->in[5], c->in[6],
+				c->in[7]);
+		reply_len = 4 + 1 + reply[4] + 2;
+		break;
+	default:
+		step = STEP_CONNECT;
+		reply[1] = SOCKS5_REPLY_CMD_NOTSUP;
+		break;
+	}
+	if (!addr_len && reply[1] == SOCKS5_REPLY_SUCCESS) {
+		reply[1] = SOCKS5_REPLY_ADR_NOTSUP;
+	}
+	if (reply[1] == SOCKS5_REPLY_SUCCESS && fails(step)) {
+		reply[1] = step == STEP_CONNECT ? SOCKS5_REPLY_TTL_EXP :
+			SOCKS5_REPLY_NO_HOST;
+	}
+
+	if (c->in[1] == SOCKS5_CMD_CONNECT && reply[1] == SOCKS5_REPLY_SUCCESS) {
+		client_reply(c, step, reply, reply_len, STATE_SINK_CONNECT, 0);
+		if (c->state == STATE_SINK_CONNECT) {
+			start_sink(c);
+		}
+		return;
+	}
+	/* A resolve or an error ends the connection as Tor does. */
+	client_reply(c, step, reply, reply_len, STATE_REQUEST, 1);
+}
+
+/*
+ * Send a DNS reply, a datagram not sent is lost.
+ */
+static void dns_send(const struct dns_reply *r)
+{
+	(void) sendto(mock.dns_fd, r->msg, r->len, 0,
+			(const struct sockaddr *) &r->peer, sizeof(r->peer));
+}
+
+/*
+ * Answer a DNS query in r->msg of r->len bytes in place.
+ *
+ * Return 0 if the reply is ready else -1 to drop the query.
+ */
+static int dns_answer(struct dns_reply *r)
+{
+	char name[UINT8_MAX + 1];
+	unsigned int a, b, c, d;
+	uint32_t hash;
+	uint16_t qtype;
+	size_t pos = 12, name_len = 0, label_len, rdlen = 0, i;
+	unsigned char *p, rcode = 0, rdata[UINT8_MAX + 2];
+
+	/* A query with a single uncompressed question. */
+	if (r->len < 12 || (r->msg[2] & 0x80) || r->msg[4] != 0 ||
+			r->msg[5] != 1) {
+		return -1;
+	}
+	while (pos < r->len && (label_len = r->msg[pos]) != 0) {
+		if (label_len > 63 || pos + 1 + label_len > r->len ||
+				name_len + label_len + 1 >= sizeof(name)) {
+			return -1;
+		}
+		if (name_len) {
+			name[name_len++] = '.';
+		}
+		memcpy(name + name_len, r->msg + pos + 1, label_len);
+		name_len += label_len;
+		pos += 1 + label_len;
+	}
+	name[name_len] = '\0';
+	if (pos + 5 > r->len) {
+		return -1;
+	}
+	qtype = (r->msg[pos + 1] << 8) | r->msg[pos + 2];
+	/* Only the question is kept in the reply. */
+	r->len = pos + 5;
+
+	if (fails(STEP_RESOLVE)) {
+		return -1;
+	}
+
+	hash = name_hash(name, name_len);
+
+	if (name_len >= 8 && strcasecmp(name + name_len - 8, ".invalid") == 0) {
+		rcode = 3;
+	} else if (qtype == 1) {
+		rdata[0] = 10;
+		rdata[1] = hash >> 16;
+		rdata[2] = hash >> 8;
+		rdata[3] = hash | 1;
+		rdlen = 4;
+	} else if (qtype == 28) {
+		memset(rdata, 0, 16);
+		rdata[0] = 0x20;
+		rdata[1] = 0x01;
+		rdata[2] = 0x0d;
+		rdata[3] = 0xb8;
+		rdata[13] = hash >> 16;
+		rdata[14] = hash >> 8;
+		rdata[15] = hash | 1;
+		rdlen = 16;
+	} else if (qtype == 12 && name_len > 13 &&
+			strcasecmp(name + name_len - 13, ".in-addr.arpa") == 0 &&
+			sscanf(name, "%u.%u.%u.%u.", &d, &c, &b, &a) == 4) {
+		/* The name in wire format after its length. */
+		rdlen = snprintf((char *) rdata + 1, UINT8_MAX,
+				"mock-%u-%u-%u-%u.example", a, b, c, d);
+		for (p = rdata, i = 1; i <= rdlen + 1; i++) {
+			if (i == rdlen + 1 || rdata[i] == '.') {
+				*p = rdata + i - p - 1;
+				p = rdata + i;
+			}
+		}
+		rdata[rdlen + 1] = 0;
+		rdlen += 2;
+	}
+
+	/* QR, RD copied and RA set. */
+	r->msg[2] = 0x80 | (r->msg[2] & 0x01);
+	r->msg[3] = 0x80 | rcode;
+	memset(r->msg + 6, 0, 6);
+	if (!rdlen) {
+		/* No record of that type, or the name does not exist. */
+		return 0;
+	}
+
+	p = r->msg + r->len;
+	r->msg[7] = 1;
+	/* Pointer to the name of the question. */
+	*p++ = 0xc0;
+	*p++ = 12;
+	*p++ = qtype >> 8;
+	*p++ = qtype & 0xff;
+	*p++ = 0;
+	*p++ = 1;
+	/* TTL of 60 seconds. */
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 60;
+	*p++ = rdlen >> 8;
+	*p++ = rdlen & 0xff;
+	memcpy(p, rdata, rdlen);
+	r->len += 12 + rdlen;
+	return 0;
+}
+
+/*
+ * Answer every query waiting on the DNS socket, now or once delayed.
+ */
+static void handle_dns(void)
+{
+	ssize_t len;
+	uint64_t delay;
+	socklen_t peer_len;
+	struct dns_reply *r = NULL;
+
+	for (;;) {
+		if (!r) {
+			r = malloc(sizeof(*r));
+			if (!r) {
+				return;
+			}
+		}
+		peer_len = sizeof(r->peer);
+		len = recvfrom(mock.dns_fd, r->msg, sizeof(r->msg), 0,
+				(struct sockaddr *) &r->peer, &peer_len);
+		if (len < 0) {
+			break;
+		}
+		r->len = len;
+		if (dns_answer(r) < 0) {
+			continue;
+		}
+
+		delay = dist_sample(&mock.latency[STEP_RESOLVE]);
+		if (!delay) {
+			dns_send(r);
+			continue;
+		}
+		r->reply_at = now_us() + delay;
+		r->next = mock.dns_delayed;
+		mock.dns_delayed = r;
+		r = NULL;
+	}
+	free(r);
+}
+
+/*
+ * Read from a relay or echo client.
+ *
+ * Return 0 on success else -1 if the client must be freed.
+ */
+static int relay_read(struct client *c)
+{
+	ssize_t ret;
+
+	if (c->buf_pos < c->buf_len || c->eof) {
+		return 0;
+	}
+	ret = recv(c->fd, c->buf, RELAY_BUF_SIZE, 0);
+	if (ret < 0) {
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	if (ret == 0) {
+		if (c->state == STATE_ECHO || !c->peer) {
+			return -1;
+		}
+		c->eof = 1;
+		shutdown(c->peer->fd, SHUT_WR);
+		return c->peer->eof ? -1 : 0;
+	}
+	c->buf_len = ret;
+	c->buf_pos = 0;
+	return 0;
+}
+
+/*
+ * Write the data of src in the given client.
+ *
+ * Return 0 on success else -1 if the client must be freed.
+ */
+static int relay_write(struct client *c, struct client *src)
+{
+	ssize_t ret;
+
+	while (src->buf_pos < src->buf_len) {
+		ret = send(c->fd, src->buf + src->buf_pos,
+				src->buf_len - src->buf_pos, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? 0 : -1;
+		}
+		src->buf_pos += ret;
+	}
+	src->buf_pos = src->buf_len = 0;
+	return 0;
+}
+
+/*
+ * Queue a line to a control client, written by relay_write().
+ *
+ * Return 0 on success else -1 if the client does not read its replies.
+ */
+static int control_write(struct client *c, const char *line)
+{
+	size_t len = strlen(line);
+
+	if (c->buf_pos > 0) {
+		memmove(c->buf, c->buf + c->buf_pos, c->buf_len - c->buf_pos);
+		c->buf_len -= c->buf_pos;
+		c->buf_pos = 0;
+	}
+	if (c->buf_len + len > RELAY_BUF_SIZE) {
+		return -1;
+	}
+	memcpy(c->buf + c->buf_len, line, len);
+	c->buf_len += len;
+	return 0;
+}
+
+/*
+ * Check the argument of AUTHENTICATE, the cookie in hex or the password as a
+ * quoted string. Anything goes if neither is required.
+ */
+static int control_auth_ok(const char *arg)
+{
+	size_t len = 0;
+	char password[UINT8_MAX + 1];
+
+	if (!mock.control_pass && !mock.cookie_hex[0]) {
+		return 1;
+	}
+	if (mock.cookie_hex[0] && strcasecmp(arg, mock.cookie_hex) == 0) {
+		return 1;
+	}
+	if (!mock.control_pass || *arg++ != '"') {
+		return 0;
+	}
+	while (*arg && *arg != '"') {
+		if (*arg == '\\' && arg[1]) {
+			arg++;
+		}
+		if (len + 1 >= sizeof(password)) {
+			return 0;
+		}
+		password[len++] = *arg++;
+	}
+	password[len] = '\0';
+	return arg[0] == '"' && arg[1] == '\0' &&
+		strcmp(password, mock.control_pass) == 0;
+}
+
+/*
+ * Queue the ADDRMAP event answering a RESOLVE of the given name, or address
+ * if reverse. Like Tor, a reverse lookup is mapped from its in-addr.arpa
+ * name.
+ *
+ * Return 0 on success else -1 if the client must be freed.
+ */
+static int control_resolve(struct client *c, const char *name, int reverse)
+{
+	int ret;
+	uint32_t hash;
+	uint64_t delay;
+	size_t len = strlen(name);
+	unsigned char *b;
+	struct in_addr in;
+	struct control_event *e;
+
+	e = malloc(sizeof(*e));
+	if (!e) {
+		return -1;
+	}
+
+	if (fails(STEP_RESOLVE) ||
+			(len >= 8 && strcasecmp(name + len - 8, ".invalid") == 0)) {
+		snprintf(e->line, sizeof(e->line),
+				"650 ADDRMAP %s <error> NEVER error=yes CACHED=\"NO\"\r\n",
+				name);
+	} else if (reverse) {
+		if (inet_pton(AF_INET, name, &in) != 1) {
+			snprintf(e->line, sizeof(e->line),
+					"650 ADDRMAP %s <error> NEVER error=yes\r\n", name);
+		} else {
+			b = (unsigned char *) &in;
+			snprintf(e->line, sizeof(e->line), "650 ADDRMAP "
+					"%u.%u.%u.%u.in-addr.arpa mock-%u-%u-%u-%u.example NEVER "
+					"CACHED=\"NO\"\r\n", b[3], b[2], b[1], b[0], b[0], b[1],
+					b[2], b[3]);
+		}
+	} else {
+		/* RESOLVE gives an IPv4 address, whatever -6 says. */
+		hash = name_hash(name, len);
+		snprintf(e->line, sizeof(e->line),
+				"650 ADDRMAP %s 10.%u.%u.%u NEVER CACHED=\"NO\"\r\n", name,
+				(hash >> 16) & 0xff, (hash >> 8) & 0xff, (hash | 1) & 0xff);
+	}
+
+	delay = dist_sample(&mock.latency[STEP_RESOLVE]);
+	if (!delay) {
+		ret = control_write(c, e->line);
+		free(e);
+		return ret;
+	}
+	e->c = c;
+	e->reply_at = now_us() + delay;
+	e->next = mock.control_delayed;
+	mock.control_delayed = e;
+	return 0;
+}
+
+/*
+ * Handle a command line of a control client.
+ *
+ * Return 0 on success else -1 if the client must be freed.
+ */
+static int control_command(struct client *c, char *line)
+{
+	int ret, reverse = 0;
+	char *arg, *end;
+
+	arg = strchr(line, ' ');
+	if (arg) {
+		*arg++ = '\0';
+	} else {
+		arg = line + strlen(line);
+	}
+
+	if (strcasecmp(line, "AUTHENTICATE") == 0) {
+		if (!control_auth_ok(arg) || fails(STEP_AUTH)) {
+			c->close_after = 1;
+			return control_write(c, "515 Authentication failed\r\n");
+		}
+		c->authenticated = 1;
+		return control_write(c, "250 OK\r\n");
+	}
+	if (!c->authenticated) {
+		c->close_after = 1;
+		return control_write(c, "514 Authentication required.\r\n");
+	}
+
+	if (strcasecmp(line, "SETEVENTS") == 0) {
+		c->addrmap_events = strstr(arg, "ADDRMAP") != NULL;
+		return control_write(c, "250 OK\r\n");
+	}
+	if (strcasecmp(line, "RESOLVE") == 0) {
+		if (strncmp(arg, "mode=reverse ", 13) == 0) {
+			reverse = 1;
+			arg += 13;
+		}
+		/* A single name is resolved. */
+		end = strchr(arg, ' ');
+		if (end) {
+			*end = '\0';
+		}
+		if (*arg == '\0') {
+			return control_write(c, "512 Missing argument to RESOLVE\r\n");
+		}
+		ret = control_write(c, "250 OK\r\n");
+		if (ret == 0 && c->addrmap_events) {
+			ret = control_resolve(c, arg, reverse);
+		}
+		return ret;
+	}
+	return control_write(c, "510 Unrecognized command\r\n");
+}
+
+static void handle_control(struct client *c, uint32_t events)
+{
+	ssize_t ret;
+	unsigned char *line, *end;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		ret = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+		if (ret == 0 ||
+				(ret < 0 && errno != EAGAIN && errno != EINTR)) {
+			goto error;
+		}
+		if (ret > 0) {
+			c->in_len += ret;
+		}
+	}
+
+	line = c->in;
+	while (!c->close_after &&
+			(end = memchr(line, '\n', c->in + c->in_len - line))) {
+		*end = '\0';
+		if (end > line && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+		if (control_command(c, (char *) line) < 0) {
+			goto error;
+		}
+		line = end + 1;
+	}
+	c->in_len -= line - c->in;
+	memmove(c->in, line, c->in_len);
+	if (c->in_len == sizeof(c->in)) {
+		goto error;
+	}
+
+	if (relay_write(c, c) < 0 || (c->close_after && !c->buf_len)) {
+		goto error;
+	}
+	client_update(c);
+	return;
+
+error:
+	client_free(c);
+}
+
+static void handle_relay(struct client *c, uint32_t events)
+{
+	if (c->out_pos < c->out_len) {
+		/* The CONNECT reply goes before any data. */
+		if (client_flush_out(c) < 0 || c->close_after) {
+			goto error;
+		}
+		if (c->out_pos < c->out_len) {
+			client_update(c);
+			return;
+		}
+	}
+
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && relay_read(c) < 0) {
+		goto error;
+	}
+	if (c->state == STATE_ECHO) {
+		if (relay_write(c, c) < 0) {
+			goto error;
+		}
+	} else if (c->peer) {
+		if (relay_write(c->peer, c) < 0 ||
+				relay_write(c, c->peer) < 0) {
+			goto error;
+		}
+		client_update(c->peer);
+	} else {
+		goto error;
+	}
+	client_update(c);
+	return;
+
+error:
+	client_free(c);
+}
+
+static void handle_handshake(struct client *c, uint32_t events)
+{
+	ssize_t ret;
+
+	if (c->out_pos < c->out_len) {
+		ret = client_flush_out(c);
+		if (ret < 0 || (ret == 0 && c->close_after)) {
+			goto error;
+		}
+		client_update(c);
+		return;
+	}
+
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		return;
+	}
+	ret = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		goto error;
+	}
+	c->in_len += ret;
+
+	switch (c->state) {
+	case STATE_METHOD:
+		handle_method(c);
+		break;
+	case STATE_AUTH:
+		handle_auth(c);
+		break;
+	case STATE_REQUEST:
+		handle_request(c);
+		break;
+	default:
+		break;
+	}
+	if (c->in_len == sizeof(c->in)) {
+		goto error;
+	}
+
+	/* Replies without delay go out right away. */
+	if (c->state != STATE_DELAYED && c->out_pos < c->out_len) {
+		ret = client_flush_out(c);
+		if (ret < 0 || (ret == 0 && c->close_after)) {
+			goto error;
+		}
+		client_update(c);
+	}
+	return;
+
+error:
+	client_free(c);
+}
+
+/*
+ * Send the replies whose delay is over and arm the timer for the next one.
+ */
+static void run_delayed(void)
+{
+	uint64_t now = now_us(), next = UINT64_MAX;
+	struct client *c, **p = &mock.delayed;
+	struct dns_reply *r, **rp = &mock.dns_delayed;
+	struct control_event *e, **ep = &mock.control_delayed;
+	struct itimerspec its;
+
+	while ((r = *rp)) {
+		if (r->reply_at > now) {
+			if (r->reply_at < next) {
+				next = r->reply_at;
+			}
+			rp = &r->next;
+			continue;
+		}
+		*rp = r->next;
+		dns_send(r);
+		free(r);
+	}
+
+	while ((e = *ep)) {
+		if (e->reply_at > now) {
+			if (e->reply_at < next) {
+				next = e->reply_at;
+			}
+			ep = &e->next;
+			continue;
+		}
+		*ep = e->next;
+		c = e->c;
+		if (control_write(c, e->line) < 0 || relay_write(c, c) < 0) {
+			/* Its other events are freed as well, start over. */
+			free(e);
+			client_free(c);
+			ep = &mock.control_delayed;
+			continue;
+		}
+		client_update(c);
+		free(e);
+	}
+
+	while ((c = *p)) {
+		if (c->reply_at == UINT64_MAX) {
+			/* Waiting for its sink. */
+			p = &c->next_delayed;
+			continue;
+		}
+		if (c->reply_at > now) {
+			if (c->reply_at < next) {
+				next = c->reply_at;
+			}
+			p = &c->next_delayed;
+			continue;
+		}
+
+		*p = c->next_delayed;
+		c->state = c->next_state;
+		if (c->state == STATE_SINK_CONNECT) {
+			start_sink(c);
+		} else {
+			client_update(c);
+		}
+	}
+
+	/* A zero value disarms the timer. */
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = (next % 1000000) * 1000;
+	}
+	(void) timerfd_settime(mock.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void accept_clients(int listen_fd, enum client_state state)
+{
+	int fd, on = 1;
+	struct client *c;
+
+	for (;;) {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		c = client_new(fd, state);
+		if (c && (state == STATE_ECHO || state == STATE_CONTROL)) {
+			c->buf = malloc(RELAY_BUF_SIZE);
+			if (!c->buf) {
+				client_free(c);
+			}
+		}
+	}
+}
+
+/*
+ * Write a random control cookie in the given file, as Tor does at startup.
+ */
+static int write_cookie(const char *path)
+{
+	unsigned int i;
+	unsigned char cookie[COOKIE_LEN];
+	FILE *fp;
+
+	for (i = 0; i < COOKIE_LEN; i++) {
+		cookie[i] = rand_unit() * 256;
+		snprintf(mock.cookie_hex + 2 * i, 3, "%02x", cookie[i]);
+	}
+
+	fp = fopen(path, "wb");
+	if (!fp || fwrite(cookie, sizeof(cookie), 1, fp) != 1) {
+		perror(path);
+		if (fp) {
+			fclose(fp);
+		}
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void sighandler(int signo)
+{
+	(void) signo;
+	mock.quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, nb;
+	uint64_t expirations;
+	unsigned int mask, s;
+	uint16_t socks_port = 0, sink_port = 0, dns_port = 0, control_port = 0;
+	const char *value, *cookie_file = NULL;
+	char *sep;
+	struct dist d;
+	struct client *c;
+	struct epoll_event events[MAX_EVENTS];
+	struct sigaction sa;
+
+	mock.rand_state = 0x9e3779b97f4a7c15ULL;
+
+	while ((opt = getopt(argc, argv, "p:e:d:c:P:C:s:a:6l:f:S:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			socks_port = atoi(optarg);
+			break;
+		case 'e':
+			sink_port = atoi(optarg);
+			break;
+		case 'd':
+			dns_port = atoi(optarg);
+			break;
+		case 'c':
+			control_port = atoi(optarg);
+			break;
+		case 'P':
+			mock.control_pass = optarg;
+			break;
+		case 'C':
+			cookie_file = optarg;
+			break;
+		case 's':
+			sep = strrchr(optarg, ':');
+			if (!sep) {
+				goto error_usage;
+			}
+			*sep = '\0';
+			mock.sink_addr.sin_family = AF_INET;
+			mock.sink_addr.sin_port = htons(atoi(sep + 1));
+			if (inet_pton(AF_INET, optarg, &mock.sink_addr.sin_addr) != 1) {
+				goto error_usage;
+			}
+			break;
+		case 'a':
+			sep = strchr(optarg, ':');
+			if (!sep) {
+				goto error_usage;
+			}
+			*sep = '\0';
+			mock.user = optarg;
+			mock.pass = sep + 1;
+			break;
+		case '6':
+			mock.ipv6 = 1;
+			break;
+		case 'l':
+			mask = step_parse(optarg, &value);
+			if (!mask || dist_parse(value, &d) < 0) {
+				goto error_usage;
+			}
+			for (s = 0; s < STEP_MAX; s++) {
+				if (mask & (1U << s)) {
+					mock.latency[s] = d;
+				}
+			}
+			break;
+		case 'f':
+			mask = step_parse(optarg, &value);
+			if (!mask) {
+				goto error_usage;
+			}
+			for (s = 0; s < STEP_MAX; s++) {
+				if (mask & (1U << s)) {
+					mock.failure[s] = atof(value);
+				}
+			}
+			break;
+		case 'S':
+			mock.rand_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			goto error_usage;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	mock.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mock.epoll_fd < 0) {
+		perror("epoll_create1");
+		return EXIT_FAILURE;
+	}
+
+	mock.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (mock.timer_fd < 0) {
+		perror("timerfd_create");
+		return EXIT_FAILURE;
+	}
+
+	mock.socks_fd = listen_on(SOCK_STREAM, socks_port, &socks_port);
+	mock.sink_fd = listen_on(SOCK_STREAM, sink_port, &sink_port);
+	mock.dns_fd = listen_on(SOCK_DGRAM, dns_port, &dns_port);
+	mock.control_fd = listen_on(SOCK_STREAM, control_port, &control_port);
+	if (mock.socks_fd < 0 || mock.sink_fd < 0 || mock.dns_fd < 0 ||
+			mock.control_fd < 0) {
+		return EXIT_FAILURE;
+	}
+	if (cookie_file && write_cookie(cookie_file) < 0) {
+		return EXIT_FAILURE;
+	}
+	if (mock.sink_addr.sin_family != AF_INET) {
+		mock.sink_addr.sin_family = AF_INET;
+		mock.sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		mock.sink_addr.sin_port = htons(sink_port);
+	}
+
+	/* These are told apart from the clients by the address of their fd. */
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = &mock.socks_fd;
+	epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, mock.socks_fd, &events[0]);
+	events[0].data.ptr = &mock.sink_fd;
+	epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, mock.sink_fd, &events[0]);
+	events[0].data.ptr = &mock.dns_fd;
+	epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, mock.dns_fd, &events[0]);
+	events[0].data.ptr = &mock.control_fd;
+	epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, mock.control_fd, &events[0]);
+	events[0].data.ptr = &mock.timer_fd;
+	epoll_ctl(mock.epoll_fd, EPOLL_CTL_ADD, mock.timer_fd, &events[0]);
+
+	printf("socks %u sink %u dns %u control %u\n", socks_port, sink_port,
+			dns_port, control_port);
+	fflush(stdout);
+
+	while (!mock.quit) {
+		run_delayed();
+		nb = epoll_wait(mock.epoll_fd, events, MAX_EVENTS, -1);
+		if (nb < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < nb; i++) {
+			if (events[i].data.ptr == &mock.socks_fd) {
+				accept_clients(mock.socks_fd, STATE_METHOD);
+				continue;
+			}
+			if (events[i].data.ptr == &mock.sink_fd) {
+				accept_clients(mock.sink_fd, STATE_ECHO);
+				continue;
+			}
+			if (events[i].data.ptr == &mock.control_fd) {
+				accept_clients(mock.control_fd, STATE_CONTROL);
+				continue;
+			}
+			if (events[i].data.ptr == &mock.dns_fd) {
+				handle_dns();
+				continue;
+			}
+			if (events[i].data.ptr == &mock.timer_fd) {
+				/* The delayed replies are sent at the next loop. */
+				if (read(mock.timer_fd, &expirations,
+							sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("read timer");
+				}
+				continue;
+			}
+
+			c = events[i].data.ptr;
+			if (c->dead) {
+				continue;
+			}
+			switch (c->state) {
+			case STATE_SINK_CONNECT:
+				sink_connected(c);
+				break;
+			case STATE_RELAY:
+			case STATE_ECHO:
+				handle_relay(c, events[i].events);
+				break;
+			case STATE_CONTROL:
+				handle_control(c, events[i].events);
+				break;
+			case STATE_DELAYED:
+				/* Only an error is reported while waiting. */
+				client_free(c);
+				break;
+			default:
+				handle_handshake(c, events[i].events);
+				break;
+			}
+		}
+		free_dead();
+	}
+
+	return EXIT_SUCCESS;
+
+error_usage:
+	usage(argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,77 @@
+#
+# Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License, version 2 only, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# Sourced by the benchmark scripts. Creates $tmpdir, starts the mock Tor
+# server with $BENCH_MOCK_ARGS and writes $tmpdir/torsocks.conf pointing to
+# it, resolving through its DNS port if BENCH_DNS is 1 or its control port if
+# BENCH_CONTROL is 1. Sets socks_port, sink_port, dns_port and control_port,
+# everything is cleaned up on exit.
+#
+# Usage: mock_start MOCK_TOR
+
+tmpdir=`mktemp -d ${TMPDIR:-/tmp}/torsocks-bench.XXXXXX` || exit 1
+mock_pid=
+
+cleanup ()
+{
+	if [ -n "$mock_pid" ]; then
+		kill $mock_pid 2>/dev/null
+		wait $mock_pid 2>/dev/null
+	fi
+	rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mock_start ()
+{
+	"$1" $BENCH_MOCK_ARGS > "$tmpdir/ports" &
+	mock_pid=$!
+
+	# Wait for the mock to print its ports.
+	i=0
+	while [ ! -s "$tmpdir/ports" ]; do
+		i=`expr $i + 1`
+		if [ $i -gt 50 ] || ! kill -0 $mock_pid 2>/dev/null; then
+			echo "$0: mock Tor server did not start" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+	read _ socks_port _ sink_port _ dns_port _ control_port < "$tmpdir/ports"
+
+	cat > "$tmpdir/torsocks.conf" <<EOC
+TorAddress 127.0.0.1
+TorPort $socks_port
+EOC
+	if [ "$BENCH_DNS" = 1 ]; then
+		echo "TorDNSPort $dns_port" >> "$tmpdir/torsocks.conf"
+	fi
+	if [ "$BENCH_CONTROL" = 1 ]; then
+		echo "TorControlPort $control_port" >> "$tmpdir/torsocks.conf"
+	fi
+}
+
+# Thread counts 1 2 4 ... nproc unless BENCH_THREADS is set.
+if [ -z "$BENCH_THREADS" ]; then
+	nproc=`getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1`
+	n=1
+	while [ $n -lt $nproc ]; do
+		BENCH_THREADS="$BENCH_THREADS $n"
+		n=`expr $n \* 2`
+	done
+	BENCH_THREADS="$BENCH_THREADS $nproc"
+fi
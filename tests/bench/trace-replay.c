@@ -0,0 +1,827 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Replay of a trace recorded with TORSOCKS_TRACE_FILE. Every thread of the
+ * recording gets a thread issuing its calls in the same order at the same
+ * time offsets. Linked with the library so the calls go through it, run it
+ * with a configuration pointing to the mock Tor server, see trace-replay.sh.
+ *
+ * The fds of the recording are mapped to the ones of the replay and the
+ * addresses returned by the resolutions of the recording to the ones of the
+ * replay so a connect() to an onion cookie address still finds its entry.
+ * Calls needing a peer or data (accept, recvmsg, sendto, ...) are skipped.
+ * The result is a JSON object on stdout comparing the recorded and replayed
+ * durations per call.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/trace.h>
+
+/* Recorded fds at or above are not replayed. */
+#define FD_MAP_SIZE		65536
+#define ADDR_MAP_SIZE	4096
+
+static const char *hook_names[TRACE_HOOK_MAX] = {
+	[TRACE_SOCKET] = "socket",
+	[TRACE_SOCKETPAIR] = "socketpair",
+	[TRACE_CONNECT] = "connect",
+	[TRACE_CLOSE] = "close",
+	[TRACE_FCLOSE] = "fclose",
+	[TRACE_GETPEERNAME] = "getpeername",
+	[TRACE_ACCEPT] = "accept",
+	[TRACE_ACCEPT4] = "accept4",
+	[TRACE_LISTEN] = "listen",
+	[TRACE_BIND] = "bind",
+	[TRACE_DUP] = "dup",
+	[TRACE_DUP2] = "dup2",
+	[TRACE_DUP3] = "dup3",
+	[TRACE_RECVMSG] = "recvmsg",
+	[TRACE_RECVMMSG] = "recvmmsg",
+	[TRACE_SENDTO] = "sendto",
+	[TRACE_SENDMMSG] = "sendmmsg",
+	[TRACE_GETADDRINFO] = "getaddrinfo",
+	[TRACE_GETHOSTBYNAME] = "gethostbyname",
+	[TRACE_GETHOSTBYNAME2] = "gethostbyname2",
+	[TRACE_GETHOSTBYNAME_R] = "gethostbyname_r",
+	[TRACE_GETHOSTBYNAME2_R] = "gethostbyname2_r",
+	[TRACE_GETHOSTBYADDR] = "gethostbyaddr",
+	[TRACE_GETHOSTBYADDR_R] = "gethostbyaddr_r",
+	[TRACE_SYSCALL] = "syscall",
+	[TRACE_IO_URING_SETUP] = "io_uring_setup",
+	[TRACE_IO_URING_QUEUE_INIT] = "io_uring_queue_init",
+	[TRACE_RECVFROM] = "recvfrom",
+	[TRACE_SENDMSG] = "sendmsg",
+	[TRACE_FCNTL] = "fcntl",
+	[TRACE_CLOSE_RANGE] = "close_range",
+	[TRACE_CLOSEFROM] = "closefrom",
+};
+
+/* Outcome of a replayed call. */
+enum replay_result {
+	REPLAY_SAME		= 0,
+	/* Failed when the recorded one succeeded or the opposite. */
+	REPLAY_DIFF		= 1,
+	REPLAY_SKIPPED	= 2,
+};
+
+struct replay_record {
+	const struct trace_record *rec;
+	const char *name;
+	/*
+	 * Recorded fds the call uses or creates, -1 if none, and its rank among
+	 * the calls on each of them.
+	 */
+	int chains[2];
+	uint32_t seqs[2];
+};
+
+struct replay_thread {
+	pthread_t thread;
+	uint32_t tid;
+	struct replay_record *records;
+	size_t nb_records;
+	size_t size;
+	/* Per hook. */
+	uint64_t count[TRACE_HOOK_MAX];
+	uint64_t diff[TRACE_HOOK_MAX];
+	uint64_t skipped[TRACE_HOOK_MAX];
+	uint64_t recorded_ns[TRACE_HOOK_MAX];
+	uint64_t replayed_ns[TRACE_HOOK_MAX];
+	/* Duration of every replayed call, in record order. */
+	uint64_t *durations;
+};
+
+/* Address of the recording mapped to the one of the replay. */
+struct addr_map {
+	uint16_t family;
+	uint8_t from[16];
+	uint8_t to[16];
+};
+
+static struct {
+	double speed;
+	uint64_t t0;
+	uint64_t replay_start;
+	int fd_map[FD_MAP_SIZE];
+	/* Calls done on each recorded fd, see chain_wait(). */
+	uint32_t fd_done[FD_MAP_SIZE];
+	struct addr_map addrs[ADDR_MAP_SIZE];
+	unsigned int nb_addrs;
+	pthread_mutex_t addrs_lock;
+	pthread_barrier_t barrier;
+} replay = {
+	.speed = 1.0,
+	.addrs_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t addr_len(int family)
+{
+	return family == AF_INET6 ? sizeof(struct in6_addr) :
+		sizeof(struct in_addr);
+}
+
+/*
+ * Set the recorded fds used or created by a call.
+ */
+static void record_chains(struct replay_record *r)
+{
+	const struct trace_record *rec = r->rec;
+
+	r->chains[0] = r->chains[1] = -1;
+
+	switch (rec->hook) {
+	case TRACE_SOCKET:
+		r->chains[0] = rec->ret;
+		break;
+	case TRACE_CONNECT:
+	case TRACE_CLOSE:
+	case TRACE_FCLOSE:
+	case TRACE_GETPEERNAME:
+		r->chains[0] = rec->fd;
+		break;
+	case TRACE_DUP:
+		r->chains[0] = rec->fd;
+		r->chains[1] = rec->ret;
+		break;
+	case TRACE_DUP2:
+	case TRACE_DUP3:
+		r->chains[0] = rec->fd;
+		r->chains[1] = rec->arg;
+		break;
+	default:
+		break;
+	}
+
+	if (r->chains[0] < 0 || r->chains[0] >= FD_MAP_SIZE) {
+		r->chains[0] = -1;
+	}
+	if (r->chains[1] < 0 || r->chains[1] >= FD_MAP_SIZE ||
+			r->chains[1] == r->chains[0]) {
+		r->chains[1] = -1;
+	}
+}
+
+/*
+ * Threads reuse the fd numbers closed by others. Wait for every call made
+ * before this one in the recording on the same fds so a socket is never
+ * closed or mapped again under another thread.
+ */
+static void chain_wait(const struct replay_record *r)
+{
+	int i;
+	unsigned int spins = 0;
+	struct timespec ts = { .tv_nsec = 20000 };
+
+	for (i = 0; i < 2; i++) {
+		if (r->chains[i] < 0) {
+			continue;
+		}
+		while (__atomic_load_n(&replay.fd_done[r->chains[i]],
+					__ATOMIC_ACQUIRE) != r->seqs[i]) {
+			if (++spins < 100) {
+				sched_yield();
+			} else {
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+}
+
+static void chain_done(const struct replay_record *r)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (r->chains[i] >= 0) {
+			__atomic_add_fetch(&replay.fd_done[r->chains[i]], 1,
+					__ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * Order of two records in the recording, the ones of a thread being in call
+ * order in its array.
+ */
+static int compare_records(const void *a, const void *b)
+{
+	const struct replay_record *ra = *(struct replay_record * const *) a;
+	const struct replay_record *rb = *(struct replay_record * const *) b;
+
+	if (ra->rec->start != rb->rec->start) {
+		return ra->rec->start < rb->rec->start ? -1 : 1;
+	}
+	return ra < rb ? -1 : ra > rb;
+}
+
+static int map_fd(int fd)
+{
+	if (fd < 0 || fd >= FD_MAP_SIZE) {
+		return -1;
+	}
+	return __atomic_load_n(&replay.fd_map[fd], __ATOMIC_RELAXED);
+}
+
+static void set_fd(int fd, int value)
+{
+	if (fd >= 0 && fd < FD_MAP_SIZE) {
+		__atomic_store_n(&replay.fd_map[fd], value, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Remember that the recorded address of a resolution is now another one.
+ */
+static void map_addr(const struct trace_record *rec, const void *to)
+{
+	unsigned int i;
+	struct addr_map *m;
+
+	if (rec->family != AF_INET && rec->family != AF_INET6) {
+		return;
+	}
+
+	pthread_mutex_lock(&replay.addrs_lock);
+	for (i = 0; i < replay.nb_addrs; i++) {
+		m = &replay.addrs[i];
+		if (m->family == rec->family &&
+				!memcmp(m->from, rec->addr, addr_len(rec->family))) {
+			break;
+		}
+	}
+	if (i < ADDR_MAP_SIZE) {
+		m = &replay.addrs[i];
+		m->family = rec->family;
+		memcpy(m->from, rec->addr, addr_len(rec->family));
+		memcpy(m->to, to, addr_len(rec->family));
+		if (i == replay.nb_addrs) {
+			replay.nb_addrs++;
+		}
+	}
+	pthread_mutex_unlock(&replay.addrs_lock);
+}
+
+/*
+ * Build the socket address of a record, mapped if a resolution returned it.
+ */
+static socklen_t record_sockaddr(const struct trace_record *rec,
+		struct sockaddr_storage *ss)
+{
+	unsigned int i;
+	const uint8_t *addr = rec->addr;
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+	pthread_mutex_lock(&replay.addrs_lock);
+	for (i = 0; i < replay.nb_addrs; i++) {
+		if (replay.addrs[i].family == rec->family &&
+				!memcmp(replay.addrs[i].from, rec->addr,
+					addr_len(rec->family))) {
+			addr = replay.addrs[i].to;
+			break;
+		}
+	}
+
+	memset(ss, 0, sizeof(*ss));
+	if (rec->family == AF_INET) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = rec->port;
+		memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+	} else {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = rec->port;
+		memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+	}
+	pthread_mutex_unlock(&replay.addrs_lock);
+
+	return rec->family == AF_INET ? sizeof(*sin) : sizeof(*sin6);
+}
+
+static void map_hostent(const struct trace_record *rec,
+		const struct hostent *he)
+{
+	if (he && he->h_addrtype == rec->family && he->h_addr_list[0]) {
+		map_addr(rec, he->h_addr_list[0]);
+	}
+}
+
+/*
+ * Issue the call of a record.
+ *
+ * Return the replay result and set failed if the call failed.
+ */
+static enum replay_result replay_call(const struct replay_record *r,
+		int *failed)
+{
+	int ret = 0, fd, herr;
+	char buf[1024];
+	socklen_t len;
+	struct addrinfo hints, *res;
+	struct hostent he, *result;
+	struct sockaddr_storage ss;
+	const struct trace_record *rec = r->rec;
+
+	switch (rec->hook) {
+	case TRACE_SOCKET:
+		ret = socket(rec->fd, rec->arg, 0);
+		if (ret >= 0 && rec->ret >= 0) {
+			set_fd(rec->ret, ret);
+		} else if (ret >= 0) {
+			close(ret);
+		}
+		break;
+	case TRACE_CONNECT:
+		fd = map_fd(rec->fd);
+		if (fd < 0 || (rec->family != AF_INET && rec->family != AF_INET6)) {
+			return REPLAY_SKIPPED;
+		}
+		len = record_sockaddr(rec, &ss);
+		ret = connect(fd, (struct sockaddr *) &ss, len);
+		break;
+	case TRACE_CLOSE:
+	case TRACE_FCLOSE:
+		/* Never close an fd that this process did not map. */
+		fd = map_fd(rec->fd);
+		if (fd < 0) {
+			return REPLAY_SKIPPED;
+		}
+		set_fd(rec->fd, -1);
+		ret = close(fd);
+		break;
+	case TRACE_GETPEERNAME:
+		fd = map_fd(rec->fd);
+		if (fd < 0) {
+			return REPLAY_SKIPPED;
+		}
+		len = sizeof(ss);
+		ret = getpeername(fd, (struct sockaddr *) &ss, &len);
+		break;
+	case TRACE_DUP:
+	case TRACE_DUP2:
+	case TRACE_DUP3:
+		fd = map_fd(rec->fd);
+		if (fd < 0) {
+			return REPLAY_SKIPPED;
+		}
+		/* dup() since the target fd number may be used here. */
+		ret = dup(fd);
+		if (ret >= 0 && rec->ret >= 0) {
+			fd = map_fd(rec->hook == TRACE_DUP ? rec->ret : rec->arg);
+			if (fd >= 0) {
+				close(fd);
+			}
+			set_fd(rec->hook == TRACE_DUP ? rec->ret : rec->arg, ret);
+		} else if (ret >= 0) {
+			close(ret);
+		}
+		break;
+	case TRACE_GETADDRINFO:
+		if (!rec->name_len) {
+			return REPLAY_SKIPPED;
+		}
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = rec->arg;
+		hints.ai_socktype = SOCK_STREAM;
+		ret = getaddrinfo(r->name, NULL, &hints, &res);
+		if (ret == 0) {
+			if (res->ai_family == AF_INET) {
+				map_addr(rec,
+						&((struct sockaddr_in *) res->ai_addr)->sin_addr);
+			} else if (res->ai_family == AF_INET6) {
+				map_addr(rec,
+						&((struct sockaddr_in6 *) res->ai_addr)->sin6_addr);
+			}
+			freeaddrinfo(res);
+		} else {
+			ret = -1;
+		}
+		break;
+	case TRACE_GETHOSTBYNAME:
+	case TRACE_GETHOSTBYNAME2:
+		if (!rec->name_len) {
+			return REPLAY_SKIPPED;
+		}
+		result = rec->hook == TRACE_GETHOSTBYNAME ? gethostbyname(r->name) :
+			gethostbyname2(r->name, rec->arg);
+		map_hostent(rec, result);
+		ret = result ? 0 : -1;
+		break;
+	case TRACE_GETHOSTBYNAME_R:
+	case TRACE_GETHOSTBYNAME2_R:
+		if (!rec->name_len) {
+			return REPLAY_SKIPPED;
+		}
+		ret = rec->hook == TRACE_GETHOSTBYNAME_R ?
+			gethostbyname_r(r->name, &he, buf, sizeof(buf), &result, &herr) :
+			gethostbyname2_r(r->name, rec->arg, &he, buf, sizeof(buf),
+					&result, &herr);
+		if (ret == 0 && result) {
+			map_hostent(rec, result);
+		} else {
+			ret = -1;
+		}
+		break;
+	case TRACE_GETHOSTBYADDR:
+	case TRACE_GETHOSTBYADDR_R:
+		if (rec->family != AF_INET && rec->family != AF_INET6) {
+			return REPLAY_SKIPPED;
+		}
+		if (rec->hook == TRACE_GETHOSTBYADDR) {
+			ret = gethostbyaddr(rec->addr, addr_len(rec->family),
+					rec->family) ? 0 : -1;
+		} else {
+			ret = gethostbyaddr_r(rec->addr, addr_len(rec->family),
+					rec->family, &he, buf, sizeof(buf), &result, &herr);
+			ret = ret == 0 && result ? 0 : -1;
+		}
+		break;
+	default:
+		return REPLAY_SKIPPED;
+	}
+
+	*failed = ret < 0;
+	/* getaddrinfo() and the *_r() calls fail with a positive value. */
+	if ((rec->hook == TRACE_GETADDRINFO || rec->hook == TRACE_GETHOSTBYNAME_R ||
+				rec->hook == TRACE_GETHOSTBYNAME2_R ||
+				rec->hook == TRACE_GETHOSTBYADDR_R) ?
+			(rec->ret != 0) != *failed : (rec->ret < 0) != *failed) {
+		return REPLAY_DIFF;
+	}
+	return REPLAY_SAME;
+}
+
+static void *replay_thread(void *data)
+{
+	int failed;
+	size_t i;
+	uint64_t target, start, end;
+	struct timespec ts;
+	enum replay_result result;
+	struct replay_thread *t = data;
+	const struct trace_record *rec;
+
+	pthread_barrier_wait(&replay.barrier);
+
+	for (i = 0; i < t->nb_records; i++) {
+		rec = t->records[i].rec;
+
+		if (replay.speed > 0) {
+			target = replay.replay_start +
+				(rec->start - replay.t0) / replay.speed;
+			ts.tv_sec = target / 1000000000ULL;
+			ts.tv_nsec = target % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+					EINTR) {
+				continue;
+			}
+		}
+
+		chain_wait(&t->records[i]);
+		failed = 0;
+		start = now_ns();
+		result = replay_call(&t->records[i], &failed);
+		end = now_ns();
+		chain_done(&t->records[i]);
+
+		switch (result) {
+		case REPLAY_SKIPPED:
+			t->skipped[rec->hook]++;
+			t->durations[i] = UINT64_MAX;
+			continue;
+		case REPLAY_DIFF:
+			t->diff[rec->hook]++;
+			break;
+		case REPLAY_SAME:
+			break;
+		}
+		t->durations[i] = end - start;
+		t->count[rec->hook]++;
+		t->recorded_ns[rec->hook] += rec->duration;
+		t->replayed_ns[rec->hook] += t->durations[i];
+	}
+
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *) a, ub = *(const uint64_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static void print_record(const struct replay_record *r)
+{
+	char addr[INET6_ADDRSTRLEN] = "-";
+	const struct trace_record *rec = r->rec;
+
+	if (rec->family == AF_INET || rec->family == AF_INET6) {
+		inet_ntop(rec->family, rec->addr, addr, sizeof(addr));
+	}
+	printf("%12.3f %7u %-20s fd=%d arg=%d ret=%d err=%d %s:%u %s %.3fus\n",
+			(rec->start - replay.t0) / 1e3, rec->tid,
+			rec->hook < TRACE_HOOK_MAX && hook_names[rec->hook] ?
+			hook_names[rec->hook] : "?", rec->fd, rec->arg, rec->ret, rec->err,
+			addr, ntohs(rec->port), r->name ? r->name : "-",
+			rec->duration / 1e3);
+}
+
+/*
+ * Append a record to the thread of its tid, created if needed.
+ */
+static int add_record(struct replay_thread **threads, size_t *nb_threads,
+		const struct trace_record *rec, const char *name)
+{
+	size_t i;
+	void *tmp;
+	struct replay_thread *t;
+
+	for (i = 0; i < *nb_threads; i++) {
+		if ((*threads)[i].tid == rec->tid) {
+			break;
+		}
+	}
+	if (i == *nb_threads) {
+		tmp = realloc(*threads, (i + 1) * sizeof(**threads));
+		if (!tmp) {
+			return -1;
+		}
+		*threads = tmp;
+		memset(&(*threads)[i], 0, sizeof(**threads));
+		(*threads)[i].tid = rec->tid;
+		(*nb_threads)++;
+	}
+
+	t = &(*threads)[i];
+	if (t->nb_records == t->size) {
+		t->size = t->size ? t->size * 2 : 256;
+		tmp = realloc(t->records, t->size * sizeof(*t->records));
+		if (!tmp) {
+			return -1;
+		}
+		t->records = tmp;
+	}
+	t->records[t->nb_records].rec = rec;
+	t->records[t->nb_records].name = name;
+	t->nb_records++;
+	return 0;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+	FILE *fp;
+	char *buf = NULL, *tmp;
+	size_t ret, size = 0;
+
+	*len = 0;
+	fp = fopen(path, "r");
+	if (!fp) {
+		return NULL;
+	}
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 65536;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = tmp;
+		}
+		ret = fread(buf + *len, 1, size - *len, fp);
+		*len += ret;
+	} while (ret > 0);
+	fclose(fp);
+	return buf;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-p] [-s SPEED] TRACE\n"
+			"Replay a TORSOCKS_TRACE_FILE recording.\n\n"
+			"  -p        print the records instead of replaying them\n"
+			"  -s SPEED  time scale, 2 is twice as fast, 0 as fast as "
+			"possible\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, print = 0, first = 1;
+	char *buf, *name;
+	size_t len, off, i, j, k, nb_threads = 0, nb_records = 0, nb_durations;
+	uint64_t count, diff, skipped, rec_ns, rep_ns, wall, *durations;
+	uint32_t *next;
+	const struct trace_header *hdr;
+	const struct trace_record *rec;
+	struct replay_record **sorted;
+	struct replay_thread *threads = NULL;
+
+	while ((opt = getopt(argc, argv, "ps:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			print = 1;
+			break;
+		case 's':
+			replay.speed = atof(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 1 || replay.speed < 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buf = read_file(argv[optind], &len);
+	if (!buf) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	hdr = (const struct trace_header *) buf;
+	if (len < sizeof(*hdr) || hdr->magic != TRACE_MAGIC ||
+			hdr->version != TRACE_VERSION ||
+			hdr->record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a torsocks trace of version %d\n",
+				argv[optind], TRACE_VERSION);
+		return EXIT_FAILURE;
+	}
+
+	replay.t0 = UINT64_MAX;
+	for (off = sizeof(*hdr); off + sizeof(*rec) <= len;
+			off += TRACE_RECORD_SPACE(rec->name_len)) {
+		rec = (const struct trace_record *) (buf + off);
+		if (off + TRACE_RECORD_SPACE(rec->name_len) > len ||
+				rec->hook >= TRACE_HOOK_MAX) {
+			fprintf(stderr, "Truncated trace, stopping at offset %zu\n", off);
+			break;
+		}
+		name = NULL;
+		if (rec->name_len) {
+			/* The padding holds at least one zero unless the length is a
+			 * multiple of 8, copy the name to terminate it. */
+			name = strndup((const char *) (rec + 1), rec->name_len);
+			if (!name) {
+				perror("strndup");
+				return EXIT_FAILURE;
+			}
+		}
+		if (add_record(&threads, &nb_threads, rec, name) < 0) {
+			perror("realloc");
+			return EXIT_FAILURE;
+		}
+		if (rec->start < replay.t0) {
+			replay.t0 = rec->start;
+		}
+		nb_records++;
+	}
+
+	if (print) {
+		for (i = 0; i < nb_threads; i++) {
+			for (j = 0; j < threads[i].nb_records; j++) {
+				print_record(&threads[i].records[j]);
+			}
+		}
+		return EXIT_SUCCESS;
+	}
+	if (!nb_threads) {
+		fprintf(stderr, "%s: no records\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	/* Rank every call on each recorded fd in the recording order. */
+	sorted = calloc(nb_records + 1, sizeof(*sorted));
+	next = calloc(FD_MAP_SIZE, sizeof(*next));
+	if (!sorted || !next) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0, k = 0; i < nb_threads; i++) {
+		for (j = 0; j < threads[i].nb_records; j++) {
+			sorted[k++] = &threads[i].records[j];
+		}
+	}
+	qsort(sorted, nb_records, sizeof(*sorted), compare_records);
+	for (k = 0; k < nb_records; k++) {
+		record_chains(sorted[k]);
+		for (j = 0; j < 2; j++) {
+			if (sorted[k]->chains[j] >= 0) {
+				sorted[k]->seqs[j] = next[sorted[k]->chains[j]]++;
+			}
+		}
+	}
+	free(next);
+	free(sorted);
+
+	memset(replay.fd_map, -1, sizeof(replay.fd_map));
+	pthread_barrier_init(&replay.barrier, NULL, nb_threads + 1);
+	for (i = 0; i < nb_threads; i++) {
+		threads[i].durations = calloc(threads[i].nb_records + 1,
+				sizeof(uint64_t));
+		if (!threads[i].durations ||
+				pthread_create(&threads[i].thread, NULL, replay_thread,
+					&threads[i])) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	/* Give the threads time to reach the barrier before the first call. */
+	replay.replay_start = now_ns() + 1000000;
+	pthread_barrier_wait(&replay.barrier);
+	for (i = 0; i < nb_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	wall = now_ns() - replay.replay_start;
+
+	durations = calloc(nb_records + 1, sizeof(*durations));
+	if (!durations) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("{\"trace_pid\":%u,\"threads\":%zu,\"records\":%zu,"
+			"\"speed\":%.3f,\"wall_s\":%.6f,\"hooks\":{", hdr->pid,
+			nb_threads, nb_records, replay.speed, wall / 1e9);
+	for (k = 1; k < TRACE_HOOK_MAX; k++) {
+		count = diff = skipped = rec_ns = rep_ns = 0;
+		nb_durations = 0;
+		for (i = 0; i < nb_threads; i++) {
+			count += threads[i].count[k];
+			diff += threads[i].diff[k];
+			skipped += threads[i].skipped[k];
+			rec_ns += threads[i].recorded_ns[k];
+			rep_ns += threads[i].replayed_ns[k];
+			for (j = 0; j < threads[i].nb_records; j++) {
+				if (threads[i].records[j].rec->hook == k &&
+						threads[i].durations[j] != UINT64_MAX) {
+					durations[nb_durations++] = threads[i].durations[j];
+				}
+			}
+		}
+		if (!count && !skipped) {
+			continue;
+		}
+		qsort(durations, nb_durations, sizeof(*durations), compare_u64);
+		printf("%s\"%s\":{\"replayed\":%" PRIu64 ",\"skipped\":%" PRIu64
+				",\"result_diff\":%" PRIu64 ",\"recorded_mean_us\":%.3f,"
+				"\"replayed_mean_us\":%.3f,\"replayed_p50_us\":%.3f,"
+				"\"replayed_p99_us\":%.3f}", first ? "" : ",", hook_names[k],
+				count, skipped, diff, count ? rec_ns / 1e3 / count : 0,
+				count ? rep_ns / 1e3 / count : 0,
+				nb_durations ? durations[nb_durations / 2] / 1e3 : 0,
+				nb_durations ? durations[(nb_durations - 1) * 99 / 100] / 1e3 :
+				0);
+		first = 0;
+	}
+	printf("}}\n");
+
+	/* Close what the trace left open. */
+	for (i = 0; i < FD_MAP_SIZE; i++) {
+		if (replay.fd_map[i] >= 0) {
+			close(replay.fd_map[i]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License, version 2 only, as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# Replay a trace recorded with TORSOCKS_TRACE_FILE against the mock Tor
+# server and write the per call timings as one JSON document.
+#
+# Usage: trace-replay.sh MOCK_TOR TRACE_REPLAY TRACE [VERSION]
+#
+# Environment:
+#   BENCH_SPEED     time scale of the replay, 0 as fast as possible, default 1
+#   BENCH_MOCK_ARGS options of mock-tor such as "-l all=exp:200"
+#   BENCH_OUTPUT    file of the results, default bench-replay.json
+
+MOCK_TOR=$1
+TRACE_REPLAY=$2
+TRACE=$3
+VERSION=$4
+
+if [ ! -x "$MOCK_TOR" ] || [ ! -x "$TRACE_REPLAY" ] || [ ! -f "$TRACE" ]; then
+	echo "Usage: $0 MOCK_TOR TRACE_REPLAY TRACE [VERSION]" >&2
+	exit 1
+fi
+
+SPEED=${BENCH_SPEED:-1}
+OUTPUT=${BENCH_OUTPUT:-bench-replay.json}
+
+. `dirname "$0"`/mock.sh
+mock_start "$MOCK_TOR"
+
+# The replay itself is not recorded.
+unset TORSOCKS_TRACE_FILE
+result=`TORSOCKS_CONF_FILE="$tmpdir/torsocks.conf" \
+	"$TRACE_REPLAY" -s $SPEED "$TRACE"` || exit 1
+
+cat > "$OUTPUT" <<EOF2
+{
+  "torsocks": "$VERSION",
+  "date": "`date -u +%Y-%m-%dT%H:%M:%SZ`",
+  "host": "`uname -srm`",
+  "trace": "$TRACE",
+  "mock_args": "$BENCH_MOCK_ARGS",
+  "result": $result
+}
+EOF2
+cat "$OUTPUT"
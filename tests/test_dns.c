@@ -129,7 +129,7 @@ static void test_getaddrinfo(const struct test_host *host)
 		fail("Resolving address %s with getaddrinfo", host->name);
 	}
 
-	free(result);
+	freeaddrinfo(result);
     return;
 }
 
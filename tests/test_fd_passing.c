@@ -15,8 +15,14 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/* For recvmmsg(2) and sendmmsg(2). */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -29,7 +35,7 @@
 
 #include <tap/tap.h>
 
-#define NUM_TESTS 5
+#define NUM_TESTS 12
 
 /*
  * Indicate if the thread recv is ready. 0 means no, 1 means yes and -1 means
@@ -509,12 +515,252 @@ error:
 	return;
 }
 
+#if (defined(__linux__))
+
+/*
+ * Fill the given message to carry a single byte and the given fd.
+ */
+static void fill_fd_msg(struct msghdr *msg, struct iovec *iov, char *data,
+		char *control, size_t control_len, int fd)
+{
+	struct cmsghdr *cmsg;
+
+	memset(msg, 0, sizeof(*msg));
+	iov->iov_base = data;
+	iov->iov_len = 1;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = control;
+	msg->msg_controllen = control_len;
+
+	if (fd < 0) {
+		return;
+	}
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	msg->msg_controllen = cmsg->cmsg_len;
+}
+
+/*
+ * Return the fd carried by the given received message or -1 if none.
+ */
+static int msg_fd(struct msghdr *msg)
+{
+	int fd;
+	struct cmsghdr *cmsg;
+
+	cmsg = CMSG_FIRSTHDR(msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/*
+ * Return the number of fds opened by the process or -1 on error.
+ */
+static int count_fds(void)
+{
+	int nb = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir) {
+		return -1;
+	}
+	while (readdir(dir)) {
+		nb++;
+	}
+	closedir(dir);
+	return nb;
+}
+
+/*
+ * Send one fd per message of a batch and receive the batch with a single
+ * recvmmsg() call.
+ *
+ * Return what recvmmsg() returned, the received fds are set in fds.
+ */
+static int pass_fds_batch(const int *send_fds, int *fds, unsigned int nb)
+{
+	int ret, sv[2];
+	unsigned int i;
+	char data[2] = { 'a', 'b' };
+	char control[2][CMSG_SPACE(sizeof(int))];
+	struct iovec iov[2];
+	struct mmsghdr msgvec[2];
+
+	assert(nb <= 2);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < nb; i++) {
+		fill_fd_msg(&msgvec[i].msg_hdr, &iov[i], &data[i], control[i],
+				sizeof(control[i]), send_fds[i]);
+	}
+	ret = sendmmsg(sv[0], msgvec, nb, 0);
+	if (ret != (int) nb) {
+		ret = -1;
+		goto end;
+	}
+
+	for (i = 0; i < nb; i++) {
+		memset(control[i], 0, sizeof(control[i]));
+		fill_fd_msg(&msgvec[i].msg_hdr, &iov[i], &data[i], control[i],
+				sizeof(control[i]), -1);
+	}
+	ret = recvmmsg(sv[1], msgvec, nb, 0, NULL);
+	for (i = 0; i < nb; i++) {
+		fds[i] = msg_fd(&msgvec[i].msg_hdr);
+	}
+
+end:
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+static void test_recvmmsg(void)
+{
+	int ret, inet_sock, pipe_fds[2], fds[2], nb_fds;
+
+	diag("recvmmsg fd passing test");
+
+	if (pipe(pipe_fds) < 0) {
+		fail("Unable to create pipe");
+		return;
+	}
+
+	ret = pass_fds_batch(pipe_fds, fds, 2);
+	ok(ret == 2 && fcntl(fds[0], F_GETFD) >= 0 &&
+			fcntl(fds[1], F_GETFD) >= 0, "Batch of pipes received");
+	close(fds[0]);
+	close(fds[1]);
+
+	/* Only the second message of the batch carries an inet socket. */
+	inet_sock = socket(AF_INET, SOCK_STREAM, 0);
+	fds[0] = pipe_fds[0];
+	fds[1] = inet_sock;
+	nb_fds = count_fds();
+	errno = 0;
+	ret = pass_fds_batch(fds, fds, 2);
+	ok(ret == -1 && errno == EACCES, "Inet socket in a batch denied");
+	ok(nb_fds > 0 && count_fds() == nb_fds && fds[0] == -1 && fds[1] == -1,
+			"Fds of the whole batch closed");
+
+	close(inet_sock);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+static void test_sendmmsg(void)
+{
+	int ret, sv[2], sock, listen_sock, fd;
+	char data[] = "ab", buf[4];
+	socklen_t addrlen;
+	struct iovec iov[2];
+	struct mmsghdr msgvec[2];
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+
+	diag("sendmmsg batch test");
+
+	memset(msgvec, 0, sizeof(msgvec));
+	iov[0].iov_base = &data[0];
+	iov[0].iov_len = 1;
+	iov[1].iov_base = &data[1];
+	iov[1].iov_len = 1;
+	msgvec[0].msg_hdr.msg_iov = &iov[0];
+	msgvec[0].msg_hdr.msg_iovlen = 1;
+	msgvec[1].msg_hdr.msg_iov = &iov[1];
+	msgvec[1].msg_hdr.msg_iovlen = 1;
+
+	ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, sv);
+	ret = ret < 0 ? -1 : sendmmsg(sv[0], msgvec, 2, 0);
+	ok(ret == 2 && recv(sv[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'a' &&
+			recv(sv[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'b',
+			"Batch sent on a unix socket");
+	close(sv[0]);
+	close(sv[1]);
+
+	/* A UDP socket torsocks did not create. */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(80);
+	inet_pton(AF_INET, "192.0.2.1", &addr.sin_addr);
+	msgvec[0].msg_hdr.msg_name = &addr;
+	msgvec[0].msg_hdr.msg_namelen = sizeof(addr);
+	sock = tsocks_libc_socket(AF_INET, SOCK_DGRAM, 0);
+	errno = 0;
+	ret = sendmmsg(sock, msgvec, 2, 0);
+	ok(ret == -1 && errno == EPERM, "Batch of a UDP socket denied");
+	tsocks_libc_close(sock);
+
+#ifdef MSG_FASTOPEN
+	/* A local listener that a fast open would reach behind Tor's back. */
+	listen_sock = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	addrlen = sizeof(addr);
+	if (tsocks_libc_bind(listen_sock, (struct sockaddr *) &addr,
+				sizeof(addr)) < 0 ||
+			tsocks_libc_listen(listen_sock, 1) < 0 ||
+			getsockname(listen_sock, (struct sockaddr *) &addr,
+				&addrlen) < 0) {
+		fail("Local listener created");
+		fail("TCP fast open batch connected first");
+		tsocks_libc_close(listen_sock);
+		return;
+	}
+
+	tsocks_config.allow_outbound_localhost = 0;
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	errno = 0;
+	ret = sendmmsg(sock, msgvec, 2, MSG_FASTOPEN);
+	pfd.fd = listen_sock;
+	pfd.events = POLLIN;
+	ok(ret == -1 && errno == EPERM && poll(&pfd, 1, 0) == 0,
+			"TCP fast open batch to localhost denied");
+	close(sock);
+
+	tsocks_config.allow_outbound_localhost = 1;
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	ret = sendmmsg(sock, msgvec, 2, MSG_FASTOPEN);
+	fd = ret == 2 ? tsocks_libc_accept(listen_sock, NULL, NULL) : -1;
+	ok(fd >= 0 && recv(fd, buf, 2, MSG_WAITALL) == 2 &&
+			memcmp(buf, "ab", 2) == 0,
+			"TCP fast open batch connected first");
+	tsocks_config.allow_outbound_localhost = 0;
+	if (fd >= 0) {
+		tsocks_libc_close(fd);
+	}
+	close(sock);
+	tsocks_libc_close(listen_sock);
+#else
+	skip(2, "No MSG_FASTOPEN on this system");
+#endif /* MSG_FASTOPEN */
+}
+
+#endif /* __linux__ */
+
 int main(int argc, char **argv)
 {
 	/* Libtap call for the number of tests planned. */
 	plan_tests(NUM_TESTS);
 
 	test_inet_socket();
+#if (defined(__linux__))
+	test_recvmmsg();
+	test_sendmmsg();
+#else
+	skip(7, "No recvmmsg() and sendmmsg() on this system");
+#endif
 
     return 0;
 }
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <common/addrinfo.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 19
+
+static unsigned int count_entries(const struct addrinfo *ai)
+{
+	unsigned int nb = 0;
+
+	for (; ai; ai = ai->ai_next) {
+		nb++;
+	}
+	return nb;
+}
+
+static void test_addrinfo_build(void)
+{
+	int ret;
+	struct in_addr addr;
+	struct in6_addr addr6;
+	struct addrinfo hints, *res = NULL;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	diag("Addrinfo build test");
+
+	inet_pton(AF_INET, "127.42.42.1", &addr);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "80", &hints, &res);
+	sin = res ? (struct sockaddr_in *) res->ai_addr : NULL;
+	ok(ret == 0 && count_entries(res) == 1 && res->ai_family == AF_INET &&
+			res->ai_socktype == SOCK_STREAM &&
+			res->ai_protocol == IPPROTO_TCP &&
+			res->ai_addrlen == sizeof(*sin) && sin->sin_port == htons(80) &&
+			sin->sin_addr.s_addr == addr.s_addr &&
+			res->ai_canonname == NULL,
+			"Stream entry with a numeric service");
+	ok(res && res->ai_addr == (struct sockaddr *) (res + 1),
+			"Address allocated right after its entry");
+	freeaddrinfo(res);
+
+	hints.ai_socktype = 0;
+	ret = addrinfo_build("example.onion", AF_INET, &addr, NULL, &hints, &res);
+	ok(ret == 0 && count_entries(res) == 3 &&
+			res->ai_socktype == SOCK_STREAM &&
+			res->ai_next->ai_socktype == SOCK_DGRAM &&
+			res->ai_next->ai_next->ai_socktype == SOCK_RAW,
+			"Every socket type without a service");
+	freeaddrinfo(res);
+
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "443", &hints, &res);
+	ok(ret == 0 && count_entries(res) == 2 &&
+			res->ai_next->ai_protocol == IPPROTO_UDP,
+			"No raw socket with a service");
+	freeaddrinfo(res);
+
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "http", &hints,
+			&res);
+	sin = res ? (struct sockaddr_in *) res->ai_addr : NULL;
+	ok(ret == 0 && sin->sin_port == htons(80), "Service name looked up");
+	ok(ret == 0 && res->ai_canonname &&
+			strcmp(res->ai_canonname, "example.onion") == 0 &&
+			res->ai_flags == AI_CANONNAME, "Canonical name set");
+	freeaddrinfo(res);
+
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "http", &hints,
+			&res);
+	ok(ret == 0 && ((struct sockaddr_in *) res->ai_addr)->sin_port == htons(80),
+			"Service name found in cache");
+	freeaddrinfo(res);
+
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "nosuchservice",
+			&hints, &res);
+	ok(ret == EAI_SERVICE, "Unknown service");
+
+	hints.ai_flags = AI_NUMERICSERV;
+	ret = addrinfo_build("example.onion", AF_INET, &addr, "http", &hints,
+			&res);
+	ok(ret == EAI_NONAME, "Service name with AI_NUMERICSERV");
+
+	hints.ai_flags = 0;
+	hints.ai_socktype = SOCK_SEQPACKET;
+	ret = addrinfo_build("example.onion", AF_INET, &addr, NULL, &hints, &res);
+	ok(ret == EAI_SOCKTYPE, "Unsupported socket type");
+
+	inet_pton(AF_INET6, "2001:db8::1", &addr6);
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = addrinfo_build("2001:db8::1", AF_INET6, &addr6, "22", &hints, &res);
+	sin6 = res ? (struct sockaddr_in6 *) res->ai_addr : NULL;
+	ok(ret == 0 && res->ai_family == AF_INET6 &&
+			res->ai_addrlen == sizeof(*sin6) &&
+			sin6->sin6_port == htons(22) &&
+			memcmp(&sin6->sin6_addr, &addr6, sizeof(addr6)) == 0,
+			"IPv6 entry");
+	freeaddrinfo(res);
+}
+
+static void test_addrinfo_build_list(void)
+{
+	int ret;
+	struct addrinfo_addr addrs[2];
+	struct addrinfo hints, *res = NULL;
+
+	diag("Addrinfo build list test");
+
+	addrs[0].af = AF_INET6;
+	inet_pton(AF_INET6, "2001:db8::1", &addrs[0].u.v6);
+	addrs[1].af = AF_INET;
+	inet_pton(AF_INET, "192.0.2.1", &addrs[1].u.v4);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_CANONNAME;
+
+	ret = addrinfo_build_list("dual.example", addrs, 2, "80", &hints, &res);
+	ok(ret == 0 && count_entries(res) == 4 &&
+			res->ai_family == AF_INET6 &&
+			res->ai_next->ai_family == AF_INET6 &&
+			res->ai_next->ai_next->ai_family == AF_INET &&
+			res->ai_next->ai_next->ai_next->ai_family == AF_INET &&
+			((struct sockaddr_in *)
+			 res->ai_next->ai_next->ai_addr)->sin_port == htons(80),
+			"Every address in the given order");
+	ok(ret == 0 && res->ai_canonname &&
+			res->ai_next->ai_canonname == NULL &&
+			res->ai_next->ai_next->ai_next->ai_canonname == NULL,
+			"Canonical name only on the first entry");
+	freeaddrinfo(res);
+}
+
+static void test_addrinfo_copy(void)
+{
+	int ret;
+	struct in_addr addr;
+	struct addrinfo hints, *res = NULL, *copy;
+
+	diag("Addrinfo copy test");
+
+	inet_pton(AF_INET, "127.42.42.3", &addr);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_flags = AI_CANONNAME;
+	ret = addrinfo_build("copy.onion", AF_INET, &addr, "80", &hints, &res);
+	copy = ret == 0 ? addrinfo_copy(res) : NULL;
+	ok(copy && copy != res && count_entries(copy) == count_entries(res) &&
+			copy->ai_addr != res->ai_addr &&
+			memcmp(copy->ai_addr, res->ai_addr, res->ai_addrlen) == 0 &&
+			copy->ai_canonname != res->ai_canonname &&
+			strcmp(copy->ai_canonname, "copy.onion") == 0 &&
+			copy->ai_next->ai_socktype == res->ai_next->ai_socktype,
+			"Every entry copied");
+	freeaddrinfo(copy);
+	freeaddrinfo(res);
+}
+
+static void test_addrinfo_cache(void)
+{
+	int ret;
+	struct in_addr addr;
+	struct addrinfo hints, *res = NULL, *cached;
+
+	diag("Addrinfo cache test");
+
+	inet_pton(AF_INET, "127.42.42.2", &addr);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo_cache_init(60);
+	ret = addrinfo_build("cache.onion", AF_INET, &addr, "80", &hints, &res);
+	addrinfo_cache_insert("cache.onion", "80", &hints, res);
+
+	cached = addrinfo_cache_lookup("cache.onion", "80", &hints);
+	ok(ret == 0 && cached && cached != res &&
+			memcmp(cached->ai_addr, res->ai_addr, res->ai_addrlen) == 0,
+			"Copy of the result returned from cache");
+	freeaddrinfo(res);
+	if (cached) {
+		((struct sockaddr_in *) cached->ai_addr)->sin_port = 0;
+		freeaddrinfo(cached);
+	}
+
+	cached = addrinfo_cache_lookup("cache.onion", "80", &hints);
+	ok(cached && ((struct sockaddr_in *) cached->ai_addr)->sin_port ==
+			htons(80), "Cached result not changed by a caller");
+	freeaddrinfo(cached);
+
+	hints.ai_socktype = SOCK_DGRAM;
+	cached = addrinfo_cache_lookup("cache.onion", "80", &hints);
+	ok(cached == NULL, "Other hints not found in cache");
+	hints.ai_socktype = SOCK_STREAM;
+	cached = addrinfo_cache_lookup("cache.onion", "443", &hints);
+	ok(cached == NULL, "Other service not found in cache");
+
+	addrinfo_cache_destroy();
+	cached = addrinfo_cache_lookup("cache.onion", "80", &hints);
+	ok(cached == NULL, "Nothing found once destroyed");
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_addrinfo_build();
+	test_addrinfo_build_list();
+	test_addrinfo_copy();
+	test_addrinfo_cache();
+
+	return exit_status();
+}
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include <common/utils.h>
@@ -28,7 +29,7 @@
 #include <tap/tap.h>
 #include <fixtures.h>
 
-#define NUM_TESTS 11
+#define NUM_TESTS 17
 
 static void test_config_file_read_none(void)
 {
@@ -84,6 +85,74 @@ static void test_config_file_read_empty(void)
 		"Read empty config file");
 }
 
+static void test_config_file_read_ipv6(void)
+{
+	int ret = 0;
+	struct configuration config;
+
+	diag("Config file read IPv6 resolution");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config10"), &config);
+	ok(ret == 0 &&
+		config.conf_file.tor_port == DEFAULT_TOR_PORT &&
+		config.conf_file.tor_ipv6_port == 9052 &&
+		config.prefer_ipv6,
+		"Read TorIPv6Port and PreferIPv6");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config11"), &config);
+	ok(ret == -EINVAL &&
+		config.conf_file.tor_ipv6_port == 0,
+		"TorIPv6Port 0 returns -EINVAL");
+}
+
+static void test_config_file_read_dns_port(void)
+{
+	int ret = 0;
+	struct configuration config;
+
+	diag("Config file read DNSPort");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config12"), &config);
+	ok(ret == 0 &&
+		config.conf_file.tor_port == DEFAULT_TOR_PORT &&
+		config.conf_file.tor_dns_port == 9053,
+		"Read TorDNSPort");
+}
+
+static void test_config_file_read_control_port(void)
+{
+	int ret = 0;
+	struct configuration config;
+
+	diag("Config file read ControlPort");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config13"), &config);
+	ok(ret == 0 &&
+		config.conf_file.tor_control_port == 0 &&
+		strcmp(config.conf_file.tor_control_socket,
+			"/run/tor/control") == 0 &&
+		strcmp(config.conf_file.tor_control_cookie_file,
+			"/run/tor/control.authcookie") == 0 &&
+		strcmp(config.conf_file.tor_control_password, "secret") == 0,
+		"Read TorControlPort socket, cookie file and password");
+}
+
+static void test_config_file_read_udp_dns(void)
+{
+	int ret = 0;
+	struct configuration config;
+
+	diag("Config file read AllowUDPDNS");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config14"), &config);
+	ok(ret == 0 && config.allow_udp_dns, "Read AllowUDPDNS");
+}
+
 static void test_config_file_read_invalid_values(void)
 {
 	int ret = 0;
@@ -141,6 +210,12 @@ static void test_config_file_read_invalid_values(void)
 	ok(ret == -EINVAL &&
 		config.conf_file.onion_base == 0,
 		"OnionAdrRange invalid mask returns -EINVAL");
+
+	memset(&config, 0x0, sizeof(config));
+	ret = config_file_read(fixture("config15"), &config);
+	ok(ret == -EINVAL &&
+		config.conf_file.tor_control_socket[0] == '\0',
+		"TorControlPort socket path too long returns -EINVAL");
 }
 
 int main(int argc, char **argv)
@@ -149,10 +224,14 @@ int main(int argc, char **argv)
 	plan_tests(NUM_TESTS);
 
 	test_config_file_read_none();
-	skip_start(0 == TORSOCKS_FIXTURE_PATH, 10, "TORSOCKS_FIXTURE_PATH not defined");
+	skip_start(0 == TORSOCKS_FIXTURE_PATH, 15, "TORSOCKS_FIXTURE_PATH not defined");
 	test_config_file_read_valid();
 	test_config_file_read_empty();
 	test_config_file_read_invalid_values();
+	test_config_file_read_ipv6();
+	test_config_file_read_dns_port();
+	test_config_file_read_control_port();
+	test_config_file_read_udp_dns();
 	skip_end();
 
 	return exit_status();
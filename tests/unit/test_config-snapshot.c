@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <common/config-snapshot.h>
+#include <common/defaults.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 17
+
+static void init_config(struct configuration *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->conf_file.tor_address = strdup("127.0.0.1");
+	config->conf_file.tor_domain = CONNECTION_DOMAIN_INET;
+	config->conf_file.tor_port = 9050;
+	config->conf_file.tor_ipv6_port = 9052;
+	config->conf_file.tor_dns_port = 9053;
+	config->conf_file.tor_control_port = 9051;
+	strcpy(config->conf_file.tor_control_cookie_file,
+			"/run/tor/control.authcookie");
+	config->conf_file.onion_base = inet_addr("127.42.42.0");
+	config->conf_file.onion_mask = 24;
+	strcpy(config->conf_file.socks5_username, "user");
+	config->socks5_use_auth = 1;
+	config->allow_outbound_localhost = 1;
+	config->prefer_ipv6 = 1;
+	config->allow_udp_dns = 1;
+	(void) connection_addr_set(CONNECTION_DOMAIN_INET, "127.0.0.1", 9050,
+			&config->socks5_addr);
+}
+
+static void test_snapshot_roundtrip(void)
+{
+	int ret;
+	struct configuration config, copy;
+	struct config_snapshot snap;
+
+	diag("Config snapshot roundtrip");
+
+	init_config(&config);
+
+	ret = config_snapshot_encode(&config, 42, &snap);
+	ok(ret == 0, "Snapshot encoded");
+
+	ret = config_snapshot_decode(&snap, sizeof(snap), 42, &copy);
+	ok(ret == 0 &&
+		strcmp(copy.conf_file.tor_address, "127.0.0.1") == 0 &&
+		copy.conf_file.tor_domain == CONNECTION_DOMAIN_INET &&
+		copy.conf_file.tor_port == 9050 &&
+		copy.conf_file.tor_ipv6_port == 9052 &&
+		copy.conf_file.tor_dns_port == 9053 &&
+		copy.conf_file.tor_control_port == 9051 &&
+		copy.conf_file.tor_control_socket[0] == '\0' &&
+		strcmp(copy.conf_file.tor_control_cookie_file,
+			"/run/tor/control.authcookie") == 0 &&
+		copy.conf_file.tor_control_password[0] == '\0' &&
+		copy.conf_file.onion_base == config.conf_file.onion_base &&
+		copy.conf_file.onion_mask == 24 &&
+		strcmp(copy.conf_file.socks5_username, "user") == 0 &&
+		copy.conf_file.socks5_password[0] == '\0',
+		"Snapshot decoded to the same config file");
+	ok(copy.socks5_use_auth && copy.allow_outbound_localhost &&
+		copy.prefer_ipv6 && copy.allow_udp_dns && !copy.allow_inbound &&
+		!copy.isolate_pid && !copy.use_io_uring,
+		"Snapshot decoded to the same flags");
+	ok(memcmp(&copy.socks5_addr, &config.socks5_addr,
+			sizeof(copy.socks5_addr)) == 0,
+		"Snapshot decoded to the same Tor address");
+
+	config_file_destroy(&copy.conf_file);
+	config_file_destroy(&config.conf_file);
+}
+
+static void test_snapshot_invalid(void)
+{
+	int ret;
+	struct configuration config, copy;
+	struct config_snapshot snap;
+
+	diag("Config snapshot invalid");
+
+	init_config(&config);
+	(void) config_snapshot_encode(&config, 42, &snap);
+
+	ret = config_snapshot_decode(&snap, sizeof(snap), 43, &copy);
+	ok(ret == -ESTALE, "Snapshot of another configuration is stale");
+
+	ret = config_snapshot_decode(&snap, sizeof(snap) - 1, 42, &copy);
+	ok(ret == -EINVAL, "Truncated snapshot is rejected");
+
+	snap.tor_port++;
+	ret = config_snapshot_decode(&snap, sizeof(snap), 42, &copy);
+	ok(ret == -EINVAL, "Corrupted snapshot is rejected");
+	snap.tor_port--;
+
+	snap.version++;
+	ret = config_snapshot_decode(&snap, sizeof(snap), 42, &copy);
+	ok(ret == -EINVAL, "Snapshot of another version is rejected");
+
+	config_file_destroy(&config.conf_file);
+}
+
+static void test_snapshot_password(void)
+{
+	int ret;
+	struct configuration config;
+	struct config_snapshot snap;
+
+	diag("Config snapshot password");
+
+	init_config(&config);
+
+	strcpy(config.conf_file.socks5_password, "pass");
+	ret = config_snapshot_encode(&config, 42, &snap);
+	ok(ret == -EPERM, "SOCKS5 password never put in a snapshot");
+	config.conf_file.socks5_password[0] = '\0';
+
+	strcpy(config.conf_file.tor_control_password, "secret");
+	ret = config_snapshot_encode(&config, 42, &snap);
+	ok(ret == -EPERM, "Control port password never put in a snapshot");
+
+	config_file_destroy(&config.conf_file);
+}
+
+static void test_snapshot_fingerprint(void)
+{
+	uint64_t fp1, fp2;
+
+	diag("Config snapshot fingerprint");
+
+	unsetenv(DEFAULT_SOCKS5_USER_ENV);
+	fp1 = config_snapshot_fingerprint("/nonexistent/torsocks.conf", getenv);
+	fp2 = config_snapshot_fingerprint("/nonexistent/torsocks.conf", getenv);
+	ok(fp1 == fp2, "Fingerprint is stable");
+
+	setenv(DEFAULT_SOCKS5_USER_ENV, "someone", 1);
+	fp2 = config_snapshot_fingerprint("/nonexistent/torsocks.conf", getenv);
+	ok(fp1 != fp2, "Fingerprint depends on the environment");
+	unsetenv(DEFAULT_SOCKS5_USER_ENV);
+
+	fp2 = config_snapshot_fingerprint("/nonexistent/other.conf", getenv);
+	ok(fp1 != fp2, "Fingerprint depends on the file");
+}
+
+static void test_snapshot_publish(void)
+{
+	int ret, fd;
+	struct configuration config, copy;
+
+	diag("Config snapshot publish");
+
+	init_config(&config);
+
+	ret = config_snapshot_publish(&config, 42);
+	if (ret == -ENOSYS) {
+		skip(3, "No memfd_create() on this system");
+		config_file_destroy(&config.conf_file);
+		return;
+	}
+	ret = config_snapshot_load(42, &copy, getenv);
+	ok(ret == 0 && copy.conf_file.tor_port == 9050,
+		"Published snapshot loaded back");
+	config_file_destroy(&copy.conf_file);
+
+	/* A snapshot of another configuration is dropped. */
+	fd = atoi(getenv(DEFAULT_CONFIG_FD_ENV));
+	ret = config_snapshot_load(43, &copy, getenv);
+	ok(ret < 0 && !getenv(DEFAULT_CONFIG_FD_ENV),
+		"Mismatching snapshot unset from the environment");
+	ok(fcntl(fd, F_GETFD) < 0 && errno == EBADF,
+		"Mismatching snapshot fd closed");
+
+	config_file_destroy(&config.conf_file);
+}
+
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *thread_wait(void *data)
+{
+	pthread_mutex_lock(&thread_lock);
+	pthread_mutex_unlock(&thread_lock);
+	return NULL;
+}
+
+static void test_snapshot_publish_threaded(void)
+{
+	int ret;
+	pthread_t th;
+	struct configuration config;
+
+	diag("Config snapshot publish with threads");
+
+	init_config(&config);
+
+	pthread_mutex_lock(&thread_lock);
+	pthread_create(&th, NULL, thread_wait, NULL);
+	ret = config_snapshot_publish(&config, 42);
+	pthread_mutex_unlock(&thread_lock);
+	pthread_join(th, NULL);
+	ok(ret == -EBUSY || ret == -ENOSYS,
+		"Nothing published once the process has threads");
+
+	config_file_destroy(&config.conf_file);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_snapshot_roundtrip();
+	test_snapshot_invalid();
+	test_snapshot_password();
+	test_snapshot_fingerprint();
+	test_snapshot_publish();
+	test_snapshot_publish_threaded();
+
+	return exit_status();
+}
@@ -18,6 +18,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include <common/connection.h>
@@ -25,7 +26,7 @@
 
 #include <tap/tap.h>
 
-#define NUM_TESTS 13
+#define NUM_TESTS 17
 
 static void test_connection_usage(void)
 {
@@ -136,6 +137,51 @@ static void test_connection_creation(void)
 	connection_destroy(conn);
 }
 
+static void test_connection_cache(void)
+{
+	int ret, i;
+	struct connection *conn, *conn2;
+	struct connection *conns[100];
+	char name[128];
+
+	diag("Connection cache and host name test");
+
+	conn = connection_create(42, NULL);
+	connection_destroy(conn);
+	conn2 = connection_create(43, NULL);
+	ok(conn2 == conn && conn2->fd == 43 && conn2->refcount.count == 1 &&
+			conn2->dest_addr.hostname.addr == NULL,
+		"Destroyed connection is reused zeroed");
+
+	ret = connection_set_hostname(conn2, "example.onion");
+	ok(ret == 0 && conn2->dest_addr.hostname.addr == conn2->hostname &&
+			strcmp(conn2->dest_addr.hostname.addr, "example.onion") == 0,
+		"Short host name stored in the connection");
+	connection_destroy(conn2);
+
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	conn = connection_create(42, NULL);
+	ret = connection_set_hostname(conn, name);
+	ok(ret == 0 && conn->dest_addr.hostname.addr != conn->hostname &&
+			strcmp(conn->dest_addr.hostname.addr, name) == 0,
+		"Long host name allocated");
+	connection_destroy(conn);
+
+	/* More than a slab and more than a thread cache. */
+	memset(conns, 0, sizeof(conns));
+	for (i = 0; i < 100; i++) {
+		conns[i] = connection_create(i, NULL);
+		if (!conns[i] || conns[i]->fd != i) {
+			break;
+		}
+	}
+	ok(i == 100, "Many connections created");
+	for (i = 0; i < 100 && conns[i]; i++) {
+		connection_destroy(conns[i]);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	/* Libtap call for the number of tests planned. */
@@ -143,6 +189,7 @@ int main(int argc, char **argv)
 
 	test_connection_creation();
 	test_connection_usage();
+	test_connection_cache();
 
     return 0;
 }
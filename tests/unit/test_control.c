@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <common/control.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 4
+
+static void test_control_dir(void)
+{
+	int ret;
+	char dir[] = "/tmp/tsocks-control-XXXXXX", path[PATH_MAX];
+	struct stat st;
+	mode_t old_mask;
+
+	diag("Control socket directory");
+
+	if (!mkdtemp(dir)) {
+		fail("Directory created");
+		return;
+	}
+
+	(void) chmod(dir, 0777);
+	ret = control_init(dir);
+	ok(ret == -EPERM, "World writable directory refused");
+
+	(void) chmod(dir, 0770);
+	ret = control_init(dir);
+	ok(ret == -EPERM, "Group writable directory refused");
+
+	/* Even with a permissive umask the socket is only ours. */
+	(void) chmod(dir, 0700);
+	old_mask = umask(0);
+	ret = control_init(dir);
+	umask(old_mask);
+	ok(ret == 0, "Control socket created in a private directory");
+
+	snprintf(path, sizeof(path), "%s/torsocks-%d.sock", dir, (int) getpid());
+	ok(stat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+			(st.st_mode & 0777) == 0600, "Socket only accessible to its user");
+
+	control_destroy();
+	(void) rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_control_dir();
+
+	return exit_status();
+}
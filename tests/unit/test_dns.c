@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/dns.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 29
+
+/*
+ * Build the reply to a query with a single answer record whose name points to
+ * the question.
+ */
+static size_t build_reply(const unsigned char *query, size_t query_len,
+		uint8_t rcode, uint16_t type, const void *rdata, uint16_t rdlen,
+		unsigned char *buf)
+{
+	size_t pos = query_len;
+
+	memcpy(buf, query, query_len);
+	buf[2] |= 0x80;
+	buf[3] = 0x80 | rcode;
+	buf[7] = rdata ? 1 : 0;
+	if (!rdata) {
+		return pos;
+	}
+
+	buf[pos++] = 0xc0;
+	buf[pos++] = 12;
+	buf[pos++] = type >> 8;
+	buf[pos++] = type & 0xff;
+	buf[pos++] = 0;
+	buf[pos++] = 1;
+	memset(buf + pos, 0, 4);
+	pos += 4;
+	buf[pos++] = rdlen >> 8;
+	buf[pos++] = rdlen & 0xff;
+	memcpy(buf + pos, rdata, rdlen);
+	return pos + rdlen;
+}
+
+static void test_encode(void)
+{
+	ssize_t len;
+	unsigned char buf[DNS_QUERY_MAX];
+	static const unsigned char expected[] = {
+		0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o',
+		'm', 0, 0x00, 0x1c, 0x00, 0x01,
+	};
+	char name[300];
+
+	diag("DNS query encoding test");
+
+	len = dns_encode_query(0x1234, "www.example.com", DNS_TYPE_AAAA, buf,
+			sizeof(buf));
+	ok(len == sizeof(expected) && memcmp(buf, expected, len) == 0,
+			"AAAA query encoded");
+
+	len = dns_encode_query(0x1234, "www.example.com.", DNS_TYPE_AAAA, buf,
+			sizeof(buf));
+	ok(len == sizeof(expected) && memcmp(buf, expected, len) == 0,
+			"Trailing dot ignored");
+
+	len = dns_encode_query(1, "www..example.com", DNS_TYPE_A, buf, sizeof(buf));
+	ok(len == -EINVAL, "Empty label refused");
+
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	len = dns_encode_query(1, name, DNS_TYPE_A, buf, sizeof(buf));
+	ok(len == -EINVAL, "Label over 63 bytes refused");
+
+	len = dns_encode_query(1, ".", DNS_TYPE_A, buf, sizeof(buf));
+	ok(len == -EINVAL, "Root name refused");
+}
+
+static void test_decode(void)
+{
+	int ret;
+	ssize_t query_len;
+	size_t len;
+	struct in_addr v4;
+	struct in6_addr v6;
+	struct dns_answer answer;
+	unsigned char query[DNS_QUERY_MAX], buf[DNS_MSG_MAX];
+	/* A CNAME to www.example.com then its address. */
+	unsigned char cname[] = {
+		0xc0, 12, 0x00, 0x05, 0x00, 0x01, 0, 0, 0, 0, 0x00, 0x06,
+		3, 'w', 'w', 'w', 0xc0, 12,
+		0xc0, 0, 0x00, 0x01, 0x00, 0x01, 0, 0, 0, 0, 0x00, 0x04,
+		192, 0, 2, 7,
+	};
+	/* mail.example.com, the suffix compressed. */
+	unsigned char ptr[] = { 4, 'm', 'a', 'i', 'l', 0xc0, 0 };
+
+	diag("DNS reply decoding test");
+
+	query_len = dns_encode_query(0x0102, "example.com", DNS_TYPE_A, query,
+			sizeof(query));
+	inet_pton(AF_INET, "192.0.2.1", &v4);
+	len = build_reply(query, query_len, 0, DNS_TYPE_A, &v4, sizeof(v4), buf);
+	ret = dns_decode_reply(buf, len, query, query_len, &answer);
+	ok(ret == 0 && answer.type == DNS_TYPE_A &&
+			answer.u.v4.s_addr == v4.s_addr, "A record decoded");
+
+	memcpy(buf, query, query_len);
+	buf[2] |= 0x80;
+	buf[7] = 2;
+	/* The owner of the A record is the CNAME target, in the first rdata. */
+	cname[19] = query_len + 12;
+	memcpy(buf + query_len, cname, sizeof(cname));
+	ret = dns_decode_reply(buf, query_len + sizeof(cname), query, query_len,
+			&answer);
+	ok(ret == 0 && answer.u.v4.s_addr == htonl(0xc0000207),
+			"CNAME skipped to the A record");
+
+	len = build_reply(query, query_len, 3, 0, NULL, 0, buf);
+	ok(dns_decode_reply(buf, len, query, query_len, &answer) == -ENOENT,
+			"NXDOMAIN reported");
+
+	len = build_reply(query, query_len, 2, 0, NULL, 0, buf);
+	ok(dns_decode_reply(buf, len, query, query_len, &answer) == -ECONNABORTED,
+			"Server failure reported");
+
+	len = build_reply(query, query_len, 0, 0, NULL, 0, buf);
+	ok(dns_decode_reply(buf, len, query, query_len, &answer) == -ENODATA,
+			"No record of the type asked");
+
+	len = build_reply(query, query_len, 0, DNS_TYPE_A, &v4, sizeof(v4), buf);
+	buf[1] ^= 1;
+	ok(dns_decode_reply(buf, len, query, query_len, &answer) == -EBADMSG,
+			"Other query ID refused");
+
+	len = build_reply(query, query_len, 0, DNS_TYPE_A, &v4, sizeof(v4), buf);
+	ok(dns_decode_reply(buf, len - 1, query, query_len, &answer) == -EBADMSG,
+			"Truncated record refused");
+
+	query_len = dns_encode_query(0x0103, "example.com", DNS_TYPE_AAAA, query,
+			sizeof(query));
+	inet_pton(AF_INET6, "2001:db8::7", &v6);
+	len = build_reply(query, query_len, 0, DNS_TYPE_AAAA, &v6, sizeof(v6), buf);
+	ret = dns_decode_reply(buf, len, query, query_len, &answer);
+	ok(ret == 0 && answer.type == DNS_TYPE_AAAA &&
+			memcmp(&answer.u.v6, &v6, sizeof(v6)) == 0, "AAAA record decoded");
+
+	query_len = dns_encode_query(0x0104, "example.com", DNS_TYPE_PTR, query,
+			sizeof(query));
+	/* The suffix points to example.com in the question. */
+	ptr[sizeof(ptr) - 1] = 12;
+	len = build_reply(query, query_len, 0, DNS_TYPE_PTR, ptr, sizeof(ptr),
+			buf);
+	ret = dns_decode_reply(buf, len, query, query_len, &answer);
+	ok(ret == 0 && answer.type == DNS_TYPE_PTR &&
+			strcmp(answer.u.name, "mail.example.com") == 0,
+			"PTR record decoded");
+
+	/* A pointer to itself never ends. */
+	ptr[sizeof(ptr) - 2] = 0xc0 | ((query_len + 12 + 5) >> 8);
+	ptr[sizeof(ptr) - 1] = (query_len + 12 + 5) & 0xff;
+	len = build_reply(query, query_len, 0, DNS_TYPE_PTR, ptr, sizeof(ptr),
+			buf);
+	ok(dns_decode_reply(buf, len, query, query_len, &answer) == -EBADMSG,
+			"Compression loop refused");
+}
+
+static void test_ptr_name(void)
+{
+	char name[DNS_PTR_NAME_MAX];
+	struct in_addr v4;
+	struct in6_addr v6;
+
+	diag("DNS PTR name test");
+
+	inet_pton(AF_INET, "192.0.2.1", &v4);
+	ok(dns_ptr_name(AF_INET, &v4, name, sizeof(name)) == 0 &&
+			strcmp(name, "1.2.0.192.in-addr.arpa") == 0, "IPv4 PTR name");
+
+	inet_pton(AF_INET6, "2001:db8::567:89ab", &v6);
+	ok(dns_ptr_name(AF_INET6, &v6, name, sizeof(name)) == 0 &&
+			strcmp(name, "b.a.9.8.7.6.5.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0."
+				"8.b.d.0.1.0.0.2.ip6.arpa") == 0, "IPv6 PTR name");
+}
+
+static void test_ptr_addr(void)
+{
+	int af;
+	unsigned char addr[sizeof(struct in6_addr)];
+	char name[DNS_PTR_NAME_MAX];
+	struct in6_addr v6;
+
+	diag("DNS PTR address test");
+
+	ok(dns_ptr_addr("1.2.0.192.IN-ADDR.ARPA", &af, addr) == 0 &&
+			af == AF_INET && memcmp(addr, "\xc0\x00\x02\x01", 4) == 0,
+			"IPv4 address of a PTR name");
+
+	inet_pton(AF_INET6, "2001:db8::567:89ab", &v6);
+	(void) dns_ptr_name(AF_INET6, &v6, name, sizeof(name));
+	ok(dns_ptr_addr(name, &af, addr) == 0 && af == AF_INET6 &&
+			memcmp(addr, &v6, sizeof(v6)) == 0,
+			"IPv6 address of a PTR name");
+
+	ok(dns_ptr_addr("256.2.0.192.in-addr.arpa", &af, addr) == -EINVAL &&
+			dns_ptr_addr("2.0.192.in-addr.arpa", &af, addr) == -EINVAL &&
+			dns_ptr_addr("in-addr.arpa", &af, addr) == -EINVAL,
+			"Names of no address refused");
+}
+
+static void test_reply(void)
+{
+	ssize_t query_len, len;
+	struct dns_question question;
+	struct dns_answer answers[2], answer;
+	unsigned char query[DNS_QUERY_MAX], buf[DNS_MSG_MAX];
+
+	diag("DNS reply encoding test");
+
+	query_len = dns_encode_query(0x4242, "www.example.com", DNS_TYPE_A, query,
+			sizeof(query));
+	ok(dns_decode_query(query, query_len, &question) == query_len &&
+			question.type == DNS_TYPE_A && question.class == DNS_CLASS_IN &&
+			strcmp(question.name, "www.example.com") == 0,
+			"Question of a query");
+
+	answers[0].type = DNS_TYPE_A;
+	answers[0].u.v4.s_addr = htonl(0x0a000001);
+	answers[1].type = DNS_TYPE_A;
+	answers[1].u.v4.s_addr = htonl(0x0a000002);
+	len = dns_encode_reply(query, query_len, DNS_RCODE_NOERROR, answers, 2, 60,
+			buf, sizeof(buf));
+	ok(len == query_len + 2 * 16 && buf[7] == 2 &&
+			dns_decode_reply(buf, len, query, query_len, &answer) == 0 &&
+			answer.u.v4.s_addr == htonl(0x0a000001),
+			"Reply with two addresses");
+
+	len = dns_encode_reply(query, query_len, DNS_RCODE_NOERROR, answers, 2, 60,
+			buf, query_len + 20);
+	ok(len == query_len + 16 && buf[7] == 1 && (buf[2] & 0x02),
+			"Truncated reply");
+
+	len = dns_encode_reply(query, query_len, DNS_RCODE_NOTIMP, NULL, 0, 0,
+			buf, sizeof(buf));
+	ok(len == query_len && (buf[3] & 0x0f) == DNS_RCODE_NOTIMP,
+			"Reply without answer");
+	ok(dns_encode_reply(query, query_len, DNS_RCODE_NOERROR, NULL, 0, 0, buf,
+				query_len - 1) == -EMSGSIZE,
+			"Reply too long for the buffer");
+
+	query_len = dns_encode_query(0x4242, "1.2.0.192.in-addr.arpa",
+			DNS_TYPE_PTR, query, sizeof(query));
+	answers[0].type = DNS_TYPE_PTR;
+	strcpy(answers[0].u.name, "host.example");
+	len = dns_encode_reply(query, query_len, DNS_RCODE_NOERROR, answers, 1, 60,
+			buf, sizeof(buf));
+	ok(len > 0 && dns_decode_reply(buf, len, query, query_len, &answer) == 0 &&
+			strcmp(answer.u.name, "host.example") == 0,
+			"Reply with a name");
+}
+
+/*
+ * Answer the queries received on fd in the reverse order. The address is the
+ * index of the query in the order received.
+ */
+static void answer_reversed(int fd, unsigned int nb)
+{
+	unsigned int i;
+	ssize_t len[3];
+	struct sockaddr_in peer;
+	socklen_t peer_len = sizeof(peer);
+	struct in_addr v4;
+	unsigned char queries[3][DNS_MSG_MAX], buf[DNS_MSG_MAX];
+
+	for (i = 0; i < nb; i++) {
+		len[i] = recvfrom(fd, queries[i], sizeof(queries[i]), 0,
+				(struct sockaddr *) &peer, &peer_len);
+		if (len[i] < 0) {
+			return;
+		}
+	}
+	while (i-- > 0) {
+		v4.s_addr = htonl(i);
+		/* The server socket is not ours, the hooked sendto() denies it. */
+		(void) tsocks_libc_sendto(fd, buf, build_reply(queries[i], len[i], 0,
+					DNS_TYPE_A, &v4, sizeof(v4), buf), 0,
+				(struct sockaddr *) &peer, peer_len);
+	}
+}
+
+/*
+ * Drop the first query received on the fd given as argument and answer its
+ * retransmission. Return non NULL if both are the same datagram.
+ */
+static void *lossy_server(void *data)
+{
+	int fd = *(int *) data;
+	ssize_t first, again;
+	struct sockaddr_in peer;
+	socklen_t peer_len = sizeof(peer);
+	struct in_addr v4 = { .s_addr = htonl(42) };
+	unsigned char query[DNS_MSG_MAX], buf[DNS_MSG_MAX];
+
+	first = recv(fd, query, sizeof(query), 0);
+	again = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer,
+			&peer_len);
+	if (first <= 0 || again != first || memcmp(query, buf, first) != 0) {
+		return NULL;
+	}
+	(void) tsocks_libc_sendto(fd, buf, build_reply(query, first, 0,
+				DNS_TYPE_A, &v4, sizeof(v4), buf), 0,
+			(struct sockaddr *) &peer, peer_len);
+	return data;
+}
+
+static void test_resolver(void)
+{
+	int fd, ret[3];
+	unsigned int i;
+	void *same = NULL;
+	pthread_t server;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct dns_query queries[3];
+	struct dns_answer answers[3];
+	struct timeval tv = { .tv_sec = 5 };
+
+	diag("DNS resolver test");
+
+	/* A UDP socket out of libc since torsocks denies them. */
+	fd = tsocks_libc_socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+			getsockname(fd, (struct sockaddr *) &sin, &len) < 0) {
+		diag("Unable to bind a UDP socket");
+		return;
+	}
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	dns_resolver_init((struct sockaddr *) &sin, sizeof(sin));
+
+	for (i = 0; i < 3; i++) {
+		ret[i] = dns_query_send("pipelined.example", DNS_TYPE_A, &queries[i]);
+	}
+	ok(ret[0] == 0 && ret[1] == 0 && ret[2] == 0 &&
+			queries[0].id != queries[1].id && queries[1].id != queries[2].id,
+			"Queries in flight at once");
+
+	answer_reversed(fd, 3);
+	for (i = 0; i < 3; i++) {
+		ret[i] = dns_query_wait(&queries[i], &answers[i]);
+	}
+	ok(ret[0] == 0 && ret[1] == 0 && ret[2] == 0 &&
+			answers[0].u.v4.s_addr == htonl(0) &&
+			answers[1].u.v4.s_addr == htonl(1) &&
+			answers[2].u.v4.s_addr == htonl(2),
+			"Replies out of order matched to their query");
+
+	/* The first datagram is lost, the query is sent again. */
+	pthread_create(&server, NULL, lossy_server, &fd);
+	ret[0] = dns_query_send("lost.example", DNS_TYPE_A, &queries[0]);
+	if (ret[0] == 0) {
+		ret[0] = dns_query_wait(&queries[0], &answers[0]);
+	}
+	pthread_join(server, &same);
+	ok(ret[0] == 0 && same && answers[0].u.v4.s_addr == htonl(42),
+			"Lost query retransmitted");
+
+	dns_resolver_destroy();
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_encode();
+	test_decode();
+	test_ptr_name();
+	test_ptr_addr();
+	test_reply();
+	test_resolver();
+
+	return exit_status();
+}
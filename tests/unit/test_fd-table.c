@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* For close_range(2) and closefrom(3). */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <common/fd-table.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 23
+
+static void test_classify(void)
+{
+	uint8_t flags;
+
+	diag("fd table classify");
+
+	flags = fd_table_classify(AF_INET, SOCK_STREAM);
+	ok(flags == (FD_TABLE_INET | FD_TABLE_STREAM), "AF_INET stream socket");
+
+	flags = fd_table_classify(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK);
+	ok(flags == (FD_TABLE_INET | FD_TABLE_STREAM),
+			"AF_INET6 non blocking stream socket");
+
+	flags = fd_table_classify(AF_UNIX, SOCK_DGRAM);
+	ok(flags == FD_TABLE_UNIX, "AF_UNIX datagram socket");
+
+	flags = fd_table_classify(AF_NETLINK, SOCK_RAW);
+	ok(flags == 0, "AF_NETLINK socket is unknown");
+}
+
+static void test_classify_addr(void)
+{
+	uint8_t flags;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct sockaddr_un sun;
+
+	diag("fd table classify address");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	inet_pton(sin.sin_family, "127.0.0.1", &sin.sin_addr);
+	flags = fd_table_classify_addr((struct sockaddr *) &sin);
+	ok(flags == (FD_TABLE_INET | FD_TABLE_LOCAL), "127.0.0.1 is local");
+
+	inet_pton(sin.sin_family, "0.0.0.0", &sin.sin_addr);
+	flags = fd_table_classify_addr((struct sockaddr *) &sin);
+	ok(flags == FD_TABLE_INET, "0.0.0.0 is NOT local");
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	inet_pton(sin6.sin6_family, "::1", &sin6.sin6_addr);
+	flags = fd_table_classify_addr((struct sockaddr *) &sin6);
+	ok(flags == (FD_TABLE_INET | FD_TABLE_LOCAL), "::1 is local");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	flags = fd_table_classify_addr((struct sockaddr *) &sun);
+	ok(flags == FD_TABLE_UNIX, "Unix address");
+}
+
+static void test_entries(void)
+{
+	diag("fd table entries");
+
+	ok(fd_table_get(42) == 0, "Unknown fd has no flags");
+
+	fd_table_set(42, FD_TABLE_INET | FD_TABLE_STREAM);
+	ok(fd_table_get(42) == (FD_TABLE_INET | FD_TABLE_STREAM), "Set entry");
+
+	fd_table_add(42, FD_TABLE_LOCAL);
+	ok(fd_table_get(42) == (FD_TABLE_INET | FD_TABLE_STREAM | FD_TABLE_LOCAL),
+			"Add flag keeps the existing ones");
+
+	fd_table_dup(42, 43);
+	ok(fd_table_get(43) == fd_table_get(42), "Dup copies the entry");
+
+	fd_table_dup(44, 43);
+	ok(fd_table_get(43) == 0, "Dup of an unknown fd clears the entry");
+
+	fd_table_clear(42);
+	ok(fd_table_get(42) == 0, "Cleared entry has no flags");
+
+	fd_table_set(-1, FD_TABLE_UNIX);
+	ok(fd_table_get(-1) == 0, "Negative fd is ignored");
+
+	fd_table_set(FD_TABLE_SIZE, FD_TABLE_UNIX);
+	ok(fd_table_get(FD_TABLE_SIZE) == 0, "Out of range fd is ignored");
+
+	fd_table_add(FD_TABLE_SIZE - 1, FD_TABLE_UNIX);
+	ok(fd_table_get(FD_TABLE_SIZE - 1) == FD_TABLE_UNIX, "Last fd is tracked");
+}
+
+/*
+ * Put an inet socket unknown to torsocks on the given fd and check that
+ * listen() on it is still denied, thus that no stale flag let it through.
+ *
+ * Return 1 if denied else 0.
+ */
+static int listen_denied(int fd)
+{
+	int sock, ret;
+
+	sock = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0 || tsocks_libc_dup2(sock, fd) != fd) {
+		return 0;
+	}
+	tsocks_libc_close(sock);
+
+	errno = 0;
+	ret = listen(fd, 1) == -1 && errno == EPERM;
+	tsocks_libc_close(fd);
+	return ret;
+}
+
+static void test_hooks(void)
+{
+	int sock, copy;
+
+	diag("fd table kept in sync by the hijacked calls");
+
+	/* A Unix socket closed behind our back leaves a stale entry. */
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	dup2(sock, 4000);
+	tsocks_libc_close(4000);
+	close(sock);
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	copy = fcntl(sock, F_DUPFD, 4000);
+	errno = 0;
+	ok(copy == 4000 && listen(copy, 1) == -1 && errno == EPERM,
+			"F_DUPFD gives the entry of the copied fd");
+	close(copy);
+	close(sock);
+
+	/* Even a stale Unix entry must not let an inet socket listen. */
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	dup2(sock, 4003);
+	close(sock);
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	tsocks_libc_dup2(sock, 4003);
+	close(sock);
+	ok(listen_denied(4003), "Stale entry still asks the kernel");
+
+#ifdef SYS_dup2
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	ok(syscall(SYS_dup2, sock, 4004) == 4004, "syscall(SYS_dup2) routed");
+	close(sock);
+	close(4004);
+#else
+	skip(1, "No dup2 system call on this architecture");
+#endif
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	ok(syscall(SYS_dup3, sock, 4005, 0) == 4005, "syscall(SYS_dup3) routed");
+	close(sock);
+	close(4005);
+
+#ifdef HAVE_CLOSE_RANGE
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	dup2(sock, 4001);
+	close(sock);
+	ok(close_range(4001, 4001, 0) == 0 && listen_denied(4001),
+			"close_range() clears the entry");
+#else
+	skip(1, "No close_range() on this system");
+#endif
+
+#ifdef HAVE_CLOSEFROM
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	dup2(sock, 4002);
+	close(sock);
+	closefrom(4002);
+	ok(listen_denied(4002), "closefrom() clears the entry");
+#else
+	skip(1, "No closefrom() on this system");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_classify();
+	test_classify_addr();
+	test_entries();
+	test_hooks();
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/flight.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 12
+
+/* Dump in a temporary file and read back the events of the dump. */
+static size_t dump_events(struct flight_dump_header *hdr,
+		struct flight_event *events, size_t max)
+{
+	int ret;
+	size_t nb;
+	FILE *fp;
+
+	fp = tmpfile();
+	ret = flight_dump(fileno(fp));
+	if (ret < 0) {
+		fclose(fp);
+		return 0;
+	}
+
+	rewind(fp);
+	if (fread(hdr, sizeof(*hdr), 1, fp) != 1) {
+		fclose(fp);
+		return 0;
+	}
+	nb = fread(events, sizeof(*events), max, fp);
+	fclose(fp);
+	return nb;
+}
+
+static void test_flight_record(void)
+{
+	size_t nb;
+	struct flight_dump_header hdr;
+	struct flight_event events[8];
+
+	diag("Flight recorder record and dump");
+
+	flight_record(42, FLIGHT_CONNECT_START, FLIGHT_BACKEND_SOCKET, 0, 0);
+	flight_record(42, FLIGHT_REPLY, FLIGHT_BACKEND_URING, 0x05, 0);
+	flight_record(42, FLIGHT_CONNECT_END, FLIGHT_BACKEND_URING, 0,
+			-ECONNREFUSED);
+
+	nb = dump_events(&hdr, events, 8);
+	ok(hdr.magic == FLIGHT_DUMP_MAGIC && hdr.version == FLIGHT_DUMP_VERSION &&
+			hdr.event_size == sizeof(struct flight_event) &&
+			hdr.pid == (uint32_t) getpid(), "Dump header is valid");
+	ok(nb == 3, "Three events dumped");
+	ok(events[0].fd == 42 && events[0].phase == FLIGHT_CONNECT_START,
+			"First event is the connect start");
+	ok(events[1].phase == FLIGHT_REPLY && events[1].reply == 0x05 &&
+			events[1].backend == FLIGHT_BACKEND_URING, "Reply code recorded");
+	ok(events[2].err == ECONNREFUSED, "Error recorded as a positive errno");
+	ok(events[0].ts <= events[1].ts && events[1].ts <= events[2].ts &&
+			events[2].ts <= hdr.monotonic, "Events are in time order");
+}
+
+static void test_flight_wrap(void)
+{
+	int i;
+	size_t nb;
+	struct flight_dump_header hdr;
+	static struct flight_event events[FLIGHT_RING_EVENTS + 1];
+
+	diag("Flight recorder ring wrap");
+
+	for (i = 0; i < 3 * FLIGHT_RING_EVENTS; i++) {
+		flight_record(i, FLIGHT_CLOSE, FLIGHT_BACKEND_SOCKET, 0, 0);
+	}
+
+	nb = dump_events(&hdr, events, FLIGHT_RING_EVENTS + 1);
+	/* The oldest slot is the next one written thus never dumped. */
+	ok(nb == FLIGHT_RING_EVENTS - 1, "Ring keeps the last events");
+	ok(events[0].fd == 2 * FLIGHT_RING_EVENTS + 1 &&
+			events[nb - 1].fd == 3 * FLIGHT_RING_EVENTS - 1,
+			"Oldest event is dumped first");
+}
+
+static void test_flight_disabled(void)
+{
+	size_t nb;
+	struct flight_dump_header hdr;
+	static struct flight_event events[FLIGHT_RING_EVENTS];
+
+	diag("Flight recorder disabled");
+
+	flight_set_enabled(0);
+	flight_record(-1, FLIGHT_CLOSE, FLIGHT_BACKEND_SOCKET, 0, 0);
+	flight_set_enabled(1);
+
+	nb = dump_events(&hdr, events, FLIGHT_RING_EVENTS);
+	ok(nb == FLIGHT_RING_EVENTS - 1 && events[nb - 1].fd != -1,
+			"Nothing recorded when disabled");
+}
+
+static void test_flight_dump_to_file(void)
+{
+	int ret;
+
+	diag("Flight recorder dump to file");
+
+	ret = flight_dump_to_file();
+	ok(ret == -ENOENT, "No dump without a directory");
+}
+
+static volatile sig_atomic_t app_signals;
+
+static void app_handler(int signo)
+{
+	app_signals++;
+}
+
+static void test_flight_signal(void)
+{
+	int ret;
+	char dir[] = "/tmp/tsocks-flight-XXXXXX", path[PATH_MAX];
+
+	diag("Flight recorder dump signal");
+
+	/* The application handles the signal before torsocks is set up. */
+	signal(SIGUSR2, app_handler);
+
+	if (!mkdtemp(dir) || flight_set_dump_dir(dir) < 0 ||
+			flight_install_signal(SIGUSR2) < 0) {
+		fail("Dump signal installed");
+		fail("Handler of the application called");
+		return;
+	}
+
+	raise(SIGUSR2);
+	snprintf(path, sizeof(path), "%s/torsocks-%d.flight", dir, (int) getpid());
+	ret = access(path, F_OK);
+	ok(ret == 0, "Dump written on the signal");
+	ok(app_signals == 1, "Handler of the application called");
+
+	(void) unlink(path);
+	(void) rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_flight_record();
+	test_flight_wrap();
+	test_flight_disabled();
+	test_flight_dump_to_file();
+	test_flight_signal();
+
+	return exit_status();
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* For getaddrinfo_a(3). */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 11
+
+/* Same name many times, all resolved at once. */
+#define NB_SAME		32
+
+static pthread_mutex_t notified_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notified_cond = PTHREAD_COND_INITIALIZER;
+static int notified;
+
+static void notify_function(union sigval value)
+{
+	pthread_mutex_lock(&notified_lock);
+	notified += value.sival_int;
+	pthread_cond_signal(&notified_cond);
+	pthread_mutex_unlock(&notified_lock);
+}
+
+static int wait_notified(int expected)
+{
+	int ret;
+	struct timespec deadline;
+
+	(void) clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+
+	pthread_mutex_lock(&notified_lock);
+	while (notified < expected) {
+		if (pthread_cond_timedwait(&notified_cond, &notified_lock,
+					&deadline) != 0) {
+			break;
+		}
+	}
+	ret = notified;
+	pthread_mutex_unlock(&notified_lock);
+	return ret;
+}
+
+static void init_request(struct gaicb *req, const char *name, int family,
+		struct addrinfo *hints)
+{
+	memset(req, 0, sizeof(*req));
+	memset(hints, 0, sizeof(*hints));
+	hints->ai_family = family;
+	hints->ai_socktype = SOCK_STREAM;
+	req->ar_name = name;
+	req->ar_request = hints;
+}
+
+static void test_wait(void)
+{
+	int ret;
+	struct gaicb reqs[3], *list[4];
+	struct addrinfo hints[3];
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	diag("getaddrinfo_a GAI_WAIT test");
+
+	init_request(&reqs[0], "127.0.0.1", AF_INET, &hints[0]);
+	init_request(&reqs[1], "localhost", AF_INET, &hints[1]);
+	init_request(&reqs[2], "::1", AF_INET6, &hints[2]);
+	list[0] = &reqs[0];
+	list[1] = NULL;
+	list[2] = &reqs[1];
+	list[3] = &reqs[2];
+
+	ret = getaddrinfo_a(GAI_WAIT, list, 4, NULL);
+	ok(ret == 0 && gai_error(&reqs[0]) == 0 && gai_error(&reqs[1]) == 0 &&
+			gai_error(&reqs[2]) == 0,
+			"Every request done on return");
+
+	sin = (struct sockaddr_in *) reqs[1].ar_result->ai_addr;
+	sin6 = (struct sockaddr_in6 *) reqs[2].ar_result->ai_addr;
+	ok(reqs[0].ar_result->ai_family == AF_INET &&
+			sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK) &&
+			reqs[2].ar_result->ai_family == AF_INET6 &&
+			IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr),
+			"Results of every request");
+
+	freeaddrinfo(reqs[0].ar_result);
+	freeaddrinfo(reqs[1].ar_result);
+	freeaddrinfo(reqs[2].ar_result);
+}
+
+static void test_nowait(void)
+{
+	int ret, i, done;
+	struct gaicb reqs[NB_SAME], *list[NB_SAME];
+	struct addrinfo hints[NB_SAME];
+	struct sigevent sev;
+	const struct gaicb *wait_list[1];
+
+	diag("getaddrinfo_a GAI_NOWAIT test");
+
+	for (i = 0; i < NB_SAME; i++) {
+		init_request(&reqs[i], "localhost", AF_INET, &hints[i]);
+		list[i] = &reqs[i];
+	}
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = notify_function;
+	sev.sigev_value.sival_int = 1;
+
+	ret = getaddrinfo_a(GAI_NOWAIT, list, NB_SAME, &sev);
+	ok(ret == 0, "Requests queued");
+
+	/* Wait for every request, one gai_suspend() at a time. */
+	for (i = 0, done = 0; i < NB_SAME; i++) {
+		wait_list[0] = &reqs[i];
+		if (gai_suspend(wait_list, 1, NULL) == 0 &&
+				gai_error(&reqs[i]) == 0) {
+			done++;
+		}
+	}
+	ok(done == NB_SAME, "Every request waited for with gai_suspend");
+
+	/*
+	 * Resolved once then copied to the pending ones, or by the cache. Each
+	 * gets its own result to free.
+	 */
+	for (i = 1; i < NB_SAME; i++) {
+		if (!reqs[i].ar_result || !reqs[0].ar_result ||
+				reqs[i].ar_result == reqs[0].ar_result ||
+				memcmp(reqs[i].ar_result->ai_addr, reqs[0].ar_result->ai_addr,
+					reqs[0].ar_result->ai_addrlen) != 0) {
+			break;
+		}
+	}
+	ok(i == NB_SAME, "Identical requests get a copy of one result");
+	ok(wait_notified(1) == 1, "SIGEV_THREAD notification once all are done");
+
+	for (i = 0; i < NB_SAME; i++) {
+		freeaddrinfo(reqs[i].ar_result);
+	}
+}
+
+static void test_signal(void)
+{
+	int ret;
+	sigset_t set;
+	siginfo_t info;
+	struct sigevent sev;
+	struct gaicb req, *list[1];
+	struct addrinfo hints;
+	struct timespec timeout = { .tv_sec = 5 };
+
+	diag("getaddrinfo_a SIGEV_SIGNAL test");
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	init_request(&req, "localhost", AF_INET6, &hints);
+	hints.ai_flags = AI_NUMERICHOST;
+	list[0] = &req;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGUSR1;
+	sev.sigev_value.sival_int = 42;
+
+	ret = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+	ret = ret ? ret : sigtimedwait(&set, &info, &timeout);
+	ok(ret == SIGUSR1 && info.si_value.sival_int == 42,
+			"SIGEV_SIGNAL notification with its value");
+	ok(gai_error(&req) == EAI_NONAME && req.ar_result == NULL,
+			"Error of a failed request");
+	ok(gai_cancel(&req) == EAI_ALLDONE, "Done request not canceled");
+}
+
+static void test_errors(void)
+{
+	struct gaicb *list[1] = { NULL };
+	const struct gaicb *wait_list[1] = { NULL };
+
+	diag("getaddrinfo_a errors test");
+
+	ok(getaddrinfo_a(42, list, 1, NULL) == EAI_SYSTEM, "Invalid mode");
+	ok(gai_suspend(wait_list, 1, NULL) == EAI_ALLDONE,
+			"Nothing to wait for");
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_wait();
+	test_nowait();
+	test_signal();
+	test_errors();
+
+	return exit_status();
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 15
+
+/* Documentation address, never known by Tor. */
+#define UNKNOWN_ADDR	"192.0.2.1"
+
+/*
+ * Make every resolution through Tor fail right away. Nothing listens on the
+ * port 1 of the loopback.
+ */
+static void tor_unreachable(void)
+{
+	/* Initialize torsocks before its configuration is changed. */
+	(void) gethostbyname("localhost");
+	tsocks_config.socks5_addr.u.sin.sin_port = htons(1);
+	tsocks_config.socks5_addr.u.sin6.sin6_port = htons(1);
+}
+
+static void test_gethostbyname(void)
+{
+	struct hostent *he;
+	struct in_addr v4 = { .s_addr = htonl(INADDR_LOOPBACK) };
+	char name[] = "localhost";
+
+	diag("gethostbyname test");
+
+	he = gethostbyname(name);
+	ok(he && he->h_addrtype == AF_INET && he->h_length == sizeof(v4) &&
+			memcmp(he->h_addr_list[0], &v4, sizeof(v4)) == 0 &&
+			he->h_addr_list[1] == NULL, "IPv4 entry with a single address");
+	ok(he && he->h_aliases && he->h_aliases[0] == NULL,
+			"Empty alias list");
+
+	/* The entry must not point to the name of the caller. */
+	name[0] = 'X';
+	ok(he && he->h_name != name && strcmp(he->h_name, "localhost") == 0,
+			"Name copied in the entry");
+
+	he = gethostbyname2("localhost", AF_INET6);
+	ok(he && he->h_addrtype == AF_INET6 &&
+			he->h_length == sizeof(struct in6_addr) &&
+			memcmp(he->h_addr_list[0], &in6addr_loopback,
+				sizeof(in6addr_loopback)) == 0,
+			"IPv6 entry with the length of an IPv6 address");
+
+	h_errno = 0;
+	he = gethostbyname("unknown.example");
+	ok(he == NULL && h_errno == HOST_NOT_FOUND,
+			"h_errno set when Tor fails to resolve");
+}
+
+static void test_gethostbyname_r(void)
+{
+	int ret, herr;
+	struct hostent he, *result;
+	char buf[512];
+
+	diag("gethostbyname_r test");
+
+	result = (struct hostent *) buf;
+	ret = gethostbyname_r("localhost", &he, buf, sizeof(buf), &result, &herr);
+	ok(ret == 0 && result == &he && he.h_name >= buf &&
+			he.h_name < buf + sizeof(buf),
+			"Result set and stored in the buffer given");
+
+	/* Tor being unreachable, asking it would give HOST_NOT_FOUND. */
+	result = &he;
+	errno = 0;
+	ret = gethostbyname_r("unknown.example", &he, buf, 8, &result, &herr);
+	ok(ret == ERANGE && errno == ERANGE && herr == NETDB_INTERNAL &&
+			result == NULL, "ERANGE before asking Tor");
+
+	result = &he;
+	ret = gethostbyname_r("unknown.example", &he, buf, sizeof(buf), &result,
+			&herr);
+	ok(ret != 0 && herr == HOST_NOT_FOUND && result == NULL,
+			"Result cleared when Tor fails to resolve");
+
+	result = &he;
+	ret = gethostbyname2_r("localhost", AF_UNIX, &he, buf, sizeof(buf),
+			&result, &herr);
+	ok(ret != 0 && herr == HOST_NOT_FOUND && result == NULL,
+			"Unsupported family refused");
+}
+
+static void test_gethostbyaddr(void)
+{
+	int ret, herr;
+	struct in_addr addr;
+	struct hostent *he, entry, *result;
+	char buf[512];
+
+	diag("gethostbyaddr test");
+
+	inet_pton(AF_INET, UNKNOWN_ADDR, &addr);
+
+	he = gethostbyaddr(&addr, sizeof(addr), AF_INET);
+	ok(he && strcmp(he->h_name, UNKNOWN_ADDR) == 0 &&
+			he->h_length == sizeof(addr) &&
+			memcmp(he->h_addr_list[0], &addr, sizeof(addr)) == 0,
+			"Numeric name when Tor can't resolve the address");
+
+	ret = gethostbyaddr_r(&addr, sizeof(addr), AF_INET, &entry, buf,
+			sizeof(buf), &result, &herr);
+	ok(ret == 0 && result == &entry &&
+			strcmp(entry.h_name, UNKNOWN_ADDR) == 0,
+			"Numeric name from the reentrant call");
+
+	result = &entry;
+	errno = 0;
+	ret = gethostbyaddr_r(&addr, sizeof(addr), AF_INET, &entry, buf, 8,
+			&result, &herr);
+	ok(ret == ERANGE && errno == ERANGE && herr == NETDB_INTERNAL &&
+			result == NULL, "ERANGE of the reentrant call");
+
+	h_errno = 0;
+	he = gethostbyaddr(&in6addr_loopback, sizeof(in6addr_loopback), AF_INET6);
+	ok(he == NULL && h_errno == HOST_NOT_FOUND, "IPv6 address refused");
+}
+
+static void *thread_lookup(void *data)
+{
+	struct hostent *he;
+
+	he = gethostbyname2("localhost", AF_INET6);
+	*(int *) data = he ? he->h_length : -1;
+	return he;
+}
+
+static void test_per_thread(void)
+{
+	int len = 0;
+	void *other;
+	pthread_t th;
+	struct hostent *he;
+
+	diag("gethostbyname per thread storage test");
+
+	he = gethostbyname("localhost");
+	pthread_create(&th, NULL, thread_lookup, &len);
+	pthread_join(th, &other);
+	ok(he && other && other != he && len == sizeof(struct in6_addr),
+			"Each thread has its own entry");
+	ok(he && he->h_addrtype == AF_INET && he->h_length == sizeof(struct in_addr),
+			"Entry untouched by the lookup of another thread");
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	tor_unreachable();
+
+	test_gethostbyname();
+	test_gethostbyname_r();
+	test_gethostbyaddr();
+	test_per_thread();
+
+	return exit_status();
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 5
+
+#if (defined(__linux__))
+
+/* The liburing entry points hijacked by torsocks. */
+LIBC_IO_URING_SETUP_DECL;
+LIBC_IO_URING_QUEUE_INIT_DECL;
+LIBC_IO_URING_QUEUE_INIT_PARAMS_DECL;
+LIBC_IO_URING_QUEUE_INIT_MEM_DECL;
+
+static void test_liburing_denied(void)
+{
+	int ret;
+	char buf[64];
+
+	diag("io_uring liburing calls denied");
+
+	errno = 0;
+	ret = io_uring_setup(8, NULL);
+	ok(ret == -ENOSYS && errno == ENOSYS, "io_uring_setup denied");
+
+	errno = 0;
+	ret = io_uring_queue_init(8, NULL, 0);
+	ok(ret == -ENOSYS && errno == ENOSYS, "io_uring_queue_init denied");
+
+	errno = 0;
+	ret = io_uring_queue_init_params(8, NULL, NULL);
+	ok(ret == -ENOSYS && errno == ENOSYS, "io_uring_queue_init_params denied");
+
+	errno = 0;
+	ret = io_uring_queue_init_mem(8, NULL, NULL, buf, sizeof(buf));
+	ok(ret == -ENOSYS && errno == ENOSYS, "io_uring_queue_init_mem denied");
+}
+
+static void test_syscall_denied(void)
+{
+	long ret;
+
+	diag("io_uring_setup syscall denied");
+
+	/* The kernel would fail on the NULL parameters with EFAULT. */
+	errno = 0;
+	ret = syscall(TSOCKS_NR_IO_URING_SETUP, 8, NULL);
+	ok(ret == -1 && errno == ENOSYS, "io_uring_setup through syscall denied");
+}
+
+#endif /* __linux__ */
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+#if (defined(__linux__))
+	test_liburing_denied();
+	test_syscall_denied();
+#else
+	skip(NUM_TESTS, "io_uring is Linux only");
+#endif
+
+	return exit_status();
+}
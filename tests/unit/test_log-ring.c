@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/log-ring.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 12
+
+/* Read back everything written in a temporary file. */
+static size_t read_back(FILE *fp, char *buf, size_t len)
+{
+	size_t ret;
+
+	rewind(fp);
+	ret = fread(buf, 1, len - 1, fp);
+	buf[ret] = '\0';
+	return ret;
+}
+
+static void test_log_ring_text(void)
+{
+	int ret;
+	FILE *fp;
+	char buf[256];
+
+	diag("Log ring text format");
+
+	fp = tmpfile();
+	ret = log_ring_init(fileno(fp), LOG_FORMAT_TEXT, 0);
+	ok(ret == 0, "Log ring initialized");
+
+	ret = log_ring_write("hello\n", 6);
+	ret |= log_ring_write("world\n", 6);
+	ok(ret == 0, "Messages queued");
+
+	log_ring_destroy();
+	(void) read_back(fp, buf, sizeof(buf));
+	ok(strcmp(buf, "hello\nworld\n") == 0, "Messages written in order at exit");
+
+	fclose(fp);
+}
+
+static void *thread_log(void *data)
+{
+	(void) log_ring_write(data, strlen(data));
+	return NULL;
+}
+
+static void test_log_ring_binary(void)
+{
+	int ret;
+	FILE *fp;
+	size_t len;
+	char buf[512];
+	pthread_t th;
+	struct log_record rec;
+
+	diag("Log ring binary format");
+
+	fp = tmpfile();
+	ret = log_ring_init(fileno(fp), LOG_FORMAT_BINARY, 0);
+
+	ret = log_ring_write("main\n", 5);
+	pthread_create(&th, NULL, thread_log, "thread\n");
+	pthread_join(th, NULL);
+	ok(ret == 0, "Messages queued from two threads");
+
+	log_ring_destroy();
+	len = read_back(fp, buf, sizeof(buf));
+	ok(len == 2 * sizeof(rec) + 5 + 7, "Two records written");
+
+	memcpy(&rec, buf, sizeof(rec));
+	ok(rec.magic == LOG_RECORD_MAGIC && rec.pid == (uint32_t) getpid() &&
+		rec.sec > 0, "Record header is valid");
+	ok((rec.len == 5 && memcmp(buf + sizeof(rec), "main\n", 5) == 0) ||
+		(rec.len == 7 && memcmp(buf + sizeof(rec), "thread\n", 7) == 0),
+		"Record message is valid");
+
+	fclose(fp);
+}
+
+/* Read everything written in a pipe until it is closed. */
+static void *pipe_read(void *data)
+{
+	int fd = *(int *) data;
+	size_t len = 0;
+	ssize_t ret;
+	static char buf[256 * 1024];
+
+	do {
+		ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (ret > 0) {
+			len += ret;
+		}
+	} while (ret > 0 && len < sizeof(buf) - 1);
+	buf[len] = '\0';
+
+	/* Drain whatever does not fit so the writer never blocks. */
+	while (ret > 0) {
+		char discard[4096];
+		ret = read(fd, discard, sizeof(discard));
+	}
+	return buf;
+}
+
+static void test_log_ring_dropped(void)
+{
+	int i, ret, dropped = 0, fds[2];
+	char msg[1024], *buf = NULL;
+	pthread_t th;
+
+	diag("Log ring dropped messages");
+
+	/* Nobody reads the pipe yet thus the writer blocks once it is full. */
+	if (pipe(fds) < 0) {
+		fail("Pipe created");
+		fail("Dropped messages reported");
+		return;
+	}
+	(void) log_ring_init(fds[1], LOG_FORMAT_TEXT, 0);
+
+	memset(msg, 'a', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	for (i = 0; i < 1000; i++) {
+		ret = log_ring_write(msg, sizeof(msg));
+		if (ret == -ENOBUFS) {
+			dropped++;
+		}
+	}
+	ok(dropped > 0, "Messages dropped when the ring is full");
+
+	pthread_create(&th, NULL, pipe_read, &fds[0]);
+	log_ring_destroy();
+	close(fds[1]);
+	pthread_join(th, (void **) &buf);
+	ok(strstr(buf, "log messages dropped") != NULL, "Dropped messages reported");
+
+	close(fds[0]);
+}
+
+static void test_log_ring_wakeup(void)
+{
+	int ret, fds[2];
+	char buf[64];
+	struct pollfd pfd;
+
+	diag("Log ring writer wake up");
+
+	if (pipe(fds) < 0) {
+		fail("Pipe created");
+		return;
+	}
+	(void) log_ring_init(fds[1], LOG_FORMAT_TEXT, 0);
+
+	/* The first message starts the writer, the second one must wake it. */
+	(void) log_ring_write("first\n", 6);
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 5000) == 1 ? read(fds[0], buf, sizeof(buf)) : -1;
+	(void) log_ring_write("second\n", 7);
+	ret = poll(&pfd, 1, 5000) == 1 ? read(fds[0], buf, sizeof(buf) - 1) : -1;
+	buf[ret > 0 ? ret : 0] = '\0';
+	ok(strcmp(buf, "second\n") == 0, "Message written before exit");
+
+	log_ring_destroy();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static pthread_key_t exit_key;
+static int exit_ret;
+
+/*
+ * Destructor run after the one of the log ring the second time around, the
+ * thread is exiting and its ring is gone.
+ */
+static void exit_log(void *data)
+{
+	if (data == (void *) 1) {
+		(void) pthread_setspecific(exit_key, (void *) 2);
+		return;
+	}
+	exit_ret = log_ring_write("exiting\n", 8);
+}
+
+static void *thread_exit_log(void *data)
+{
+	(void) pthread_setspecific(exit_key, (void *) 1);
+	(void) log_ring_write(data, strlen(data));
+	return NULL;
+}
+
+static void test_log_ring_thread_exit(void)
+{
+	FILE *fp;
+	pthread_t th;
+	char buf[256];
+
+	diag("Log ring of an exiting thread");
+
+	fp = tmpfile();
+	(void) log_ring_init(fileno(fp), LOG_FORMAT_TEXT, 0);
+	(void) pthread_key_create(&exit_key, exit_log);
+
+	pthread_create(&th, NULL, thread_exit_log, "alive\n");
+	pthread_join(th, NULL);
+	ok(exit_ret < 0 && exit_ret != -ENOBUFS,
+			"Message of an exiting thread left to the caller");
+
+	log_ring_destroy();
+	(void) read_back(fp, buf, sizeof(buf));
+	ok(strcmp(buf, "alive\n") == 0, "Message of the thread written");
+
+	(void) pthread_key_delete(exit_key);
+	fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_log_ring_text();
+	test_log_ring_binary();
+	test_log_ring_dropped();
+	test_log_ring_wakeup();
+	test_log_ring_thread_exit();
+
+	return exit_status();
+}
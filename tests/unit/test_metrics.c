@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/metrics.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 11
+
+#define NB_THREADS	4
+#define NB_LOOPS	10000
+
+static void test_metrics_bucket(void)
+{
+	int ordered = 1, bounded = 1;
+	uint64_t us;
+	unsigned int bucket, prev = 0;
+
+	diag("Metrics histogram buckets");
+
+	ok(metrics_bucket(0) == 0 && metrics_bucket(3) == 3,
+			"One bucket per small value");
+	ok(metrics_bucket(UINT64_MAX) == METRICS_HIST_BUCKETS - 1,
+			"Huge value in the last bucket");
+
+	for (us = 1; us < (1ULL << 24); us += us / 7 + 1) {
+		bucket = metrics_bucket(us);
+		if (bucket < prev) {
+			ordered = 0;
+		}
+		/* A value is below the bound of its bucket, not the previous one. */
+		if (us >= metrics_bucket_bound(bucket) ||
+				(bucket > 0 && us < metrics_bucket_bound(bucket - 1))) {
+			bounded = 0;
+		}
+		prev = bucket;
+	}
+	ok(ordered, "Buckets grow with the value");
+	ok(bounded, "Values are within the bounds of their bucket");
+	ok(metrics_bucket_bound(METRICS_HIST_BUCKETS - 2) > 20000000,
+			"Buckets cover more than 20 seconds");
+}
+
+static void *inc_thread(void *data)
+{
+	int i;
+
+	(void) data;
+
+	for (i = 0; i < NB_LOOPS; i++) {
+		metrics_inc(METRICS_CONNECT_OK);
+		metrics_observe(METRICS_PHASE_REPLY, 1500);
+	}
+	return NULL;
+}
+
+static void test_metrics_threads(void)
+{
+	int i;
+	pthread_t threads[NB_THREADS];
+	struct metrics_data data;
+
+	diag("Metrics merged from every thread");
+
+	for (i = 0; i < NB_THREADS; i++) {
+		pthread_create(&threads[i], NULL, inc_thread, NULL);
+	}
+	for (i = 0; i < NB_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	/* Threads are gone, their metrics stay. */
+	metrics_inc(METRICS_CONNECT_OK);
+
+	metrics_read(&data);
+	ok(data.counters[METRICS_CONNECT_OK] == NB_THREADS * NB_LOOPS + 1,
+			"Counters of every thread are summed");
+	ok(data.hists[METRICS_PHASE_REPLY].buckets[metrics_bucket(1)] ==
+			NB_THREADS * NB_LOOPS, "Histogram bucket is summed");
+	ok(data.hists[METRICS_PHASE_REPLY].sum == 1500ULL * NB_THREADS * NB_LOOPS,
+			"Histogram sum is summed");
+	ok(data.counters[METRICS_CONNECT_FAILED] == 0, "Other counter untouched");
+}
+
+static void test_metrics_write(void)
+{
+	int ret;
+	size_t len;
+	FILE *fp;
+	char *buf;
+	struct metrics_gauges gauges = {
+		.onion_entries = 3,
+		.onion_capacity = 255,
+		.connections = 7,
+	};
+
+	diag("Metrics in the Prometheus text format");
+
+	metrics_inc(METRICS_HANDSHAKE_STARTED);
+
+	fp = tmpfile();
+	ret = metrics_write(fileno(fp), &gauges);
+	ok(ret == 0, "Metrics written");
+
+	len = ftell(fp);
+	rewind(fp);
+	buf = calloc(1, len + 1);
+	if (fread(buf, 1, len, fp) != len) {
+		len = 0;
+	}
+	fclose(fp);
+
+	ok(len > 0 &&
+			strstr(buf, "torsocks_connects_total{result=\"ok\"} 40001\n") &&
+			strstr(buf, "torsocks_handshakes_in_flight 1\n") &&
+			strstr(buf, "torsocks_onion_pool_entries 3\n") &&
+			strstr(buf, "torsocks_connections 7\n") &&
+			strstr(buf, "le=\"+Inf\"} 40000\n"),
+			"Expected metrics found");
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_metrics_bucket();
+	test_metrics_threads();
+	test_metrics_write();
+
+	return exit_status();
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/dns.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 10
+
+/* Record types Tor can't resolve. */
+#define TYPE_MX		15
+#define TYPE_TXT	16
+#define TYPE_SRV	33
+
+static void test_addresses(void)
+{
+	int len;
+	struct in_addr v4 = { .s_addr = htonl(INADDR_LOOPBACK) };
+	unsigned char answer[DNS_MSG_MAX];
+
+	diag("res_query addresses test");
+
+	len = res_query("localhost", DNS_CLASS_IN, DNS_TYPE_A, answer,
+			sizeof(answer));
+	ok(len > 0 && (answer[2] & 0x80) && answer[7] == 1 &&
+			memcmp(answer + len - 4, &v4, sizeof(v4)) == 0,
+			"A record of localhost");
+
+	len = res_search("localhost.", DNS_CLASS_IN, DNS_TYPE_AAAA, answer,
+			sizeof(answer));
+	ok(len > 0 && answer[7] == 1 &&
+			memcmp(answer + len - 16, &in6addr_loopback, 16) == 0,
+			"AAAA record of an absolute name");
+
+	errno = 0;
+	len = res_query("localhost", DNS_CLASS_IN, DNS_TYPE_A, answer, 20);
+	ok(len == -1 && h_errno == NETDB_INTERNAL && errno == EMSGSIZE,
+			"Answer buffer too small");
+}
+
+static void test_not_implemented(void)
+{
+	int len;
+	time_t start;
+	struct __res_state state;
+	struct dns_question question;
+	unsigned char answer[DNS_MSG_MAX];
+
+	diag("res_query not implemented test");
+
+	start = time(NULL);
+	len = res_query("example.com", DNS_CLASS_IN, TYPE_MX, answer,
+			sizeof(answer));
+	ok(len == -1 && h_errno == NO_RECOVERY &&
+			(answer[3] & 0x0f) == DNS_RCODE_NOTIMP && time(NULL) - start < 2,
+			"MX query refused right away");
+
+	memset(&state, 0, sizeof(state));
+	len = res_nquery(&state, "example.com", DNS_CLASS_IN, TYPE_TXT, answer,
+			sizeof(answer));
+	ok(len == -1 && state.res_h_errno == NO_RECOVERY,
+			"h_errno of the resolver state");
+
+	len = res_querydomain("_xmpp._tcp", "example.com", DNS_CLASS_IN, TYPE_SRV,
+			answer, sizeof(answer));
+	ok(len == -1 && dns_decode_query(answer, sizeof(answer), &question) > 0 &&
+			strcmp(question.name, "_xmpp._tcp.example.com") == 0,
+			"Name and domain asked together");
+
+	len = res_query("www.example.com", DNS_CLASS_IN, DNS_TYPE_PTR, answer,
+			sizeof(answer));
+	ok(len == -1 && (answer[3] & 0x0f) == DNS_RCODE_NOTIMP,
+			"PTR query for the name of no address");
+}
+
+static void test_send(void)
+{
+	ssize_t query_len;
+	int len;
+	unsigned char query[DNS_QUERY_MAX], answer[DNS_MSG_MAX];
+	struct dns_answer result;
+
+	diag("res_send test");
+
+	query_len = dns_encode_query(0x1234, "localhost", DNS_TYPE_A, query,
+			sizeof(query));
+	len = res_send(query, query_len, answer, sizeof(answer));
+	ok(len > 0 &&
+			dns_decode_reply(answer, len, query, query_len, &result) == 0 &&
+			result.u.v4.s_addr == htonl(INADDR_LOOPBACK),
+			"Reply to a query");
+
+	/* Different class, the reply is still returned. */
+	query[query_len - 1] = 3;
+	len = res_send(query, query_len, answer, sizeof(answer));
+	ok(len == query_len && answer[0] == 0x12 && answer[1] == 0x34 &&
+			(answer[3] & 0x0f) == DNS_RCODE_NOTIMP,
+			"Reply to a query of another class");
+
+	/* A header without question. */
+	memset(query, 0, DNS_HEADER_LEN);
+	len = res_send(query, DNS_HEADER_LEN, answer, sizeof(answer));
+	ok(len == DNS_HEADER_LEN && (answer[3] & 0x0f) == DNS_RCODE_FORMERR,
+			"Reply to a malformed query");
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_addresses();
+	test_not_implemented();
+	test_send();
+
+	return exit_status();
+}
@@ -922,7 +922,7 @@ static void test_socks5_send_resolve_request_failure(void)
 
 static void test_socks5_recv_resolve_reply_valid(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t ipv4_addr;
 	uint8_t ipv6_addr[16];
@@ -931,11 +931,12 @@ static void test_socks5_recv_resolve_reply_valid(void)
 	conn_stub = get_connection_stub();
 	socks5_init(NULL, socks5_recv_resolve_reply_ipv4_stub);
 
-	ret = socks5_recv_resolve_reply(conn_stub, &ipv4_addr, sizeof(uint32_t));
+	ret = socks5_recv_resolve_reply(conn_stub, &ipv4_addr, sizeof(uint32_t),
+			&af);
 
 	inet_ntop(AF_INET, &ipv4_addr, ip_str, INET_ADDRSTRLEN);
 
-	ok(ret == 0 &&
+	ok(ret == 0 && af == AF_INET &&
 		strncmp(ip_str, "127.0.0.1", INET_ADDRSTRLEN) == 0,
 		"socks5 resolve reply valid IPv4 address");
 
@@ -947,11 +948,12 @@ static void test_socks5_recv_resolve_reply_valid(void)
 	conn_stub = get_connection_ipv6_stub();
 	socks5_init(NULL, socks5_recv_resolve_reply_ipv6_stub);
 
-	ret = socks5_recv_resolve_reply(conn_stub, &ipv6_addr, sizeof(ipv6_addr));
+	ret = socks5_recv_resolve_reply(conn_stub, &ipv6_addr, sizeof(ipv6_addr),
+			&af);
 
 	inet_ntop(AF_INET6, &ipv6_addr, ip_str, INET6_ADDRSTRLEN);
 
-	ok(ret == 0 &&
+	ok(ret == 0 && af == AF_INET6 &&
 		strncmp(ip_str, "::1", INET6_ADDRSTRLEN) == 0,
 		"socks5 resolve reply valid IPv6 address");
 
@@ -961,7 +963,7 @@ static void test_socks5_recv_resolve_reply_valid(void)
 
 static void test_socks5_recv_resolve_reply_failure(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t dummy_ip_addr;
 
@@ -969,7 +971,7 @@ static void test_socks5_recv_resolve_reply_failure(void)
 	socks5_init(NULL, socks5_recv_data_error_stub);
 
 	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr,
-			sizeof(dummy_ip_addr));
+			sizeof(dummy_ip_addr), &af);
 
 	ok(ret == -1, "socks5 resolve reply returns recv error code");
 
@@ -979,7 +981,7 @@ static void test_socks5_recv_resolve_reply_failure(void)
 
 static void test_socks5_recv_resolve_reply_incorrect_version(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t dummy_ip_addr;
 
@@ -987,7 +989,7 @@ static void test_socks5_recv_resolve_reply_incorrect_version(void)
 	socks5_init(NULL, socks5_recv_resolve_reply_incorrect_version_stub);
 
 	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr,
-			sizeof(dummy_ip_addr));
+			sizeof(dummy_ip_addr), &af);
 
 	ok(ret == -ECONNABORTED, "socks5 resolve reply incorrect version");
 
@@ -997,7 +999,7 @@ static void test_socks5_recv_resolve_reply_incorrect_version(void)
 
 static void test_socks5_recv_resolve_reply_response_error(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t dummy_ip_addr;
 
@@ -1005,7 +1007,7 @@ static void test_socks5_recv_resolve_reply_response_error(void)
 	socks5_init(NULL, socks5_recv_resolve_reply_response_error_stub);
 
 	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr,
-			sizeof(dummy_ip_addr));
+			sizeof(dummy_ip_addr), &af);
 
 	ok(ret == -ECONNABORTED, "socks5 resolve reply response error");
 
@@ -1015,7 +1017,7 @@ static void test_socks5_recv_resolve_reply_response_error(void)
 
 static void test_socks5_recv_resolve_reply_address_type_error(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t dummy_ip_addr;
 
@@ -1023,7 +1025,7 @@ static void test_socks5_recv_resolve_reply_address_type_error(void)
 	socks5_init(NULL, socks5_recv_resolve_reply_address_type_error_stub);
 
 	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr,
-			sizeof(dummy_ip_addr));
+			sizeof(dummy_ip_addr), &af);
 
 	ok(ret == -EINVAL, "socks5 resolve reply address type error");
 
@@ -1033,14 +1035,14 @@ static void test_socks5_recv_resolve_reply_address_type_error(void)
 
 static void test_socks5_recv_resolve_reply_addrlen_error(void)
 {
-	int ret;
+	int ret, af;
 	struct connection *conn_stub;
 	uint32_t dummy_ip_addr;
 
 	conn_stub = get_connection_stub();
 	socks5_init(NULL, socks5_recv_resolve_reply_addrlen_error_stub);
 
-	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr, 1);
+	ret = socks5_recv_resolve_reply(conn_stub, &dummy_ip_addr, 1, &af);
 
 	ok(ret == -EINVAL, "socks5 resolve reply address length error");
 
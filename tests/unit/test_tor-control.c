@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <common/tor-control.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 19
+
+static void test_parse(void)
+{
+	int ret, code;
+	char sep;
+	const char *text;
+	char name[64], addr[64];
+	struct tor_control_answer answer;
+
+	diag("Control protocol parsing test");
+
+	ret = tor_control_parse_reply("250 OK", &code, &sep, &text);
+	ok(ret == 0 && code == 250 && sep == ' ' && strcmp(text, "OK") == 0,
+			"Last line of a reply");
+	ret = tor_control_parse_reply("250-version=0.4.8", &code, &sep, &text);
+	ok(ret == 0 && code == 250 && sep == '-' &&
+			strcmp(text, "version=0.4.8") == 0,
+			"Middle line of a reply");
+	ret = tor_control_parse_reply("25x OK", &code, &sep, &text);
+	ok(ret == -EBADMSG, "Bad status code refused");
+
+	ret = tor_control_parse_addrmap("ADDRMAP www.example.com 10.0.0.1 "
+			"\"2026-01-01 00:00:00\" CACHED=\"NO\"", name, sizeof(name), addr,
+			sizeof(addr));
+	ok(ret == 0 && strcmp(name, "www.example.com") == 0 &&
+			strcmp(addr, "10.0.0.1") == 0,
+			"ADDRMAP event name and address");
+	ret = tor_control_parse_addrmap("CIRC 1 BUILT", name, sizeof(name), addr,
+			sizeof(addr));
+	ok(ret == -ENOENT, "Other event ignored");
+
+	ret = tor_control_parse_answer("10.0.0.1", 0, &answer);
+	ok(ret == 0 && answer.af == AF_INET &&
+			answer.u.v4.s_addr == htonl(0x0a000001),
+			"IPv4 answer");
+	ret = tor_control_parse_answer("[2001:db8::1]", 0, &answer);
+	ok(ret == 0 && answer.af == AF_INET6 && answer.u.v6.s6_addr[0] == 0x20 &&
+			answer.u.v6.s6_addr[15] == 1,
+			"IPv6 answer in brackets");
+	ret = tor_control_parse_answer("<error>", 0, &answer);
+	ok(ret == -ENOENT, "Failed resolution");
+	ret = tor_control_parse_answer("host.example", 1, &answer);
+	ok(ret == 0 && answer.af == AF_UNSPEC &&
+			strcmp(answer.u.name, "host.example") == 0,
+			"Reverse answer");
+}
+
+static void test_auth(void)
+{
+	ssize_t len;
+	char buf[128];
+	unsigned char cookie[TOR_CONTROL_COOKIE_LEN];
+
+	diag("Control authentication test");
+
+	len = tor_control_auth_command("pa\"s\\s", NULL, buf, sizeof(buf));
+	ok(len > 0 && strcmp(buf, "AUTHENTICATE \"pa\\\"s\\\\s\"\r\n") == 0,
+			"Password quoted and escaped");
+
+	memset(cookie, 0xab, sizeof(cookie));
+	cookie[0] = 0x01;
+	len = tor_control_auth_command("ignored", cookie, buf, sizeof(buf));
+	ok(len == 13 + 2 * TOR_CONTROL_COOKIE_LEN + 2 &&
+			strncmp(buf, "AUTHENTICATE 01ABAB", 19) == 0 &&
+			strcmp(buf + len - 2, "\r\n") == 0,
+			"Cookie in hex before the password");
+
+	len = tor_control_auth_command(NULL, NULL, buf, sizeof(buf));
+	ok(len > 0 && strcmp(buf, "AUTHENTICATE\r\n") == 0,
+			"No authentication");
+}
+
+static int read_line(int fd, char *buf, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos + 1 < len) {
+		if (recv(fd, buf + pos, 1, 0) != 1) {
+			return -1;
+		}
+		if (buf[pos] == '\n') {
+			if (pos > 0 && buf[pos - 1] == '\r') {
+				pos--;
+			}
+			buf[pos] = '\0';
+			return 0;
+		}
+		pos++;
+	}
+	return -1;
+}
+
+/*
+ * Read a command, check it is the given one and write the reply if any.
+ */
+static int expect(int fd, const char *cmd, const char *reply)
+{
+	char line[512];
+
+	if (read_line(fd, line, sizeof(line)) < 0 || strcmp(line, cmd) != 0) {
+		diag("Expected \"%s\"", cmd);
+		return -1;
+	}
+	if (reply && send(fd, reply, strlen(reply), MSG_NOSIGNAL) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int accept_authenticated(int listen_fd)
+{
+	int fd;
+	struct sockaddr_un peer;
+	socklen_t peer_len = sizeof(peer);
+	struct timeval tv = { .tv_sec = 5 };
+
+	fd = accept(listen_fd, (struct sockaddr *) &peer, &peer_len);
+	if (fd < 0) {
+		return -1;
+	}
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (expect(fd, "AUTHENTICATE \"pa\\\"ss\"", "250 OK\r\n") < 0 ||
+			expect(fd, "SETEVENTS ADDRMAP", "250 OK\r\n") < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Stand-in ControlPort on the listening fd given as argument. It answers
+ * three resolutions at once out of order, drops the connection on the fourth
+ * and answers the fifth on a new connection. Return non NULL if every command
+ * is the expected one.
+ */
+static void *control_server(void *data)
+{
+	int fd, listen_fd = *(int *) data;
+	void *ret = NULL;
+
+	fd = accept_authenticated(listen_fd);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (expect(fd, "RESOLVE one.example", "250 OK\r\n") < 0 ||
+			expect(fd, "RESOLVE two.invalid", "250 OK\r\n") < 0 ||
+			expect(fd, "RESOLVE mode=reverse 192.0.2.9", "250 OK\r\n"
+				"650 ADDRMAP 9.2.0.192.in-addr.arpa host.example NEVER\r\n"
+				"650 ADDRMAP other.example 10.9.9.9 NEVER\r\n"
+				"650 ADDRMAP two.invalid <error> NEVER error=yes\r\n"
+				"650 ADDRMAP ONE.example 10.0.0.1 NEVER CACHED=\"NO\"\r\n") < 0 ||
+			expect(fd, "RESOLVE dropped.example", NULL) < 0) {
+		goto end;
+	}
+	close(fd);
+
+	fd = accept_authenticated(listen_fd);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (expect(fd, "RESOLVE again.example", "250 OK\r\n"
+				"650 ADDRMAP again.example 10.0.0.2 NEVER\r\n") < 0) {
+		goto end;
+	}
+	ret = data;
+
+end:
+	close(fd);
+	return ret;
+}
+
+static void test_resolver(void)
+{
+	int fd, ret[3];
+	unsigned int i;
+	void *expected = NULL;
+	pthread_t server;
+	struct sockaddr_un sun;
+	struct tor_control_query queries[3];
+	struct tor_control_answer answers[3];
+	struct timeval tv = { .tv_sec = 5 };
+
+	diag("ControlPort resolver test");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "/tmp/test_tor-control.%d",
+			(int) getpid());
+	(void) unlink(sun.sun_path);
+
+	fd = tsocks_libc_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 ||
+			listen(fd, 1) < 0) {
+		diag("Unable to listen on a Unix socket");
+		return;
+	}
+	/* The server gives up if torsocks never connects. */
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	pthread_create(&server, NULL, control_server, &fd);
+
+	tor_control_init((struct sockaddr *) &sun, sizeof(sun), "pa\"ss", NULL);
+
+	ok(tor_control_resolve_send("bad.example\r\nSIGNAL HALT", 0,
+				&queries[0]) == -EINVAL,
+			"Name with control characters refused");
+
+	ret[0] = tor_control_resolve_send("one.example", 0, &queries[0]);
+	ret[1] = tor_control_resolve_send("two.invalid", 0, &queries[1]);
+	ret[2] = tor_control_resolve_send("192.0.2.9", 1, &queries[2]);
+	ok(ret[0] == 0 && ret[1] == 0 && ret[2] == 0,
+			"Resolutions in flight at once");
+
+	for (i = 0; i < 3; i++) {
+		if (ret[i] == 0) {
+			ret[i] = tor_control_resolve_wait(&queries[i], &answers[i]);
+		}
+	}
+	ok(ret[0] == 0 && answers[0].af == AF_INET &&
+			answers[0].u.v4.s_addr == htonl(0x0a000001),
+			"Event out of order matched to its name");
+	ok(ret[1] == -ENOENT, "Failed resolution");
+	ok(ret[2] == 0 && answers[2].af == AF_UNSPEC &&
+			strcmp(answers[2].u.name, "host.example") == 0,
+			"Reverse resolution matched to its in-addr.arpa name");
+
+	ret[0] = tor_control_resolve_send("dropped.example", 0, &queries[0]);
+	if (ret[0] == 0) {
+		ret[0] = tor_control_resolve_wait(&queries[0], &answers[0]);
+	}
+	ok(ret[0] < 0, "Resolution failed with the connection");
+
+	ret[0] = tor_control_resolve_send("again.example", 0, &queries[0]);
+	if (ret[0] == 0) {
+		ret[0] = tor_control_resolve_wait(&queries[0], &answers[0]);
+	}
+	pthread_join(server, &expected);
+	ok(ret[0] == 0 && answers[0].u.v4.s_addr == htonl(0x0a000002) && expected,
+			"Connection opened again");
+
+	tor_control_destroy();
+	close(fd);
+	(void) unlink(sun.sun_path);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_parse();
+	test_auth();
+	test_resolver();
+
+	return exit_status();
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/trace.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 9
+
+static char trace_path[] = "/tmp/torsocks-test-trace-XXXXXX";
+
+/*
+ * Read the trace file in a malloc'ed buffer.
+ *
+ * Return its size, 0 on error.
+ */
+static size_t read_trace(char **buf)
+{
+	size_t len = 0;
+	long size;
+	FILE *fp;
+
+	*buf = NULL;
+	fp = fopen(trace_path, "r");
+	if (!fp) {
+		return 0;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0) {
+		rewind(fp);
+		*buf = malloc(size);
+		if (*buf && fread(*buf, size, 1, fp) == 1) {
+			len = size;
+		}
+	}
+	fclose(fp);
+	return len;
+}
+
+/*
+ * Find the first record of a hook in the trace. The calls made by this test
+ * are recorded as well since it is linked with the library.
+ */
+static const struct trace_record *find_record(const char *buf, size_t len,
+		enum trace_hook hook, const char **name)
+{
+	size_t off = sizeof(struct trace_header);
+	const struct trace_record *rec;
+
+	while (off + sizeof(*rec) <= len) {
+		rec = (const struct trace_record *) (buf + off);
+		if (rec->hook == hook) {
+			*name = (const char *) (rec + 1);
+			return rec;
+		}
+		off += TRACE_RECORD_SPACE(rec->name_len);
+	}
+	return NULL;
+}
+
+static void test_trace_record(void)
+{
+	int ret;
+	size_t len;
+	char *buf = NULL;
+	const char *name = NULL;
+	uint64_t start;
+	struct in_addr addr;
+	struct sockaddr_in sin;
+	const struct trace_header *hdr;
+	const struct trace_record *rec;
+
+	diag("Trace record and read back");
+
+	start = trace_begin();
+	ok(start == 0, "Nothing recorded before open");
+
+	ret = trace_open(trace_path);
+	ok(ret == 0 && trace_enabled, "Trace file opened");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9050);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+	start = trace_begin();
+	errno = ECONNREFUSED;
+	trace_call(start, TRACE_CONNECT, 42, 0, -1, (struct sockaddr *) &sin);
+	ok(errno == ECONNREFUSED, "errno is preserved");
+
+	inet_pton(AF_INET, "127.42.42.1", &addr);
+	trace_record(trace_begin(), TRACE_GETADDRINFO, -1, 0, 0, AF_INET, &addr,
+			0, "example.onion");
+	trace_destroy();
+	ok(!trace_enabled && trace_begin() == 0, "Tracing stopped");
+
+	len = read_trace(&buf);
+	hdr = (const struct trace_header *) buf;
+	ok(len >= sizeof(*hdr) && hdr->magic == TRACE_MAGIC &&
+			hdr->version == TRACE_VERSION &&
+			hdr->record_size == sizeof(struct trace_record) &&
+			hdr->pid == (uint32_t) getpid(), "Trace header is valid");
+
+	rec = find_record(buf, len, TRACE_CONNECT, &name);
+	ok(rec && rec->fd == 42 && rec->ret == -1 && rec->err == ECONNREFUSED,
+			"Connect recorded with its error");
+	ok(rec && rec->family == AF_INET && rec->port == htons(9050) &&
+			memcmp(rec->addr, &sin.sin_addr, sizeof(sin.sin_addr)) == 0 &&
+			rec->start >= hdr->monotonic && rec->tid != 0,
+			"Connect address, time and thread recorded");
+
+	rec = find_record(buf, len, TRACE_GETADDRINFO, &name);
+	ok(rec && rec->name_len == strlen("example.onion") &&
+			strncmp(name, "example.onion", rec->name_len) == 0,
+			"Resolved name recorded");
+	ok(rec && memcmp(rec->addr, &addr, sizeof(addr)) == 0,
+			"Resolved address recorded");
+
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	fd = mkstemp(trace_path);
+	if (fd < 0) {
+		diag("mkstemp: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	test_trace_record();
+
+	unlink(trace_path);
+	return exit_status();
+}
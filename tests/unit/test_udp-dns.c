@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <common/dns.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 16
+
+/* DNS server of the documentation network, never reached. */
+#define SERVER_V4	"192.0.2.1"
+#define SERVER_V6	"2001:db8::1"
+
+static void server_v4(struct sockaddr_in *sin, in_port_t port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	inet_pton(AF_INET, SERVER_V4, &sin->sin_addr);
+}
+
+static void server_v6(struct sockaddr_in6 *sin6, in_port_t port)
+{
+	memset(sin6, 0, sizeof(*sin6));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = htons(port);
+	inet_pton(AF_INET6, SERVER_V6, &sin6->sin6_addr);
+}
+
+/*
+ * Wait for a reply on the socket.
+ *
+ * Return 1 if one is readable else 0.
+ */
+static int wait_reply(int sock)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+	return poll(&pfd, 1, 5000) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_denied(void)
+{
+	int sock;
+	struct sockaddr_in sin;
+
+	diag("UDP DNS denied test");
+
+	tsocks_config.allow_udp_dns = 0;
+	errno = 0;
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	ok(sock == -1 && errno == EPERM, "UDP socket denied without the option");
+	tsocks_config.allow_udp_dns = 1;
+
+	errno = 0;
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+	ok(sock == -1 && errno == EPERM, "ICMP socket still denied");
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	server_v4(&sin, 80);
+	errno = 0;
+	ok(sock >= 0 && sendto(sock, "x", 1, 0, (struct sockaddr *) &sin,
+				sizeof(sin)) == -1 && errno == EPERM,
+			"Datagram to another port denied");
+
+	errno = 0;
+	ok(connect(sock, (struct sockaddr *) &sin, sizeof(sin)) == -1 &&
+			errno == EPERM, "Connect to another port denied");
+	close(sock);
+}
+
+static void test_sendto(void)
+{
+	int sock, dup_sock;
+	ssize_t query_len, len;
+	socklen_t addrlen;
+	struct sockaddr_in sin, from;
+	struct dns_answer answer;
+	unsigned char query[DNS_QUERY_MAX], reply[DNS_MSG_MAX];
+
+	diag("UDP DNS sendto test");
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	server_v4(&sin, DNS_PORT);
+	query_len = dns_encode_query(0x4242, "localhost", DNS_TYPE_A, query,
+			sizeof(query));
+	len = sendto(sock, query, query_len, 0, (struct sockaddr *) &sin,
+			sizeof(sin));
+	ok(len == query_len, "Query sent to a DNS server");
+	ok(wait_reply(sock), "Reply readable with poll");
+
+	addrlen = sizeof(from);
+	memset(&from, 0, sizeof(from));
+	len = recvfrom(sock, reply, sizeof(reply), 0, (struct sockaddr *) &from,
+			&addrlen);
+	ok(len > 0 && addrlen == sizeof(from) &&
+			memcmp(&from, &sin, sizeof(sin)) == 0,
+			"Reply from the DNS server asked");
+	ok(dns_decode_reply(reply, len, query, query_len, &answer) == 0 &&
+			answer.u.v4.s_addr == htonl(INADDR_LOOPBACK),
+			"Reply resolved through torsocks");
+
+	/* A copy of the socket is allowed as well. */
+	dup_sock = dup(sock);
+	len = sendto(dup_sock, query, query_len, 0, (struct sockaddr *) &sin,
+			sizeof(sin));
+	ok(len == query_len && wait_reply(sock) &&
+			recv(sock, reply, sizeof(reply), 0) > 0,
+			"Query sent on a copy of the socket");
+	close(dup_sock);
+	close(sock);
+}
+
+static void test_unknown(void)
+{
+	int sock, copy;
+	ssize_t query_len, len;
+	socklen_t addrlen;
+	struct sockaddr_in sin, from;
+	unsigned char query[DNS_QUERY_MAX], reply[DNS_MSG_MAX];
+
+	diag("UDP DNS unknown socket test");
+
+	/* A copy made by a call torsocks might not see. */
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	copy = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+	server_v4(&sin, 9999);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	errno = 0;
+	ok(copy >= 0 && sendto(copy, "x", 1, 0, (struct sockaddr *) &sin,
+				sizeof(sin)) == -1 && errno == EPERM,
+			"Datagram of a copied socket to another port denied");
+	close(copy);
+	close(sock);
+
+	/* Created behind our back like a socket inherited across exec. */
+	sock = tsocks_libc_socket(AF_INET, SOCK_DGRAM, 0);
+	server_v4(&sin, DNS_PORT);
+	query_len = dns_encode_query(0x4545, "localhost", DNS_TYPE_A, query,
+			sizeof(query));
+	len = sendto(sock, query, query_len, 0, (struct sockaddr *) &sin,
+			sizeof(sin));
+	addrlen = sizeof(from);
+	len = (len == query_len && wait_reply(sock)) ?
+		recvfrom(sock, reply, sizeof(reply), 0, (struct sockaddr *) &from,
+				&addrlen) : -1;
+	ok(len > 0 && memcmp(&from, &sin, sizeof(sin)) == 0,
+			"Query of a socket unknown to torsocks answered");
+	close(sock);
+
+	tsocks_config.allow_udp_dns = 0;
+	sock = tsocks_libc_socket(AF_INET, SOCK_DGRAM, 0);
+	errno = 0;
+	ok(sendto(sock, query, query_len, 0, (struct sockaddr *) &sin,
+				sizeof(sin)) == -1 && errno == EPERM,
+			"Unknown UDP socket denied without the option");
+	tsocks_libc_close(sock);
+	tsocks_config.allow_udp_dns = 1;
+}
+
+static void test_connected(void)
+{
+	int sock;
+	ssize_t query_len, len;
+	socklen_t addrlen;
+	struct sockaddr_in sin, peer;
+	unsigned char query[DNS_QUERY_MAX], reply[DNS_MSG_MAX];
+
+	diag("UDP DNS connected test");
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	server_v4(&sin, DNS_PORT);
+	ok(connect(sock, (struct sockaddr *) &sin, sizeof(sin)) == 0,
+			"Socket connected to a DNS server");
+
+	addrlen = sizeof(peer);
+	ok(getpeername(sock, (struct sockaddr *) &peer, &addrlen) == 0 &&
+			memcmp(&peer, &sin, sizeof(sin)) == 0,
+			"Peer of the socket is the DNS server");
+
+	query_len = dns_encode_query(0x4343, "localhost", DNS_TYPE_A, query,
+			sizeof(query));
+	len = send(sock, query, query_len, 0);
+	ok(len == query_len && wait_reply(sock) &&
+			recv(sock, reply, sizeof(reply), 0) > 0,
+			"Reply to a query sent on the connected socket");
+	close(sock);
+}
+
+static void test_msg_v6(void)
+{
+	int sock;
+	ssize_t query_len, len;
+	struct sockaddr_in6 sin6, from;
+	struct iovec iov;
+	struct msghdr msg;
+	struct dns_answer answer;
+	unsigned char query[DNS_QUERY_MAX], reply[DNS_MSG_MAX];
+
+	diag("UDP DNS sendmsg and recvmsg test");
+
+	sock = socket(AF_INET6, SOCK_DGRAM, 0);
+	server_v6(&sin6, DNS_PORT);
+	query_len = dns_encode_query(0x4444, "localhost", DNS_TYPE_AAAA, query,
+			sizeof(query));
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = query;
+	iov.iov_len = query_len;
+	msg.msg_name = &sin6;
+	msg.msg_namelen = sizeof(sin6);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	len = sendmsg(sock, &msg, 0);
+
+	memset(&from, 0, sizeof(from));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_name = &from;
+	msg.msg_namelen = sizeof(from);
+	len = (len == query_len && wait_reply(sock)) ? recvmsg(sock, &msg, 0) : -1;
+	ok(len > 0 && msg.msg_namelen == sizeof(from) &&
+			memcmp(&from, &sin6, sizeof(sin6)) == 0 &&
+			dns_decode_reply(reply, len, query, query_len, &answer) == 0 &&
+			IN6_IS_ADDR_LOOPBACK(&answer.u.v6),
+			"IPv6 reply from the DNS server asked");
+	close(sock);
+}
+
+int main(int argc, char **argv)
+{
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_denied();
+	test_sendto();
+	test_unknown();
+	test_connected();
+	test_msg_v6();
+
+	return exit_status();
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2013 - David Goulet <dgoulet@ev0ke.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <common/connection.h>
+#include <common/socks5.h>
+#include <common/uring.h>
+#include <lib/torsocks.h>
+
+#include <tap/tap.h>
+
+#define NUM_TESTS 5
+
+#ifdef HAVE_IO_URING
+
+/* The syscall(2) of the libc, io_uring_enter(2) is failed in front of it. */
+static long int (*real_syscall)(long int number, ...);
+
+/* Number of io_uring_enter(2) calls let through before failing them. */
+static int enter_allowed;
+
+static long int fail_enter(long int number, ...)
+{
+	long int a[6];
+	unsigned int i;
+	va_list args;
+
+	va_start(args, number);
+	for (i = 0; i < 6; i++) {
+		a[i] = va_arg(args, long int);
+	}
+	va_end(args);
+
+	if (number == __NR_io_uring_enter && enter_allowed-- <= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (number == __NR_io_uring_enter) {
+		/* Submit only, the completions are waited for by the next calls. */
+		a[2] = 0;
+		a[3] = 0;
+	}
+	return real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+static void test_drop(struct uring *ring)
+{
+	int32_t res;
+	uint64_t user_data;
+	struct io_uring_sqe *sqe;
+
+	diag("uring drop test");
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 1;
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 2;
+	ok(uring_drop_unsubmitted(ring) == 2, "Prepared entries dropped");
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 42;
+	ok(uring_submit_and_wait(ring, 1) == 0 &&
+			uring_reap(ring, &user_data, &res) && user_data == 42 &&
+			!uring_reap(ring, &user_data, &res),
+			"Dropped entries never submitted");
+}
+
+/*
+ * Handshake on a new socket with the Tor address being the given listening
+ * socket, which never answers.
+ */
+static int handshake(int server)
+{
+	int ret, sock;
+	socklen_t len;
+	struct sockaddr_in dest;
+	struct connection *conn;
+
+	len = sizeof(tsocks_config.socks5_addr.u.sin);
+	(void) getsockname(server,
+			(struct sockaddr *) &tsocks_config.socks5_addr.u.sin, &len);
+
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(80);
+	inet_pton(AF_INET, "192.0.2.1", &dest.sin_addr);
+
+	sock = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	conn = connection_create(sock, (struct sockaddr *) &dest);
+
+	real_syscall = tsocks_libc_syscall;
+	tsocks_libc_syscall = fail_enter;
+	ret = socks5_uring_handshake(conn, SOCKS5_NO_AUTH_METHOD, NULL, NULL);
+	tsocks_libc_syscall = real_syscall;
+
+	connection_destroy(conn);
+	tsocks_libc_close(sock);
+	return ret;
+}
+
+static void test_handshake(struct uring *ring)
+{
+	int server, ret;
+	struct sockaddr_in sin;
+
+	diag("uring handshake failed wait test");
+
+	server = tsocks_libc_socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	(void) bind(server, (struct sockaddr *) &sin, sizeof(sin));
+	(void) listen(server, 4);
+
+	enter_allowed = 0;
+	ret = handshake(server);
+	ok(ret == -ENOSYS, "Nothing submitted, handshake left to the normal path");
+	ok(*ring->sq_tail == *ring->sq_head && ring->to_submit == 0,
+			"No entry left in the ring");
+
+	/* The connect and send complete, the receive never does. */
+	enter_allowed = 1;
+	ret = handshake(server);
+	ok(ret < 0 && ret != -ENOSYS, "Failed waits end the handshake");
+
+	tsocks_libc_close(server);
+}
+
+int main(int argc, char **argv)
+{
+	struct uring *ring;
+
+	ring = uring_get_thread_ring();
+	if (!ring) {
+		plan_skip_all("io_uring not usable on this system");
+		return 0;
+	}
+
+	/* Libtap call for the number of tests planned. */
+	plan_tests(NUM_TESTS);
+
+	test_drop(ring);
+	test_handshake(ring);
+
+	return exit_status();
+}
+
+#else /* HAVE_IO_URING */
+
+int main(int argc, char **argv)
+{
+	plan_skip_all("Built without io_uring");
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */